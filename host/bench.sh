@@ -0,0 +1,27 @@
+#!/bin/sh
+# bench.sh © Penguin_Spy 2024
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Runs each fsbench benchmark in a new process on a fresh copy of the benchmark image,
+# so every benchmark starts with an empty cache and an unmodified filesystem.
+#   usage: bench.sh <build directory> [benchmark...]
+set -e
+
+BUILD=$1
+shift
+HOST=$(dirname "$0")
+IMAGE="$BUILD/bench.img"
+
+if [ ! -f "$IMAGE" ]; then
+    echo "creating $IMAGE"
+    "$HOST/mkimage.sh" "$IMAGE"
+fi
+
+BENCHMARKS=${*:-seq-read-4k seq-read-1m random-read small-files open-storm missing random-write seq-write create-files copy-rename tmpfs rom rom-lz4 stat-list mmap defrag queue-order}
+for benchmark in $BENCHMARKS; do
+    cp "$IMAGE" "$BUILD/work.img"
+    "$BUILD/fsbench" "$BUILD/work.img" "$benchmark"
+done
+rm -f "$BUILD/work.img"
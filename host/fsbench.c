@@ -0,0 +1,1365 @@
+/* fsbench.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  Benchmarks the filesystem code on the host, against a disk image made by
+  `host/mkimage.sh`. Usage:
+    fsbench <image> [benchmark...]
+  Runs the named benchmarks (or all of them) in order, and reports the wall
+  time and the number of block commands each one issued, and how often the
+  caches helped. The commands are the number to compare between changes,
+  since on real hardware each one is a round trip to the SD card.
+
+  After each benchmark, what it wrote is read back and compared, and the
+  image is checked for consistency with host_fsck(). A benchmark that leaves
+  wrong data or a broken filesystem behind fails, however fast it was.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "fs.h"
+
+#include "fs_cache.h"
+#include "storage.h"
+
+#include "host-fsck.h"
+#include "host-storage.h"
+
+// these must match the files host/mkimage.sh creates
+#define BENCH_FILE          "bench.bin"
+#define BENCH_FILE_SIZE     (16 * 1024 * 1024)
+#define SMALL_FILE_COUNT    500
+#define DEEP_FILE           "deep/a/b/c/d/target.txt"
+// names the benchmarks create, which must not exist in the image
+#define COPY_FILE           "copy.bin"
+#define MOVED_FILE          "small/moved.bin"
+#define CREATED_FILE_COUNT  300
+
+#define RANDOM_OPERATIONS   2000
+#define RANDOM_LENGTH       512
+#define OPEN_STORM_COUNT    5000
+
+typedef struct {
+    const char* name;
+    const char* description;
+    int64_t (*run)();   // returns the number of bytes read or written, or -1 on error
+    int (*prepare)();   // called before the benchmark is timed, returns 0 or -1 on error (optional)
+    int (*verify)();    // called after the filesystem is synced, returns 0 if what was written reads back, or -1 (optional)
+} benchmark;
+
+static uint8_t* buffer;
+#define BUFFER_SIZE (1024 * 1024)
+// what the write benchmarks write: BENCH_FILE_SIZE bytes that differ in every block, so misplaced data is noticed
+static uint8_t* pattern;
+// what a file is expected to contain once a benchmark has run
+static uint8_t* expected;
+
+static double now_ms() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+// xorshift, so every run does the same "random" operations
+static uint32_t random_state;
+static uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void small_file_name(char* name, int n) {
+    sprintf(name, "small/file%03d.txt", n);
+}
+
+static void created_file_name(char* name, int n) {
+    sprintf(name, "small/new%03d.txt", n);
+}
+
+static void fill_pattern() {
+    for(uint32_t i = 0; i < BENCH_FILE_SIZE; i++) {
+        pattern[i] = (uint8_t)(i + (i >> 9) * 151 + (i >> 17) * 17);
+    }
+}
+
+/** Reads a whole file and compares it to what it should contain, reporting the first difference.
+ * @returns `0` if the file matches, or `-1`.
+ */
+static int verify_file(const char* name, const uint8_t* data, int64_t size) {
+    int file = fs_open(name, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s to verify it: %s\n", name, strerror(errno));
+        return -1;
+    }
+    int64_t offset = 0;
+    int result;
+    while((result = fs_read(file, buffer, BUFFER_SIZE)) > 0) {
+        int64_t length = offset + result <= size ? result : size - offset;
+        if(length > 0 && memcmp(buffer, data + offset, length) != 0) {
+            int64_t i = 0;
+            while(buffer[i] == data[offset + i]) i++;
+            fprintf(stderr, "%s differs at offset %lld\n", name, (long long)(offset + i));
+            fs_close(file);
+            return -1;
+        }
+        offset += result;
+    }
+    fs_close(file);
+    if(result < 0) {
+        fprintf(stderr, "failed to read %s to verify it: %s\n", name, strerror(errno));
+        return -1;
+    } else if(offset != size) {
+        fprintf(stderr, "%s is %lld bytes instead of %lld\n", name, (long long)offset, (long long)size);
+        return -1;
+    }
+    return 0;
+}
+
+// reads BENCH_FILE into `expected`, for benchmarks that change or copy it
+static int read_expected() {
+    int file = fs_open(BENCH_FILE, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    int result = fs_read(file, expected, BENCH_FILE_SIZE);
+    fs_close(file);
+    if(result != BENCH_FILE_SIZE) {
+        fprintf(stderr, "failed to read %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// reads a whole file in `chunk` sized reads, returns the number of bytes read or -1
+static int64_t read_file(const char* name, int chunk) {
+    int file = fs_open(name, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    int64_t total = 0;
+    int result;
+    while((result = fs_read(file, buffer, chunk)) > 0) {
+        total += result;
+    }
+    fs_close(file);
+    if(result < 0) {
+        fprintf(stderr, "failed to read %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return total;
+}
+
+static int64_t sequential_read_small() {
+    return read_file(BENCH_FILE, 4096);
+}
+
+static int64_t sequential_read_large() {
+    return read_file(BENCH_FILE, BUFFER_SIZE);
+}
+
+static int64_t sequential_write() {
+    int file = fs_open(BENCH_FILE, O_WRONLY | O_TRUNC, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    int64_t total = 0;
+    while(total < BENCH_FILE_SIZE) {
+        int result = fs_write(file, pattern + total, 64 * 1024);
+        if(result <= 0) {
+            fprintf(stderr, "failed to write %s: %s\n", BENCH_FILE, strerror(errno));
+            fs_close(file);
+            return -1;
+        }
+        total += result;
+    }
+    fs_close(file);
+    return total;
+}
+
+static int verify_sequential_write() {
+    return verify_file(BENCH_FILE, pattern, BENCH_FILE_SIZE);
+}
+
+// seeks to random offsets in the file and reads or writes RANDOM_LENGTH bytes at each
+static int64_t random_access(bool write) {
+    int file = fs_open(BENCH_FILE, write ? O_RDWR : O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    random_state = 0xC0FFEE;
+    int64_t total = 0;
+    for(int i = 0; i < RANDOM_OPERATIONS; i++) {
+        int offset = next_random() % (BENCH_FILE_SIZE - RANDOM_LENGTH);
+        int result = fs_seek(file, offset, SEEK_SET);
+        if(result != -1) {
+            result = write ? fs_write(file, pattern + offset, RANDOM_LENGTH) : fs_read(file, buffer, RANDOM_LENGTH);
+        }
+        if(result <= 0) {
+            fprintf(stderr, "failed to %s %s @%i: %s\n", write ? "write" : "read", BENCH_FILE, offset, strerror(errno));
+            fs_close(file);
+            return -1;
+        }
+        total += result;
+    }
+    fs_close(file);
+    return total;
+}
+
+static int64_t random_read() {
+    return random_access(false);
+}
+
+static int64_t random_write() {
+    return random_access(true);
+}
+
+// makes the same writes as random_write() to `expected`, which holds the file from before them
+static int verify_random_write() {
+    random_state = 0xC0FFEE;
+    for(int i = 0; i < RANDOM_OPERATIONS; i++) {
+        int offset = next_random() % (BENCH_FILE_SIZE - RANDOM_LENGTH);
+        memcpy(expected + offset, pattern + offset, RANDOM_LENGTH);
+    }
+    return verify_file(BENCH_FILE, expected, BENCH_FILE_SIZE);
+}
+
+// the size & data of the nth file create_files() makes
+static int created_file_size(int n) {
+    return 1 + (n * 997) % (16 * 1024);
+}
+
+static const uint8_t* created_file_data(int n) {
+    return pattern + (n * 7919) % (BENCH_FILE_SIZE - 16 * 1024);
+}
+
+// creates files in small/, which grows its directory table
+static int64_t create_files() {
+    char name[32];
+    int64_t total = 0;
+    for(int i = 0; i < CREATED_FILE_COUNT; i++) {
+        created_file_name(name, i);
+        int file = fs_open(name, O_WRONLY | O_CREAT | O_EXCL, 1);
+        if(file == -1) {
+            fprintf(stderr, "failed to create %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        int result = fs_write(file, (uint8_t*)created_file_data(i), created_file_size(i));
+        fs_close(file);
+        if(result != created_file_size(i)) {
+            fprintf(stderr, "failed to write %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        total += result;
+    }
+    return total;
+}
+
+static int verify_create_files() {
+    char name[32];
+    for(int i = 0; i < CREATED_FILE_COUNT; i++) {
+        created_file_name(name, i);
+        if(verify_file(name, created_file_data(i), created_file_size(i)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// a storage device in memory, for checking the request queue without touching the image
+#define RAM_DEVICE_BLOCKS 256
+static uint8_t ram_device_data[RAM_DEVICE_BLOCKS * STORAGE_BLOCK_SIZE];
+static storage_device* ram_device;
+
+static int ram_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    memcpy(buffer, ram_device_data + lba * STORAGE_BLOCK_SIZE, count * STORAGE_BLOCK_SIZE);
+    return 0;
+}
+
+static int ram_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    memcpy(ram_device_data + lba * STORAGE_BLOCK_SIZE, buffer, count * STORAGE_BLOCK_SIZE);
+    return 0;
+}
+
+static const storage_device_ops ram_ops = {
+    .read = ram_read,
+    .write = ram_write,
+};
+
+// overlapping writes, queued in this order in two rounds, too far apart to combine into one command (so dispatching
+// them in block order would let the older one win)
+static const struct {
+    uint32_t lba;
+    uint32_t count;
+    uint32_t head_lba;  // where the elevator is when the round is queued
+    bool dispatch;      // dispatch the queue after this write
+} queue_writes[] = {
+    { 50, 100, 0, false }, { 0, 100, 0, true },     // the older write is at a higher address
+    { 60, 100, 150, false }, { 155, 100, 150, true },  // the older write is below the elevator, so it's done after the wrap
+};
+#define QUEUE_WRITE_COUNT (int)(sizeof(queue_writes) / sizeof(queue_writes[0]))
+
+static int64_t queue_order() {
+    if(ram_device == NULL) {
+        ram_device = storage_add_device("ram", &ram_ops, RAM_DEVICE_BLOCKS, 0xFFFF, 1, 0);
+        if(ram_device == NULL) {
+            return -1;
+        }
+    }
+    int64_t total = 0;
+    for(int i = 0; i < QUEUE_WRITE_COUNT; i++) {
+        if(i == 0 || queue_writes[i - 1].dispatch) {
+            ram_device->head_lba = queue_writes[i].head_lba;
+        }
+        // every write has different data
+        if(storage_queue(ram_device, queue_writes[i].lba, queue_writes[i].count, pattern + i * RAM_DEVICE_BLOCKS * STORAGE_BLOCK_SIZE, true, NULL) != 0
+            || (queue_writes[i].dispatch && storage_dispatch(ram_device) != 0)) {
+            fprintf(stderr, "failed to queue or dispatch writes: %s\n", strerror(errno));
+            return -1;
+        }
+        total += queue_writes[i].count * STORAGE_BLOCK_SIZE;
+    }
+    return total;
+}
+
+// makes the same writes in the order they were queued, the device must match
+static int verify_queue_order() {
+    memset(expected, 0, RAM_DEVICE_BLOCKS * STORAGE_BLOCK_SIZE);
+    for(int i = 0; i < QUEUE_WRITE_COUNT; i++) {
+        memcpy(expected + queue_writes[i].lba * STORAGE_BLOCK_SIZE, pattern + i * RAM_DEVICE_BLOCKS * STORAGE_BLOCK_SIZE, queue_writes[i].count * STORAGE_BLOCK_SIZE);
+    }
+    for(uint32_t block = 0; block < RAM_DEVICE_BLOCKS; block++) {
+        if(memcmp(ram_device_data + block * STORAGE_BLOCK_SIZE, expected + block * STORAGE_BLOCK_SIZE, STORAGE_BLOCK_SIZE) != 0) {
+            fprintf(stderr, "block %u of %s holds the wrong write\n", block, ram_device->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int64_t copy_rename() {
+    if(fs_copy(BENCH_FILE, COPY_FILE) != 0) {
+        fprintf(stderr, "failed to copy %s to %s: %s\n", BENCH_FILE, COPY_FILE, strerror(errno));
+        return -1;
+    }
+    if(fs_rename(COPY_FILE, MOVED_FILE) != 0) {
+        fprintf(stderr, "failed to rename %s to %s: %s\n", COPY_FILE, MOVED_FILE, strerror(errno));
+        return -1;
+    }
+    return BENCH_FILE_SIZE;
+}
+
+static int verify_copy_rename() {
+    int file = fs_open(COPY_FILE, O_RDONLY, 1);
+    if(file != -1 || errno != ENOENT) {
+        fprintf(stderr, "%s still exists after being renamed\n", COPY_FILE);
+        if(file != -1) fs_close(file);
+        return -1;
+    }
+    if(verify_file(MOVED_FILE, expected, BENCH_FILE_SIZE) != 0 || verify_file(BENCH_FILE, expected, BENCH_FILE_SIZE) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// files the tmpfs benchmark makes on the RAM filesystem
+#define TMP_FILE            "/tmp/grown.bin"
+#define TMP_FILE_SIZE       (3 * 1024 * 1024 + 123)
+#define TMP_WRITE_LENGTH    3000    // not a power of 2, so writes straddle the chunks
+#define TMP_RENAMED_FILE    "/tmp/renamed.bin"
+#define TMP_TRUNCATED_FILE  "/tmp/truncated.bin"
+#define TMP_FILL_FILE       "/tmp/fill.bin"
+static int64_t tmp_fill_size;   // how much space was free before the fill file was written
+
+static int64_t write_tmp_file(const char* name, const uint8_t* data, int size) {
+    int file = fs_open(name, O_WRONLY | O_CREAT | O_EXCL, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to create %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    int total = 0;
+    while(total < size) {
+        int result = fs_write(file, (uint8_t*)data + total, size - total < TMP_WRITE_LENGTH ? size - total : TMP_WRITE_LENGTH);
+        if(result <= 0) {
+            fprintf(stderr, "failed to write %s: %s\n", name, strerror(errno));
+            fs_close(file);
+            return -1;
+        }
+        total += result;
+    }
+    fs_close(file);
+    return total;
+}
+
+// a file truncated by another handle must read as zeros up to where the first handle writes next
+static int64_t truncate_tmp_file() {
+    int first = fs_open(TMP_TRUNCATED_FILE, O_WRONLY | O_CREAT | O_EXCL, 1);
+    if(first == -1 || fs_write(first, pattern, 100) != 100) {
+        fprintf(stderr, "failed to write %s: %s\n", TMP_TRUNCATED_FILE, strerror(errno));
+        return -1;
+    }
+    int second = fs_open(TMP_TRUNCATED_FILE, O_WRONLY | O_TRUNC, 1);
+    if(second == -1) {
+        fprintf(stderr, "failed to truncate %s: %s\n", TMP_TRUNCATED_FILE, strerror(errno));
+        fs_close(first);
+        return -1;
+    }
+    fs_close(second);
+    int result = fs_write(first, pattern + 100, 1);
+    fs_close(first);
+    if(result != 1) {
+        fprintf(stderr, "failed to write %s after truncating it: %s\n", TMP_TRUNCATED_FILE, strerror(errno));
+        return -1;
+    }
+    return 101;
+}
+
+// writes a file until the RAM filesystem is full, the file must take exactly the space that was free
+static int64_t fill_tmp() {
+    tmp_fill_size = fs_get_free_space("/tmp");
+    int file = fs_open(TMP_FILL_FILE, O_WRONLY | O_CREAT | O_EXCL, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to create %s: %s\n", TMP_FILL_FILE, strerror(errno));
+        return -1;
+    }
+    int64_t total = 0;
+    int result;
+    while((result = fs_write(file, pattern + total % (BENCH_FILE_SIZE - 64 * 1024), 64 * 1024)) > 0) {
+        total += result;
+    }
+    fs_close(file);
+    if(result != -1 || errno != ENOSPC) {
+        fprintf(stderr, "writing %s past the end of the free space didn't fail with ENOSPC: %s\n", TMP_FILL_FILE, strerror(errno));
+        return -1;
+    } else if(total != tmp_fill_size || fs_get_free_space("/tmp") != 0) {
+        fprintf(stderr, "%s is %lld bytes, but %lld were free (%lld still are)\n", TMP_FILL_FILE, (long long)total,
+            (long long)tmp_fill_size, (long long)fs_get_free_space("/tmp"));
+        return -1;
+    }
+    return total;
+}
+
+static int64_t tmpfs() {
+    int64_t grown = write_tmp_file(TMP_FILE, pattern, TMP_FILE_SIZE);
+    int64_t renamed = write_tmp_file("/tmp/small.bin", created_file_data(1), created_file_size(1));
+    if(grown < 0 || renamed < 0) {
+        return -1;
+    }
+    if(fs_rename("/tmp/small.bin", TMP_RENAMED_FILE) != 0) {
+        fprintf(stderr, "failed to rename /tmp/small.bin to %s: %s\n", TMP_RENAMED_FILE, strerror(errno));
+        return -1;
+    } else if(fs_rename(TMP_RENAMED_FILE, TMP_FILE) != -1 || errno != EEXIST) {
+        fprintf(stderr, "renaming %s onto %s didn't fail with EEXIST\n", TMP_RENAMED_FILE, TMP_FILE);
+        return -1;
+    } else if(fs_rename(TMP_FILE, "/grown.bin") != -1 || errno != EXDEV) {
+        fprintf(stderr, "renaming %s off of /tmp didn't fail with EXDEV\n", TMP_FILE);
+        return -1;
+    }
+    int64_t truncated = truncate_tmp_file();
+    if(truncated < 0) {
+        return -1;
+    }
+    int64_t filled = fill_tmp();
+    if(filled < 0) {
+        return -1;
+    }
+    return grown + renamed + truncated + filled;
+}
+
+// checks a directory listing has an item, with the expected size and type
+static int find_in_listing(const fs_dirent* entries, int count, const char* path, const char* name, int size, bool is_directory) {
+    for(int i = 0; i < count; i++) {
+        if(strcmp(entries[i].name, name) != 0) {
+            continue;
+        }
+        if(entries[i].attributes.is_directory != is_directory || (!is_directory && entries[i].attributes.size != size)) {
+            fprintf(stderr, "%s in the listing of %s has size %i and is%s a directory\n", name, path,
+                entries[i].attributes.size, entries[i].attributes.is_directory ? "" : " not");
+            return -1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "%s is missing from the listing of %s\n", name, path);
+    return -1;
+}
+
+static int verify_tmpfs() {
+    uint8_t truncated[101] = { 0 };
+    truncated[100] = pattern[100];
+    if(verify_file(TMP_FILE, pattern, TMP_FILE_SIZE) != 0
+        || verify_file(TMP_RENAMED_FILE, created_file_data(1), created_file_size(1)) != 0
+        || verify_file(TMP_TRUNCATED_FILE, truncated, sizeof truncated) != 0) {
+        return -1;
+    }
+    for(int64_t offset = 0; offset < tmp_fill_size; offset += 64 * 1024) {
+        memcpy(expected + offset, pattern + offset % (BENCH_FILE_SIZE - 64 * 1024), 64 * 1024);
+    }
+    if(verify_file(TMP_FILL_FILE, expected, tmp_fill_size) != 0) {
+        return -1;
+    }
+
+    fs_dirent* entries;
+    int count = fs_list("/tmp", &entries);
+    if(count != 4) {
+        fprintf(stderr, "listing /tmp found %i items instead of 4: %s\n", count, strerror(errno));
+        if(count > 0) free(entries);
+        return -1;
+    }
+    int status = 0;
+    if(find_in_listing(entries, count, "/tmp", "grown.bin", TMP_FILE_SIZE, false) != 0
+        || find_in_listing(entries, count, "/tmp", "renamed.bin", created_file_size(1), false) != 0
+        || find_in_listing(entries, count, "/tmp", "truncated.bin", sizeof truncated, false) != 0
+        || find_in_listing(entries, count, "/tmp", "fill.bin", tmp_fill_size, false) != 0) {
+        status = -1;
+    }
+    free(entries);
+    fs_attributes attributes;
+    if(fs_stat("/tmp/small.bin", &attributes) != -1 || errno != ENOENT) {
+        fprintf(stderr, "/tmp/small.bin still exists after being renamed\n");
+        status = -1;
+    }
+    return status;
+}
+
+// the files in host/rom, which the host build serves at /rom, and how large they are
+static const struct {
+    const char* path;
+    int size;
+} rom_files[] = {
+    { "apis/colors.lua", 715 },
+    { "empty.txt", 0 },
+    { "one.txt", 1 },               // "x"
+    { "programs/noise.bin", 1000 }, // doesn't compress, so it's stored as it is in the compressed archive too
+    { "programs/runs.txt", 71680 }, // runs of 1000 of each letter, see rom_run_byte()
+    { "startup.lua", 829 },
+};
+#define ROM_FILE_COUNT (int)(sizeof(rom_files) / sizeof(rom_files[0]))
+#define ROM_ROOT_ITEMS 5    // apis, empty.txt, one.txt, programs, startup.lua
+
+// the compressed copy of host/rom, linked in by host/rom-compressed.S
+extern const uint8_t host_rom_compressed[];
+extern const uint8_t host_rom_compressed_end[];
+static fs_rom* rom_compressed;
+
+static uint8_t rom_run_byte(int i) {
+    return 'a' + (i / 1000) % 26;
+}
+
+// where each rom file's data is put in `expected` by the rom benchmarks
+static int rom_file_offset(int n) {
+    int offset = 0;
+    for(int i = 0; i < n; i++) {
+        offset += rom_files[i].size;
+    }
+    return offset;
+}
+
+// reads every file under /rom into `expected`
+static int64_t read_rom() {
+    char path[64];
+    int64_t total = 0;
+    for(int i = 0; i < ROM_FILE_COUNT; i++) {
+        snprintf(path, sizeof path, "/rom/%s", rom_files[i].path);
+        int file = fs_open(path, O_RDONLY, 1);
+        if(file == -1) {
+            fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        uint8_t* data = expected + rom_file_offset(i);
+        int offset = 0;
+        int result;
+        while((result = fs_read(file, data + offset, 512)) > 0) {
+            offset += result;
+        }
+        fs_close(file);
+        if(result < 0 || offset != rom_files[i].size) {
+            fprintf(stderr, "read %i bytes of %s instead of %i: %s\n", offset, path, rom_files[i].size, strerror(errno));
+            return -1;
+        }
+        total += offset;
+    }
+    return total;
+}
+
+// reads every file of the compressed archive into `expected`, through fs_rom itself since only one archive is at /rom
+static int64_t read_rom_compressed() {
+    if(rom_compressed == NULL) {
+        rom_compressed = fs_rom_init(host_rom_compressed, host_rom_compressed_end - host_rom_compressed);
+        if(rom_compressed == NULL) {
+            fprintf(stderr, "failed to mount the compressed rom archive\n");
+            return -1;
+        }
+    }
+    int64_t total = 0;
+    for(int i = 0; i < ROM_FILE_COUNT; i++) {
+        fs_file* file = fs_rom_ops.open(rom_compressed, rom_files[i].path, O_RDONLY);
+        if(file == NULL) {
+            fprintf(stderr, "failed to open %s in the compressed archive: %s\n", rom_files[i].path, strerror(errno));
+            return -1;
+        }
+        uint8_t* data = expected + rom_file_offset(i);
+        int offset = 0;
+        int result;
+        while((result = fs_rom_ops.read(file, data + offset, 512)) > 0) {
+            offset += result;
+        }
+        fs_rom_ops.close(file);
+        free(file);
+        if(offset != rom_files[i].size) {
+            fprintf(stderr, "read %i bytes of %s in the compressed archive instead of %i\n", offset, rom_files[i].path, rom_files[i].size);
+            return -1;
+        }
+        total += offset;
+    }
+    return total;
+}
+
+// checks the files read into `expected` by either rom benchmark match what's known about them, and what /rom holds
+static int verify_rom_files() {
+    if(expected[rom_file_offset(2)] != 'x') {
+        fprintf(stderr, "one.txt doesn't hold \"x\"\n");
+        return -1;
+    }
+    const uint8_t* runs = expected + rom_file_offset(4);
+    for(int i = 0; i < rom_files[4].size; i++) {
+        if(runs[i] != rom_run_byte(i)) {
+            fprintf(stderr, "%s differs at offset %i\n", rom_files[4].path, i);
+            return -1;
+        }
+    }
+    char path[64];
+    for(int i = 0; i < ROM_FILE_COUNT; i++) {
+        snprintf(path, sizeof path, "/rom/%s", rom_files[i].path);
+        if(verify_file(path, expected + rom_file_offset(i), rom_files[i].size) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// fs_list_callback that counts the items in a directory
+static int count_item(void* context, const char* name, const fs_attributes* attributes) {
+    (*(int*)context)++;
+    return 0;
+}
+
+// checks a path can't be opened, with the expected error
+static int expect_open_error(const char* path, int mode, int error) {
+    int file = fs_open(path, mode, 1);
+    if(file != -1 || errno != error) {
+        fprintf(stderr, "opening %s didn't fail with %s\n", path, strerror(error));
+        if(file != -1) fs_close(file);
+        return -1;
+    }
+    return 0;
+}
+
+static int verify_rom() {
+    if(verify_rom_files() != 0) {
+        return -1;
+    }
+    char path[64];
+    for(int i = 0; i < ROM_FILE_COUNT; i++) {
+        snprintf(path, sizeof path, "/rom/%s", rom_files[i].path);
+        fs_attributes attributes;
+        if(fs_stat(path, &attributes) != 0 || attributes.size != rom_files[i].size || attributes.is_directory || !attributes.is_read_only) {
+            fprintf(stderr, "stat of %s reports size %i, directory %i, read-only %i: %s\n", path, attributes.size,
+                attributes.is_directory, attributes.is_read_only, strerror(errno));
+            return -1;
+        }
+    }
+    fs_dirent* entries;
+    int count = fs_list("/rom", &entries);
+    if(count != ROM_ROOT_ITEMS) {
+        fprintf(stderr, "listing /rom found %i items instead of %i: %s\n", count, ROM_ROOT_ITEMS, strerror(errno));
+        if(count > 0) free(entries);
+        return -1;
+    }
+    int status = find_in_listing(entries, count, "/rom", "apis", 0, true) | find_in_listing(entries, count, "/rom", "programs", 0, true)
+        | find_in_listing(entries, count, "/rom", "empty.txt", 0, false) | find_in_listing(entries, count, "/rom", "one.txt", 1, false)
+        | find_in_listing(entries, count, "/rom", "startup.lua", rom_files[5].size, false);
+    free(entries);
+    count = fs_list("/rom/programs", &entries);
+    if(count != 2) {
+        fprintf(stderr, "listing /rom/programs found %i items instead of 2: %s\n", count, strerror(errno));
+        status = -1;
+    } else {
+        status |= find_in_listing(entries, count, "/rom/programs", "noise.bin", rom_files[3].size, false)
+            | find_in_listing(entries, count, "/rom/programs", "runs.txt", rom_files[4].size, false);
+    }
+    if(count > 0) free(entries);
+    if(fs_list("/rom/one.txt", &entries) != -1 || errno != ENOTDIR) {
+        fprintf(stderr, "listing /rom/one.txt didn't fail with ENOTDIR\n");
+        status = -1;
+    }
+    status |= expect_open_error("/rom/one.txt", O_WRONLY, EROFS) | expect_open_error("/rom/missing.txt", O_RDONLY, ENOENT)
+        | expect_open_error("/rom/programs", O_RDONLY, EISDIR);
+    return status;
+}
+
+static int verify_rom_compressed() {
+    // most of the files must really be compressed, or the decompression isn't being checked
+    int compressed = 0;
+    for(uint32_t i = 0; i < rom_compressed->entry_count; i++) {
+        compressed += (rom_compressed->entries[i].flags & FS_ROM_FLAG_COMPRESSED) != 0;
+    }
+    if(compressed < 3) {
+        fprintf(stderr, "only %i files in the compressed archive are compressed\n", compressed);
+        return -1;
+    }
+    if(verify_rom_files() != 0) {
+        return -1;
+    }
+    for(int i = 0; i < ROM_FILE_COUNT; i++) {
+        fs_attributes attributes;
+        if(fs_rom_ops.stat(rom_compressed, rom_files[i].path, &attributes) != 0 || attributes.size != rom_files[i].size) {
+            fprintf(stderr, "stat of %s in the compressed archive reports size %i\n", rom_files[i].path, attributes.size);
+            return -1;
+        }
+    }
+    int count = 0;
+    if(fs_rom_ops.list(rom_compressed, "", count_item, &count) != 0 || count != ROM_ROOT_ITEMS) {
+        fprintf(stderr, "listing the compressed archive found %i items instead of %i\n", count, ROM_ROOT_ITEMS);
+        return -1;
+    }
+    return 0;
+}
+
+// files in /tmp for the mmap benchmark, one small enough to be mapped in place and one that's copied into a buffer
+#define TMP_MAPPED_SMALL    "/tmp/mapped-small.bin"
+#define TMP_MAPPED_LARGE    "/tmp/mapped-large.bin"
+
+static int prepare_mmap() {
+    if(write_tmp_file(TMP_MAPPED_SMALL, pattern, FS_TMP_MIN_CHUNK - 1) < 0 || write_tmp_file(TMP_MAPPED_LARGE, pattern, 300 * 1000) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// maps BENCH_FILE, which is read in as few commands as possible
+static int64_t mmap_file() {
+    int file = fs_open(BENCH_FILE, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    int size;
+    const uint8_t* view = fs_mmap(file, &size);
+    fs_close(file);
+    if(view == NULL) {
+        fprintf(stderr, "failed to map %s: %s\n", BENCH_FILE, strerror(errno));
+        return -1;
+    }
+    return size;
+}
+
+/** Maps a file and checks the view holds what fs_read() reads, that mapping it again gives the same view, that mapping
+ * doesn't move the file's offset, and that it can be unmapped (once) and mapped again.
+ * @param start, end    if they aren't `NULL`, the view must point into the filesystem's own memory between them
+ */
+static int check_mapping(const char* path, const uint8_t* start, const uint8_t* end) {
+    int file = fs_open(path, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int status = -1;
+    uint8_t first_byte;
+    int size, second_size;
+    const uint8_t* view = NULL;
+    if(fs_read(file, &first_byte, 1) < 0) {
+        fprintf(stderr, "failed to read %s: %s\n", path, strerror(errno));
+    } else if((view = fs_mmap(file, &size)) == NULL) {
+        fprintf(stderr, "failed to map %s: %s\n", path, strerror(errno));
+    } else if(start != NULL && (view < start || view + size > end)) {
+        fprintf(stderr, "%s was copied when it was mapped, instead of being mapped in place\n", path);
+    } else if(verify_file(path, view, size) != 0) {
+        fprintf(stderr, "the view of %s doesn't match what's read from it\n", path);
+    } else if(size > 1 && (fs_read(file, &first_byte, 1) != 1 || first_byte != view[1])) {
+        fprintf(stderr, "mapping %s moved its offset\n", path);
+    } else if(fs_mmap(file, &second_size) != view || second_size != size) {
+        fprintf(stderr, "mapping %s twice gave a different view\n", path);
+    } else if(fs_munmap(file) != 0) {
+        fprintf(stderr, "failed to unmap %s: %s\n", path, strerror(errno));
+    } else if(fs_munmap(file) != -1 || errno != EINVAL) {
+        fprintf(stderr, "unmapping %s twice didn't fail with EINVAL\n", path);
+    } else if((view = fs_mmap(file, &size)) == NULL || verify_file(path, view, size) != 0) {
+        fprintf(stderr, "mapping %s again after unmapping it failed: %s\n", path, strerror(errno));
+    } else {
+        status = 0;
+    }
+    fs_close(file);  // which unmaps it
+    return status;
+}
+
+// a file that's mapped in place gives every handle the same view
+static int check_shared_mapping(const char* path) {
+    int first = fs_open(path, O_RDONLY, 1);
+    int second = fs_open(path, O_RDONLY, 1);
+    int size;
+    const uint8_t* view = first == -1 ? NULL : fs_mmap(first, &size);
+    int status = 0;
+    if(view == NULL || second == -1 || fs_mmap(second, &size) != view) {
+        fprintf(stderr, "%s wasn't mapped in place: %s\n", path, strerror(errno));
+        status = -1;
+    }
+    if(first != -1) fs_close(first);
+    if(second != -1) fs_close(second);
+    return status;
+}
+
+static int verify_mmap() {
+    int status = check_mapping(BENCH_FILE, NULL, NULL) | check_mapping("small/file000.txt", NULL, NULL)
+        | check_mapping("/rom/programs/runs.txt", fs_rom_archive, fs_rom_archive_end)
+        | check_mapping("/rom/empty.txt", fs_rom_archive, fs_rom_archive_end)
+        | check_mapping(TMP_MAPPED_SMALL, NULL, NULL) | check_shared_mapping(TMP_MAPPED_SMALL)
+        | check_mapping(TMP_MAPPED_LARGE, NULL, NULL);
+
+    int file = fs_open(TMP_MAPPED_SMALL, O_WRONLY, 1);
+    int size;
+    if(file == -1 || fs_mmap(file, &size) != NULL || errno != EACCES) {
+        fprintf(stderr, "mapping %s opened for writing didn't fail with EACCES\n", TMP_MAPPED_SMALL);
+        status = -1;
+    }
+    if(file != -1) fs_close(file);
+    return status;
+}
+
+// the size host/mkimage.sh gives the nth file in small/
+static int small_file_size(int n) {
+    return 1024 + (n * 61) % 3072;
+}
+
+// lists small/ and stats every file in it, which should only read the directory once and then hit the dentry cache
+static int64_t stat_list() {
+    fs_dirent* entries;
+    int count = fs_list("small", &entries);
+    if(count == -1) {
+        fprintf(stderr, "failed to list small: %s\n", strerror(errno));
+        return -1;
+    }
+    free(entries);
+    char name[32];
+    for(int i = 0; i < SMALL_FILE_COUNT; i++) {
+        small_file_name(name, i);
+        fs_attributes attributes;
+        if(fs_stat(name, &attributes) != 0) {
+            fprintf(stderr, "failed to stat %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static bool same_attributes(const fs_attributes* a, const fs_attributes* b) {
+    return a->size == b->size && a->is_directory == b->is_directory && a->is_read_only == b->is_read_only
+        && a->created == b->created && a->modified == b->modified;
+}
+
+// checks a listing has the same items as reading the directory with fs_opendir() & fs_readdir()
+static int check_readdir(const char* path, const fs_dirent* entries, int count) {
+    fs_dir* dir = fs_opendir(path);
+    if(dir == NULL) {
+        fprintf(stderr, "failed to open directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int status = 0;
+    const fs_dirent* item;
+    int i = 0;
+    while((item = fs_readdir(dir)) != NULL) {
+        if(i >= count || strcmp(item->name, entries[i].name) != 0 || !same_attributes(&item->attributes, &entries[i].attributes)) {
+            fprintf(stderr, "item %i of directory %s (%s) doesn't match its listing\n", i, path, item->name);
+            status = -1;
+            break;
+        }
+        i++;
+    }
+    if(status == 0 && i != count) {
+        fprintf(stderr, "reading directory %s found %i items instead of %i\n", path, i, count);
+        status = -1;
+    }
+    fs_closedir(dir);
+    return status;
+}
+
+// checks fs_fstat() of an open file reports the same as fs_stat() of its path
+static int check_fstat(const char* path) {
+    int file = fs_open(path, O_RDONLY, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fs_attributes by_path, by_file;
+    int status = 0;
+    if(fs_stat(path, &by_path) != 0 || fs_fstat(file, &by_file) != 0) {
+        fprintf(stderr, "failed to stat %s: %s\n", path, strerror(errno));
+        status = -1;
+    } else if(!same_attributes(&by_path, &by_file)) {
+        fprintf(stderr, "fstat of %s reports size %i, read-only %i, created %lld, modified %lld, but stat reports %i, %i, %lld, %lld\n",
+            path, by_file.size, by_file.is_read_only, (long long)by_file.created, (long long)by_file.modified,
+            by_path.size, by_path.is_read_only, (long long)by_path.created, (long long)by_path.modified);
+        status = -1;
+    }
+    fs_close(file);
+    return status;
+}
+
+// the files mkimage.sh creates were stamped when it ran, which is after this and before now
+#define EARLIEST_TIMESTAMP 1577836800000LL  // 2020-01-01
+
+static int check_timestamps(const char* path) {
+    fs_attributes attributes;
+    int64_t now = (int64_t)time(NULL) * 1000 + 86400000;    // plus a day, FAT timestamps are local time
+    if(fs_stat(path, &attributes) != 0 || attributes.created < EARLIEST_TIMESTAMP || attributes.created > now
+        || attributes.modified < EARLIEST_TIMESTAMP || attributes.modified > now) {
+        fprintf(stderr, "%s has timestamps %lld & %lld: %s\n", path, (long long)attributes.created, (long long)attributes.modified, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int verify_stat_list() {
+    // the root of the boot device, with the paths the other filesystems are mounted at
+    fs_dirent* entries;
+    int count = fs_list("/", &entries);
+    if(count == -1) {
+        fprintf(stderr, "failed to list /: %s\n", strerror(errno));
+        return -1;
+    }
+    int status = find_in_listing(entries, count, "/", BENCH_FILE, BENCH_FILE_SIZE, false) | find_in_listing(entries, count, "/", "small", 0, true)
+        | find_in_listing(entries, count, "/", "deep", 0, true) | find_in_listing(entries, count, "/", "tmp", 0, true)
+        | find_in_listing(entries, count, "/", "rom", 0, true) | check_readdir("/", entries, count);
+    for(int i = 0; i < count; i++) {
+        if(strcmp(entries[i].name, "rom") == 0 && !entries[i].attributes.is_read_only) {
+            fprintf(stderr, "rom in the listing of / isn't read-only\n");
+            status = -1;
+        }
+    }
+    free(entries);
+
+    count = fs_list("small", &entries);
+    if(count != SMALL_FILE_COUNT) {
+        fprintf(stderr, "listing small found %i items instead of %i: %s\n", count, SMALL_FILE_COUNT, strerror(errno));
+        if(count > 0) free(entries);
+        return -1;
+    }
+    char name[32];
+    for(int i = 0; i < SMALL_FILE_COUNT; i++) {
+        small_file_name(name, i);
+        fs_attributes attributes;
+        status |= find_in_listing(entries, count, "small", name + strlen("small/"), small_file_size(i), false);
+        if(fs_stat(name, &attributes) != 0 || attributes.size != small_file_size(i) || attributes.is_directory || attributes.is_read_only) {
+            fprintf(stderr, "stat of %s reports size %i, directory %i, read-only %i: %s\n", name, attributes.size,
+                attributes.is_directory, attributes.is_read_only, strerror(errno));
+            status = -1;
+        }
+    }
+    status |= check_readdir("small", entries, count);
+    free(entries);
+
+    fs_attributes attributes;
+    if(fs_stat("deep/a", &attributes) != 0 || !attributes.is_directory || attributes.size != 0) {
+        fprintf(stderr, "deep/a isn't a directory: %s\n", strerror(errno));
+        status = -1;
+    }
+    status |= check_timestamps(BENCH_FILE) | check_timestamps("small/file042.txt") | check_timestamps("deep/a");
+    status |= check_fstat(BENCH_FILE) | check_fstat("small/file007.txt") | check_fstat(DEEP_FILE) | check_fstat("/rom/startup.lua");
+    if(write_tmp_file("/tmp/stat.bin", pattern, 5000) < 0) {
+        status = -1;
+    } else {
+        status |= check_fstat("/tmp/stat.bin");
+    }
+
+    // an open file reports the size it's been written to, before its directory entry is updated
+    int file = fs_open("small/stat.txt", O_WRONLY | O_CREAT | O_EXCL, 1);
+    if(file == -1 || fs_write(file, pattern, 100) != 100 || fs_fstat(file, &attributes) != 0 || attributes.size != 100) {
+        fprintf(stderr, "fstat of small/stat.txt after writing 100 bytes to it reports size %i: %s\n", attributes.size, strerror(errno));
+        status = -1;
+    }
+    if(file != -1) fs_close(file);
+    status |= check_fstat("small/stat.txt");
+
+    if(fs_stat("small/missing.txt", &attributes) != -1 || errno != ENOENT) {
+        fprintf(stderr, "stat of small/missing.txt didn't fail with ENOENT\n");
+        status = -1;
+    }
+    if(fs_list(BENCH_FILE, &entries) != -1 || errno != ENOTDIR) {
+        fprintf(stderr, "listing %s didn't fail with ENOTDIR\n", BENCH_FILE);
+        status = -1;
+    }
+    if(fs_opendir("missing") != NULL || errno != ENOENT) {
+        fprintf(stderr, "opening directory missing didn't fail with ENOENT\n");
+        status = -1;
+    }
+    if(fs_fstat(-1, &attributes) != -1 || errno != EBADF) {
+        fprintf(stderr, "fstat of file -1 didn't fail with EBADF\n");
+        status = -1;
+    }
+    return status;
+}
+
+// files the defrag benchmark fragments by writing them a cluster at a time in turns, each a different number of
+// 64 KiB blocks long, so which one is being moved can be told from how much free space the move reserves
+#define DEFRAG_FILE_COUNT   6
+#define DEFRAG_CHUNK        4096
+#define DEFRAG_BLOCK        (64 * 1024)
+static char defrag_names[DEFRAG_FILE_COUNT][32];
+static int defrag_sizes[DEFRAG_FILE_COUNT];
+static bool defrag_changed[DEFRAG_FILE_COUNT];  // if the file was changed while it was being moved
+static fs_fragmentation defrag_before;
+
+static uint8_t* defrag_data(int n) {
+    return expected + n * 1024 * 1024;
+}
+
+// fs_fragmentation_callback that records how many runs each of the defrag benchmark's files is in
+static void count_defrag_extents(void* context, const char* path, int size, uint32_t extents) {
+    uint32_t* file_extents = context;
+    while(*path == '/') path++;
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        if(strcmp(path, defrag_names[i]) == 0) {
+            file_extents[i] = extents;
+        }
+    }
+}
+
+static int prepare_defrag() {
+    int files[DEFRAG_FILE_COUNT];
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        sprintf(defrag_names[i], "frag%i.bin", i);
+        defrag_sizes[i] = (4 + i) * DEFRAG_BLOCK - 100;
+        defrag_changed[i] = false;
+        memcpy(defrag_data(i), pattern + i * 1024 * 1024, defrag_sizes[i]);
+        files[i] = fs_open(defrag_names[i], O_WRONLY | O_CREAT | O_EXCL, 1);
+        if(files[i] == -1) {
+            fprintf(stderr, "failed to create %s: %s\n", defrag_names[i], strerror(errno));
+            return -1;
+        }
+    }
+    int status = 0;
+    for(int offset = 0; offset < defrag_sizes[DEFRAG_FILE_COUNT - 1] && status == 0; offset += DEFRAG_CHUNK) {
+        for(int i = 0; i < DEFRAG_FILE_COUNT && status == 0; i++) {
+            int length = defrag_sizes[i] - offset < DEFRAG_CHUNK ? defrag_sizes[i] - offset : DEFRAG_CHUNK;
+            if(length > 0 && fs_write(files[i], defrag_data(i) + offset, length) != length) {
+                fprintf(stderr, "failed to write %s: %s\n", defrag_names[i], strerror(errno));
+                status = -1;
+            }
+        }
+    }
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        fs_close(files[i]);
+    }
+    if(status != 0 || fs_sync() != 0) {
+        return -1;
+    }
+
+    uint32_t extents[DEFRAG_FILE_COUNT] = { 0 };
+    if(fs_get_fragmentation("/", &defrag_before, count_defrag_extents, extents) != 0) {
+        fprintf(stderr, "failed to get the fragmentation report: %s\n", strerror(errno));
+        return -1;
+    } else if(defrag_before.free_space != (uint64_t)fs_get_free_space("/")) {
+        fprintf(stderr, "the fragmentation report has %llu bytes free, but there are %lld\n",
+            (unsigned long long)defrag_before.free_space, (long long)fs_get_free_space("/"));
+        return -1;
+    }
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        if(extents[i] < 2) {
+            fprintf(stderr, "%s is in %u runs, it wasn't fragmented\n", defrag_names[i], extents[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// changes a file while it's being moved: the last one is renamed, the one before is overwritten, and the one before that truncated
+static int change_moving_file(int n) {
+    if(n == DEFRAG_FILE_COUNT - 1) {
+        char name[32];
+        sprintf(name, "moved%i.bin", n);
+        if(fs_rename(defrag_names[n], name) != 0) {
+            fprintf(stderr, "failed to rename %s to %s: %s\n", defrag_names[n], name, strerror(errno));
+            return -1;
+        }
+        strcpy(defrag_names[n], name);
+        return 0;
+    }
+    bool truncate = n == DEFRAG_FILE_COUNT - 3;
+    int file = fs_open(defrag_names[n], truncate ? O_WRONLY | O_TRUNC : O_RDWR, 1);
+    if(file == -1) {
+        fprintf(stderr, "failed to open %s: %s\n", defrag_names[n], strerror(errno));
+        return -1;
+    }
+    int offset = truncate ? 0 : 100000;
+    int length = truncate ? 2 * DEFRAG_BLOCK - 50 : 5000;
+    memcpy(defrag_data(n) + offset, pattern + BENCH_FILE_SIZE - 2 * DEFRAG_BLOCK, length);
+    if(truncate) {
+        defrag_sizes[n] = length;
+    }
+    int result = fs_seek(file, offset, SEEK_SET) == offset ? fs_write(file, defrag_data(n) + offset, length) : -1;
+    fs_close(file);
+    if(result != length) {
+        fprintf(stderr, "failed to change %s while it was being moved: %s\n", defrag_names[n], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int64_t defragment() {
+    // while a file is moved, the run it's moved to is reserved, so the free space is that much less
+    int64_t free_space = fs_get_free_space("/");
+    if(fs_defragment("/") != 0) {
+        fprintf(stderr, "failed to start defragmenting: %s\n", strerror(errno));
+        return -1;
+    }
+    int steps_moving[DEFRAG_FILE_COUNT] = { 0 };
+    int result;
+    while((result = fs_defragment_step()) > 0) {
+        int64_t reserved = free_space - fs_get_free_space("/");
+        int n = reserved / DEFRAG_BLOCK - 4;
+        if(reserved <= 0 || reserved % DEFRAG_BLOCK != 0 || n < 0 || n >= DEFRAG_FILE_COUNT) {
+            continue;   // not moving one of the files (bench.bin and small/ may be fragmented too)
+        }
+        // change the file once some of it has been copied
+        if(++steps_moving[n] == 2 && n >= DEFRAG_FILE_COUNT - 3) {
+            if(change_moving_file(n) != 0) {
+                return -1;
+            }
+            defrag_changed[n] = true;
+            free_space = fs_get_free_space("/") + (n == DEFRAG_FILE_COUNT - 1 ? reserved : 0);  // a rename doesn't stop the move
+        }
+    }
+    if(result != 0) {
+        fprintf(stderr, "defragmenting failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for(int n = DEFRAG_FILE_COUNT - 3; n < DEFRAG_FILE_COUNT; n++) {
+        if(!defrag_changed[n]) {
+            fprintf(stderr, "%s was never seen being moved\n", defrag_names[n]);
+            return -1;
+        }
+    }
+
+    // the files that were changed are moved by a second pass, driven by the timer like on the Pi
+    if(fs_defragment("/") != 0) {
+        fprintf(stderr, "failed to start defragmenting again: %s\n", strerror(errno));
+        return -1;
+    }
+    for(int round = 0; (result = fs_defragment_step()) > 0; round++) {
+        if(round == 1000) {
+            fprintf(stderr, "the second defragmentation pass didn't finish\n");
+            return -1;
+        }
+        fs_writeback_due((uint32_t)now_ms());
+        fs_writeback_if_due();
+    }
+    if(result != 0) {
+        fprintf(stderr, "defragmenting again failed: %s\n", strerror(errno));
+        return -1;
+    }
+    int64_t total = 0;
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        total += defrag_sizes[i];
+    }
+    return total;
+}
+
+static int verify_defragment() {
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        if(verify_file(defrag_names[i], defrag_data(i), defrag_sizes[i]) != 0) {
+            return -1;
+        }
+    }
+    fs_fragmentation after;
+    uint32_t extents[DEFRAG_FILE_COUNT] = { 0 };
+    if(fs_get_fragmentation("/", &after, count_defrag_extents, extents) != 0) {
+        fprintf(stderr, "failed to get the fragmentation report: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("%-13s %10u fragmented files before %u after %10u runs before %u after\n", "",
+        defrag_before.fragmented_files, after.fragmented_files, defrag_before.extent_count, after.extent_count);
+    for(int i = 0; i < DEFRAG_FILE_COUNT; i++) {
+        if(extents[i] != 1) {
+            fprintf(stderr, "%s is still in %u runs\n", defrag_names[i], extents[i]);
+            return -1;
+        }
+    }
+    if(after.fragmented_files != 0 || after.free_space != (uint64_t)fs_get_free_space("/")) {
+        fprintf(stderr, "%u files are still fragmented, the report has %llu bytes free and there are %lld\n", after.fragmented_files,
+            (unsigned long long)after.free_space, (long long)fs_get_free_space("/"));
+        return -1;
+    }
+    return 0;
+}
+
+static int64_t open_storm() {
+    char name[32];
+    random_state = 0xBEEF;
+    for(int i = 0; i < OPEN_STORM_COUNT; i++) {
+        const char* path = name;
+        if(i % 10 == 0) {
+            path = DEEP_FILE;
+        } else {
+            small_file_name(name, next_random() % SMALL_FILE_COUNT);
+        }
+        int file = fs_open(path, O_RDONLY, 1);
+        if(file == -1) {
+            fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        fs_close(file);
+    }
+    return 0;
+}
+
+static int64_t missing_lookups() {
+    char name[32];
+    for(int i = 0; i < OPEN_STORM_COUNT; i++) {
+        sprintf(name, "small/missing%03d.txt", i % 100);
+        int file = fs_open(name, O_RDONLY, 1);
+        if(file != -1 || errno != ENOENT) {
+            fprintf(stderr, "opening %s didn't fail with ENOENT: %s\n", name, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int64_t small_files() {
+    char name[32];
+    int64_t total = 0;
+    for(int i = 0; i < SMALL_FILE_COUNT; i++) {
+        small_file_name(name, i);
+        int64_t result = read_file(name, 1024);
+        if(result < 0) {
+            return -1;
+        }
+        total += result;
+    }
+    return total;
+}
+
+static const benchmark benchmarks[] = {
+    { "seq-read-4k", "read " BENCH_FILE " from start to end in 4 KiB reads", sequential_read_small },
+    { "seq-read-1m", "read " BENCH_FILE " from start to end in 1 MiB reads", sequential_read_large },
+    { "random-read", "read 512 bytes at 2000 random offsets of " BENCH_FILE, random_read },
+    { "small-files", "read all 500 files in small/ in 1 KiB reads", small_files },
+    { "open-storm", "open & close 5000 random files in small/ and " DEEP_FILE, open_storm },
+    { "missing", "open 5000 names that don't exist in small/", missing_lookups },
+    { "random-write", "write 512 bytes at 2000 random offsets of " BENCH_FILE, random_write, read_expected, verify_random_write },
+    { "seq-write", "truncate & rewrite " BENCH_FILE " in 64 KiB writes", sequential_write, NULL, verify_sequential_write },
+    { "create-files", "create 300 files of up to 16 KiB in small/", create_files, NULL, verify_create_files },
+    { "copy-rename", "copy " BENCH_FILE " to " COPY_FILE " & rename it to " MOVED_FILE, copy_rename, read_expected, verify_copy_rename },
+    { "tmpfs", "grow, truncate, rename & list files in /tmp, then fill it up", tmpfs, NULL, verify_tmpfs },
+    { "rom", "read, stat & list the files in /rom (host/rom)", read_rom, NULL, verify_rom },
+    { "rom-lz4", "read the files of host/rom from an LZ4 compressed archive, which must match /rom", read_rom_compressed, NULL, verify_rom_compressed },
+    { "stat-list", "list small/ & stat all of its files, then check listing, stat & fstat", stat_list, NULL, verify_stat_list },
+    { "mmap", "map " BENCH_FILE ", then check mapping files on FAT, /rom & /tmp", mmap_file, prepare_mmap, verify_mmap },
+    { "defrag", "defragment 6 fragmented files, changing 3 of them while they're moved", defragment, prepare_defrag, verify_defragment },
+    { "queue-order", "queue overlapping writes to a RAM device, the last one queued must win", queue_order, NULL, verify_queue_order },
+};
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int run_benchmark(const benchmark* bench, const char* image) {
+    if(bench->prepare != NULL && bench->prepare() != 0) {
+        printf("%-13s FAILED to prepare\n", bench->name);
+        return -1;
+    }
+    storage_stats* stats = &storage_get_device(0)->stats;
+    *stats = (storage_stats){ 0 };
+    // the cache counters only ever go up, so report the difference
+    fs_cache_stats cache_before = *fs_cache_get_stats();
+    fs_fat_stats fat_before = *fs_get_fat_stats("/");
+    double start = now_ms();
+    int64_t bytes = bench->run();
+    if(bytes >= 0 && fs_sync() != 0) {  // count the writes that closing files left for the write-back
+        fprintf(stderr, "failed to sync: %s\n", strerror(errno));
+        bytes = -1;
+    }
+    double elapsed = now_ms() - start;
+    if(bytes < 0) {
+        printf("%-13s FAILED\n", bench->name);
+        return -1;
+    }
+    printf("%-13s %10.2f ms %9u cmds %10llu blocks read %10llu blocks written", bench->name, elapsed,
+        stats->read_commands + stats->write_commands, (unsigned long long)stats->blocks_read, (unsigned long long)stats->blocks_written);
+    if(bytes > 0 && elapsed > 0) {
+        printf(" %9.2f MiB/s", (bytes / (1024.0 * 1024.0)) / (elapsed / 1000.0));
+    }
+    printf("\n");
+    const fs_cache_stats* cache = fs_cache_get_stats();
+    const fs_fat_stats* fat = fs_get_fat_stats("/");
+    printf("%-13s %10u cache hits %5u misses %10u directory hits %5u misses %10u of %u bytes read ahead used\n", "",
+        cache->hits - cache_before.hits, cache->misses - cache_before.misses,
+        fat->dentry_cache_hits - fat_before.dentry_cache_hits, fat->dentry_cache_misses - fat_before.dentry_cache_misses,
+        fat->readahead_hit_bytes - fat_before.readahead_hit_bytes, fat->readahead_bytes - fat_before.readahead_bytes);
+
+    // the filesystem is synced, so the image holds everything the benchmark did
+    int problems = host_fsck(image);
+    if((bench->verify != NULL && bench->verify() != 0) || problems != 0) {
+        printf("%-13s FAILED verification (%i filesystem problems)\n", bench->name, problems);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <image> [benchmark...]\n", argv[0]);
+        for(int i = 0; i < BENCHMARK_COUNT; i++) {
+            fprintf(stderr, "  %-13s %s\n", benchmarks[i].name, benchmarks[i].description);
+        }
+        return 2;
+    }
+    if(host_storage_add_image(argv[1]) != 0) {
+        fprintf(stderr, "failed to open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    buffer = malloc(BUFFER_SIZE);
+    pattern = malloc(BENCH_FILE_SIZE);
+    expected = malloc(BENCH_FILE_SIZE);
+    if(buffer == NULL || pattern == NULL || expected == NULL || fs_init() != 0) {
+        fprintf(stderr, "failed to initialize the filesystem\n");
+        return 1;
+    }
+    fill_pattern();
+
+    int failures = 0;
+    if(argc == 2) {
+        for(int i = 0; i < BENCHMARK_COUNT; i++) {
+            failures += run_benchmark(&benchmarks[i], argv[1]) != 0;
+        }
+    }
+    for(int arg = 2; arg < argc; arg++) {
+        int i = 0;
+        while(i < BENCHMARK_COUNT && strcmp(benchmarks[i].name, argv[arg]) != 0) i++;
+        if(i == BENCHMARK_COUNT) {
+            fprintf(stderr, "unknown benchmark %s\n", argv[arg]);
+            failures++;
+            continue;
+        }
+        failures += run_benchmark(&benchmarks[i], argv[1]) != 0;
+    }
+
+    free(buffer);
+    free(pattern);
+    free(expected);
+    host_storage_close();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,296 @@
+/* host-fsck.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  Checks that the FAT32 filesystem in a disk image is consistent. The image
+  file is read directly instead of through the filesystem code, so a bug in
+  that code can't hide itself. The checks are:
+    - every copy of the FAT is the same
+    - the FSInfo free cluster count matches the number of free FAT entries
+    - every allocated cluster is in exactly one file or directory's chain
+      (no lost or cross-linked clusters)
+    - every chain ends properly, and each file's chain is as long as its size
+  Each problem found is printed to stderr.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "host-fsck.h"
+
+#define SECTOR_SIZE 512
+#define ENTRIES_PER_FAT_SECTOR (SECTOR_SIZE / 4)
+#define CLUSTER_ID_MASK 0x0FFFFFFF
+#define BAD_CLUSTER 0x0FFFFFF7
+#define END_OF_CHAIN_MARKERS 0x0FFFFFF8
+#define FREE_COUNT_UNKNOWN 0xFFFFFFFF
+// the most problems of one kind that are printed, the rest are only counted
+#define MAX_REPORTED 10
+
+#define ATTRIBUTE_VOLUME_ID 0x08
+#define ATTRIBUTE_DIRECTORY 0x10
+#define ATTRIBUTE_LONG_NAME 0x0F
+
+typedef struct {
+    int image;
+    uint32_t data_start_LS;
+    uint32_t sectors_per_cluster;
+    uint32_t bytes_per_cluster;
+    uint32_t cluster_count;
+    uint32_t* fat;          // the first copy of the FAT
+    uint8_t* in_chain;      // for each cluster, 1 if a file or directory's chain has been found to contain it
+    int problems;
+} fsck;
+
+static uint32_t le16(const uint8_t* bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t le32(const uint8_t* bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static int read_sectors(fsck* self, uint32_t lba, uint32_t count, void* buffer) {
+    size_t length = (size_t)count * SECTOR_SIZE;
+    if(pread(self->image, buffer, length, (off_t)lba * SECTOR_SIZE) != (ssize_t)length) {
+        fprintf(stderr, "fsck: failed to read %u sectors @%u\n", count, lba);
+        return -1;
+    }
+    return 0;
+}
+
+static void problem(fsck* self, const char* message, const char* path, uint32_t value) {
+    self->problems++;
+    fprintf(stderr, "fsck: %s: %s (%u)\n", path, message, value);
+}
+
+/** Follows a cluster chain, marking its clusters as being in a chain.
+ * @returns the number of clusters in the chain (up to where it's broken, if it is)
+ */
+static uint32_t walk_chain(fsck* self, uint32_t cluster, const char* path) {
+    uint32_t length = 0;
+    while(true) {
+        if(cluster < 2 || cluster > self->cluster_count + 1) {
+            problem(self, "chain points outside the filesystem", path, cluster);
+            return length;
+        }
+        if(self->in_chain[cluster]) {
+            problem(self, "chain is cross-linked (or loops) at cluster", path, cluster);
+            return length;
+        }
+        self->in_chain[cluster] = 1;
+        length++;
+
+        uint32_t next = self->fat[cluster] & CLUSTER_ID_MASK;
+        if(next >= END_OF_CHAIN_MARKERS) {
+            return length;
+        } else if(next == 0) {
+            problem(self, "chain continues into a free cluster after", path, cluster);
+            return length;
+        } else if(next == BAD_CLUSTER) {
+            problem(self, "chain continues into a bad cluster after", path, cluster);
+            return length;
+        }
+        cluster = next;
+    }
+}
+
+// reads all of a directory's clusters (already walked), returns the buffer or NULL
+static uint8_t* read_directory(fsck* self, uint32_t cluster, uint32_t length) {
+    uint8_t* table = malloc((size_t)length * self->bytes_per_cluster);
+    if(table == NULL) {
+        return NULL;
+    }
+    for(uint32_t i = 0; i < length; i++) {
+        uint32_t lba = self->data_start_LS + (cluster - 2) * self->sectors_per_cluster;
+        if(read_sectors(self, lba, self->sectors_per_cluster, table + i * self->bytes_per_cluster) != 0) {
+            free(table);
+            return NULL;
+        }
+        cluster = self->fat[cluster] & CLUSTER_ID_MASK;
+    }
+    return table;
+}
+
+// checks a directory and everything in it
+static void check_directory(fsck* self, uint32_t first_cluster, const char* path) {
+    uint32_t length = walk_chain(self, first_cluster, path);
+    uint8_t* table = read_directory(self, first_cluster, length);
+    if(table == NULL) {
+        problem(self, "failed to read the directory", path, first_cluster);
+        return;
+    }
+
+    uint32_t entry_count = length * self->bytes_per_cluster / 32;
+    for(uint32_t i = 0; i < entry_count; i++) {
+        const uint8_t* entry = table + i * 32;
+        if(entry[0] == 0x00) {
+            break;  // end of the directory
+        }
+        uint8_t attributes = entry[11];
+        if(entry[0] == 0xE5 || entry[0] == '.' || attributes == ATTRIBUTE_LONG_NAME || (attributes & ATTRIBUTE_VOLUME_ID)) {
+            continue;
+        }
+
+        // the short name is enough to say where a problem is
+        char item_path[512];
+        int name_length = 8, extension_length = 3;
+        while(name_length > 0 && entry[name_length - 1] == ' ') name_length--;
+        while(extension_length > 0 && entry[8 + extension_length - 1] == ' ') extension_length--;
+        snprintf(item_path, sizeof item_path, "%s/%.*s%s%.*s", path, name_length, entry,
+            extension_length > 0 ? "." : "", extension_length, entry + 8);
+
+        uint32_t cluster = (le16(entry + 0x14) << 16) | le16(entry + 0x1A);
+        uint32_t size = le32(entry + 0x1C);
+        if(attributes & ATTRIBUTE_DIRECTORY) {
+            if(cluster == 0) {
+                problem(self, "directory has no clusters", item_path, 0);
+            } else {
+                check_directory(self, cluster, item_path);
+            }
+            continue;
+        }
+
+        uint32_t needed = (size + self->bytes_per_cluster - 1) / self->bytes_per_cluster;
+        uint32_t chain_length = cluster == 0 ? 0 : walk_chain(self, cluster, item_path);
+        // an empty file may keep the first cluster it had
+        if(chain_length != needed && !(size == 0 && chain_length == 1)) {
+            problem(self, "file's chain doesn't fit its size, clusters", item_path, chain_length);
+        }
+    }
+    free(table);
+}
+
+/** Checks the FAT32 filesystem in the first partition of a disk image.
+ * @returns the number of problems found, or `-1` if the image couldn't be read.
+ */
+int host_fsck(const char* path) {
+    fsck self = { 0 };
+    self.image = open(path, O_RDONLY);
+    if(self.image == -1) {
+        fprintf(stderr, "fsck: failed to open %s\n", path);
+        return -1;
+    }
+
+    uint8_t sector[SECTOR_SIZE];
+    int status = -1;
+    if(read_sectors(&self, 0, 1, sector) != 0) {
+        goto done;
+    }
+    if(sector[0x1FE] != 0x55 || sector[0x1FF] != 0xAA) {
+        fprintf(stderr, "fsck: no MBR\n");
+        goto done;
+    }
+    uint32_t partition_start_LS = le32(sector + 0x1C6);
+    uint32_t partition_size_LS = le32(sector + 0x1CA);
+
+    if(read_sectors(&self, partition_start_LS, 1, sector) != 0) {
+        goto done;
+    }
+    if(le16(sector + 0x00B) != SECTOR_SIZE || sector[0x00D] == 0) {
+        fprintf(stderr, "fsck: not a FAT32 partition\n");
+        goto done;
+    }
+    self.sectors_per_cluster = sector[0x00D];
+    self.bytes_per_cluster = self.sectors_per_cluster * SECTOR_SIZE;
+    uint32_t reserved_sectors = le16(sector + 0x00E);
+    uint32_t fat_count = sector[0x010];
+    uint32_t total_sectors = le32(sector + 0x020);
+    uint32_t sectors_per_fat = le32(sector + 0x024);
+    uint32_t root_cluster = le32(sector + 0x02C);
+    uint32_t fsinfo_LS = le16(sector + 0x030);
+
+    uint32_t fat_start_LS = partition_start_LS + reserved_sectors;
+    self.data_start_LS = fat_start_LS + sectors_per_fat * fat_count;
+    if(total_sectors == 0 || total_sectors > partition_size_LS) {
+        total_sectors = partition_size_LS;
+    }
+    self.cluster_count = (total_sectors - reserved_sectors - sectors_per_fat * fat_count) / self.sectors_per_cluster;
+    if(self.cluster_count > sectors_per_fat * ENTRIES_PER_FAT_SECTOR - 2) {
+        self.cluster_count = sectors_per_fat * ENTRIES_PER_FAT_SECTOR - 2;
+    }
+
+    // every copy of the FAT must match the first
+    size_t fat_size = (size_t)sectors_per_fat * SECTOR_SIZE;
+    self.fat = malloc(fat_size);
+    uint32_t* other_fat = malloc(fat_size);
+    self.in_chain = calloc(self.cluster_count + 2, 1);
+    if(self.fat == NULL || other_fat == NULL || self.in_chain == NULL) {
+        fprintf(stderr, "fsck: out of memory\n");
+        free(other_fat);
+        goto done;
+    }
+    if(read_sectors(&self, fat_start_LS, sectors_per_fat, self.fat) != 0) {
+        free(other_fat);
+        goto done;
+    }
+    for(uint32_t copy = 1; copy < fat_count; copy++) {
+        if(read_sectors(&self, fat_start_LS + copy * sectors_per_fat, sectors_per_fat, other_fat) != 0) {
+            free(other_fat);
+            goto done;
+        }
+        int reported = 0;
+        for(uint32_t i = 0; i < fat_size / 4; i++) {
+            if(self.fat[i] != other_fat[i] && reported++ < MAX_REPORTED) {
+                problem(&self, "FAT copies differ at entry", copy == 1 ? "FAT 2" : "FAT 3+", i);
+            }
+        }
+        if(reported > MAX_REPORTED) {
+            problem(&self, "more differing FAT entries", copy == 1 ? "FAT 2" : "FAT 3+", reported - MAX_REPORTED);
+        }
+    }
+    free(other_fat);
+
+    // the FSInfo free count is allowed to be unknown, but not wrong
+    uint32_t free_clusters = 0;
+    for(uint32_t cluster = 2; cluster <= self.cluster_count + 1; cluster++) {
+        if((self.fat[cluster] & CLUSTER_ID_MASK) == 0) {
+            free_clusters++;
+        }
+    }
+    if(fsinfo_LS != 0 && fsinfo_LS != 0xFFFF) {
+        if(read_sectors(&self, partition_start_LS + fsinfo_LS, 1, sector) != 0) {
+            goto done;
+        }
+        uint32_t fsinfo_free = le32(sector + 0x1E8);
+        if(le32(sector) != 0x41615252 || le32(sector + 0x1E4) != 0x61417272) {
+            problem(&self, "FSInfo has invalid signatures", "FSInfo", fsinfo_LS);
+        } else if(fsinfo_free != FREE_COUNT_UNKNOWN && fsinfo_free != free_clusters) {
+            problem(&self, "free count doesn't match the FAT's, which has", "FSInfo", free_clusters);
+        }
+    }
+
+    check_directory(&self, root_cluster, "");
+
+    // every allocated cluster should have been in a chain
+    uint32_t lost = 0;
+    for(uint32_t cluster = 2; cluster <= self.cluster_count + 1; cluster++) {
+        uint32_t entry = self.fat[cluster] & CLUSTER_ID_MASK;
+        if(entry != 0 && entry != BAD_CLUSTER && !self.in_chain[cluster] && lost++ < MAX_REPORTED) {
+            problem(&self, "allocated cluster isn't in any chain", "FAT", cluster);
+        }
+    }
+    if(lost > MAX_REPORTED) {
+        problem(&self, "more lost clusters", "FAT", lost - MAX_REPORTED);
+    }
+    status = self.problems;
+
+done:
+    free(self.fat);
+    free(self.in_chain);
+    close(self.image);
+    return status;
+}
@@ -0,0 +1,88 @@
+/* host-storage.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  The storage devices of the host build: disk image files, added with
+  `host_storage_add_image()` before `fs_init()`. The first image stands in for
+  the SD card (and has its transfer limits), any others stand in for USB
+  drives.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+#include "host-storage.h"
+
+static int images[STORAGE_MAX_DEVICES];
+static uint32_t image_blocks[STORAGE_MAX_DEVICES];
+static int image_count = 0;
+
+/** Opens a disk image to be added as a storage device.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int host_storage_add_image(const char* path) {
+    if(image_count == STORAGE_MAX_DEVICES) {
+        return -1;
+    }
+    int image = open(path, O_RDWR);
+    if(image == -1) {
+        return -1;
+    }
+    off_t size = lseek(image, 0, SEEK_END);
+    if(size == -1) {
+        close(image);
+        return -1;
+    }
+    images[image_count] = image;
+    image_blocks[image_count] = size / STORAGE_BLOCK_SIZE;
+    image_count++;
+    return 0;
+}
+
+void host_storage_close() {
+    for(int i = 0; i < image_count; i++) {
+        close(images[i]);
+    }
+    image_count = 0;
+}
+
+static int image_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    size_t length = (size_t)count * STORAGE_BLOCK_SIZE;
+    return pread(images[device->driver_index], buffer, length, (off_t)lba * STORAGE_BLOCK_SIZE) == (ssize_t)length ? 0 : -1;
+}
+
+static int image_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    size_t length = (size_t)count * STORAGE_BLOCK_SIZE;
+    return pwrite(images[device->driver_index], buffer, length, (off_t)lba * STORAGE_BLOCK_SIZE) == (ssize_t)length ? 0 : -1;
+}
+
+static const storage_device_ops image_ops = {
+    .read = image_read,
+    .write = image_write,
+};
+
+int storage_platform_init() {
+    for(int i = 0; i < image_count; i++) {
+        char name[8];
+        if(i == 0) {
+            // same limits as the sd card driver (see storage-rpi.c)
+            storage_add_device("sd", &image_ops, image_blocks[i], 0xFFFF, 1, i);
+        } else {
+            // same limits as a usb drive
+            snprintf(name, sizeof name, "usb%i", i - 1);
+            storage_add_device(name, &image_ops, image_blocks[i], 128, 4, i);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+/* host-stubs.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  Host versions of the kernel functions the filesystem code calls for logging,
+  drawing to the screen, and timing.
+  Only errors & warnings are logged, unless the KERNELUA_LOG environment
+  variable is set to a higher LOG_x level.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "log.h"
+#include "rpi-term.h"
+#include "rpi-systimer.h"
+
+static unsigned log_level() {
+    static int level = -1;
+    if(level == -1) {
+        const char* setting = getenv("KERNELUA_LOG");
+        level = setting != NULL ? atoi(setting) : LOG_WARNING;
+    }
+    return level;
+}
+
+void log_write_variadic(const char* source, unsigned level, const char* message, va_list vl) {
+    if(level > log_level()) return;
+    fprintf(stderr, "[%s]: ", source);
+    vfprintf(stderr, message, vl);
+    fputc('\n', stderr);
+}
+
+void log_write(const char* source, unsigned level, const char* message, ...) {
+    va_list vl;
+    va_start(vl, message);
+    log_write_variadic(source, level, message, vl);
+    va_end(vl);
+}
+
+void log_dump(const char* source, const uint8_t* buffer, unsigned length) {
+    log_dump_columns(source, buffer, length, 16);
+}
+
+void log_dump_columns(const char* source, const uint8_t* buffer, unsigned length, unsigned columns) {
+    if(LOG_DEBUG > log_level()) return;
+    fprintf(stderr, "[%s]:", source);
+    for(unsigned i = 0; i < length; i++) {
+        fprintf(stderr, i % columns == 0 ? "\n  %02X" : " %02X", buffer[i]);
+    }
+    fputc('\n', stderr);
+}
+
+// the open file list is drawn on the screen, there's no screen
+void RPI_TermPrintAtDyed(int x, int y, int textColor, int backgroundColor, const char* string, ...) {
+}
+
+// the Pi's system timer counts microseconds
+uint64_t RPI_GetTimerTicks(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
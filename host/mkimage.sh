@@ -0,0 +1,56 @@
+#!/bin/sh
+# mkimage.sh © Penguin_Spy 2024
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Creates a disk image with one FAT32 partition holding the files fsbench expects.
+# Requires mkfs.fat (dosfstools) and mtools.
+#   usage: mkimage.sh <image> [size in MiB] [sectors per cluster]
+set -e
+
+IMAGE=$1
+SIZE_MB=${2:-128}
+CLUSTER_SECTORS=${3:-8}
+PARTITION_START=2048    # 1 MiB in, like most partitioning tools
+
+if [ -z "$IMAGE" ]; then
+    echo "usage: $0 <image> [size in MiB] [sectors per cluster]" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+PARTITION="$WORK/partition.img"
+PARTITION_SECTORS=$((SIZE_MB * 2048 - PARTITION_START))
+
+# format & fill the partition on its own, then place it after the MBR
+mkfs.fat -F 32 -s "$CLUSTER_SECTORS" -n KERNELUA -C "$PARTITION" $((PARTITION_SECTORS / 2)) > /dev/null
+
+head -c $((16 * 1024 * 1024)) /dev/urandom > "$WORK/bench.bin"
+mkdir -p "$WORK/small" "$WORK/deep/a/b/c/d"
+i=0
+while [ $i -lt 500 ]; do
+    head -c $((1024 + (i * 61) % 3072)) /dev/urandom > "$WORK/small/$(printf 'file%03d.txt' $i)"
+    i=$((i + 1))
+done
+echo "found it" > "$WORK/deep/a/b/c/d/target.txt"
+mcopy -s -i "$PARTITION" "$WORK/bench.bin" "$WORK/small" "$WORK/deep" ::/
+
+# writes a 32 bit little-endian value as 4 bytes
+le32() {
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) $((($1 >> 8) & 255)) $((($1 >> 16) & 255)) $((($1 >> 24) & 255)))"
+}
+
+# MBR with one FAT32 LBA (type 0x0C) partition
+rm -f "$IMAGE"
+head -c 446 /dev/zero > "$IMAGE"
+{
+    printf '\000\000\000\000\014\000\000\000'
+    le32 $PARTITION_START
+    le32 $PARTITION_SECTORS
+    head -c 48 /dev/zero
+    printf '\125\252'
+} >> "$IMAGE"
+head -c $(((PARTITION_START - 1) * 512)) /dev/zero >> "$IMAGE"
+cat "$PARTITION" >> "$IMAGE"
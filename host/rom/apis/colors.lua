@@ -0,0 +1,37 @@
+-- colours, as the bits of a mask (the same values CraftOS uses)
+white = 0x1
+orange = 0x2
+magenta = 0x4
+lightBlue = 0x8
+yellow = 0x10
+lime = 0x20
+pink = 0x40
+gray = 0x80
+lightGray = 0x100
+cyan = 0x200
+purple = 0x400
+blue = 0x800
+brown = 0x1000
+green = 0x2000
+red = 0x4000
+black = 0x8000
+
+function combine(...)
+    local result = 0
+    for _, colour in ipairs({ ... }) do
+        result = bit32.bor(result, colour)
+    end
+    return result
+end
+
+function subtract(colours, ...)
+    local result = colours
+    for _, colour in ipairs({ ... }) do
+        result = bit32.band(result, bit32.bnot(colour))
+    end
+    return result
+end
+
+function test(colours, colour)
+    return bit32.band(colours, colour) == colour
+end
@@ -0,0 +1,28 @@
+-- A small stand-in for CraftOS's rom, packed into the host build's /rom so
+-- fsbench can check fs_rom (and its LZ4 decompression) without the real one.
+
+local function loadApis(directory)
+    for _, name in ipairs(fs.list(directory)) do
+        local path = fs.combine(directory, name)
+        if not fs.isDir(path) then
+            local apiName = name:gsub("%.lua$", "")
+            os.loadAPI(path)
+            print("loaded " .. apiName)
+        end
+    end
+end
+
+local function printSizes(directory)
+    for _, name in ipairs(fs.list(directory)) do
+        local path = fs.combine(directory, name)
+        if fs.isDir(path) then
+            printSizes(path)
+        else
+            print(path .. " is " .. fs.getSize(path) .. " bytes")
+        end
+    end
+end
+
+loadApis("rom/apis")
+printSizes("rom")
+print("startup done")
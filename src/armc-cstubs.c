@@ -28,6 +28,8 @@ extern int errno;
 // for file open mode flags
 #include <stdio.h>
 #include <fcntl.h>
+// for memset
+#include <string.h>
 
 #include "rpi-term.h"
 #include "rpi-aux.h"
@@ -137,6 +139,7 @@ int _read(int file, char* buffer, int length) {
         log_warn("read: %i", status);
         return status;
     } else {
+        fs_writeback_if_due();  // Lua waiting for input is a good time to save file changes
         return RPI_InputGetChars(buffer, length);
     }
 }
@@ -189,6 +192,31 @@ int _lseek(int file, int offset, int whence) {
     }
 }
 
+/** Save an open file's changes to the disk.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int _fsync(int file) {
+    log_warn("fsync(%i)", file);
+
+    if(file < FILE_HANDLE_START) {
+        return 0;   // the terminal has nothing to save
+    } else {
+        return fs_fsync(file - FILE_HANDLE_START);
+    }
+}
+
+// fills in a stat struct from the attributes the fs module reports
+static void attributes_to_stat(const fs_attributes* attributes, struct stat* stat) {
+    memset(stat, 0, sizeof *stat);
+    stat->st_mode = (attributes->is_directory ? S_IFDIR | 0777 : S_IFREG | 0666) & ~(attributes->is_read_only ? 0222 : 0);
+    stat->st_size = attributes->size;
+    stat->st_blksize = 512;
+    stat->st_blocks = (attributes->size + 511) / 512;
+    stat->st_mtime = attributes->modified / 1000;
+    stat->st_atime = stat->st_mtime;
+    stat->st_ctime = attributes->created / 1000;
+}
+
 /** Status of an open file.
  * @returns `0` on success, or `-1` on error and sets `errno`.
  */
@@ -197,13 +225,13 @@ int _fstat(int file, struct stat* stat) {
 
     if(file < FILE_HANDLE_START) {
         stat->st_mode = S_IFCHR;
-    } else if(!fs_is_valid_file(file - FILE_HANDLE_START)) {
-        errno = EBADF;
+        return 0;
+    }
+    fs_attributes attributes;
+    if(fs_fstat(file - FILE_HANDLE_START, &attributes) != 0) {
         return -1;
-    } else {
-        stat->st_mode = S_IFREG;
-        stat->st_size = 3;  // TODO: get the actual size
     }
+    attributes_to_stat(&attributes, stat);
     return 0;
 }
 
@@ -247,14 +275,18 @@ int _unlink(char* name) {
 }
 
 /** Status of a file (by name).
- *
+ * @returns `0` on success, or `-1` on error and sets `errno`.
  */
-/*int _stat(const char* name, struct stat* st) {
+int _stat(const char* name, struct stat* st) {
     log_warn("stat(%s, %X)", name, st);
 
-    st->st_mode = S_IFCHR;
+    fs_attributes attributes;
+    if(fs_stat(name, &attributes) != 0) {
+        return -1;
+    }
+    attributes_to_stat(&attributes, st);
     return 0;
-}*/
+}
 
 
 // --- System syscalls --- //
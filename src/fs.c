@@ -23,6 +23,13 @@
     - All files and subdirectories of additional storage devices (USB drives,
       populated floppy disk or CD drives) can be found under the path "/disk/",
       "/disk1/", "/disk2/", etc.
+    - Scratch files kept in RAM (see fs_tmp) can be found under "/tmp/"
+    - The CraftOS rom, if it was linked into the kernel (see fs_rom), can be
+      found under "/rom/". Otherwise "/rom/" is on the boot device like any
+      other directory.
+
+  Each mounted filesystem has a table of its type's functions (`fs_ops`),
+  which open files keep a pointer to, so calls are passed to the right module.
 
   Note that the paths the Lua environment interacts with are slightly different.
   See the lualib_fs module for how the paths are translated.
@@ -35,64 +42,168 @@
 #include <fcntl.h>
 
 #include "rpi-term.h"
+#include "rpi-systimer.h"
 #include "log.h"
-#include "rpi-sd.h"
+#include "storage.h"
 
 #include "fs.h"
 
 #include "fs_fat.h"
+#include "fs_tmp.h"
+#include "fs_rom.h"
+#include "fs_cache.h"
 
 static const char log_from[] = "fs";
 
 #define FS_MAX_OPEN_FILES 32
+// the most of a file `fs_copy()` reads at once
+#define FS_COPY_BUFFER_SIZE (256 * 1024)
+// how long `fs_writeback_if_due()` spends moving a defragmentation pass along each time, in microseconds
+#define FS_DEFRAGMENT_BATCH_US 50000
 static fs_file* files[FS_MAX_OPEN_FILES] = { 0 };
 
-static fs_fat* main_fs;
-
-// Initalizes the file system module. Reads from the boot storage device and
-//  locates the boot FAT32 partition
-int fs_init() {
-    log_notice("initializing filesystem");
-
-    // temporarily hardcode reading from the SD card on a Raspberry Pi
-    int result = sdInitCard();
-
-    if(result != SD_OK) {
-        log_error("error during sd init: %i", result);
-        return result;
-    }
-
-    log_notice("reading MBR");
+typedef struct {
+    const fs_ops* ops;
+    void* filesystem;
+} fs_mount;
+
+// mounts[0] is the boot device at "/", mounts[1] is "/disk", mounts[2] is "/disk1", etc.
+static fs_mount mounts[STORAGE_MAX_DEVICES] = { 0 };
+static int mount_count = 0;
+// the RAM filesystem at "/tmp"
+static fs_mount tmp_mount = { 0 };
+// the rom archive linked into the kernel at "/rom"
+static fs_mount rom_mount = { 0 };
+
+// set by `fs_writeback_due()` (from a timer interrupt), the write-back (and defragmentation) is done by the next file operation
+static volatile bool writeback_is_due = false;
+static volatile uint32_t writeback_due_ms;
+
+/** Reads a device's MBR and mounts its first partition, which must be FAT32.
+ * @returns the mounted filesystem, or `NULL` on error.
+ */
+static fs_fat* mount_device(storage_device* device) {
+    log_notice("reading MBR of %s", device->name);
     uint8_t buffer[512];
-    result = sdTransferBlocks(0, 1, buffer, false);
-
-    if(result != SD_OK) {
-        log_error("error reading MBR: %i", result);
-        return result;
+    if(fs_cache_read(device, 0, 1, buffer) != 0) {
+        log_error("error reading MBR: %i", errno);
+        return NULL;
     }
 
     // confirm MBR magic bytes
     if(buffer[0x1FE] != 0x55 || buffer[0x1FF] != 0xAA) {
         log_error("sector 0 did not have MBR magic bytes!");
-        return -1;
+        return NULL;
     }
-    // check first partition type (0x0C = FAT32 LBA)
-    if(buffer[0x1C2] != 0x0C) {
-        log_error("first partition is not FAT32 LBA!");
-        return -1;
+    // check first partition type (0x0C = FAT32 LBA, 0x0B = FAT32 CHS, which some usb drives are formatted with)
+    if(buffer[0x1C2] != 0x0C && buffer[0x1C2] != 0x0B) {
+        log_error("first partition is not FAT32!");
+        return NULL;
     }
 
     // get partition sector start (logical sector)
     uint32_t partition_start_LS = buffer[0x1C6] + (buffer[0x1C7] << 8) + (buffer[0x1C8] << 16) + (buffer[0x1C9] << 24);
-    uint32_t partition_size_LS = buffer[0x1CA] + (buffer[0x1CB] << 8) + (buffer[0x1CD] << 16) + (buffer[0x1CE] << 24);
+    uint32_t partition_size_LS = buffer[0x1CA] + (buffer[0x1CB] << 8) + (buffer[0x1CC] << 16) + (buffer[0x1CD] << 24);
     log_notice("fat32 partition starting sector, size: %u, %u", partition_start_LS, partition_size_LS);
 
-    main_fs = fs_fat_init(partition_start_LS, partition_size_LS);
+    return fs_fat_init(device, partition_start_LS, partition_size_LS);
+}
+
+// Initalizes the file system module. Finds the storage devices and mounts the
+//  boot FAT32 partition at "/", any other drives under "/disk", "/disk1", etc., a RAM filesystem at "/tmp",
+//  and the rom archive at "/rom".
+int fs_init() {
+    log_notice("initializing filesystem");
+
+    if(fs_cache_init(FS_CACHE_BUDGET) != 0) {
+        return -1;
+    }
+    int device_count = storage_init();
+    if(device_count < 1) {
+        return -1;
+    }
+
+    mount_count = 0;
+    mounts[0] = (fs_mount){ &fs_fat_ops, mount_device(storage_get_device(0)) };
+    if(mounts[0].filesystem == NULL) {
+        log_error("failed to mount boot device");
+        return -1;
+    }
+    mount_count = 1;
+
+    for(int i = 1; i < device_count; i++) {
+        storage_device* device = storage_get_device(i);
+        fs_fat* filesystem = mount_device(device);
+        if(filesystem == NULL) {
+            log_warn("failed to mount %s", device->name);
+            continue;
+        }
+        log_notice("mounted %s as disk %i", device->name, mount_count);
+        mounts[mount_count++] = (fs_mount){ &fs_fat_ops, filesystem };
+    }
+
+    tmp_mount = (fs_mount){ &fs_tmp_ops, fs_tmp_init(FS_TMP_MAX_BYTES) };
+    if(tmp_mount.filesystem == NULL) {
+        log_warn("failed to create tmpfs");
+    }
+    rom_mount = (fs_mount){ &fs_rom_ops, fs_rom_init(fs_rom_archive, fs_rom_archive_end - fs_rom_archive) };
+    if(rom_mount.filesystem == NULL) {
+        log_notice("no rom archive, reading /rom from the boot device");
+    }
 
     log_notice("filesystem initialized!");
     return 0;
 }
 
+/** Finds which filesystem a path is on, and skips the part of the path that selects it.
+ * "/disk/..." (or "/disk0/...") is on the first drive after the boot device, "/disk1/..." the second, etc.
+ * "/tmp/..." is on the RAM filesystem, and "/rom/..." is in the rom archive if there is one.
+ * @param path  the path, updated to point to the rest of the path on that filesystem
+ * @returns the mount, or `NULL` if the drive isn't attached and sets `errno`.
+ */
+static fs_mount* resolve_path(const char** path) {
+    const char* name = *path;
+    // skip initial slash if present
+    if(name[0] == '/') {
+        name = name + 1;
+    }
+
+    // determine which drive the path is on
+    if(strncmp(name, "disk", 4) == 0) {
+        const char* end = name + 4;
+        int number = 0;
+        while(*end >= '0' && *end <= '9') {
+            number = number * 10 + (*end - '0');
+            end++;
+        }
+        if(*end == '/' || *end == '\0') {   // otherwise it's just a file starting with "disk"
+            int mount = number + 1;
+            if(mount >= mount_count) {
+                errno = ENXIO; // or ENODEV ?
+                return NULL;
+            }
+            *path = *end == '/' ? end + 1 : end;
+            return &mounts[mount];
+        }
+    }
+    if(strncmp(name, "tmp", 3) == 0 && (name[3] == '/' || name[3] == '\0')) {
+        if(tmp_mount.filesystem == NULL) {
+            errno = ENXIO;
+            return NULL;
+        }
+        *path = name[3] == '/' ? name + 4 : name + 3;
+        return &tmp_mount;
+    }
+    if(strncmp(name, "rom", 3) == 0 && (name[3] == '/' || name[3] == '\0') && rom_mount.filesystem != NULL) {
+        *path = name[3] == '/' ? name + 4 : name + 3;
+        return &rom_mount;
+    }
+
+    // TODO: filter file paths based on `kernel` flag
+    *path = name;
+    return &mounts[0];
+}
+
 /**
  * @param name the file name
  * @param mode file opening mode, O_* defines from fcntl.h
@@ -100,6 +211,7 @@ int fs_init() {
  * @returns an open file id ("handle") on success, or `-1` on error and sets `errno`.
  */
 int fs_open(const char* name, int mode, int kernel) {
+    fs_writeback_if_due();
     int file_id = -1;
     for(int i = 0; i < FS_MAX_OPEN_FILES; i++) {
         if(files[i] == NULL) {
@@ -112,27 +224,17 @@ int fs_open(const char* name, int mode, int kernel) {
         return -1;
     }
 
-    // skip initial slash if present
-    if(name[0] == '/') {
-        name = name + 1;
-    }
-
-    fs_fat* filesystem;
-
-    // determine which drive to read from
-    if(strncmp(name, "disk", 4) == 0) {
-        // TODO: usb drives & stuff
-        errno = ENXIO; // or ENODEV ?
-        return -1;
-    } else {
-        // TODO: filter file paths based on `kernel` flag
-        filesystem = main_fs;
+    fs_mount* mount = resolve_path(&name);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
     }
 
-    fs_file* file = fs_fat_open(filesystem, name, mode);
+    fs_file* file = mount->ops->open(mount->filesystem, name, mode);
     if(file == NULL) {
-        return -1;  // fs_fat_open sets errno
+        return -1;  // the filesystem's open sets errno
     }
+    file->view = NULL;
+    file->mapping = NULL;
     files[file_id] = file;
 
     // debug open file display
@@ -145,18 +247,16 @@ int fs_open(const char* name, int mode, int kernel) {
  * @param file the file handle
  */
 int fs_close(int file_id) {
+    fs_writeback_if_due();
     if(!fs_is_valid_file(file_id)) {
         errno = EBADF;
         return -1;
     }
 
-    // TODO: change which function is used depending on filesystem type
     fs_file* file = files[file_id];
-    fs_fat_close(file);
+    file->ops->close(file);
 
-    if(files[file_id]->buffer != NULL) {
-        free(files[file_id]->buffer);
-    }
+    free(file->mapping);
     free(files[file_id]);
     files[file_id] = NULL;
     RPI_TermPrintAtDyed(180, 4 + file_id, COLORS_BLUE, COLORS_BLACK, "%2i: <closed>", file_id);
@@ -204,6 +304,7 @@ int fs_seek(int file_id, int offset, int whence) {
  * @returns the number of bytes read, `0` for end of file, or `-1` on error and sets `errno`.
  */
 int fs_read(int file_id, uint8_t* buffer, int length) {
+    fs_writeback_if_due();
     if(!fs_is_valid_file(file_id)) {
         errno = EBADF;
         return -1;
@@ -215,14 +316,14 @@ int fs_read(int file_id, uint8_t* buffer, int length) {
         return -1;
     }
 
-    // TODO: change which function is used depending on filesystem type
-    return fs_fat_read(file, buffer, length);
+    return file->ops->read(file, buffer, length);
 }
 
 /** Writes `length` bytes from `buffer` into the file.
  * @returns the number of bytes written, or `-1` on error and sets `errno`.
  */
 int fs_write(int file_id, uint8_t* buffer, int length) {
+    fs_writeback_if_due();
     if(!fs_is_valid_file(file_id)) {
         errno = EBADF;
         return -1;
@@ -239,6 +340,540 @@ int fs_write(int file_id, uint8_t* buffer, int length) {
         return -1;
     }
 
-    // TODO: change which function is used depending on filesystem type
-    return fs_fat_write(file, buffer, length);
+    return file->ops->write(file, buffer, length);
+}
+
+/** Gets the amount of free space on the drive a path is on.
+ * @returns the number of free bytes, or `-1` on error and sets `errno`.
+ */
+int64_t fs_get_free_space(const char* path) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
+    }
+    return mount->ops->get_free_space(mount->filesystem);
+}
+
+/** Gets the cache & read-ahead counters of the FAT filesystem a path is on (the block cache's are `fs_cache_get_stats()`).
+ * @returns the filesystem's counters, or `NULL` on error and sets `errno`.
+ */
+const fs_fat_stats* fs_get_fat_stats(const char* path) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return NULL;    // resolve_path sets errno
+    } else if(mount->ops != &fs_fat_ops) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    return fs_fat_get_stats(mount->filesystem);
+}
+
+/** Hints how large a file opened for writing is expected to become, so space for it can be allocated contiguously.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_reserve(int file_id, int size) {
+    if(!fs_is_valid_file(file_id)) {
+        errno = EBADF;
+        return -1;
+    }
+    if(size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fs_file* file = files[file_id];
+    file->ops->reserve(file, size);
+    return 0;
+}
+
+/** Saves an open file's changes to the disk.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fsync(int file_id) {
+    if(!fs_is_valid_file(file_id)) {
+        errno = EBADF;
+        return -1;
+    }
+    fs_file* file = files[file_id];
+    if(file->ops->fsync != NULL) {
+        return file->ops->fsync(file);
+    }
+    return file->ops->sync(file->filesystem);
+}
+
+/** Saves all changes to every mounted filesystem to the disk.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_sync() {
+    int status = 0;
+    // commit every filesystem's changes first, so they're all written back in one pass
+    for(int i = 0; i < mount_count; i++) {
+        if(mounts[i].ops->commit != NULL && mounts[i].ops->commit(mounts[i].filesystem) != 0) {
+            status = -1;    // commit sets errno
+        }
+    }
+    for(int i = 0; i < mount_count; i++) {
+        if(mounts[i].ops->sync(mounts[i].filesystem) != 0) {
+            status = -1;    // keep going, the other filesystems may still be saved (sync sets errno)
+        }
+    }
+    if(tmp_mount.filesystem != NULL) {
+        tmp_mount.ops->sync(tmp_mount.filesystem);
+    }
+    return status;
+}
+
+/** Writes back modified blocks that have waited longer than `FS_CACHE_DIRTY_AGE_MS`, so closing files
+ * (or running out of cache) doesn't have to. Called by `fs_writeback_if_due()`.
+ * @param now_ms    the current time in milliseconds
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_writeback(uint32_t now_ms) {
+    int status = 0;
+    for(int i = 0; i < mount_count; i++) {
+        if(mounts[i].ops->commit != NULL && mounts[i].ops->commit(mounts[i].filesystem) != 0) {
+            status = -1;    // commit sets errno
+        }
+    }
+    if(fs_cache_writeback(now_ms, FS_CACHE_DIRTY_AGE_MS) != 0) {
+        status = -1;    // fs_cache_writeback sets errno
+    }
+    return status;
+}
+
+/** Notes that modified blocks may have waited long enough to be written back, and that a defragmentation pass can be
+ * moved along. Only sets a flag, so it's safe to call from a timer interrupt: the work itself is done by
+ * `fs_writeback_if_due()`, outside of any file operation.
+ * @param now_ms    the current time in milliseconds
+ */
+void fs_writeback_due(uint32_t now_ms) {
+    writeback_due_ms = now_ms;
+    writeback_is_due = true;
+}
+
+/** Does the write-back `fs_writeback_due()` asked for, if there is one, and then spends up to `FS_DEFRAGMENT_BATCH_US`
+ * on any defragmentation pass. Called at the start of the file operations Lua uses, and while Lua waits for input,
+ * so changes reach the disk (and files are defragmented) while Lua runs. `errno` isn't changed.
+ */
+void fs_writeback_if_due() {
+    if(!writeback_is_due) {
+        return;
+    }
+    writeback_is_due = false;
+    int error = errno;
+    if(fs_writeback(writeback_due_ms) != 0) {
+        log_error("write-back failed: %i", errno);
+    }
+    // the system timer counts microseconds
+    for(uint64_t start = RPI_GetTimerTicks(); RPI_GetTimerTicks() - start < FS_DEFRAGMENT_BATCH_US && fs_defragment_step() > 0;) {}
+    errno = error;
+}
+
+/** Maps a file into memory, for reading all of it at once without copying it into another buffer.
+ * If the file's data is already in memory (like files in the rom archive), the view points straight to it,
+ * otherwise the whole file is read into a buffer in as few transfers as possible.
+ * The view is read-only, and is only valid until `fs_munmap()` or `fs_close()` (the file must not be written to while it's mapped).
+ * @param size  set to the size of the file
+ * @returns the file's data, or `NULL` on error and sets `errno`.
+ */
+const uint8_t* fs_mmap(int file_id, int* size) {
+    if(!fs_is_valid_file(file_id)) {
+        errno = EBADF;
+        return NULL;
+    }
+    fs_file* file = files[file_id];
+    if(file->mode & O_WRONLY) {
+        errno = EACCES; // POSIX says mapping a file that wasn't opened for reading returns EACCES
+        return NULL;
+    }
+
+    if(file->view == NULL && file->ops->map != NULL) {
+        file->view = file->ops->map(file);
+    }
+    if(file->view == NULL) {
+        uint8_t* mapping = malloc(file->size > 0 ? file->size : 1);
+        if(mapping == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        int offset = file->offset;
+        file->offset = 0;
+        int total = 0;
+        while(total < file->size) {
+            int result = file->ops->read(file, mapping + total, file->size - total);
+            if(result <= 0) {
+                if(result == 0) {
+                    errno = EIO;    // the file ended before its size
+                }
+                file->offset = offset;
+                free(mapping);
+                return NULL;
+            }
+            total += result;
+        }
+        file->offset = offset;
+        file->view = mapping;
+        file->mapping = mapping;
+    }
+
+    *size = file->size;
+    return file->view;
+}
+
+/** Unmaps a file mapped with `fs_mmap()`.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_munmap(int file_id) {
+    if(!fs_is_valid_file(file_id)) {
+        errno = EBADF;
+        return -1;
+    }
+    fs_file* file = files[file_id];
+    if(file->view == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    free(file->mapping);
+    file->mapping = NULL;
+    file->view = NULL;
+    return 0;
+}
+
+/** Gets the size, type, and timestamps of an item by its path.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_stat(const char* path, fs_attributes* attributes) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
+    }
+    return mount->ops->stat(mount->filesystem, path, attributes);
+}
+
+/** Gets the size, type, and timestamps of an open file. Filesystems without an `fstat` op only report its size
+ * (and whether it's in the read-only rom archive), with timestamps of `0`.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fstat(int file_id, fs_attributes* attributes) {
+    if(!fs_is_valid_file(file_id)) {
+        errno = EBADF;
+        return -1;
+    }
+    fs_file* file = files[file_id];
+    if(file->ops->fstat != NULL) {
+        return file->ops->fstat(file, attributes);
+    }
+    *attributes = (fs_attributes){
+        .size = file->size,
+        .is_directory = false,
+        .is_read_only = file->ops == &fs_rom_ops,
+        .created = 0,
+        .modified = 0,
+    };
+    return 0;
+}
+
+// a directory listing being built by `fs_list()`
+typedef struct {
+    fs_dirent* entries;     // each name is an offset into `names` until the listing is complete
+    int count;
+    int capacity;
+    char* names;            // all of the names, null terminated
+    size_t names_size;
+    size_t names_capacity;
+} listing;
+
+// fs_list_callback that adds an item to a listing
+static int add_to_listing(void* context, const char* name, const fs_attributes* attributes) {
+    listing* list = context;
+    if(list->count == list->capacity) {
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 32;
+        fs_dirent* entries = realloc(list->entries, capacity * sizeof *entries);
+        if(entries == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    size_t length = strlen(name) + 1;
+    if(list->names_size + length > list->names_capacity) {
+        size_t capacity = list->names_capacity > 0 ? list->names_capacity * 2 : 512;
+        while(capacity < list->names_size + length) capacity *= 2;
+        char* names = realloc(list->names, capacity);
+        if(names == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        list->names = names;
+        list->names_capacity = capacity;
+    }
+    memcpy(list->names + list->names_size, name, length);
+    list->entries[list->count].name = (const char*)(uintptr_t)list->names_size;
+    list->entries[list->count].attributes = *attributes;
+    list->count++;
+    list->names_size += length;
+    return 0;
+}
+
+// checks if an item in the root of the boot device can't be reached because a mount's path hides it
+static bool is_hidden_by_mount(const char* name) {
+    if(strcmp(name, "tmp") == 0) {
+        return tmp_mount.filesystem != NULL;
+    } else if(strcmp(name, "rom") == 0) {
+        return rom_mount.filesystem != NULL;
+    } else if(strncmp(name, "disk", 4) == 0) {
+        const char* end = name + 4;
+        while(*end >= '0' && *end <= '9') end++;
+        return *end == '\0';
+    }
+    return false;
+}
+
+// fs_list_callback that skips the items is_hidden_by_mount() is true for
+static int add_to_root_listing(void* context, const char* name, const fs_attributes* attributes) {
+    if(is_hidden_by_mount(name)) {
+        return 0;
+    }
+    return add_to_listing(context, name, attributes);
+}
+
+/** Lists every item in a directory along with its size, type, and timestamps, reading the directory only once.
+ * Listing "/" includes the paths other filesystems are mounted at ("disk", "tmp", "rom").
+ * @param entries   set to the items, which must be freed with `free()` (the names are in the same allocation)
+ * @returns the number of items, or `-1` on error and sets `errno`.
+ */
+int fs_list(const char* path, fs_dirent** entries) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
+    }
+    while(*path == '/') path++;
+    bool is_root = mount == &mounts[0] && *path == '\0';
+
+    listing list = { 0 };
+    int status = mount->ops->list(mount->filesystem, path, is_root ? add_to_root_listing : add_to_listing, &list);
+    if(status == 0 && is_root) {
+        const fs_attributes directory = { .is_directory = true };
+        char name[16];
+        for(int i = 1; i < mount_count && status == 0; i++) {
+            if(i == 1) {
+                strcpy(name, "disk");
+            } else {
+                snprintf(name, sizeof name, "disk%i", i - 1);
+            }
+            status = add_to_listing(&list, name, &directory);
+        }
+        if(tmp_mount.filesystem != NULL && status == 0) {
+            status = add_to_listing(&list, "tmp", &directory);
+        }
+        if(rom_mount.filesystem != NULL && status == 0) {
+            const fs_attributes read_only_directory = { .is_directory = true, .is_read_only = true };
+            status = add_to_listing(&list, "rom", &read_only_directory);
+        }
+    }
+
+    // put the names right after the items, so the whole listing is one allocation
+    fs_dirent* result = NULL;
+    if(status == 0) {
+        result = malloc(list.count * sizeof *result + list.names_size + 1);
+        if(result == NULL) {
+            errno = ENOMEM;
+            status = -1;
+        }
+    }
+    if(status == 0) {
+        char* names = (char*)&result[list.count];
+        memcpy(names, list.names, list.names_size);
+        for(int i = 0; i < list.count; i++) {
+            result[i] = list.entries[i];
+            result[i].name = names + (uintptr_t)list.entries[i].name;
+        }
+        *entries = result;
+    }
+    free(list.entries);
+    free(list.names);
+    return status == 0 ? list.count : -1;
+}
+
+/** Renames or moves an item. Both paths must be on the same filesystem, which moves the item without copying its data.
+ * @returns `0` on success, or `-1` on error and sets `errno` (`EXDEV` if the paths are on different filesystems).
+ */
+int fs_rename(const char* from, const char* to) {
+    fs_mount* from_mount = resolve_path(&from);
+    if(from_mount == NULL) {
+        return -1;  // resolve_path sets errno
+    }
+    fs_mount* to_mount = resolve_path(&to);
+    if(to_mount == NULL) {
+        return -1;  // resolve_path sets errno
+    }
+    if(from_mount != to_mount) {
+        errno = EXDEV;
+        return -1;
+    } else if(from_mount->ops->rename == NULL) {
+        errno = EROFS;
+        return -1;
+    }
+    return from_mount->ops->rename(from_mount->filesystem, from, to);
+}
+
+/** Copies a file without going through Lua. The data is copied in large chunks (or straight out of memory, for
+ * files that are already in it), and space for the whole destination file is reserved first so it's contiguous.
+ * The destination must not already exist. If copying fails partway, what was copied is kept.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_copy(const char* from, const char* to) {
+    int source = fs_open(from, O_RDONLY, 1);
+    if(source == -1) {
+        return -1;  // fs_open sets errno
+    }
+    int destination = fs_open(to, O_WRONLY | O_CREAT | O_EXCL, 1);
+    if(destination == -1) {
+        int error = errno;
+        fs_close(source);
+        errno = error;
+        return -1;
+    }
+    fs_file* file = files[source];
+    int size = file->size;
+    fs_reserve(destination, size);
+
+    int status = 0;
+    const uint8_t* view = file->ops->map != NULL ? file->ops->map(file) : NULL;
+    uint8_t* buffer = NULL;
+    if(view == NULL && size > 0) {
+        buffer = malloc(size < FS_COPY_BUFFER_SIZE ? size : FS_COPY_BUFFER_SIZE);
+        if(buffer == NULL) {
+            errno = ENOMEM;
+            status = -1;
+        }
+    }
+
+    int copied = 0;
+    while(status == 0 && copied < size) {
+        uint8_t* chunk;
+        int length;
+        if(view != NULL) {
+            chunk = (uint8_t*)view + copied;
+            length = size - copied;
+        } else {
+            chunk = buffer;
+            length = fs_read(source, buffer, size - copied < FS_COPY_BUFFER_SIZE ? size - copied : FS_COPY_BUFFER_SIZE);
+            if(length <= 0) {
+                if(length == 0) {
+                    errno = EIO;    // the file ended before its size
+                }
+                status = -1;
+                break;
+            }
+        }
+        for(int written = 0; written < length;) {
+            int result = fs_write(destination, chunk + written, length - written);
+            if(result <= 0) {
+                if(result == 0) {
+                    errno = ENOSPC;
+                }
+                status = -1;
+                break;
+            }
+            written += result;
+        }
+        copied += length;
+    }
+
+    int error = errno;
+    free(buffer);
+    fs_close(source);
+    fs_close(destination);
+    errno = error;
+    return status;
+}
+
+/** Reports how fragmented the filesystem a path is on is: how many contiguous runs each file's data is in, and the
+ * largest run of free space. The rest of the path is ignored, the whole filesystem is reported on.
+ * @param callback  called for each file with its path (from the root of the filesystem), or `NULL`
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_get_fragmentation(const char* path, fs_fragmentation* report, fs_fragmentation_callback callback, void* context) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
+    } else if(mount->ops->get_fragmentation == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return mount->ops->get_fragmentation(mount->filesystem, report, callback, context);
+}
+
+/** Starts defragmenting the filesystem a path is on. The work is done a little at a time by `fs_defragment_step()`
+ * (see `fs_writeback_if_due()`), and the filesystem stays consistent if it's interrupted at any point.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_defragment(const char* path) {
+    fs_mount* mount = resolve_path(&path);
+    if(mount == NULL) {
+        return -1;  // resolve_path sets errno
+    } else if(mount->ops->defragment == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return mount->ops->defragment(mount->filesystem);
+}
+
+/** Does a step of work on every filesystem that is being defragmented. Called regularly by `fs_writeback_if_due()`.
+ * @returns the number of filesystems that still have work to do.
+ */
+int fs_defragment_step() {
+    int running = 0;
+    for(int i = 0; i < mount_count; i++) {
+        if(mounts[i].ops->defragment_step != NULL && mounts[i].ops->defragment_step(mounts[i].filesystem) == 1) {
+            running++;  // errors stop the pass, and are logged by the filesystem
+        }
+    }
+    return running;
+}
+
+struct fs_dir {
+    fs_dirent* entries;
+    int count;
+    int position;   // the index of the next item fs_readdir() returns
+};
+
+/** Opens a directory to read its items one at a time with `fs_readdir()`.
+ * The whole directory is listed when it's opened (see `fs_list()`), so changes made to it afterwards aren't seen.
+ * @returns the open directory, or `NULL` on error and sets `errno`.
+ */
+fs_dir* fs_opendir(const char* path) {
+    fs_dir* dir = malloc(sizeof *dir);
+    if(dir == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    dir->count = fs_list(path, &dir->entries);
+    if(dir->count == -1) {
+        free(dir);
+        return NULL;    // fs_list sets errno
+    }
+    dir->position = 0;
+    return dir;
+}
+
+/** Gets the next item of an open directory. It's valid until the directory is closed.
+ * @returns the item, or `NULL` once every item has been read.
+ */
+const fs_dirent* fs_readdir(fs_dir* dir) {
+    if(dir->position >= dir->count) {
+        return NULL;
+    }
+    return &dir->entries[dir->position++];
+}
+
+/** Closes a directory opened with `fs_opendir()`.
+ * @returns `0` on success.
+ */
+int fs_closedir(fs_dir* dir) {
+    free(dir->entries);
+    free(dir);
+    return 0;
 }
@@ -13,21 +13,91 @@
 #define FS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct fs_file fs_file;
 
+// what `fs_stat()` reports about an item, the parts of CraftOS's `fs.attributes()` that filesystems can provide
+typedef struct {
+    int size;               // the size of the file in bytes, 0 for directories
+    bool is_directory;
+    bool is_read_only;
+    int64_t created;        // milliseconds since the unix epoch, or 0 if the filesystem doesn't record it
+    int64_t modified;       // milliseconds since the unix epoch, or 0 if the filesystem doesn't record it
+} fs_attributes;
+
+// an item in a directory listing from `fs_list()` or `fs_readdir()`
+typedef struct {
+    const char* name;
+    fs_attributes attributes;
+} fs_dirent;
+
+// called by a filesystem's `list` for each item in the directory, returns `0` to continue or `-1` to make `list` fail
+typedef int (*fs_list_callback)(void* context, const char* name, const fs_attributes* attributes);
+
+// what `fs_get_fragmentation()` reports about how a filesystem's files & free space are split up
+typedef struct {
+    uint32_t file_count;
+    uint32_t fragmented_files;  // files whose data isn't in one contiguous run
+    uint32_t extent_count;      // the total number of contiguous runs the files' data is in
+    uint32_t most_extents;      // the most runs any one file's data is split into
+    uint32_t free_runs;         // the number of contiguous runs of free space
+    uint64_t free_space;        // in bytes
+    uint64_t largest_free_run;  // the size of the largest contiguous run of free space in bytes
+} fs_fragmentation;
+
+// called by `fs_get_fragmentation()` for each file, with how many contiguous runs its data is in
+typedef void (*fs_fragmentation_callback)(void* context, const char* path, int size, uint32_t extents);
+
+// the functions a filesystem type provides, each mount points to its type's table
+typedef struct {
+    // returns the opened file, or `NULL` on error and sets `errno`
+    fs_file* (*open)(void* filesystem, const char* name, int mode);
+    void (*close)(fs_file* file);
+    // both return the number of bytes transferred, or `-1` on error and set `errno`
+    int (*read)(fs_file* file, uint8_t* buffer, int length);
+    int (*write)(fs_file* file, uint8_t* buffer, int length);
+    void (*reserve)(fs_file* file, int size);
+    int64_t (*get_free_space)(void* filesystem);
+    int (*sync)(void* filesystem);
+    // both return `0` on success, or `-1` on error and set `errno`
+    int (*stat)(void* filesystem, const char* name, fs_attributes* attributes);
+    int (*list)(void* filesystem, const char* name, fs_list_callback callback, void* context);
+    // returns `0` on success, or `-1` on error and sets `errno` (optional, only the open file's size is reported if it's NULL)
+    int (*fstat)(fs_file* file, fs_attributes* attributes);
+    // returns `0` on success, or `-1` on error and sets `errno` (optional, the filesystem is read-only if it's NULL)
+    int (*rename)(void* filesystem, const char* from, const char* to);
+    // saves one open file's changes to the disk (optional, `sync` is used if it's NULL)
+    int (*fsync)(fs_file* file);
+    // moves changes the filesystem holds back (like updates to FAT mirrors) into the block cache, before a write-back (optional)
+    int (*commit)(void* filesystem);
+    // returns the file's data if it's already contiguous in memory, or `NULL` for fs_mmap() to read it into a buffer (optional)
+    const uint8_t* (*map)(fs_file* file);
+    // reports how fragmented the filesystem is, returns `0` on success, or `-1` on error and sets `errno` (optional)
+    int (*get_fragmentation)(void* filesystem, fs_fragmentation* report, fs_fragmentation_callback callback, void* context);
+    // starts a defragmentation pass, which `defragment_step` carries out a little at a time (both optional)
+    int (*defragment)(void* filesystem);
+    // returns `1` if the pass has more work to do, `0` if it's done (or there isn't one), or `-1` on error and sets `errno`
+    int (*defragment_step)(void* filesystem);
+} fs_ops;
+
 #include "fs_fat.h"
+#include "fs_tmp.h"
+#include "fs_rom.h"
 
 struct fs_file {
     int offset;         // the current offset in the file in bytes
     int size;           // the size of the file in bytes
-    uint8_t* buffer;    // a buffer to cache data while reading/before writing
-    bool buffer_is_modified; // true if the buffer must be written back to the disk before loading other data
     bool file_is_modified;  // true if the file has been written to at all
     int mode;           // file opening mode, O_* defines from fcntl.h
-    fs_fat* filesystem; // the filesystem this file resides on
+    const fs_ops* ops;  // the functions of the filesystem this file resides on
+    void* filesystem;   // the filesystem this file resides on
+    const uint8_t* view;    // the file's data if it's mapped with fs_mmap(), or `NULL`
+    uint8_t* mapping;       // the buffer the view was read into, if the filesystem couldn't map the file itself
     union {
         fs_fat_file fat;
+        fs_tmp_file tmp;
+        fs_rom_file rom;
     } data;             // filesystem-specific data for accessing this file
 };
 
@@ -38,5 +108,28 @@ int fs_is_valid_file(int file_id);
 int fs_seek(int file_id, int offset, int whence);
 int fs_read(int file_id, uint8_t* buffer, int length);
 int fs_write(int file_id, uint8_t* buffer, int length);
+int fs_reserve(int file_id, int size);
+int64_t fs_get_free_space(const char* path);
+const fs_fat_stats* fs_get_fat_stats(const char* path);
+const uint8_t* fs_mmap(int file_id, int* size);
+int fs_munmap(int file_id);
+int fs_fsync(int file_id);
+int fs_sync();
+int fs_writeback(uint32_t now_ms);
+void fs_writeback_due(uint32_t now_ms);
+void fs_writeback_if_due();
+int fs_stat(const char* path, fs_attributes* attributes);
+int fs_fstat(int file_id, fs_attributes* attributes);
+int fs_list(const char* path, fs_dirent** entries);
+int fs_rename(const char* from, const char* to);
+int fs_copy(const char* from, const char* to);
+int fs_get_fragmentation(const char* path, fs_fragmentation* report, fs_fragmentation_callback callback, void* context);
+int fs_defragment(const char* path);
+int fs_defragment_step();
+
+typedef struct fs_dir fs_dir;
+fs_dir* fs_opendir(const char* path);
+const fs_dirent* fs_readdir(fs_dir* dir);
+int fs_closedir(fs_dir* dir);
 
 #endif
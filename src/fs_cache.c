@@ -0,0 +1,513 @@
+/* fs_cache.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  A write-back cache of storage device blocks, shared by everything the
+  filesystem reads from or writes to any device (file data, directory
+  tables, and the FAT).
+
+  Blocks are found by their device & logical block address in a hash table, and are
+  evicted with the CLOCK algorithm once the memory budget is used up.
+  Modified blocks stay in memory until they are evicted, `fs_cache_flush()`
+  is called, or they have been modified for longer than the dirty age limit
+  when `fs_cache_writeback()` is called (regularly, see `fs_writeback_if_due()`).
+  Either way they are queued on their device in order, which combines runs of
+  consecutive blocks into single transfers (see `storage_dispatch()`). Blocks
+  are marked with the stage they're written back in (data, then allocation,
+  then directory entries), and a write-back of a later stage's blocks always
+  includes the earlier stages' blocks.
+
+  Transfers larger than a quarter of the cache go straight to the disk so that
+  reading one huge file doesn't push everything else out, but they still use
+  (and update) any copies of their blocks that are already cached.
+*/
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+
+#include "fs_cache.h"
+
+static const char log_from[] = "fs_cache";
+
+#define NO_BLOCK 0xFFFFFFFF
+
+typedef struct {
+    storage_device* device; // the device the block is from, or NULL if the slot is empty
+    uint32_t lba;           // the block stored in this slot
+    uint32_t next;          // the next slot in the same hash bucket
+    bool referenced;        // set when the block is used, cleared when the clock hand passes it (its second chance)
+    bool dirty;             // true if the block must be written back to the disk before it is evicted
+    uint8_t stage;          // which stage of a write-back the block is written in (FS_CACHE_STAGE_*)
+    uint32_t dirtied_at;    // the time the block was first modified since it was last written back
+} cache_slot;
+
+static cache_slot* slots;
+static uint8_t* slot_data;          // FS_CACHE_BLOCK_SIZE bytes for each slot
+static uint32_t slot_count;
+static uint32_t* buckets;           // the first slot in each hash bucket
+static uint32_t bucket_shift;       // 32 - log2(number of buckets)
+static uint32_t clock_hand;
+static uint32_t dirty_count;
+static uint32_t* flush_order;       // list of dirty slots, sorted by lba when flushing
+static int* flush_results;          // whether each block in flush_order was written
+static uint8_t* bounce_buffer;      // staging for transfers that can't go directly to/from the caller's buffer (or the cache)
+static uint32_t bypass_blocks;      // transfers with more blocks than this don't add blocks to the cache
+static uint32_t cache_time;         // the time (in milliseconds) of the last fs_cache_writeback() call
+static fs_cache_stats stats;
+
+#define DATA(slot) (slot_data + (slot) * FS_CACHE_BLOCK_SIZE)
+
+// the most blocks that can be staged for one transfer to a device
+static inline uint32_t staging_blocks(storage_device* device) {
+    uint32_t max = storage_get_transfer_blocks(device);
+    return max < FS_CACHE_STAGING_BLOCKS ? max : FS_CACHE_STAGING_BLOCKS;
+}
+
+/** Initializes the block cache.
+ * @param budget    how many bytes of block data the cache may hold
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_init(uint32_t budget) {
+    slot_count = budget / FS_CACHE_BLOCK_SIZE;
+    if(slot_count < FS_CACHE_STAGING_BLOCKS) {
+        slot_count = FS_CACHE_STAGING_BLOCKS;
+    }
+    uint32_t bucket_count = 1;
+    bucket_shift = 32;
+    while(bucket_count < slot_count) {
+        bucket_count *= 2;
+        bucket_shift--;
+    }
+    log_notice("initializing block cache with %u blocks, %u buckets", slot_count, bucket_count);
+
+    slots = malloc(slot_count * sizeof *slots);
+    slot_data = memalign(STORAGE_BUFFER_ALIGNMENT, slot_count * FS_CACHE_BLOCK_SIZE);
+    buckets = malloc(bucket_count * sizeof *buckets);
+    flush_order = malloc(slot_count * sizeof *flush_order);
+    flush_results = malloc(slot_count * sizeof *flush_results);
+    bounce_buffer = memalign(STORAGE_BUFFER_ALIGNMENT, FS_CACHE_STAGING_BLOCKS * FS_CACHE_BLOCK_SIZE);
+    if(slots == NULL || slot_data == NULL || buckets == NULL || flush_order == NULL || flush_results == NULL || bounce_buffer == NULL) {
+        log_error("failed to allocate block cache");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < slot_count; i++) {
+        slots[i].device = NULL;
+        slots[i].lba = 0;
+        slots[i].next = NO_BLOCK;
+        slots[i].referenced = false;
+        slots[i].dirty = false;
+    }
+    for(uint32_t i = 0; i < bucket_count; i++) {
+        buckets[i] = NO_BLOCK;
+    }
+    clock_hand = 0;
+    dirty_count = 0;
+    cache_time = 0;
+    bypass_blocks = slot_count / 4;
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+}
+
+// multiplicative hashing, using the top bits of the product
+static inline uint32_t bucket_of(storage_device* device, uint32_t lba) {
+    return ((lba ^ (device->id * 0x9E3779B9u)) * 2654435761u) >> bucket_shift;
+}
+
+// finds the slot holding a block, or NO_BLOCK if it isn't cached
+static uint32_t find_slot(storage_device* device, uint32_t lba) {
+    for(uint32_t slot = buckets[bucket_of(device, lba)]; slot != NO_BLOCK; slot = slots[slot].next) {
+        if(slots[slot].lba == lba && slots[slot].device == device) {
+            return slot;
+        }
+    }
+    return NO_BLOCK;
+}
+
+// removes a slot from its hash bucket & marks it empty
+static void remove_slot(uint32_t slot) {
+    uint32_t* link = &buckets[bucket_of(slots[slot].device, slots[slot].lba)];
+    while(*link != slot) {
+        link = &slots[*link].next;
+    }
+    *link = slots[slot].next;
+    slots[slot].device = NULL;
+    slots[slot].next = NO_BLOCK;
+    if(slots[slot].dirty) {
+        slots[slot].dirty = false;
+        dirty_count--;
+    }
+}
+
+/** Finds a slot for a block that isn't cached, evicting another block if necessary.
+ * If the block chosen for eviction is modified, all modified blocks are written back first.
+ * @returns the slot (which holds undefined data), or NO_BLOCK on error and sets `errno`.
+ */
+static uint32_t claim_slot(storage_device* device, uint32_t lba) {
+    // two passes clears every referenced bit, a third is only needed if flushing failed
+    for(uint32_t steps = 0; steps < slot_count * 3; steps++) {
+        uint32_t slot = clock_hand;
+        clock_hand = (clock_hand + 1) % slot_count;
+
+        if(slots[slot].device != NULL) {
+            if(slots[slot].referenced) {
+                slots[slot].referenced = false;
+                continue;
+            }
+            if(slots[slot].dirty && fs_cache_flush() != 0) {
+                continue;   // couldn't save it, so it can't be evicted
+            }
+            remove_slot(slot);
+            stats.evictions++;
+        }
+
+        uint32_t bucket = bucket_of(device, lba);
+        slots[slot].device = device;
+        slots[slot].lba = lba;
+        slots[slot].next = buckets[bucket];
+        slots[slot].referenced = true;
+        slots[slot].dirty = false;
+        buckets[bucket] = slot;
+        return slot;
+    }
+
+    log_error("no block could be evicted for %s:%u", device->name, lba);
+    errno = EIO;
+    return NO_BLOCK;
+}
+
+/** Gets a pointer to the cached copy of a block, reading it from the disk if it isn't cached.
+ * The pointer is only valid until the next call to a fs_cache function.
+ * @param mode  FS_CACHE_READ, or FS_CACHE_ZERO if the block's current contents don't matter
+ * @returns a pointer to FS_CACHE_BLOCK_SIZE bytes of block data, or `NULL` on error and sets `errno`.
+ */
+uint8_t* fs_cache_get(storage_device* device, uint32_t lba, int mode) {
+    uint32_t slot = find_slot(device, lba);
+    if(slot != NO_BLOCK) {
+        slots[slot].referenced = true;
+        stats.hits++;
+        return DATA(slot);
+    }
+
+    slot = claim_slot(device, lba);
+    if(slot == NO_BLOCK) {
+        return NULL;    // claim_slot sets errno
+    }
+    if(mode == FS_CACHE_ZERO) {
+        memset(DATA(slot), 0, FS_CACHE_BLOCK_SIZE);
+        return DATA(slot);
+    }
+
+    stats.misses++;
+    stats.reads++;
+    if(storage_read(device, lba, 1, DATA(slot)) != 0) {
+        remove_slot(slot);
+        return NULL;    // storage_read sets errno
+    }
+    return DATA(slot);
+}
+
+// marks a cached block as modified, so it is written back to the disk later (with the file data)
+void fs_cache_mark_dirty(storage_device* device, uint32_t lba) {
+    fs_cache_mark_dirty_stage(device, lba, FS_CACHE_STAGE_DATA);
+}
+
+// marks a cached block as modified, to be written back in the given stage (or later, if it's already marked for a later one)
+void fs_cache_mark_dirty_stage(storage_device* device, uint32_t lba, int stage) {
+    uint32_t slot = find_slot(device, lba);
+    if(slot == NO_BLOCK) {
+        return;
+    }
+    if(!slots[slot].dirty) {
+        slots[slot].dirty = true;
+        slots[slot].stage = stage;
+        slots[slot].dirtied_at = cache_time;
+        dirty_count++;
+    } else if(slots[slot].stage < stage) {
+        slots[slot].stage = stage;
+    }
+}
+
+/** Copies a block to another block in the cache (like to a mirror of the FAT), without writing it.
+ * The copy is written back along with the original block, if it is modified.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_copy(storage_device* device, uint32_t from_lba, uint32_t to_lba) {
+    uint8_t* source = fs_cache_get(device, from_lba, FS_CACHE_READ);
+    if(source == NULL) {
+        return -1;  // fs_cache_get sets errno
+    }
+    cache_slot original = slots[find_slot(device, from_lba)];
+    // getting the copy's slot can evict the original, so keep its data somewhere else
+    memcpy(bounce_buffer, source, FS_CACHE_BLOCK_SIZE);
+    uint8_t* destination = fs_cache_get(device, to_lba, FS_CACHE_ZERO);
+    if(destination == NULL) {
+        return -1;  // fs_cache_get sets errno
+    }
+    memcpy(destination, bounce_buffer, FS_CACHE_BLOCK_SIZE);
+
+    uint32_t slot = find_slot(device, to_lba);
+    fs_cache_mark_dirty_stage(device, to_lba, original.dirty ? original.stage : FS_CACHE_STAGE_DATA);
+    if(original.dirty && slots[slot].dirtied_at - original.dirtied_at < UINT32_MAX / 2) {
+        slots[slot].dirtied_at = original.dirtied_at;   // it's as old as the original
+    }
+    return 0;
+}
+
+/** Makes sure a range of blocks is cached, reading any that aren't with as few transfers as possible.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_fill(storage_device* device, uint32_t lba, uint32_t count) {
+    uint32_t max_run = staging_blocks(device);
+    uint32_t i = 0;
+    while(i < count) {
+        if(find_slot(device, lba + i) != NO_BLOCK) {
+            i++;
+            continue;
+        }
+        // read the whole run of missing blocks at once
+        uint32_t run = 1;
+        while(i + run < count && run < max_run && find_slot(device, lba + i + run) == NO_BLOCK) {
+            run++;
+        }
+        stats.misses += run;
+        stats.reads++;
+        if(storage_read(device, lba + i, run, bounce_buffer) != 0) {
+            return -1;  // storage_read sets errno
+        }
+        for(uint32_t j = 0; j < run; j++) {
+            uint32_t slot = claim_slot(device, lba + i + j);
+            if(slot == NO_BLOCK) {
+                return -1;  // claim_slot sets errno
+            }
+            memcpy(DATA(slot), bounce_buffer + j * FS_CACHE_BLOCK_SIZE, FS_CACHE_BLOCK_SIZE);
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/** Reads a range of blocks into `buffer`, using cached copies where possible.
+ * @param bypass    true to transfer blocks that aren't cached straight into `buffer`, false to add them to the cache
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int read_blocks(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool bypass) {
+    uint32_t i = 0;
+    while(i < count) {
+        uint8_t* destination = buffer + i * FS_CACHE_BLOCK_SIZE;
+        uint32_t slot = find_slot(device, lba + i);
+        if(slot != NO_BLOCK) {
+            slots[slot].referenced = true;
+            stats.hits++;
+            memcpy(destination, DATA(slot), FS_CACHE_BLOCK_SIZE);
+            i++;
+            continue;
+        }
+
+        // find the run of blocks that aren't cached
+        // (the device splits direct transfers into as few commands as it can)
+        bool direct = bypass && storage_is_aligned(device, destination);
+        uint32_t max_run = direct ? count : staging_blocks(device);
+        uint32_t run = 1;
+        while(i + run < count && run < max_run && find_slot(device, lba + i + run) == NO_BLOCK) {
+            run++;
+        }
+
+        if(direct) {
+            stats.misses += run;
+            stats.reads++;
+            if(storage_read(device, lba + i, run, destination) != 0) {
+                return -1;  // storage_read sets errno
+            }
+        } else if(bypass) {
+            stats.misses += run;
+            stats.reads++;
+            if(storage_read(device, lba + i, run, bounce_buffer) != 0) {
+                return -1;  // storage_read sets errno
+            }
+            memcpy(destination, bounce_buffer, run * FS_CACHE_BLOCK_SIZE);
+        } else {
+            if(fs_cache_fill(device, lba + i, run) != 0) {
+                return -1;  // fs_cache_fill sets errno
+            }
+            continue;   // copy them out of the cache on the next loops
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/** Reads a range of blocks into `buffer`, using cached copies where possible.
+ * Small reads add the blocks to the cache, large reads transfer straight into `buffer`.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return read_blocks(device, lba, count, buffer, count > bypass_blocks);
+}
+
+/** Reads a range of blocks into `buffer` without adding them to the cache, for reading through large
+ * structures once (like the whole FAT) without pushing everything else out. Cached copies are still used.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_scan(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return read_blocks(device, lba, count, buffer, true);
+}
+
+/** Writes a range of blocks from `buffer`.
+ * Small writes only modify the cache (the blocks are written back later), large writes go straight to the disk
+ * (updating any cached copies).
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    if(count <= bypass_blocks) {
+        for(uint32_t i = 0; i < count; i++) {
+            uint8_t* block = fs_cache_get(device, lba + i, FS_CACHE_ZERO);
+            if(block == NULL) {
+                return -1;  // fs_cache_get sets errno
+            }
+            memcpy(block, buffer + i * FS_CACHE_BLOCK_SIZE, FS_CACHE_BLOCK_SIZE);
+            fs_cache_mark_dirty(device, lba + i);
+        }
+        return 0;
+    }
+
+    uint32_t i = 0;
+    while(i < count) {
+        const uint8_t* source = buffer + i * FS_CACHE_BLOCK_SIZE;
+        bool direct = storage_is_aligned(device, source);
+        uint32_t run = count - i;
+        if(!direct && run > staging_blocks(device)) {
+            run = staging_blocks(device);
+        }
+        if(!direct) {
+            memcpy(bounce_buffer, source, run * FS_CACHE_BLOCK_SIZE);
+        }
+        stats.writes++;
+        if(storage_write(device, lba + i, run, direct ? source : bounce_buffer) != 0) {
+            return -1;  // storage_write sets errno
+        }
+        // the cached copies now match the disk
+        for(uint32_t j = 0; j < run; j++) {
+            uint32_t slot = find_slot(device, lba + i + j);
+            if(slot != NO_BLOCK) {
+                memcpy(DATA(slot), source + j * FS_CACHE_BLOCK_SIZE, FS_CACHE_BLOCK_SIZE);
+                if(slots[slot].dirty) {
+                    slots[slot].dirty = false;
+                    dirty_count--;
+                }
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// for sorting the dirty slots by write-back stage, then device, then lba
+static int compare_slot_lba(const void* a, const void* b) {
+    const cache_slot* slot_a = &slots[*(const uint32_t*)a];
+    const cache_slot* slot_b = &slots[*(const uint32_t*)b];
+    if(slot_a->stage != slot_b->stage) {
+        return slot_a->stage - slot_b->stage;
+    }
+    if(slot_a->device != slot_b->device) {
+        return slot_a->device->id - slot_b->device->id;
+    }
+    return (slot_a->lba > slot_b->lba) - (slot_a->lba < slot_b->lba);
+}
+
+/** Writes modified blocks back to the disk.
+ * Blocks are written one stage at a time, in order, and runs of consecutive blocks are combined into a single transfer
+ * by the device's queue.
+ * @param min_age   only blocks that were modified at least this long ago (and the blocks of earlier stages) are written, 0 writes all of them
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int write_back(uint32_t min_age) {
+    if(dirty_count == 0) {
+        return 0;
+    }
+
+    // writing a block means writing every block of the stages before it first
+    int last_stage = -1;
+    for(uint32_t slot = 0; slot < slot_count; slot++) {
+        if(slots[slot].device != NULL && slots[slot].dirty && cache_time - slots[slot].dirtied_at >= min_age && slots[slot].stage > last_stage) {
+            last_stage = slots[slot].stage;
+        }
+    }
+    uint32_t count = 0;
+    for(uint32_t slot = 0; slot < slot_count; slot++) {
+        if(slots[slot].device != NULL && slots[slot].dirty && (slots[slot].stage < last_stage || cache_time - slots[slot].dirtied_at >= min_age)) {
+            flush_order[count++] = slot;
+        }
+    }
+    qsort(flush_order, count, sizeof *flush_order, compare_slot_lba);
+
+    int status = 0;
+    for(uint32_t i = 0; i < count;) {
+        // queue the blocks of one stage on one device, so the device's queue combines the consecutive ones
+        storage_device* device = slots[flush_order[i]].device;
+        uint8_t stage = slots[flush_order[i]].stage;
+        uint32_t run = 0;
+        while(i + run < count && slots[flush_order[i + run]].stage == stage && slots[flush_order[i + run]].device == device) {
+            uint32_t slot = flush_order[i + run];
+            flush_results[i + run] = -1;
+            if(storage_queue(device, slots[slot].lba, 1, DATA(slot), true, &flush_results[i + run]) != 0) {
+                status = -1;    // storage_queue sets errno
+            }
+            run++;
+        }
+        uint32_t commands = device->stats.write_commands;
+        if(storage_dispatch(device) != 0) {
+            status = -1;    // keep going, the other blocks may still be saved (storage_dispatch sets errno)
+        }
+        stats.writes += device->stats.write_commands - commands;
+
+        for(uint32_t j = 0; j < run; j++) {
+            uint32_t slot = flush_order[i + j];
+            if(flush_results[i + j] == 0) {
+                slots[slot].dirty = false;
+                dirty_count--;
+            } else {
+                log_error("failed to write back block %s:%u", device->name, slots[slot].lba);
+            }
+        }
+        i += run;
+    }
+    return status;
+}
+
+/** Writes all modified blocks back to the disk.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_flush() {
+    return write_back(0);
+}
+
+/** Writes back the blocks that have been modified for at least `max_age_ms`, called regularly when the system is idle.
+ * If too much of the cache is modified, all of it is written back, so that evicting a block doesn't have to.
+ * @param now_ms    the current time in milliseconds (any clock, as long as it only goes forward)
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_cache_writeback(uint32_t now_ms, uint32_t max_age_ms) {
+    cache_time = now_ms;
+    if(dirty_count > slot_count / 2) {
+        return write_back(0);
+    }
+    return write_back(max_age_ms);
+}
+
+// gets the cache's statistics
+const fs_cache_stats* fs_cache_get_stats() {
+    return &stats;
+}
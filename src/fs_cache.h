@@ -0,0 +1,65 @@
+/* fs_cache.h © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+ */
+#ifndef FS_CACHE_H
+#define FS_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "storage.h"
+
+#define FS_CACHE_BLOCK_SIZE STORAGE_BLOCK_SIZE
+
+// how much memory the cache may use for block data, can be overridden when compiling
+#ifndef FS_CACHE_BUDGET
+#define FS_CACHE_BUDGET (8 * 1024 * 1024)
+#endif
+
+// how long a modified block may stay in the cache before fs_cache_writeback() writes it back, can be overridden when compiling
+#ifndef FS_CACHE_DIRTY_AGE_MS
+#define FS_CACHE_DIRTY_AGE_MS 2000
+#endif
+
+// the most blocks staged in memory for one transfer (when coalescing writes or reading into an unaligned buffer)
+#define FS_CACHE_STAGING_BLOCKS 128
+
+// what fs_cache_get() does with a block that isn't cached
+#define FS_CACHE_READ 0     // read it from the disk
+#define FS_CACHE_ZERO 1     // fill it with zeroes (for blocks that are about to be completely overwritten, or hold no data)
+
+// the order modified blocks are written back in, so that a write-back cut short leaves the filesystem consistent
+#define FS_CACHE_STAGE_DATA         0   // file data
+#define FS_CACHE_STAGE_ALLOCATION   1   // the FAT (and FSInfo), written once the data in the clusters it allocates is
+#define FS_CACHE_STAGE_DIRECTORY    2   // directory entries, written once the clusters they point to are allocated
+
+typedef struct {
+    uint32_t hits;          // blocks found in the cache
+    uint32_t misses;        // blocks that had to be read from the disk
+    uint32_t reads;         // sd commands issued to read blocks
+    uint32_t writes;        // sd commands issued to write blocks
+    uint32_t evictions;     // blocks removed from the cache to make space for others
+} fs_cache_stats;
+
+int fs_cache_init(uint32_t budget);
+uint8_t* fs_cache_get(storage_device* device, uint32_t lba, int mode);
+void fs_cache_mark_dirty(storage_device* device, uint32_t lba);
+void fs_cache_mark_dirty_stage(storage_device* device, uint32_t lba, int stage);
+int fs_cache_copy(storage_device* device, uint32_t from_lba, uint32_t to_lba);
+int fs_cache_fill(storage_device* device, uint32_t lba, uint32_t count);
+int fs_cache_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+int fs_cache_scan(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+int fs_cache_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer);
+int fs_cache_flush();
+int fs_cache_writeback(uint32_t now_ms, uint32_t max_age_ms);
+const fs_cache_stats* fs_cache_get_stats();
+
+#endif
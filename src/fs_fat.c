@@ -13,6 +13,7 @@
 */
 
 #include <stdlib.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -20,10 +21,11 @@
 #include <fcntl.h>
 
 #include "log.h"
-#include "rpi-sd.h"
+#include "rpi-sd.h"     // for the SDRESULT codes
 
 #include "fs.h"
 #include "fs_fat.h"
+#include "fs_cache.h"
 
 #define BYTES_PER_SECTOR 512    // effectively hardcoded in the SD card driver
 
@@ -40,205 +42,381 @@ static const char log_from[] = "fs_fat";
 #define FS_FAT_FILEATTR_DIRECTORY   1 << 4
 #define FS_FAT_FILEATTR_ARCHIVE     1 << 5
 
+// converts from a FAT32 cluster to the logical sector it starts at
+static inline uint32_t cluster_to_LS(fs_fat* self, uint32_t cluster) {
+    return self->data_start_LS + ((cluster - 2) * self->logical_sectors_per_cluster);
+}
+
+// reads or writes whole clusters through the block cache
 static SDRESULT transfer_cluster(fs_fat* self, uint32_t start_cluster, uint32_t cluster_count, uint8_t* buffer, bool write) {
     if(start_cluster < 2 || cluster_count < 1 || buffer == NULL) {
         log_error("transfer cluster invalid parameter %i, %i, %X", start_cluster, cluster_count, buffer);
         return SD_ERROR;
     }
-    // convert from FAT32 cluster to logical sector
-    uint32_t start_block = self->data_start_LS + ((start_cluster - 2) * self->logical_sectors_per_cluster);
+    uint32_t start_block = cluster_to_LS(self, start_cluster);
     uint32_t block_count = cluster_count * self->logical_sectors_per_cluster;
     log_notice("transfer cluster: %u,%u : %u,%u, %i", start_cluster, cluster_count, start_block, block_count, write ? 1 : 0);
-    // transfer blocks
-    return sdTransferBlocks(start_block, block_count, buffer, write);
+    int result = write ? fs_cache_write(self->device, start_block, block_count, buffer) : fs_cache_read(self->device, start_block, block_count, buffer);
+    return result == 0 ? SD_OK : SD_ERROR;
 }
 
-// 512 byte sector / 4 bytes per integer (aka 4 bytes per fat entry)
-#define ENTRIES_PER_FAT_SECTOR (BYTES_PER_SECTOR / 4)
+#define ENTRIES_PER_FAT_SECTOR FS_FAT_ENTRIES_PER_SECTOR
 
-static uint32_t find_next_cluster(fs_fat* self, uint32_t from_cluster) {
-    // determine index into FAT where the next cluster value is
-    // determine which sd card block contains that value
-    uint16_t index_in_sector = from_cluster % ENTRIES_PER_FAT_SECTOR;
-    uint32_t sector = from_cluster / ENTRIES_PER_FAT_SECTOR;
-
-    // read that block into a buffer
-    // TODO: cache this because we are likely to make multiple consecutive reads?
-    uint32_t buffer[ENTRIES_PER_FAT_SECTOR];
-    int result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, false);
-    if(result != SD_OK) {
-        log_error("failed to transfer block in find_next_cluster: %i", result);
-        return 0;
-    }
+// calculates the min/max, but watch out! double evaluation :)
+#define min(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define max(X, Y) (((X) > (Y)) ? (X) : (Y))
 
-    // get the next cluster value
-    uint32_t next_cluster = buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK;
+/** Gets a sector of the FAT from the block cache, reading it from the disk if it isn't cached.
+ * The pointer is only valid until the next call to a fs_cache function.
+ * @param sector    which sector of the FAT to get, relative to the start of the FAT
+ * @returns the sector's entries, or `NULL` if it could not be read.
+ */
+static uint32_t* get_fat_sector(fs_fat* self, uint32_t sector) {
+    return (uint32_t*)fs_cache_get(self->device, self->fat_start_LS + sector, FS_CACHE_READ);
+}
 
-    // check if it's an end-of-chain value & return 0 if so,
-    if(next_cluster < 2 || next_cluster >= FAT32_END_OF_CHAIN_MARKERS) {
-        return 0;
+/** Reads the FAT entry of a cluster (the id of the next cluster in the chain, or a marker).
+ * @returns `SD_OK` on success, or the error from reading the FAT sector.
+ */
+static int read_fat_entry(fs_fat* self, uint32_t cluster, uint32_t* value) {
+    uint32_t* entries = get_fat_sector(self, cluster / ENTRIES_PER_FAT_SECTOR);
+    if(entries == NULL) {
+        return SD_READ_ERROR;
     }
-    // or return the value
-    return next_cluster;
+    *value = entries[cluster % ENTRIES_PER_FAT_SECTOR] & FAT32_CLUSTER_ID_MASK;
+    return SD_OK;
 }
 
-// allocates the next available cluster into the chain that starts at from_cluster
-static uint32_t allocate_next_cluster_in_chain(fs_fat* self, uint32_t from_cluster) {
-    uint32_t buffer[ENTRIES_PER_FAT_SECTOR];
+/** Sets the FAT entry of a cluster. The change is only made in the block cache (and copied to the other FATs
+ * by `fs_fat_commit()`), call `fs_fat_sync()` to save it.
+ * @returns `SD_OK` on success, or the error from reading the FAT sector.
+ */
+static int write_fat_entry(fs_fat* self, uint32_t cluster, uint32_t value) {
+    uint32_t sector = cluster / ENTRIES_PER_FAT_SECTOR;
+    uint32_t* entries = get_fat_sector(self, sector);
+    if(entries == NULL) {
+        return SD_READ_ERROR;
+    }
+    uint32_t* entry = &entries[cluster % ENTRIES_PER_FAT_SECTOR];
+    bool was_free = (*entry & FAT32_CLUSTER_ID_MASK) == 0;
+    // the top 4 bits are reserved and must be preserved
+    *entry = (*entry & ~FAT32_CLUSTER_ID_MASK) | (value & FAT32_CLUSTER_ID_MASK);
+    fs_cache_mark_dirty_stage(self->device, self->fat_start_LS + sector, FS_CACHE_STAGE_ALLOCATION);
+    if(self->dirty_fat_sectors != NULL) {
+        self->dirty_fat_sectors[sector / 32] |= 1u << (sector % 32);
+        self->fat_is_modified = true;
+    }
 
-    // determine index into FAT where the next cluster value is
-    // determine which sd card block contains that value
-    uint16_t index_in_sector = from_cluster % ENTRIES_PER_FAT_SECTOR;
-    uint32_t sector = from_cluster / ENTRIES_PER_FAT_SECTOR;
-    uint16_t original_index_in_sector = index_in_sector;
-    uint32_t original_sector = sector;
+    // keep the free cluster bitmap & count in sync with the FAT
+    bool is_free = (value & FAT32_CLUSTER_ID_MASK) == 0;
+    if(was_free != is_free) {
+        if(self->free_bitmap != NULL) {
+            if(is_free) {
+                self->free_bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+            } else {
+                self->free_bitmap[cluster / 32] |= 1u << (cluster % 32);
+            }
+        }
+        if(self->free_clusters != FS_FAT_FREE_COUNT_UNKNOWN) {
+            self->free_clusters += is_free ? 1 : -1;
+        }
+        self->fsinfo_is_modified = true;
+    }
+    return SD_OK;
+}
 
-    log_notice("allocating from cluster %i (index %i) in fat sector %i", from_cluster, index_in_sector, sector);
+/** Builds the free cluster bitmap by reading the whole FAT, and counts the free clusters.
+ * The FAT is read in cluster-sized chunks without filling up the block cache (but cached, possibly modified, sectors are used).
+ * @returns `0` on success, or `-1` on error (the bitmap is left unbuilt).
+ */
+static int build_free_bitmap(fs_fat* self) {
+    uint32_t last_cluster = self->cluster_count + 1;
+    uint32_t* bitmap = calloc((last_cluster / 32) + 1, sizeof *bitmap);
+    if(bitmap == NULL) {
+        log_error("failed to allocate a free cluster bitmap for %u clusters", self->cluster_count);
+        return -1;
+    }
+    log_notice("building free cluster bitmap");
+
+    uint32_t fat_sectors_used = (last_cluster / ENTRIES_PER_FAT_SECTOR) + 1;
+    uint32_t free_count = 0;
+    for(uint32_t sector = 0; sector < fat_sectors_used; sector += self->logical_sectors_per_cluster) {
+        uint32_t sector_count = min(self->logical_sectors_per_cluster, fat_sectors_used - sector);
+        if(fs_cache_scan(self->device, self->fat_start_LS + sector, sector_count, self->cluster_buffer) != 0) {
+            log_error("failed to read fat sectors %u-%u for free cluster bitmap", sector, sector + sector_count - 1);
+            free(bitmap);
+            return -1;
+        }
 
-    // read that sector into a buffer
-    // TODO: cache this because we are likely to make multiple consecutive reads?
-    int result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, false);
-    if(result != SD_OK) {
-        log_error("failed to transfer block in allocate_next_cluster_in_chain: %i", result);
-        return 0;
+        uint32_t* entries = (uint32_t*)self->cluster_buffer;
+        for(uint32_t i = 0; i < sector_count * ENTRIES_PER_FAT_SECTOR; i++) {
+            uint32_t cluster = sector * ENTRIES_PER_FAT_SECTOR + i;
+            if(cluster > last_cluster) break;
+            // the first 2 entries (0 & 1) of the FAT aren't real, so are never free
+            if(cluster < 2 || (entries[i] & FAT32_CLUSTER_ID_MASK) != 0) {
+                bitmap[cluster / 32] |= 1u << (cluster % 32);
+            } else {
+                free_count++;
+            }
+        }
     }
 
-    // sanity check that the entry is an end of chain marker
-    uint32_t next_cluster = buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK;
-    if(next_cluster < FAT32_END_OF_CHAIN_MARKERS) {
-        log_error("cannot allocate starting from a non end-of-chain marker! 0x%.8X", next_cluster);
-        log_dump_columns(log_from, (uint8_t*)buffer, ENTRIES_PER_FAT_SECTOR, 16);
-        return 0;
+    if(self->free_clusters != free_count) {
+        log_notice("free cluster count was %u, actually %u", self->free_clusters, free_count);
+        self->free_clusters = free_count;
+        self->fsinfo_is_modified = true;
     }
+    self->free_bitmap = bitmap;
+    log_notice("free cluster bitmap built, %u free clusters", free_count);
+    return 0;
+}
 
-    goto start_loop; // skip re-reading the first block
+// checks if a cluster is free, using the free cluster bitmap if it has been built
+static bool cluster_is_free(fs_fat* self, uint32_t cluster) {
+    if(self->free_bitmap != NULL) {
+        return (self->free_bitmap[cluster / 32] & (1u << (cluster % 32))) == 0;
+    }
+    uint32_t entry;
+    return read_fat_entry(self, cluster, &entry) == SD_OK && entry == 0;
+}
 
-    for(sector; sector < self->sectors_per_fat; sector++) {
-        // read that sector into a buffer
-        int result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, false);
-        if(result != SD_OK) {
-            log_error("failed to transfer block in allocate_next_cluster_in_chain (2): %i", result);
+// searches the free cluster bitmap for a free cluster from `from_cluster` up to (not including) `to_cluster`
+static uint32_t search_free_bitmap(fs_fat* self, uint32_t from_cluster, uint32_t to_cluster) {
+    uint32_t cluster = from_cluster;
+    while(cluster < to_cluster) {
+        uint32_t word = self->free_bitmap[cluster / 32];
+        if(word == 0xFFFFFFFF) {
+            cluster = (cluster / 32 + 1) * 32;  // skip 32 clusters that are all in use
+            continue;
+        }
+        if((word & (1u << (cluster % 32))) == 0) {
+            return cluster;
+        }
+        cluster++;
+    }
+    return 0;
+}
+
+/** Searches the free cluster bitmap for a run of at least `count` consecutive free clusters, from `from_cluster` to the end of the FAT.
+ * @returns the first cluster of the run, or `0` if there isn't one.
+ */
+static uint32_t find_free_run(fs_fat* self, uint32_t from_cluster, uint32_t count) {
+    uint32_t last_cluster = self->cluster_count + 1;
+    uint32_t cluster = max(from_cluster, 2);
+    while(cluster + count - 1 <= last_cluster) {
+        uint32_t start = search_free_bitmap(self, cluster, last_cluster - count + 2);
+        if(start == 0) {
             return 0;
         }
-        start_loop:
+        uint32_t length = 1;
+        while(length < count && cluster_is_free(self, start + length)) {
+            length++;
+        }
+        if(length == count) {
+            return start;
+        }
+        cluster = start + length + 1;   // the cluster that ended the run is in use
+    }
+    return 0;
+}
+
+/** Updates the free cluster count & next free cluster hint in the (cached) FSInfo sector.
+ * @returns `SD_OK` on success, or `SD_READ_ERROR` if the sector couldn't be read.
+ */
+static int write_fsinfo(fs_fat* self) {
+    uint32_t lba = self->partition_start_LS + self->fsinfo_LS;
+    uint8_t* buffer = fs_cache_get(self->device, lba, FS_CACHE_READ);
+    if(buffer == NULL) {
+        log_error("failed to read FSInfo sector");
+        return SD_READ_ERROR;
+    }
+    // both the FSInfo fields and the cpu are little-endian
+    memcpy(&buffer[0x1E8], &self->free_clusters, 4);
+    memcpy(&buffer[0x1EC], &self->next_free_hint, 4);
+    fs_cache_mark_dirty_stage(self->device, lba, FS_CACHE_STAGE_ALLOCATION);
+    self->fsinfo_is_modified = false;
+    return SD_OK;
+}
 
-        // start looping through FAT entries until a free cluster is found
-        for(index_in_sector; index_in_sector < ENTRIES_PER_FAT_SECTOR; index_in_sector++) {
-            log_debug("  i %i e %.8X", index_in_sector, buffer[index_in_sector]);
-            if((buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK) == 0) {
-                goto found_free_cluster;
+/** Copies the FAT sectors modified since the last commit to the other FATs, and updates the FSInfo sector.
+ * This is done once before each write-back instead of on every change, so each sector is only copied once
+ * no matter how many of its entries changed. The changes are only made in the block cache.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_commit(void* filesystem) {
+    fs_fat* self = filesystem;
+    int status = 0;
+    if(self->fat_is_modified) {
+        for(uint32_t word = 0; word < (self->sectors_per_fat + 31) / 32; word++) {
+            while(self->dirty_fat_sectors[word] != 0) {
+                uint32_t bit = __builtin_ctz(self->dirty_fat_sectors[word]);
+                uint32_t sector = word * 32 + bit;
+                for(uint32_t fat = 1; fat < self->fat_count; fat++) {
+                    if(fs_cache_copy(self->device, self->fat_start_LS + sector, self->fat_start_LS + fat * self->sectors_per_fat + sector) != 0) {
+                        log_error("failed to copy FAT sector %u to FAT %u", sector, fat);
+                        status = -1;    // fs_cache_copy sets errno
+                    }
+                }
+                self->dirty_fat_sectors[word] &= ~(1u << bit);
             }
         }
-        index_in_sector = 0; // check the next FAT sector
+        self->fat_is_modified = false;
+    }
+    if(self->fsinfo_is_modified && self->fsinfo_LS != 0) {
+        if(write_fsinfo(self) != SD_OK) {
+            errno = EIO;
+            status = -1;
+        }
+    }
+    return status;
+}
+
+/** Writes all modified blocks back to the disk, after committing this filesystem's changes.
+ * The block cache is shared, so this saves changes to every file and filesystem, not just this one
+ * (but other filesystems' changes that aren't committed yet aren't saved).
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_sync(void* filesystem) {
+    int status = fs_fat_commit(filesystem);
+    if(fs_cache_flush() != 0) {
+        status = -1;    // fs_cache_flush sets errno
     }
+    return status;
+}
 
-    log_notice("didn't find available cluster after file, restarting from beginning of FAT");
-    index_in_sector = 2; // first 2 entries (0 & 1) of the FAT aren't real
+static uint32_t find_next_cluster(fs_fat* self, uint32_t from_cluster) {
+    uint32_t next_cluster;
+    int result = read_fat_entry(self, from_cluster, &next_cluster);
+    if(result != SD_OK) {
+        log_error("failed to read fat entry in find_next_cluster: %i", result);
+        return 0;
+    }
 
-    // if we didn't find an available cluster after the file, try looking from the start of the FAT
-    for(sector = 0; sector < (from_cluster / self->logical_sectors_per_cluster); sector++) {
-        // read that sector into a buffer
-        int result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, false);
-        if(result != SD_OK) {
-            log_error("failed to transfer block in allocate_next_cluster_in_chain (3): %i", result);
+    // check if it's an end-of-chain value & return 0 if so,
+    if(next_cluster < 2 || next_cluster >= FAT32_END_OF_CHAIN_MARKERS) {
+        return 0;
+    }
+    // or return the value
+    return next_cluster;
+}
+
+/** Searches for a free cluster, starting at `start_cluster` and wrapping around to the beginning of the FAT.
+ * The free cluster bitmap is used (and built if it hasn't been yet), otherwise the FAT itself is searched.
+ * @returns the id of the free cluster, or `0` if there are none (or the FAT couldn't be read).
+ */
+static uint32_t find_free_cluster(fs_fat* self, uint32_t start_cluster) {
+    uint32_t last_cluster = self->cluster_count + 1;
+    if(start_cluster < 2 || start_cluster > last_cluster) {
+        start_cluster = 2;  // first 2 entries (0 & 1) of the FAT aren't real
+    }
+
+    if(self->free_bitmap == NULL) {
+        build_free_bitmap(self);    // if this fails, fall back to searching the FAT itself
+    }
+    if(self->free_bitmap != NULL) {
+        if(self->free_clusters <= self->reserved_clusters) {
             return 0;
         }
-
-        // loop through FAT entries until a free cluster is found
-        for(index_in_sector; index_in_sector < ENTRIES_PER_FAT_SECTOR; index_in_sector++) {
-            log_debug("  i %i e %.8X", index_in_sector, buffer[index_in_sector]);
-            if((buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK) == 0) {
-                goto found_free_cluster;
-            }
+        uint32_t cluster = search_free_bitmap(self, start_cluster, last_cluster + 1);
+        if(cluster == 0) {
+            cluster = search_free_bitmap(self, 2, start_cluster);
         }
-        index_in_sector = 0; // check the next FAT sector
+        return cluster;
     }
-    // failed to find any open clusters
-    log_warn("failed to find any available clusters!");
-    return 0;
 
-found_free_cluster:;    // weird C syntax requirement (no declaration after label)
-
-    // free cluster found, calcluate which cluster this is
-    uint32_t free_cluster = (sector * ENTRIES_PER_FAT_SECTOR) + index_in_sector;
-    log_notice("found a free cluster %i at index %i in fat sector %i", free_cluster, index_in_sector, sector);
+    uint32_t cluster = start_cluster;
+    do {
+        uint32_t* entries = get_fat_sector(self, cluster / ENTRIES_PER_FAT_SECTOR);
+        if(entries == NULL) {
+            log_error("failed to read fat sector in find_free_cluster");
+            return 0;
+        }
+        // check the rest of the entries in this sector
+        do {
+            if((entries[cluster % ENTRIES_PER_FAT_SECTOR] & FAT32_CLUSTER_ID_MASK) == 0) {
+                return cluster;
+            }
+            cluster++;
+            if(cluster > last_cluster) {
+                log_notice("didn't find available cluster after %u, restarting from beginning of FAT", start_cluster);
+                cluster = 2;
+                break;
+            }
+        } while(cluster % ENTRIES_PER_FAT_SECTOR != 0 && cluster != start_cluster);
+    } while(cluster != start_cluster);
 
-    // note that if some of these transfers fail, the allocated cluster will still be allocated with nothing pointing to it!
+    return 0;
+}
 
-    // write end of chain to this cluster
-    buffer[index_in_sector] = FAT32_END_OF_CHAIN;
-    log_notice("writing end of chain to index %i in fat sector %i", index_in_sector, sector);
+/** Allocates a run of consecutive free clusters and links it onto the end of the chain that ends at `from_cluster`.
+ * The run starts at the first free cluster after `from_cluster` and is made as long as possible, up to `count` clusters.
+ * If that cluster doesn't continue the chain and the run would be shorter than `count`, a free run that fits all of
+ * them is used instead (if there is one), so the chain isn't split into more pieces than it has to be.
+ * The allocated clusters are not zeroed.
+ * @param from_cluster  the last cluster of the chain, or `0` to start a new chain (after the next free cluster hint)
+ * @param allocated     set to the number of clusters that were allocated
+ * @returns the id of the first allocated cluster, or `0` if none could be allocated
+ */
+static uint32_t allocate_cluster_run(fs_fat* self, uint32_t from_cluster, uint32_t count, uint32_t* allocated) {
+    log_notice("allocating %u clusters from cluster %u", count, from_cluster);
 
-    // skip these read/writes if sector == original_sector
-    if(sector != original_sector) {
-        log_notice("current sector and original sector differ: %i != %i", sector, original_sector);
-        // write FAT data to sector (saving the end of chain)
-        result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, true);
+    if(from_cluster != 0) {
+        // sanity check that the entry is an end of chain marker
+        uint32_t next_cluster;
+        int result = read_fat_entry(self, from_cluster, &next_cluster);
         if(result != SD_OK) {
-            log_error("failed to transfer block in allocate_next_cluster_in_chain (4): %i", result);
+            log_error("failed to read fat entry in allocate_cluster_run: %i", result);
             return 0;
         }
-        // read FAT data from original sector (for modifying the previous end of chain)
-        result = sdTransferBlocks(self->fat_start_LS + original_sector, 1, (uint8_t*)buffer, false);
-        if(result != SD_OK) {
-            log_error("failed to transfer block in allocate_next_cluster_in_chain (5): %i", result);
+        if(next_cluster < FAT32_END_OF_CHAIN_MARKERS) {
+            log_error("cannot allocate starting from a non end-of-chain marker! 0x%.8X", next_cluster);
             return 0;
         }
     }
 
-    // write it to the previous end of chain
-    log_notice("writing next cluster %i to index %i in fat sector %i", free_cluster, original_index_in_sector, original_sector);
-    buffer[original_index_in_sector] = free_cluster;
-    result = sdTransferBlocks(self->fat_start_LS + original_sector, 1, (uint8_t*)buffer, true);
-    if(result != SD_OK) {
-        log_error("failed to transfer block in allocate_next_cluster_in_chain (6): %i", result);
+    uint32_t first_cluster = find_free_cluster(self, from_cluster != 0 ? from_cluster + 1 : self->next_free_hint);
+    if(first_cluster == 0) {
+        // failed to find any open clusters
+        log_warn("failed to find any available clusters!");
         return 0;
     }
 
-    // zero out the cluster to remove any data remaining from deleted files
-    memset(self->cluster_buffer, 0, self->bytes_per_cluster);
-    result = transfer_cluster(self, free_cluster, 1, self->cluster_buffer, true);
-    if(result != SD_OK) {
-        log_error("failed to zero out cluster %i in allocate_next_cluster_in_chain: %i", free_cluster, result);
-        return 0;   // again, allocated cluster becomes orphaned, but it's better than adding unexpected garbage data to a file
+    // extend the run over the free clusters that directly follow it
+    uint32_t last_cluster = self->cluster_count + 1;
+    uint32_t length = 1;
+    while(length < count && first_cluster + length <= last_cluster && cluster_is_free(self, first_cluster + length)) {
+        length++;
     }
+    if(length < count && first_cluster != from_cluster + 1 && self->free_bitmap != NULL) {
+        uint32_t run = find_free_run(self, first_cluster, count);
+        if(run == 0) {
+            run = find_free_run(self, 2, count);
+        }
+        if(run != 0) {
+            first_cluster = run;
+            length = count;
+        }
+    }
+    log_notice("found %u free clusters @%u", length, first_cluster);
 
-    return free_cluster;
-}
-
-// just 2 different functions, one for extending a chain, and one for allocating a new file
-// only the loop through the fat & loading the next fat block is the same, all the rest is different enough
-
-// allocates the first cluster from the beginning of the partition (for creating a new file)
-// returns 0 if no cluster could be allocated
-static uint32_t allocate_new_cluster_chain(fs_fat* self) {
-    uint32_t buffer[ENTRIES_PER_FAT_SECTOR];
+    // note that if some of these updates fail, the allocated clusters will still be allocated with nothing pointing to them!
 
-    uint16_t index_in_sector = 2; // first 2 entries (0 & 1) of the FAT aren't real
-    // sector is block of the FAT
-    for(uint32_t sector = 0; sector < self->sectors_per_fat; sector++) {
-        // read that block into a buffer
-        int result = sdTransferBlocks(self->fat_start_LS + sector, 1, (uint8_t*)buffer, false);
-        if(result != SD_OK) {
-            log_error("failed to transfer block in allocate_new_cluster_chain: %i", result);
+    // link the run together and end it, then link it to the previous end of chain
+    for(uint32_t i = 0; i < length; i++) {
+        uint32_t value = (i == length - 1) ? FAT32_END_OF_CHAIN : first_cluster + i + 1;
+        if(write_fat_entry(self, first_cluster + i, value) != SD_OK) {
+            log_error("failed to update fat in allocate_cluster_run");
             return 0;
         }
-
-        // start looping through FAT entries until a free cluster is found
-        for(index_in_sector; index_in_sector < ENTRIES_PER_FAT_SECTOR; index_in_sector++) {
-            if((buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK) == 0) {
-                // free cluster found, calcluate which cluster this is
-                return (sector * ENTRIES_PER_FAT_SECTOR) + index_in_sector;
-                // TODO: do we also mark this cluster as allocated here? (write the end-of-chain marker to this cluster's fat entry?)
-            }
-        }
-
-        // no free cluster found in this block
-        // check the next one
-        index_in_sector = 0;
     }
-    // if all blocks of the FAT exhausted, return fail
-    return 0;
+    if(from_cluster != 0 && write_fat_entry(self, from_cluster, first_cluster) != SD_OK) {
+        log_error("failed to update fat in allocate_cluster_run");
+        return 0;
+    }
+    self->next_free_hint = first_cluster + length;
+
+    *allocated = length;
+    return first_cluster;
 }
 
 /** ends the cluster chain, marking any clusters after it as free
@@ -246,91 +424,76 @@ static uint32_t allocate_new_cluster_chain(fs_fat* self) {
  * @param delete        if true, `from_cluster` is also freed, else it's marked as the end of chain
  */
 static void truncate_cluster_chain(fs_fat* self, uint32_t from_cluster, bool delete) {
-    uint32_t buffer[ENTRIES_PER_FAT_SECTOR];
-
-    // find FAT entry for from_cluster
-    uint16_t index_in_sector = from_cluster % ENTRIES_PER_FAT_SECTOR;
-    uint32_t current_sector = from_cluster / ENTRIES_PER_FAT_SECTOR;
-
-    log_notice("truncating cluster chain starting @%i, index %i sector %i", from_cluster, index_in_sector, current_sector);
+    log_notice("truncating cluster chain starting @%i", from_cluster);
 
-    int result = sdTransferBlocks(self->fat_start_LS + current_sector, 1, (uint8_t*)buffer, false);
-    if(result != SD_OK) {
-        log_error("failed to transfer block in truncate_cluster_chain (1): %i", result);
+    // read the next cluster
+    uint32_t next_cluster;
+    if(read_fat_entry(self, from_cluster, &next_cluster) != SD_OK) {
+        log_error("failed to read fat entry in truncate_cluster_chain");
         return;
     }
-
-    // read the next cluster
-    uint32_t next_cluster = buffer[index_in_sector];
-    if(next_cluster >= FAT32_END_OF_CHAIN_MARKERS) {
+    if(next_cluster >= FAT32_END_OF_CHAIN_MARKERS && !delete) {
         // already ends here, how convenient!
         log_notice("already at end");
         return;
     }
 
     // mark the chain as ending here
-    buffer[index_in_sector] = delete ? 0 : FAT32_END_OF_CHAIN;
+    write_fat_entry(self, from_cluster, delete ? 0 : FAT32_END_OF_CHAIN);
 
     // loop through the cluster chain, freeing all clusters
     while(next_cluster >= 2 && next_cluster < FAT32_END_OF_CHAIN_MARKERS) {
-        // determine index into FAT where the next cluster value is
-        // determine which sd card block contains that value
-        index_in_sector = next_cluster % ENTRIES_PER_FAT_SECTOR;
-        uint32_t next_sector = next_cluster / ENTRIES_PER_FAT_SECTOR;
-
-        // load a new FAT sector if necessary
-        if(next_sector != current_sector) {
-            // save current changes
-            result = sdTransferBlocks(self->fat_start_LS + current_sector, 1, (uint8_t*)buffer, true);
-            if(result != SD_OK) {
-                log_error("failed to transfer block in truncate_cluster_chain (2): %i", result);
-                return;
-            }
-            // load next sector
-            result = sdTransferBlocks(self->fat_start_LS + next_sector, 1, (uint8_t*)buffer, false);
-            if(result != SD_OK) {
-                log_error("failed to transfer block in truncate_cluster_chain (3): %i", result);
-                return;
-            }
-            log_notice("loaded new sector: %i -> %i", current_sector, next_sector);
-            current_sector = next_sector;
-        }
-
-        log_notice("freeing cluster @%i, index %i sector %i", next_cluster, index_in_sector, current_sector);
-        // get the next cluster value
-        next_cluster = buffer[index_in_sector] & FAT32_CLUSTER_ID_MASK;
-        // free this cluster
-        buffer[index_in_sector] = 0;    // TODO: don't reset the upper 4 bits when allocating/freeing(?) clusters
-    }
-
-    // save final changes to the FAT
-    result = sdTransferBlocks(self->fat_start_LS + current_sector, 1, (uint8_t*)buffer, true);
-    if(result != SD_OK) {
-        log_error("failed to transfer block in truncate_cluster_chain (4): %i", result);
-        return;
+        uint32_t cluster = next_cluster;
+        if(read_fat_entry(self, cluster, &next_cluster) != SD_OK || write_fat_entry(self, cluster, 0) != SD_OK) {
+            log_error("failed to free cluster %u in truncate_cluster_chain", cluster);
+            return;
+        }
     }
 
     log_notice("finished truncating cluster chain");
     return;
 }
 
-static directory_entry* find_directory_item(fs_fat* self, char* remaining_path, uint32_t* current_cluster, uint32_t* entry_index);
-static int ensure_correct_cluster(fs_file* file, bool allow_allocating);
+static int find_path(fs_fat* self, const char* path, directory_entry* found, uint32_t* parent_cluster, uint32_t* entry_cluster, uint32_t* entry_index);
+static int create_file(fs_fat* self, const char* path, directory_entry* created, uint32_t* parent_cluster, uint32_t* entry_cluster, uint32_t* entry_index);
+static void update_cached_entry(fs_fat* self, uint32_t directory_cluster, uint32_t entry_cluster, uint32_t entry_index, const directory_entry* entry);
+static void free_directory_index(fs_fat_directory_index* index);
+static void cancel_move(fs_fat* self);
+static void stop_defragmenting(fs_fat* self);
+static uint32_t get_nth_cluster(fs_file* file, uint32_t nth, bool allow_allocating);
+
+// frees the filesystem and the buffers it owns, without writing anything back
+static void free_fat(fs_fat* self) {
+    free(self->free_bitmap);
+    free(self->dirty_fat_sectors);
+    free(self->cluster_buffer);
+    free(self);
+}
 
-// initalizes a FAT32 filesystem when passed the starting logical sector and sector count
-fs_fat* fs_fat_init(uint32_t partition_start_LS, uint32_t partition_size_LS) {
-    log_notice("mounting fat32 filesystem @%i, #%i", partition_start_LS, partition_size_LS);
+// initalizes a FAT32 filesystem when passed the device it's on, and its starting logical sector and sector count
+fs_fat* fs_fat_init(storage_device* device, uint32_t partition_start_LS, uint32_t partition_size_LS) {
+    log_notice("mounting fat32 filesystem on %s @%i, #%i", device->name, partition_start_LS, partition_size_LS);
     fs_fat* self = malloc(sizeof *self);
+    if(self == NULL) {
+        log_error("failed to allocate fat32 filesystem");
+        errno = ENOMEM;
+        return NULL;
+    }
 
+    self->device = device;
+    self->cluster_buffer = NULL;
+    self->dirty_fat_sectors = NULL;
+    self->free_bitmap = NULL;
     self->partition_start_LS = partition_start_LS;
     self->partition_size_LS = partition_size_LS;
 
     uint8_t buffer[512];    // stores 1 sd card block
 
     // read first sector of partition
-    int result = sdTransferBlocks(partition_start_LS, 1, buffer, false);
-    if(result != SD_OK) {
-        log_error("error reading VBR: %i", result);
+    int result = fs_cache_read(device, partition_start_LS, 1, buffer);
+    if(result != 0) {
+        log_error("error reading VBR: %i", errno);
+        free_fat(self);
         return NULL;
     }
 
@@ -339,15 +502,20 @@ fs_fat* fs_fat_init(uint32_t partition_start_LS, uint32_t partition_size_LS) {
     log_notice("bytes per sector: %u",  buffer[0x00B] + (buffer[0x00C] << 8)); // we always assume this is 512. should probably error if not true
     if(buffer[0x00B] + (buffer[0x00C] << 8) != BYTES_PER_SECTOR) {
         log_error("cannot read fat32 partition! bytes per sector is not 512");
+        free_fat(self);
+        errno = EINVAL;
         return NULL;
     }
 
     self->logical_sectors_per_cluster =     buffer[0x00D];
     log_notice("sectors per cluster: %u",          self->logical_sectors_per_cluster);
     self->bytes_per_cluster = BYTES_PER_SECTOR * self->logical_sectors_per_cluster;
-    uint8_t* cluster_buffer = malloc(self->bytes_per_cluster);
+    uint8_t* cluster_buffer = memalign(STORAGE_BUFFER_ALIGNMENT, self->bytes_per_cluster);
     if(cluster_buffer == NULL) {
         log_error("failed to allocate a cluster buffer of size %i", self->bytes_per_cluster);
+        free_fat(self);
+        errno = ENOMEM;
+        return NULL;
     }
     self->cluster_buffer = cluster_buffer;
 
@@ -356,7 +524,8 @@ fs_fat* fs_fat_init(uint32_t partition_start_LS, uint32_t partition_size_LS) {
     uint8_t fat_count =                     buffer[0x010];
     log_notice("FAT count: %u",                    fat_count);
     log_notice("media descriptor: 0x%X",           buffer[0x015]);
-    log_notice("total sectors: %u",                buffer[0x020] + (buffer[0x021] << 8) + (buffer[0x022] << 16) + (buffer[0x023] << 24));
+    uint32_t total_sectors =                buffer[0x020] + (buffer[0x021] << 8) + (buffer[0x022] << 16) + (buffer[0x023] << 24);
+    log_notice("total sectors: %u",                total_sectors);
     self->sectors_per_fat =              buffer[0x024] + (buffer[0x025] << 8) + (buffer[0x026] << 16) + (buffer[0x027] << 24);
     log_notice("sectors per fat: %u",              self->sectors_per_fat);
     log_notice("version: %X.%X",                   buffer[0x02B], buffer[0x02A]);
@@ -365,35 +534,118 @@ fs_fat* fs_fat_init(uint32_t partition_start_LS, uint32_t partition_size_LS) {
 
     self->fat_start_LS = partition_start_LS + reserved_sectors;
     self->data_start_LS = self->fat_start_LS + (self->sectors_per_fat * fat_count);
+    self->fat_count = fat_count;
+    self->fat_is_modified = false;
+    if(fat_count > 1) {
+        self->dirty_fat_sectors = calloc((self->sectors_per_fat + 31) / 32, sizeof *self->dirty_fat_sectors);
+        if(self->dirty_fat_sectors == NULL) {
+            log_warn("failed to allocate FAT sector bitmap, the other FATs won't be updated");
+        }
+    }
     log_notice("fat start LS: %u", self->fat_start_LS);
     log_notice("data start LS: %u", self->data_start_LS);
+    if(total_sectors == 0 || total_sectors > partition_size_LS) {
+        total_sectors = partition_size_LS;  // the filesystem can't be larger than its partition
+    }
+    self->cluster_count = (total_sectors - (self->data_start_LS - partition_start_LS)) / self->logical_sectors_per_cluster;
+    // the FAT must have an entry for every cluster
+    if(self->cluster_count > self->sectors_per_fat * ENTRIES_PER_FAT_SECTOR - 2) {
+        self->cluster_count = self->sectors_per_fat * ENTRIES_PER_FAT_SECTOR - 2;
+    }
+    log_notice("cluster count: %u", self->cluster_count);
+
+    // read the FSInfo sector, which stores the free cluster count & where to start looking for free clusters
+    self->fsinfo_LS =                       buffer[0x030] + (buffer[0x031] << 8);
+    self->free_clusters = FS_FAT_FREE_COUNT_UNKNOWN;
+    self->reserved_clusters = 0;
+    self->next_free_hint = 2;
+    self->fsinfo_is_modified = false;
+    if(self->fsinfo_LS == 0 || self->fsinfo_LS == 0xFFFF) {
+        log_notice("no FSInfo sector");
+        self->fsinfo_LS = 0;
+    } else {
+        result = fs_cache_read(device, partition_start_LS + self->fsinfo_LS, 1, buffer);
+        if(result != 0) {
+            log_error("error reading FSInfo sector: %i", errno);
+            free_fat(self);
+            return NULL;
+        }
+        uint32_t lead_signature =           buffer[0x000] + (buffer[0x001] << 8) + (buffer[0x002] << 16) + (buffer[0x003] << 24);
+        uint32_t struct_signature =         buffer[0x1E4] + (buffer[0x1E5] << 8) + (buffer[0x1E6] << 16) + (buffer[0x1E7] << 24);
+        if(lead_signature != 0x41615252 || struct_signature != 0x61417272) {
+            log_warn("FSInfo sector has invalid signatures");
+            self->fsinfo_LS = 0;
+        } else {
+            uint32_t free_clusters =        buffer[0x1E8] + (buffer[0x1E9] << 8) + (buffer[0x1EA] << 16) + (buffer[0x1EB] << 24);
+            uint32_t next_free_hint =       buffer[0x1EC] + (buffer[0x1ED] << 8) + (buffer[0x1EE] << 16) + (buffer[0x1EF] << 24);
+            log_notice("FSInfo free clusters: %u, next free: %u", free_clusters, next_free_hint);
+            // both values are only hints, ignore them if they're nonsense
+            if(free_clusters <= self->cluster_count) {
+                self->free_clusters = free_clusters;
+            }
+            if(next_free_hint >= 2 && next_free_hint <= self->cluster_count + 1) {
+                self->next_free_hint = next_free_hint;
+            }
+        }
+    }
+
+    memset(self->dentry_cache, 0, sizeof(self->dentry_cache));
+    self->dentry_cache_clock = 0;
+    memset(self->directory_indexes, 0, sizeof(self->directory_indexes));
+    self->directory_index_clock = 0;
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->open_files = NULL;
+    memset(&self->defrag, 0, sizeof(self->defrag));
 
     return self;
 }
 
 // no idea if this is how to do it or if i need this, but don't leak memory by forgetting about the buffer!
 int fs_fat_uninit(fs_fat* self) {
-    free(self->cluster_buffer);
-    free(self);
+    int result = fs_fat_sync(self);
+    for(int i = 0; i < FS_FAT_DIRECTORY_INDEXES; i++) {
+        free_directory_index(&self->directory_indexes[i]);
+    }
+    stop_defragmenting(self);
+    free_fat(self);
+    return result;
 }
 
-// calculates the min, but watch out! double evaluation :)
-#define min(X, Y) (((X) < (Y)) ? (X) : (Y))
+/** Gets the amount of free space on the filesystem.
+ * The first call builds the free cluster bitmap (reading the whole FAT), after that the free cluster count is kept up to date.
+ * @returns the number of free bytes, or `-1` on error and sets `errno`.
+ */
+int64_t fs_fat_get_free_space(void* filesystem) {
+    fs_fat* self = filesystem;
+    if(self->free_bitmap == NULL && build_free_bitmap(self) != 0 && self->free_clusters == FS_FAT_FREE_COUNT_UNKNOWN) {
+        errno = EIO;
+        return -1;
+    }
+    return (int64_t)(self->free_clusters - self->reserved_clusters) * self->bytes_per_cluster;
+}
+
+/** Gets how often the filesystem's directory caches and file read-ahead have been useful since it was mounted.
+ * @returns the filesystem's counters, which are kept up to date.
+ */
+const fs_fat_stats* fs_fat_get_stats(void* filesystem) {
+    fs_fat* self = filesystem;
+    return &self->stats;
+}
 
 /** Opens a file on the given FAT32 filesystem
- * @param self the struct returned by `fs_fat_init()`
+ * @param filesystem the struct returned by `fs_fat_init()`
  * @param name the name of the file to open
  * @param mode file opening mode, O_* defines from fcntl.h
  * @returns a `fs_file` struct on success, or `NULL` on error and sets `errno`.
  */
-fs_file* fs_fat_open(fs_fat* self, const char* name, int mode) {
-    // make a temporary copy of name so find_directory_item can modify it
-    char* mutable_name = malloc(strlen(name) + 1);
-    strcpy(mutable_name, name);
-    uint32_t entry_cluster = self->root_dir_start_C;
-    uint32_t entry_index = 0;
-    directory_entry* entry = find_directory_item(self, mutable_name, &entry_cluster, &entry_index);
-    free(mutable_name);
+fs_file* fs_fat_open(void* filesystem, const char* name, int mode) {
+    fs_fat* self = filesystem;
+    directory_entry found;
+    directory_entry* entry = &found;
+    uint32_t parent_cluster, entry_cluster, entry_index;
+    if(find_path(self, name, entry, &parent_cluster, &entry_cluster, &entry_index) != 0) {
+        entry = NULL;
+    }
 
     log_notice("found item at %u, %u", entry_cluster, entry_index);
 
@@ -411,25 +663,34 @@ fs_file* fs_fat_open(fs_fat* self, const char* name, int mode) {
     ~       but do mark it as the one loaded in the buffer, 0 out the buffer, and mark the buffer as dirty
     ✔       thus when the file is closed (or seeked), the data is overwritten
 
-        also directory entry stuff for creating files
+    ✔   also directory entry stuff for creating files
     ✔   & updating stored size & whatnot when closing a (modified) file
-        also reading directory lists longer than 1 cluster
-            oh and writing to them/allocating new clusters to write to a directory list
+    ✔   also reading directory lists longer than 1 cluster
+    ✔       oh and writing to them/allocating new clusters to write to a directory list
 
         also deleting files:
             mark directory entry as deleted
             mark cluster chain as free
 
-        defragmentation? probably just let other OS's handle it
+✔   defragmentation, a step at a time while Lua runs (fs_fat_defragment)
     */
 
 
 
     if(entry == NULL) {
-        return NULL;    // find_directory_item always sets errno
+        if(errno != ENOENT || !(mode & O_CREAT)) {
+            return NULL;    // find_path always sets errno
+        }
+        if(create_file(self, name, &found, &parent_cluster, &entry_cluster, &entry_index) != 0) {
+            return NULL;    // create_file sets errno
+        }
+        entry = &found;
     } else if(entry->attr & FS_FAT_FILEATTR_DIRECTORY) {
         errno = EISDIR;
         return NULL;
+    } else if((mode & O_CREAT) && (mode & O_EXCL)) {
+        errno = EEXIST;
+        return NULL;
     }
     fs_file* file = malloc(sizeof *file);
     if(file == NULL) {
@@ -437,22 +698,29 @@ fs_file* fs_fat_open(fs_fat* self, const char* name, int mode) {
         return NULL;
     }
 
-    file->data.fat.first_cluster_id = (entry->cluster_hi << 16) + entry->cluster_lo;
-    file->data.fat.nth_cluster_of_file = 0xFFFFFFFF;    // no cluster is loaded
+    file->data.fat.first_cluster_id = ((uint32_t)entry->cluster_hi << 16) + entry->cluster_lo;
+    file->data.fat.extents = NULL;  // the extent map is filled in as the cluster chain is walked
+    file->data.fat.extent_count = 0;
+    file->data.fat.extent_capacity = 0;
+    file->data.fat.mapped_clusters = 0;
+    file->data.fat.reserved_clusters = 0;
+    file->data.fat.readahead_next = 0;  // reading from the start counts as sequential
+    file->data.fat.readahead_end = 0;
+    file->data.fat.readahead_clusters = 0;
+    file->data.fat.parent_directory_cluster = parent_cluster;
     file->data.fat.cluster_of_directory_entry = entry_cluster;
     file->data.fat.index_of_directory_entry = entry_index;
+    file->data.fat.next_open = self->open_files;
+    self->open_files = file;
+    if(self->defrag.moving && self->defrag.file.first_cluster == file->data.fat.first_cluster_id) {
+        cancel_move(self);  // the file could be changed, so the copy of its data can't be used
+    }
 
+    file->ops = &fs_fat_ops;
     file->filesystem = self;
     file->size = entry->size;
     file->offset = 0;
     file->mode = mode;
-    file->buffer = malloc(self->bytes_per_cluster);
-    if(file->buffer == NULL) {
-        log_error("failed to allocate file buffer: %i", errno);
-        free(file);
-        return NULL;
-    }
-    file->buffer_is_modified = false;
     file->file_is_modified = false;
 
     if(mode & O_TRUNC) {
@@ -465,389 +733,2190 @@ fs_file* fs_fat_open(fs_fat* self, const char* name, int mode) {
     return file;
 }
 
-/** Closes an open file, saving its buffer if necessary. */
+/** Gets a directory entry from the block cache, for modifying it in place.
+ * The pointer is only valid until the next call to a fs_cache function.
+ * @param cluster   the cluster of the directory table the entry is in
+ * @param index     the index of the entry within that cluster
+ * @param block     set to the block the entry is in, to mark it as modified
+ * @returns the entry, or `NULL` on error and sets `errno`.
+ */
+static directory_entry* get_directory_slot(fs_fat* self, uint32_t cluster, uint32_t index, uint32_t* block) {
+    uint32_t offset = index * 32;   // directory entries are 32 bytes
+    *block = cluster_to_LS(self, cluster) + offset / BYTES_PER_SECTOR;
+    uint8_t* data = fs_cache_get(self->device, *block, FS_CACHE_READ);
+    if(data == NULL) {
+        return NULL;    // fs_cache_get sets errno
+    }
+    return (directory_entry*)&data[offset % BYTES_PER_SECTOR];
+}
+
+// updates the size & first cluster in a modified file's directory entry, the change is only made in the block cache
+static int update_directory_entry(fs_file* file) {
+    fs_fat* self = file->filesystem;
+    // last modified timestamp? i don't think we have a real time clock set up yet
+    log_notice("file is modified, updating file size of %u, %u", file->data.fat.cluster_of_directory_entry, file->data.fat.index_of_directory_entry);
+    uint32_t entry_LS;
+    directory_entry* entry = get_directory_slot(self, file->data.fat.cluster_of_directory_entry, file->data.fat.index_of_directory_entry, &entry_LS);
+    if(entry == NULL) {
+        log_error("failed to read directory entry of modified file");
+        return -1;  // get_directory_slot sets errno
+    }
+    // update size, it's written back to the disk with the other modified blocks
+    log_notice("  %.8s.%.3s %X @%u, %u bytes", entry->name, entry->ext, entry->attr, (entry->cluster_hi << 16) + entry->cluster_lo, entry->size);
+    log_notice("  was %i", entry->size);
+    entry->size = file->size;
+    log_notice("  now %i", entry->size);
+    // a file that was empty gets its first cluster when it's written to
+    entry->cluster_hi = file->data.fat.first_cluster_id >> 16;
+    entry->cluster_lo = file->data.fat.first_cluster_id & 0xFFFF;
+    fs_cache_mark_dirty_stage(self->device, entry_LS, FS_CACHE_STAGE_DIRECTORY);
+    update_cached_entry(self, file->data.fat.parent_directory_cluster, file->data.fat.cluster_of_directory_entry, file->data.fat.index_of_directory_entry, entry);
+    return 0;
+}
+
+/** Closes an open file, saving its changes.
+ * The changes are made in the block cache, and written to the disk by the next write-back or sync.
+ */
 void fs_fat_close(fs_file* file) {
     fs_fat* self = file->filesystem;
-    if(file->buffer_is_modified) {
-        // write to the disk in the right cluster (conveniently the currently loaded one)
-        int result = transfer_cluster(self, file->data.fat.current_loaded_cluster_id, 1, file->buffer, true);
-        if(result != SD_OK) {
-            log_error("failed to write cluster of file in fs_fat_close: %i", result);
-            // can't really return an error code, since closing still happens. just lose data :(
+    if(file->file_is_modified) {
+        // can't really return an error code, since closing still happens. just lose data :(
+        update_directory_entry(file);
+
+        // free up any unused clusters after the end of the file (a new file that's still empty has none)
+        // find the last cluster holding file data, then ensure the cluster chain ends there
+        if(file->data.fat.first_cluster_id >= 2) {
+            uint32_t last_nth = file->size == 0 ? 0 : (file->size - 1) / self->bytes_per_cluster;
+            uint32_t last_cluster = get_nth_cluster(file, last_nth, false);
+            if(last_cluster == 0) {
+                log_notice("failed to find last cluster when closing file");
+                // make sure we don't end the file too early (file will be saved with extra unused clusters in it's chain)
+            } else {
+                truncate_cluster_chain(self, last_cluster, false);
+            }
         }
     }
-    // update file size
-    // last modified timestamp? i don't think we have a real time clock set up yet
-    if(file->file_is_modified) {
-        log_notice("file is modified, updating file size of %u, %u", file->data.fat.cluster_of_directory_entry, file->data.fat.index_of_directory_entry);
-        // find this file's directory entry
-        uint8_t* buffer = self->cluster_buffer;
-        transfer_cluster(self, file->data.fat.cluster_of_directory_entry, 1, buffer, false);
-        directory_entry* entry = (directory_entry*)&buffer[file->data.fat.index_of_directory_entry * 32]; // directory entries are 32 bytes
-        // update size & write back to the disk
-        log_notice("  %.8s.%.3s %X @%u, %u bytes", entry->name, entry->ext, entry->attr, (entry->cluster_hi << 16) + entry->cluster_lo, entry->size);
-        log_notice("  was %i", entry->size);
-        entry->size = file->size;
-        log_notice("  now %i", entry->size);
-        transfer_cluster(self, file->data.fat.cluster_of_directory_entry, 1, buffer, true);
-
-        // free up any unused clusters after the end of the file
-        // seek to the end of the file data, then ensure the cluster chain ends there
-        file->offset = file->size;
-        if(ensure_correct_cluster(file, false) != 0) {
-            log_notice("failed to ensure correct cluster when closing file");
-            // make sure we don't end the file too early (file will be saved with extra unused clusters in it's chain)
-            return;
+    free(file->data.fat.extents);
+    for(fs_file** link = &self->open_files; *link != NULL; link = &(*link)->data.fat.next_open) {
+        if(*link == file) {
+            *link = file->data.fat.next_open;
+            break;
         }
-        truncate_cluster_chain(self, file->data.fat.current_loaded_cluster_id, false);
     }
 }
 
-/** loads the correct cluster for the file's current offset
- * if the buffer is modified, saves it to the disk
- * @param allow_allocating  true if new clusters can be allocated to the file
+/** Saves an open file's changes to the disk (its data, and its size in its directory entry).
  * @returns `0` on success, or `-1` on error and sets `errno`.
  */
-static int ensure_correct_cluster(fs_file* file, bool allow_allocating) {
-    int result;
-    fs_fat* filesystem = file->filesystem;
+int fs_fat_fsync(fs_file* file) {
+    if(file->file_is_modified && update_directory_entry(file) != 0) {
+        return -1;  // update_directory_entry sets errno
+    }
+    return fs_fat_sync(file->filesystem);
+}
 
-    int nth_cluster_of_offset = file->offset / filesystem->bytes_per_cluster;
-    if(file->data.fat.nth_cluster_of_file == nth_cluster_of_offset) {
-        log_notice("in correct cluster");
-        return 0; // conveniently already in the right cluster :)
+/** Adds a run of clusters to the end of a file's extent map, extending the last extent if the run follows it on disk.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int append_extent(fs_fat_file* data, uint32_t cluster, uint32_t length) {
+    if(data->extent_count > 0) {
+        fs_fat_extent* last = &data->extents[data->extent_count - 1];
+        if(last->cluster + last->length == cluster) {
+            last->length += length;
+            data->mapped_clusters += length;
+            return 0;
+        }
     }
 
-    if(file->buffer_is_modified) {
-        // write to the disk in the right cluster (conveniently the currently loaded one)
-        result = transfer_cluster(filesystem, file->data.fat.current_loaded_cluster_id, 1, file->buffer, true);
-        if(result != SD_OK) {
-            log_error("failed to write cluster of file in ensure_correct_cluster: %i", result);
-            errno = EIO;
+    if(data->extent_count == data->extent_capacity) {
+        uint32_t new_capacity = data->extent_capacity == 0 ? 4 : data->extent_capacity * 2;
+        fs_fat_extent* new_extents = realloc(data->extents, new_capacity * sizeof *new_extents);
+        if(new_extents == NULL) {
+            log_error("failed to grow extent map to %u extents", new_capacity);
+            errno = ENOMEM;
             return -1;
         }
-        file->buffer_is_modified = false;
+        data->extents = new_extents;
+        data->extent_capacity = new_capacity;
     }
 
-    uint32_t current_cluster_id;
-    uint32_t current_cluster_id_backup; // second copy for allocation loop
-    if(nth_cluster_of_offset < file->data.fat.nth_cluster_of_file) {
-        // have to seek backwards, aka from the beginning of the file because fat
-        log_notice("seeking from first cluster");
-        current_cluster_id = file->data.fat.first_cluster_id;
-        file->data.fat.nth_cluster_of_file = 0;
-    } else {
-        // have to seek forwards
-        current_cluster_id = file->data.fat.current_loaded_cluster_id;
-        log_notice("seeking forwards from #%i @%i", file->data.fat.nth_cluster_of_file, current_cluster_id);
-    }
-    current_cluster_id_backup = current_cluster_id;
-
-    while(file->data.fat.nth_cluster_of_file < nth_cluster_of_offset) {
-        current_cluster_id = find_next_cluster(filesystem, current_cluster_id);
-        log_notice("cluster #%i @%i", file->data.fat.nth_cluster_of_file + 1, current_cluster_id);
-        if(current_cluster_id == 0) break;  // reached end of chain
-        file->data.fat.nth_cluster_of_file += 1;
-    }
-    if(file->data.fat.nth_cluster_of_file != nth_cluster_of_offset) {
-        if(!allow_allocating) { // reached end of chain without getting to the offset, file ended early
-            log_notice("couldn't find cluster");
-            errno = EIO;    // not a physical IO error, but broken filesystem data
-            return -1;
+    data->extents[data->extent_count].first_nth = data->mapped_clusters;
+    data->extents[data->extent_count].cluster = cluster;
+    data->extents[data->extent_count].length = length;
+    data->extent_count++;
+    data->mapped_clusters += length;
+    return 0;
+}
+
+/** Makes sure the extent map covers at least the first `count` clusters of a file.
+ * The cluster chain is walked onwards from the last mapped cluster (and the map is extended as it goes).
+ * @param allow_allocating  true if new clusters can be allocated to the file if the chain is too short
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int map_clusters(fs_file* file, uint32_t count, bool allow_allocating) {
+    fs_fat* filesystem = file->filesystem;
+    fs_fat_file* data = &file->data.fat;
+
+    if(data->mapped_clusters == 0) {
+        uint32_t run_length = 1;
+        if(data->first_cluster_id < 2) {
+            if(!allow_allocating) {
+                log_notice("file has no clusters");
+                errno = EIO;
+                return -1;
+            }
+            // an empty file being written to for the first time, start its cluster chain
+            // (its directory entry is updated with the first cluster when the file is closed)
+            data->first_cluster_id = allocate_cluster_run(filesystem, 0, max(count, data->reserved_clusters), &run_length);
+            log_notice("allocated clusters #0-%u @%u", run_length - 1, data->first_cluster_id);
+            if(data->first_cluster_id == 0) {
+                log_warn("couldn't allocate necessary clusters");
+                errno = ENOSPC;
+                return -1;
+            }
         }
-        log_notice("reached end of chain, allocating clusters");
-        // allocate new clusters because we are writing
-        current_cluster_id = current_cluster_id_backup;
-        while(file->data.fat.nth_cluster_of_file < nth_cluster_of_offset) {
-            // find the next free cluster after the current one (& update the chain)
-            current_cluster_id = allocate_next_cluster_in_chain(filesystem, current_cluster_id);
-            log_notice("allocated cluster #%i @%i", file->data.fat.nth_cluster_of_file + 1, current_cluster_id);
-            if(current_cluster_id == 0) break;  // failed to allocate
-            file->data.fat.nth_cluster_of_file += 1;
-        }
-        if(file->data.fat.nth_cluster_of_file != nth_cluster_of_offset) {
-            log_warn("couldn't allocate necessary clusters");
-            errno = ENOSPC;
+        if(append_extent(data, data->first_cluster_id, run_length) != 0) {
             return -1;
         }
     }
 
-    // now we have the cluster id of the data in the file where the offset is pointing
-    result = transfer_cluster(filesystem, current_cluster_id, 1, file->buffer, false);
-    if(result != SD_OK) {
-        log_error("failed to read cluster of file in ensure_correct_cluster: %i", result);
-        errno = EIO;
-        return -1;
+    while(data->mapped_clusters < count) {
+        fs_fat_extent* last = &data->extents[data->extent_count - 1];
+        uint32_t last_cluster = last->cluster + last->length - 1;
+        uint32_t next_cluster = find_next_cluster(filesystem, last_cluster);
+        uint32_t run_length = 1;
+        if(next_cluster == 0) {
+            if(!allow_allocating) { // reached end of chain without getting to the offset, file ended early
+                log_notice("couldn't find cluster #%u", data->mapped_clusters);
+                errno = EIO;    // not a physical IO error, but broken filesystem data
+                return -1;
+            }
+            // allocate new clusters because we are writing, enough for the whole write (or the reserved size) if possible
+            uint32_t wanted = max(count, data->reserved_clusters) - data->mapped_clusters;
+            next_cluster = allocate_cluster_run(filesystem, last_cluster, wanted, &run_length);
+            log_notice("allocated clusters #%u-%u @%u", data->mapped_clusters, data->mapped_clusters + run_length - 1, next_cluster);
+            if(next_cluster == 0) {
+                log_warn("couldn't allocate necessary clusters");
+                errno = ENOSPC;
+                return -1;
+            }
+        }
+        if(append_extent(data, next_cluster, run_length) != 0) {
+            return -1;
+        }
     }
-    file->data.fat.current_loaded_cluster_id = current_cluster_id;
-    log_notice("read new cluster");
     return 0;
 }
 
-/** Reads up to `length` bytes from the file into `read_buffer`.
- * @returns the number of bytes read, `0` for end of file, or `-1` on error and sets `errno`.
- */
-int fs_fat_read(fs_file* file, uint8_t* read_buffer, int length) {
-    // make sure we have the right cluster loaded
-    if(ensure_correct_cluster(file, false) != 0) {
-        log_notice("failed to ensure correct cluster");
-        return -1;
-        // return an error when newlib is repeatedly calling _read() will cause the whole read to fail
-        // instead of stopping it early and failing on the next call
+// binary searches the extent map for the extent containing the nth cluster (which must already be mapped)
+static fs_fat_extent* find_extent(fs_fat_file* data, uint32_t nth) {
+    uint32_t low = 0;
+    uint32_t high = data->extent_count - 1;
+    while(low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if(data->extents[middle].first_nth <= nth) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
     }
+    return &data->extents[low];
+}
 
-    int buffer_offset = file->offset - (file->data.fat.nth_cluster_of_file * file->filesystem->bytes_per_cluster);
-
-    log_notice("buffer offset: %i", buffer_offset);
-    if(buffer_offset + length > file->filesystem->bytes_per_cluster) {
-        // would read past the end of the buffer
-        // TODO: allow reading across multiple clusters (read data from buffer, load next cluster, read remaining data)
-        length = file->filesystem->bytes_per_cluster - buffer_offset;   // can never be 0, because then ensure_correct_cluster would've loaded the next cluster
-    }
-    log_notice("buffer-truncated length: %i", length);
-    if(file->offset + length > file->size) {
-        // would read past the end of the file
-        length = file->size - file->offset;         // shouldn't be negative, because then ensure_correct_cluster would've returned -1
-    }
-    log_notice("size-truncated length: %i", length);
-    if(length < 1) {
-        return 0;   // end of file
+/** Finds the cluster id of the nth cluster of a file.
+ * @param allow_allocating  true if new clusters can be allocated to the file if the chain ends before the nth cluster
+ * @returns the cluster id, or `0` on error and sets `errno`.
+ */
+static uint32_t get_nth_cluster(fs_file* file, uint32_t nth, bool allow_allocating) {
+    if(map_clusters(file, nth + 1, allow_allocating) != 0) {
+        return 0;
     }
-    memcpy(read_buffer, file->buffer + buffer_offset, length);
-    file->offset += length;
-    log_notice("read %i bytes, offset now at %i", length, file->offset);
-    return length;
+    fs_fat_extent* extent = find_extent(&file->data.fat, nth);
+    return extent->cluster + (nth - extent->first_nth);
 }
 
-/** Writes `length` bytes from `buffer` into the file.
- * @returns the number of bytes written, or `-1` on error and sets `errno`.
+/** Finds the run of consecutive clusters on disk starting at the nth cluster of a file.
+ * @param max_count     the most clusters the run may contain
+ * @param run_length    set to the number of clusters in the run (at most `max_count`)
+ * @returns the cluster id of the nth cluster, or `0` on error and sets `errno`.
  */
-int fs_fat_write(fs_file* file, uint8_t* write_buffer, int length) {
-    // make sure we have the right cluster loaded
-    // this extends the cluster chain if necessary & zeroes out allocated clusters
-    if(ensure_correct_cluster(file, true) != 0) {
-        log_notice("failed to ensure correct cluster");
-        return -1;
+static uint32_t get_cluster_run(fs_file* file, uint32_t nth, uint32_t max_count, uint32_t* run_length, bool allow_allocating) {
+    // map the whole range first so that consecutive clusters are merged into one extent
+    if(map_clusters(file, nth + max_count, allow_allocating) != 0) {
+        return 0;
     }
+    fs_fat_extent* extent = find_extent(&file->data.fat, nth);
+    *run_length = min(extent->first_nth + extent->length - nth, max_count);
+    return extent->cluster + (nth - extent->first_nth);
+}
 
-    int buffer_offset = file->offset - (file->data.fat.nth_cluster_of_file * file->filesystem->bytes_per_cluster);
+/** Reads whole clusters of the file, starting at the current offset (which must be at the start of a cluster).
+ * Consecutive clusters are read with one transfer.
+ * @param cluster_count the number of clusters to read
+ * @returns the number of clusters read, or `-1` on error and sets `errno`.
+ */
+static int read_clusters_direct(fs_file* file, uint8_t* read_buffer, uint32_t cluster_count) {
+    fs_fat* filesystem = file->filesystem;
+    uint32_t nth = file->offset / filesystem->bytes_per_cluster;
 
-    log_notice("buffer offset: %i", buffer_offset);
-    if(buffer_offset + length > file->filesystem->bytes_per_cluster) {
-        // would write past the end of the buffer
-        length = file->filesystem->bytes_per_cluster - buffer_offset;   // can never be 0, because then ensure_correct_cluster would've loaded the next cluster
+    uint32_t run_length;
+    uint32_t cluster = get_cluster_run(file, nth, cluster_count, &run_length, false);
+    if(cluster == 0) {
+        return -1;  // get_cluster_run sets errno
     }
-    log_notice("buffer-truncated length: %i", length);
-
-    // have correct cluster loaded, offset into buffer, & length we can safely write
 
-    memcpy(file->buffer + buffer_offset, write_buffer, length);
-    file->buffer_is_modified = true;
-    file->file_is_modified = true;
-    file->offset += length;
-    if(file->offset > file->size) {
-        file->size = file->offset;  // extend file length
+    int result = transfer_cluster(filesystem, cluster, run_length, read_buffer, false);
+    if(result != SD_OK) {
+        log_error("failed to read clusters of file in read_clusters_direct: %i", result);
+        errno = EIO;
+        return -1;
     }
-    log_notice("wrote %i bytes, offset now at %i, size now at %i", length, file->offset, file->size);
 
-    return length;
+    log_notice("read %u clusters directly @%u", run_length, cluster);
+    return run_length;
 }
 
-
-// the exact value of the file attirbutes for a long file name entry
-#define FS_FAT_LFN_ATTRIBUTES       0x0F//FS_FAT_FILEATTR_VOLUME | FS_FAT_FILEATTR_SYSTEM | FS_FAT_FILEATTR_HIDDEN | FS_FAT_FILEATTR_READONLY
-#define FS_FAT_LFN_FIRSTENTRY       1 << 6
-// windows NT and later use byte 0x0C of the file entry (directory_entry::reserved) to store the case (if the whole part is all one case)
-#define FS_FAT_LFN_LOWERNAME        1 << 3
-#define FS_FAT_LFN_LOWEREXTENSION   1 << 4
-
-static uint8_t lfn_buffer[255 * 2]; // 255 USC-2 characters
-
-static directory_entry* find_directory_item(fs_fat* self, char* remaining_path, uint32_t* current_cluster, uint32_t* entry_index) {
-    uint8_t* buffer = self->cluster_buffer;
-
-    // the token starts where remaining_path starts
-    char* token = remaining_path;
-    for(int i = 0; i < strlen(remaining_path); i++) {
-        // if the path seperator is found
-        if(remaining_path[i] == '/') {
-            remaining_path[i] = '\0';   // terminate the token
-            remaining_path = &remaining_path[i+1];  // and set remaining_path to point to the rest of the path
-        }
+/** Reads part of a block of the file at the current offset, through the block cache.
+ * If the block isn't cached, the rest of its cluster is read along with it, since the next reads will most likely want it.
+ * @param length    the most bytes to read, only the bytes up to the end of the block are read
+ * @returns the number of bytes read, or `-1` on error and sets `errno`.
+ */
+static int read_partial_block(fs_file* file, uint8_t* read_buffer, int length) {
+    fs_fat* filesystem = file->filesystem;
+    uint32_t cluster = get_nth_cluster(file, file->offset / filesystem->bytes_per_cluster, false);
+    if(cluster == 0) {
+        return -1;  // get_nth_cluster sets errno
     }
 
-    // convert token to uppercase (FAT32 names are case-insensitive)
-    for(int i = 0; i < strlen(token); i++) {
-        if(token[i] >= 'a' && token[i] <= 'z') {
-            token[i] -= 0x20;
-        }
+    uint32_t block_of_cluster = (file->offset % filesystem->bytes_per_cluster) / BYTES_PER_SECTOR;
+    uint32_t block = cluster_to_LS(filesystem, cluster) + block_of_cluster;
+    if(fs_cache_fill(filesystem->device, block, filesystem->logical_sectors_per_cluster - block_of_cluster) != 0) {
+        return -1;  // fs_cache_fill sets errno
+    }
+    uint8_t* data = fs_cache_get(filesystem->device, block, FS_CACHE_READ);
+    if(data == NULL) {
+        return -1;  // fs_cache_get sets errno
     }
 
-    log_notice("token: %s, rempath: %s", token, remaining_path);
-
-    // if the pointers still point to the same location, the seperator wasn't found (we're at the end of the path)
-    // or if remaining_path is empty (the last char was a '/')
-    bool token_is_last = token == remaining_path || remaining_path[0] == '\0';
+    int block_offset = file->offset % BYTES_PER_SECTOR;
+    int chunk = min(BYTES_PER_SECTOR - block_offset, length);
+    memcpy(read_buffer, data + block_offset, chunk);
+    return chunk;
+}
 
-    int result = transfer_cluster(self, *current_cluster, 1, buffer, false);
-    if(result != SD_OK) {
-        log_notice("sd read fail: %u", result);
+/** Detects sequential reads and reads ahead of them into the block cache.
+ * The read-ahead window doubles with each sequential read (up to FS_FAT_READAHEAD_MAX_BYTES), and is dropped as soon
+ * as the file is read from anywhere else. The window is topped up once half of it has been used, so the clusters being
+ * read (and the ones after them) are read with one transfer instead of one per cluster.
+ * @param length    the number of bytes about to be read from the current offset
+ */
+static void read_ahead(fs_file* file, int length) {
+    fs_fat* filesystem = file->filesystem;
+    fs_fat_file* data = &file->data.fat;
+    uint32_t start = file->offset;
+    uint32_t end = start + length;
+
+    if(start != data->readahead_next) {
+        // not sequential, stop reading ahead until it is again
+        data->readahead_next = end;
+        data->readahead_end = 0;
+        data->readahead_clusters = 0;
+        return;
+    }
+    data->readahead_next = end;
+    if(data->readahead_end > start) {
+        filesystem->stats.readahead_hit_bytes += min(end, data->readahead_end) - start;
+    }
+
+    uint32_t max_clusters = max(FS_FAT_READAHEAD_MAX_BYTES / filesystem->bytes_per_cluster, 1);
+    if(data->readahead_clusters == 0) {
+        data->readahead_clusters = min(FS_FAT_READAHEAD_MIN_CLUSTERS, max_clusters);
+    } else {
+        data->readahead_clusters = min(data->readahead_clusters * 2, max_clusters);
+    }
+
+    // only top up the window once half of it has been used
+    uint32_t window = data->readahead_clusters * filesystem->bytes_per_cluster;
+    if(data->readahead_end >= end + window / 2) {
+        return;
+    }
+    uint32_t from = max(start, data->readahead_end);
+    uint32_t to = min(end + window, (uint32_t)file->size);
+    if(from >= to) {
+        return;
+    }
+
+    uint32_t nth = from / filesystem->bytes_per_cluster;
+    uint32_t last_nth = (to - 1) / filesystem->bytes_per_cluster;
+    while(nth <= last_nth) {
+        uint32_t run_length;
+        uint32_t cluster = get_cluster_run(file, nth, last_nth - nth + 1, &run_length, false);
+        if(cluster == 0 || fs_cache_fill(filesystem->device, cluster_to_LS(filesystem, cluster), run_length * filesystem->logical_sectors_per_cluster) != 0) {
+            log_notice("read-ahead stopped at cluster #%u", nth);
+            break;  // the read itself will report the error
+        }
+        nth += run_length;
+    }
+    uint32_t new_end = min(nth * filesystem->bytes_per_cluster, (uint32_t)file->size);
+    if(new_end > end) {
+        filesystem->stats.readahead_bytes += new_end - max(end, data->readahead_end);
+    }
+    data->readahead_end = max(new_end, data->readahead_end);
+}
+
+/** Reads up to `length` bytes from the file into `read_buffer`.
+ * Whole clusters are read with as few transfers as possible, the partial clusters at the start and end of the read
+ * go through the block cache. Sequential reads are read ahead of, see `read_ahead()`.
+ * @returns the number of bytes read, `0` for end of file, or `-1` on error and sets `errno`.
+ */
+int fs_fat_read(fs_file* file, uint8_t* read_buffer, int length) {
+    fs_fat* filesystem = file->filesystem;
+    int bytes_per_cluster = filesystem->bytes_per_cluster;
+
+    if(file->offset >= file->size || length < 1) {
+        return 0;   // end of file
+    }
+    if(file->offset + length > file->size) {
+        // would read past the end of the file
+        length = file->size - file->offset;
+    }
+    log_notice("size-truncated length: %i", length);
+
+    // reads too large to be cached go straight to the caller's buffer, reading ahead of them wouldn't help
+    if(length < FS_FAT_READAHEAD_MAX_BYTES) {
+        read_ahead(file, length);
+    } else {
+        file->data.fat.readahead_next = file->offset + length;
+    }
+
+    int total = 0;
+    while(total < length) {
+        uint8_t* destination = read_buffer + total;
+        int remaining = length - total;
+        int chunk;
+
+        if(file->offset % bytes_per_cluster == 0 && remaining >= bytes_per_cluster) {
+            // read whole clusters
+            int cluster_count = read_clusters_direct(file, destination, remaining / bytes_per_cluster);
+            if(cluster_count < 0) {
+                break;
+            }
+            chunk = cluster_count * bytes_per_cluster;
+
+        } else {
+            // partial cluster, go through the block cache
+            chunk = read_partial_block(file, destination, remaining);
+            if(chunk < 0) {
+                log_notice("failed to read partial block");
+                break;
+            }
+        }
+        file->offset += chunk;
+        total += chunk;
+    }
+
+    log_notice("read %i bytes, offset now at %i", total, file->offset);
+    if(total == 0) {
+        return -1;  // nothing could be read, errno is already set
+    }
+    // if an error happened partway through, return what was read; the error is reported by the next call
+    // (returning an error when newlib is repeatedly calling _read() will cause the whole read to fail)
+    return total;
+}
+
+/** Writes whole clusters of the file, starting at the current offset (which must be at the start of a cluster).
+ * Clusters are allocated as needed, and consecutive clusters are written with one transfer.
+ * @param cluster_count the number of clusters to write
+ * @returns the number of clusters written, or `-1` on error and sets `errno`.
+ */
+static int write_clusters_direct(fs_file* file, uint8_t* write_buffer, uint32_t cluster_count) {
+    fs_fat* filesystem = file->filesystem;
+    uint32_t nth = file->offset / filesystem->bytes_per_cluster;
+
+    uint32_t run_length;
+    uint32_t cluster = get_cluster_run(file, nth, cluster_count, &run_length, true);
+    if(cluster == 0) {
+        return -1;  // get_cluster_run sets errno
+    }
+
+    int result = transfer_cluster(filesystem, cluster, run_length, write_buffer, true);
+    if(result != SD_OK) {
+        log_error("failed to write clusters of file in write_clusters_direct: %i", result);
         errno = EIO;
-        return NULL;
+        return -1;
     }
 
-    uint8_t* lfn_buffer_pos = lfn_buffer + sizeof(lfn_buffer);
-    bool lfn_complete = false; // set to true once the entry with sequence number 0x01 has been read
+    log_notice("wrote %u clusters directly @%u", run_length, cluster);
+    return run_length;
+}
 
-    for(int entry = 0; entry < self->bytes_per_cluster; entry += 32) {
-        if(buffer[entry] == 0x00) {
-            log_notice("(end of directory list)");
-            errno = ENOENT;
-            return NULL;
-        } else if(buffer[entry] == 0xE5) { // skip deleted entries
-            log_notice("(skipping deleted file)");
-            lfn_complete = false;
-            continue;
+/** Writes part of a block of the file at the current offset, through the block cache.
+ * The block is only read from the disk if some of the data already in it is kept.
+ * @param length    the most bytes to write, only the bytes up to the end of the block are written
+ * @returns the number of bytes written, or `-1` on error and sets `errno`.
+ */
+static int write_partial_block(fs_file* file, uint8_t* write_buffer, int length) {
+    fs_fat* filesystem = file->filesystem;
+    // this extends the cluster chain if necessary
+    uint32_t cluster = get_nth_cluster(file, file->offset / filesystem->bytes_per_cluster, true);
+    if(cluster == 0) {
+        return -1;  // get_nth_cluster sets errno
+    }
+
+    uint32_t block = cluster_to_LS(filesystem, cluster) + (file->offset % filesystem->bytes_per_cluster) / BYTES_PER_SECTOR;
+    int block_offset = file->offset % BYTES_PER_SECTOR;
+    int chunk = min(BYTES_PER_SECTOR - block_offset, length);
+    // if the block holds no file data (it was just allocated, or is left over from truncating the file), don't read it
+    bool past_end = file->offset - block_offset >= file->size;
+    bool overwritten = block_offset == 0 && chunk == BYTES_PER_SECTOR;
+    uint8_t* data = fs_cache_get(filesystem->device, block, past_end || overwritten ? FS_CACHE_ZERO : FS_CACHE_READ);
+    if(data == NULL) {
+        return -1;  // fs_cache_get sets errno
+    }
+
+    memcpy(data + block_offset, write_buffer, chunk);
+    if(past_end) {
+        // zero the rest so no old data ends up past the end of the file
+        memset(data + block_offset + chunk, 0, BYTES_PER_SECTOR - block_offset - chunk);
+    }
+    fs_cache_mark_dirty(filesystem->device, block);
+    return chunk;
+}
+
+/** Writes `length` bytes from `buffer` into the file.
+ * Whole clusters are written with as few transfers as possible, the partial clusters at the start and end of the
+ * write go through the block cache.
+ * @returns the number of bytes written, or `-1` on error and sets `errno`.
+ */
+int fs_fat_write(fs_file* file, uint8_t* write_buffer, int length) {
+    fs_fat* filesystem = file->filesystem;
+    int bytes_per_cluster = filesystem->bytes_per_cluster;
+
+    // allocate enough clusters for the whole write up front, so they can be one contiguous run
+    if(length > 0 && file->offset + length > file->size) {
+        uint32_t clusters_needed = (file->offset + length + bytes_per_cluster - 1) / bytes_per_cluster;
+        if(file->data.fat.mapped_clusters < clusters_needed && file->data.fat.first_cluster_id >= 2) {
+            if(map_clusters(file, clusters_needed, true) != 0) {
+                log_notice("failed to allocate clusters for write");
+                // still write as much as fits
+            }
+        }
+    }
+
+    int total = 0;
+    while(total < length) {
+        uint8_t* source = write_buffer + total;
+        int remaining = length - total;
+        int chunk;
+
+        if(file->offset % bytes_per_cluster == 0 && remaining >= bytes_per_cluster) {
+            // write whole clusters
+            int cluster_count = write_clusters_direct(file, source, remaining / bytes_per_cluster);
+            if(cluster_count < 0) {
+                break;
+            }
+            chunk = cluster_count * bytes_per_cluster;
+
+        } else {
+            // partial cluster, go through the block cache
+            chunk = write_partial_block(file, source, remaining);
+            if(chunk < 0) {
+                log_notice("failed to write partial block");
+                break;
+            }
         }
 
-        directory_entry* file = (directory_entry*)&buffer[entry];
-        log_notice("  %.8s.%.3s %X @%u, %u bytes", file->name, file->ext, file->attr, (file->cluster_hi << 16) + file->cluster_lo, file->size);
-
-        // this file entry is a long file name entry
-        if(file->attr == FS_FAT_LFN_ATTRIBUTES) {
-            if(file->name[0] & FS_FAT_LFN_FIRSTENTRY) {
-                lfn_buffer_pos = lfn_buffer + sizeof(lfn_buffer); // reset pointer to end of buffer (entries are listed in reverse order)
-                memset(lfn_buffer, 0, sizeof(lfn_buffer));
-                lfn_complete = false;
-            }
-            // seek backwards 26 bytes for 13 characters
-            lfn_buffer_pos -= 26;
-            // copy LFN characters into the buffer (copy all of the entry, even if some of the characters are unused (0xFFFF))
-            memcpy(lfn_buffer_pos, &file->name[1], 10); // 10 bytes, 5 USC-2 characters
-            memcpy(lfn_buffer_pos + 10, &file->created_time, 12); // 12 bytes, 6 USC-2 characters
-            memcpy(lfn_buffer_pos + 22, &file->size, 4); // 4 bytes, 2 USC-2 characters
-            // if the sequence number (excluding the first entry bit) is one, the long file name has been completely read
-            if((file->name[0] & ~((uint8_t)FS_FAT_LFN_FIRSTENTRY)) == 0x01) {
-                lfn_complete = true;
-                // TODO: save the FAT filename checksum
-            }
-            // skip any more processing of this entry
-            continue;
-        } else if(file->attr & FS_FAT_FILEATTR_VOLUME) {
-            // skip the actual volume name entry
-            lfn_complete = false;
-            continue;
+        file->file_is_modified = true;
+        file->offset += chunk;
+        total += chunk;
+        if(file->offset > file->size) {
+            file->size = file->offset;  // extend file length
         }
+    }
+
+    log_notice("wrote %i bytes, offset now at %i, size now at %i", total, file->offset, file->size);
+    if(total == 0 && length > 0) {
+        return -1;  // nothing could be written, errno is already set
+    }
+    return total;
+}
 
-        // if we get here, this is a normal file or directory entry (may still be system, hidden, etc.)
-        bool names_equal = false;
+/** Sets how large the file is expected to become, so that clusters can be allocated for it in one contiguous run.
+ * This doesn't change the size of the file, and any clusters the file doesn't end up using are freed when it is closed.
+ */
+void fs_fat_reserve(fs_file* file, int size) {
+    fs_fat* filesystem = file->filesystem;
+    int bytes_per_cluster = filesystem->bytes_per_cluster;
+    file->data.fat.reserved_clusters = size > 0 ? (size + bytes_per_cluster - 1) / bytes_per_cluster : 0;
+}
 
-        if(lfn_complete) { // if we have a complete long file name, check if its checksum is correct and then if it matches the token
-            // TODO: checksum
+const fs_ops fs_fat_ops = {
+    .open = fs_fat_open,
+    .close = fs_fat_close,
+    .read = fs_fat_read,
+    .write = fs_fat_write,
+    .reserve = fs_fat_reserve,
+    .get_free_space = fs_fat_get_free_space,
+    .sync = fs_fat_sync,
+    .stat = fs_fat_stat,
+    .list = fs_fat_list,
+    .fstat = fs_fat_fstat,
+    .rename = fs_fat_rename,
+    .fsync = fs_fat_fsync,
+    .commit = fs_fat_commit,
+    .get_fragmentation = fs_fat_get_fragmentation,
+    .defragment = fs_fat_defragment,
+    .defragment_step = fs_fat_defragment_step,
+};
 
-            // compare path token to long file name
-            for(int i = 0; i < 255; i++) {
-                bool end_of_token = token[i] == '\0';
-                bool end_of_lfn = lfn_buffer_pos[i*2] == '\0' && lfn_buffer_pos[i*2 + 1] == '\0';
-                if(end_of_token && end_of_lfn) { // we got to the end of both at the same time, they're equal
-                    names_equal = true;
-                    log_notice("token lfn equal");
-                    break;
-                } else if(end_of_token || end_of_lfn) { // only one ended, they're not equal
-                    log_notice("token or lfn shorter");
-                    break;
-                }
 
-                if(lfn_buffer_pos[i*2] > 0x7F || lfn_buffer_pos[i*2 + 1] != 0) { // if the current LFN character isn't ASCII, it can't match the path
-                    log_notice("lfn not ascii");
-                    break;
-                }
+// the exact value of the file attirbutes for a long file name entry
+#define FS_FAT_LFN_ATTRIBUTES       0x0F//FS_FAT_FILEATTR_VOLUME | FS_FAT_FILEATTR_SYSTEM | FS_FAT_FILEATTR_HIDDEN | FS_FAT_FILEATTR_READONLY
+#define FS_FAT_LFN_FIRSTENTRY       1 << 6
+// windows NT and later use byte 0x0C of the file entry (directory_entry::reserved) to store the case (if the whole part is all one case)
+#define FS_FAT_LFN_LOWERNAME        1 << 3
+#define FS_FAT_LFN_LOWEREXTENSION   1 << 4
+
+// the number of name characters in each long file name entry, and the most long file name entries an item can have
+#define FS_FAT_LFN_CHARACTERS       13
+#define FS_FAT_LFN_MAX_ENTRIES      20
+// characters that can't be in a long file name (besides control characters), and the symbols that can be in an 8.3 name
+#define FS_FAT_LFN_INVALID_CHARACTERS   "\"*/:<>?\\|"
+#define FS_FAT_SHORT_NAME_SYMBOLS       "!#$%&'()-@^_`{}~"
+
+/** Called for each item in a directory table by `iterate_directory()`.
+ * @param long_name     the item's long file name (UTF-8), or `NULL` if it doesn't have a valid one
+ * @param short_name    the item's 8.3 name
+ * @param entry         the item's directory entry
+ * @returns `0` to continue to the next item, or anything else to stop
+ */
+typedef int (*directory_item_callback)(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index);
+
+// calculates the checksum of an 8.3 name that the long file name entries before it must store
+static uint8_t short_name_checksum(const directory_entry* entry) {
+    const uint8_t* name = (const uint8_t*)entry->name;   // the name & extension are 11 consecutive bytes
+    uint8_t sum = 0;
+    for(int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+    return sum;
+}
+
+// formats an 8.3 name as "NAME.EXT" (or "NAME" if there's no extension), applying the case flags
+static void format_short_name(const directory_entry* entry, char* short_name) {
+    char* end = short_name;
+    for(int i = 0; i < 8 && entry->name[i] != ' '; i++) {
+        char c = entry->name[i];
+        if(i == 0 && c == 0x05) {
+            c = 0xE5;   // a first character of 0xE5 is stored as 0x05, since 0xE5 marks deleted entries
+        }
+        if((entry->lowercase & FS_FAT_LFN_LOWERNAME) && c >= 'A' && c <= 'Z') {
+            c += 0x20;
+        }
+        *end++ = c;
+    }
+    if(entry->ext[0] != ' ') {
+        *end++ = '.';
+        for(int i = 0; i < 3 && entry->ext[i] != ' '; i++) {
+            char c = entry->ext[i];
+            if((entry->lowercase & FS_FAT_LFN_LOWEREXTENSION) && c >= 'A' && c <= 'Z') {
+                c += 0x20;
+            }
+            *end++ = c;
+        }
+    }
+    *end = '\0';
+}
+
+// converts a long file name from UTF-16 to UTF-8, stopping at the terminator or padding
+static void format_long_name(const uint16_t* characters, int count, char* long_name) {
+    char* end = long_name;
+    for(int i = 0; i < count && characters[i] != 0x0000 && characters[i] != 0xFFFF; i++) {
+        uint32_t c = characters[i];
+        if(c >= 0xD800 && c < 0xDC00 && i + 1 < count && characters[i + 1] >= 0xDC00 && characters[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (characters[i + 1] - 0xDC00);  // surrogate pair
+            i++;
+        }
+        if(c < 0x80) {
+            *end++ = c;
+        } else if(c < 0x800) {
+            *end++ = 0xC0 | (c >> 6);
+            *end++ = 0x80 | (c & 0x3F);
+        } else if(c < 0x10000) {
+            *end++ = 0xE0 | (c >> 12);
+            *end++ = 0x80 | ((c >> 6) & 0x3F);
+            *end++ = 0x80 | (c & 0x3F);
+        } else {
+            *end++ = 0xF0 | (c >> 18);
+            *end++ = 0x80 | ((c >> 12) & 0x3F);
+            *end++ = 0x80 | ((c >> 6) & 0x3F);
+            *end++ = 0x80 | (c & 0x3F);
+        }
+    }
+    *end = '\0';
+}
+
+/** Calls `callback` for every item in a directory table, following the directory's cluster chain.
+ * Long file names are only used if their entries are in sequence and their checksum matches the 8.3 entry.
+ * Deleted entries and the volume label are skipped.
+ * @param directory_cluster the first cluster of the directory table
+ * @returns `0` after reaching the end of the directory, `1` if the callback stopped early, or `-1` on error and sets `errno`.
+ */
+static int iterate_directory(fs_fat* self, uint32_t directory_cluster, directory_item_callback callback, void* context) {
+    uint8_t* buffer = self->cluster_buffer;
+    uint16_t lfn_characters[FS_FAT_LFN_MAX_ENTRIES * FS_FAT_LFN_CHARACTERS];
+    char long_name[FS_FAT_MAX_NAME_LENGTH + 1];
+    char short_name[13];    // 8 name, 1 '.', 3 ext, 1 '\0'
+
+    bool lfn_valid = false;     // true while reading a sequence of long file name entries that is in order
+    int lfn_count = 0;          // the number of long file name entries in the sequence
+    int lfn_next_sequence = 0;  // the sequence number the next long file name entry should have (they're listed in reverse order)
+    uint8_t lfn_checksum = 0;
+
+    uint32_t cluster = directory_cluster;
+    // a directory can't have more clusters than the filesystem, this stops a looped chain from hanging
+    for(uint32_t clusters_read = 0; clusters_read < self->cluster_count; clusters_read++) {
+        int result = transfer_cluster(self, cluster, 1, buffer, false);
+        if(result != SD_OK) {
+            log_notice("sd read fail: %u", result);
+            errno = EIO;
+            return -1;
+        }
+
+        for(int offset = 0; offset < self->bytes_per_cluster; offset += 32) {
+            uint8_t* raw = &buffer[offset];
+            directory_entry* file = (directory_entry*)raw;
+
+            if(raw[0] == 0x00) {
+                log_notice("(end of directory list)");
+                return 0;
+            } else if(raw[0] == 0xE5) { // skip deleted entries
+                lfn_valid = false;
+                continue;
+            }
 
-                char current_lfn_char = lfn_buffer_pos[i*2];// convert lowercase to uppercase
-                if(current_lfn_char >= 'a' && current_lfn_char <= 'z') {
-                    current_lfn_char -= 0x20;
+            // this file entry is a long file name entry
+            if(file->attr == FS_FAT_LFN_ATTRIBUTES) {
+                int sequence = raw[0] & ~(FS_FAT_LFN_FIRSTENTRY);
+                if(raw[0] & FS_FAT_LFN_FIRSTENTRY) {
+                    // the first entry listed holds the end of the name, and its sequence number is the entry count
+                    lfn_valid = sequence >= 1 && sequence <= FS_FAT_LFN_MAX_ENTRIES;
+                    lfn_count = sequence;
+                    lfn_checksum = raw[0x0D];
+                    memset(lfn_characters, 0xFF, sizeof(lfn_characters));
+                } else if(!lfn_valid || sequence != lfn_next_sequence || raw[0x0D] != lfn_checksum) {
+                    lfn_valid = false;  // out of order or belongs to a different name, ignore the whole long file name
                 }
-                if(token[i] != current_lfn_char) {
-                    log_notice("token and lfn not equal: %c %c", token[i], current_lfn_char);
-                    break;
+                if(lfn_valid) {
+                    // copy this entry's 13 UTF-16 characters (5 + 6 + 2, split up around the other fields)
+                    uint8_t* characters = (uint8_t*)&lfn_characters[(sequence - 1) * FS_FAT_LFN_CHARACTERS];
+                    memcpy(characters, &raw[0x01], 10);
+                    memcpy(characters + 10, &raw[0x0E], 12);
+                    memcpy(characters + 22, &raw[0x1C], 4);
+                    lfn_next_sequence = sequence - 1;
                 }
-            }
-            // if the LFN was complete and had the correct checksum, but doesn't match, skip this file's directory entry
-            if(!names_equal) {
-                lfn_complete = false;
+                // skip any more processing of this entry
+                continue;
+            } else if(file->attr & FS_FAT_FILEATTR_VOLUME) {
+                // skip the actual volume name entry
+                lfn_valid = false;
                 continue;
             }
 
-        } else { // no complete LFN when reaching this file, compare 8.3 name
-            char eight_three_name[13] = { '\0' }; // 8 name, 1 '.', 3 ext, 1 '\0'
-            char* name_end = eight_three_name;
-            char* ext_end = eight_three_name;
+            // if we get here, this is a normal file or directory entry (may still be system, hidden, etc.)
+            bool has_long_name = lfn_valid && lfn_next_sequence == 0 && lfn_checksum == short_name_checksum(file);
+            if(lfn_valid && !has_long_name) {
+                log_notice("ignoring long file name with bad checksum or missing entries");
+            }
+            lfn_valid = false;
 
-            // copy name not including padding spaces
-            for(int i = 0; i < 8; i++) {
-                char file_char = file->name[i];
-                eight_three_name[i] = file_char;
-                if(file_char != ' ') {
-                    name_end = &eight_three_name[i];
-                }
+            format_short_name(file, short_name);
+            if(has_long_name) {
+                format_long_name(lfn_characters, lfn_count * FS_FAT_LFN_CHARACTERS, long_name);
             }
-            name_end++; // after the last real character
-            *name_end = '\0'; // max 9th element of eight_three_name array
-            // if not a directory, include extention
-            if(!(file->attr & FS_FAT_FILEATTR_DIRECTORY)) {
-                *name_end = '.'; // replace the null terminator
-                char* ext_start = name_end + 1;
-                for(int i = 0; i < 3; i++) {
-                    char file_char = file->ext[i];
-                    ext_start[i] = file_char;
-                    if(file_char != ' ') {
-                        ext_end = &ext_start[i];
-                    }
-                }
-                ext_end++; // after the last real character
-                *ext_end = '\0'; // max 13th element of eight_three_name array
+            if(callback(context, has_long_name ? long_name : NULL, short_name, file, cluster, offset / 32) != 0) {
+                return 1;
             }
+        }
 
-            log_notice("8.3 name: %.13s", eight_three_name);
+        // reached the end of this cluster without finding the end of the directory table, continue to the next cluster
+        cluster = find_next_cluster(self, cluster);
+        if(cluster == 0) {
+            return 0;   // the directory table filled all of its clusters
+        }
+    }
 
-            names_equal = (strncmp(token, eight_three_name, 13) == 0);
+    log_warn("directory @%u has a looped cluster chain", directory_cluster);
+    errno = EIO;
+    return -1;
+}
 
-            log_notice("names equal: %u", names_equal);
+// converts a name to uppercase in place (FAT32 names are case-insensitive)
+static void uppercase_name(char* name) {
+    for(; *name != '\0'; name++) {
+        if(*name >= 'a' && *name <= 'z') {
+            *name -= 0x20;
+        }
+    }
+}
 
-            if(!names_equal) {
-                continue;
-            }
+// compares an uppercase token to a name, ignoring the case of the name
+static bool names_equal(const char* token, const char* name) {
+    for(; *token != '\0'; token++, name++) {
+        char c = *name;
+        if(c >= 'a' && c <= 'z') {
+            c -= 0x20;
         }
+        if(*token != c) {
+            return false;
+        }
+    }
+    return *name == '\0';
+}
+
+// hashes a directory cluster & (normalized) name for the dentry cache & directory indexes (FNV-1a)
+static uint32_t dentry_hash(uint32_t directory_cluster, const char* name) {
+    uint32_t hash = 2166136261u ^ directory_cluster;
+    for(; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// adds a name to a directory index that is being built
+static int index_add_name(fs_fat_directory_index* index, const char* name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    if(index->item_count == index->item_capacity) {
+        uint32_t new_capacity = index->item_capacity == 0 ? 32 : index->item_capacity * 2;
+        fs_fat_index_item* new_items = realloc(index->items, new_capacity * sizeof *new_items);
+        if(new_items == NULL) return -1;
+        index->items = new_items;
+        index->item_capacity = new_capacity;
+    }
+    uint32_t name_length = strlen(name) + 1;
+    if(index->names_size + name_length > index->names_capacity) {
+        uint32_t new_capacity = index->names_capacity == 0 ? 512 : index->names_capacity * 2;
+        while(index->names_size + name_length > new_capacity) new_capacity *= 2;
+        char* new_names = realloc(index->names, new_capacity);
+        if(new_names == NULL) return -1;
+        index->names = new_names;
+        index->names_capacity = new_capacity;
+    }
 
-        bool entry_is_dir = file->attr & FS_FAT_FILEATTR_DIRECTORY;
+    char* stored_name = &index->names[index->names_size];
+    strcpy(stored_name, name);
+    uppercase_name(stored_name);
+
+    fs_fat_index_item* item = &index->items[index->item_count++];
+    item->hash = dentry_hash(0, stored_name);
+    item->name = index->names_size;
+    item->entry = *entry;
+    item->entry_cluster = entry_cluster;
+    item->entry_index = entry_index;
+    index->names_size += name_length;
+    return 0;
+}
 
-        // if this was the last token, we found the item
-        if(token_is_last) {
-            // return directory entry
-            log_notice("found entry");
-            *entry_index = entry / 32;   // return info about where to find this directory entry via the passed pointers
-            return file;
+// directory_item_callback that adds both names of each item to a directory index
+static int index_add_item(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    fs_fat_directory_index* index = context;
+    if(long_name != NULL) {
+        if(index_add_name(index, long_name, entry, entry_cluster, entry_index) != 0) return -1;
+        if(names_equal(&index->names[index->items[index->item_count - 1].name], short_name)) {
+            return 0;   // the 8.3 name is the same as the long file name, don't add it twice
+        }
+    }
+    return index_add_name(index, short_name, entry, entry_cluster, entry_index);
+}
 
-        } else if(entry_is_dir) {  // if it wasn't the last token but this entry is a directory
-            // recursively traverse the subdirectory
-            *current_cluster = (file->cluster_hi << 16) + file->cluster_lo;
-            log_notice("travelling recursively with %s and %u", remaining_path, *current_cluster);
-            return find_directory_item(self, remaining_path, current_cluster, entry_index);
+// frees everything in a directory index slot
+static void free_directory_index(fs_fat_directory_index* index) {
+    free(index->items);
+    free(index->names);
+    free(index->buckets);
+    memset(index, 0, sizeof *index);
+}
 
-        } else { // if it wasn't the last token but what we found isn't a directory, the subdir we're looking for doesn't exist (it was a file instead)
-            log_notice("found file when needed directory");
-            errno = ENOTDIR;
-            return NULL;
+/** Gets the name index of a directory, reading the whole directory table and building the index if it isn't cached.
+ * @returns the index, or `NULL` on error and sets `errno` (`ENOMEM` if the index didn't fit in memory).
+ */
+static fs_fat_directory_index* get_directory_index(fs_fat* self, uint32_t directory_cluster) {
+    self->directory_index_clock++;
+
+    fs_fat_directory_index* index = NULL;
+    for(int i = 0; i < FS_FAT_DIRECTORY_INDEXES; i++) {
+        fs_fat_directory_index* slot = &self->directory_indexes[i];
+        if(slot->directory_cluster == directory_cluster) {
+            slot->last_used = self->directory_index_clock;
+            return slot;
+        }
+        // prefer an empty slot, otherwise the least recently used one
+        if(index == NULL || (index->directory_cluster != 0 && (slot->directory_cluster == 0 || slot->last_used < index->last_used))) {
+            index = slot;
+        }
+    }
+    free_directory_index(index);
+
+    log_notice("building name index of directory @%u", directory_cluster);
+    self->stats.directory_index_builds++;
+    int result = iterate_directory(self, directory_cluster, index_add_item, index);
+    if(result != 0) {
+        if(result == 1) {
+            log_warn("not enough memory to index directory @%u", directory_cluster);
+            errno = ENOMEM;
         }
+        free_directory_index(index);
+        return NULL;
     }
 
-    // looped through whole first cluster of directory table and didn't find the file OR the end of the directory table
-    // TODO: read FAT to find next cluster of this table & loop back around to read it
-    /*
-        read the FAT for the next cluster of the directory table
-        if this was the last one, return not found error
-        else read the next cluster and go loop through the table again
-    */
-    errno = ENOENT;
+    // hash table with open addressing, kept at most half full
+    uint32_t bucket_count = 16;
+    while(bucket_count < index->item_count * 2) bucket_count *= 2;
+    index->buckets = calloc(bucket_count, sizeof *index->buckets);
+    if(index->buckets == NULL) {
+        log_warn("not enough memory to index directory @%u", directory_cluster);
+        free_directory_index(index);
+        errno = ENOMEM;
+        return NULL;
+    }
+    index->bucket_count = bucket_count;
+    for(uint32_t i = 0; i < index->item_count; i++) {
+        uint32_t bucket = index->items[i].hash & (bucket_count - 1);
+        while(index->buckets[bucket] != 0) {
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+        index->buckets[bucket] = i + 1;  // 0 marks an empty bucket
+    }
+
+    index->directory_cluster = directory_cluster;
+    index->last_used = self->directory_index_clock;
+    log_notice("indexed %u names", index->item_count);
+    return index;
+}
+
+// finds an uppercase name in a directory index
+static fs_fat_index_item* index_lookup(fs_fat_directory_index* index, const char* token) {
+    uint32_t hash = dentry_hash(0, token);
+    uint32_t bucket = hash & (index->bucket_count - 1);
+    while(index->buckets[bucket] != 0) {
+        fs_fat_index_item* item = &index->items[index->buckets[bucket] - 1];
+        if(item->hash == hash && strcmp(&index->names[item->name], token) == 0) {
+            return item;
+        }
+        bucket = (bucket + 1) & (index->bucket_count - 1);
+    }
     return NULL;
 }
+
+typedef struct {
+    const char* token;
+    directory_entry* found;
+    uint32_t* entry_cluster;
+    uint32_t* entry_index;
+} scan_context;
+
+// directory_item_callback that stops at the item matching the token
+static int scan_compare_item(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    scan_context* scan = context;
+    if((long_name != NULL && names_equal(scan->token, long_name)) || names_equal(scan->token, short_name)) {
+        *scan->found = *entry;
+        *scan->entry_cluster = entry_cluster;
+        *scan->entry_index = entry_index;
+        return 1;
+    }
+    return 0;
+}
+
+/** Searches a directory table for an item, using the directory's name index (or reading through the table if it
+ * can't be indexed).
+ * @param directory_cluster the first cluster of the directory table
+ * @param token             the name of the item to find, already converted to uppercase
+ * @param found             set to a copy of the item's directory entry
+ * @param entry_cluster     set to the cluster the item's directory entry is in
+ * @param entry_index       set to the index of the item's directory entry within that cluster
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int scan_directory(fs_fat* self, uint32_t directory_cluster, const char* token, directory_entry* found, uint32_t* entry_cluster, uint32_t* entry_index) {
+    fs_fat_directory_index* index = get_directory_index(self, directory_cluster);
+    if(index != NULL) {
+        fs_fat_index_item* item = index_lookup(index, token);
+        if(item == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+        *found = item->entry;
+        *entry_cluster = item->entry_cluster;
+        *entry_index = item->entry_index;
+        return 0;
+    } else if(errno != ENOMEM) {
+        return -1;
+    }
+
+    scan_context scan = { token, found, entry_cluster, entry_index };
+    int result = iterate_directory(self, directory_cluster, scan_compare_item, &scan);
+    if(result == 1) {
+        return 0;
+    } else if(result == 0) {
+        errno = ENOENT;
+    }
+    return -1;
+}
+
+/** Looks up an item in a directory, using the dentry cache if possible and adding the result to it otherwise.
+ * Items that don't exist are cached too, so repeatedly looking for a missing file doesn't read the disk.
+ * @see scan_directory() for the parameters
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int lookup_in_directory(fs_fat* self, uint32_t directory_cluster, const char* token, directory_entry* found, uint32_t* entry_cluster, uint32_t* entry_index) {
+    uint32_t hash = dentry_hash(directory_cluster, token);
+    // the name can only be in one set of slots
+    fs_fat_dentry* set = &self->dentry_cache[(hash % (FS_FAT_DENTRY_CACHE_SIZE / FS_FAT_DENTRY_CACHE_WAYS)) * FS_FAT_DENTRY_CACHE_WAYS];
+    self->dentry_cache_clock++;
+
+    fs_fat_dentry* victim = NULL;
+    for(int i = 0; i < FS_FAT_DENTRY_CACHE_WAYS; i++) {
+        fs_fat_dentry* dentry = &set[i];
+        if(dentry->valid && dentry->hash == hash && dentry->directory_cluster == directory_cluster && strcmp(dentry->name, token) == 0) {
+            self->stats.dentry_cache_hits++;
+            dentry->last_used = self->dentry_cache_clock;
+            if(!dentry->exists) {
+                errno = ENOENT;
+                return -1;
+            }
+            *found = dentry->entry;
+            *entry_cluster = dentry->entry_cluster;
+            *entry_index = dentry->entry_index;
+            return 0;
+        }
+        // prefer an empty slot, otherwise the least recently used one
+        if(victim == NULL || (victim->valid && (!dentry->valid || dentry->last_used < victim->last_used))) {
+            victim = dentry;
+        }
+    }
+    self->stats.dentry_cache_misses++;
+
+    int result = scan_directory(self, directory_cluster, token, found, entry_cluster, entry_index);
+    if((result == 0 || errno == ENOENT) && strlen(token) < FS_FAT_DENTRY_NAME_LENGTH) {
+        fs_fat_dentry* dentry = victim;
+        dentry->valid = true;
+        dentry->last_used = self->dentry_cache_clock;
+        dentry->exists = result == 0;
+        dentry->hash = hash;
+        dentry->directory_cluster = directory_cluster;
+        strcpy(dentry->name, token);
+        if(result == 0) {
+            dentry->entry = *found;
+            dentry->entry_cluster = *entry_cluster;
+            dentry->entry_index = *entry_index;
+        }
+    }
+    return result;
+}
+
+/** Removes a directory from the dentry cache and the directory indexes.
+ * Must be called whenever items in the directory are created, renamed, or deleted.
+ */
+static void forget_directory(fs_fat* self, uint32_t directory_cluster) {
+    for(int i = 0; i < FS_FAT_DENTRY_CACHE_SIZE; i++) {
+        if(self->dentry_cache[i].directory_cluster == directory_cluster) {
+            self->dentry_cache[i].valid = false;
+        }
+    }
+    for(int i = 0; i < FS_FAT_DIRECTORY_INDEXES; i++) {
+        if(self->directory_indexes[i].directory_cluster == directory_cluster) {
+            free_directory_index(&self->directory_indexes[i]);
+        }
+    }
+}
+
+/** Updates the cached copies of a directory entry after it was modified on the disk.
+ * @param directory_cluster the first cluster of the directory the entry is in
+ */
+static void update_cached_entry(fs_fat* self, uint32_t directory_cluster, uint32_t entry_cluster, uint32_t entry_index, const directory_entry* entry) {
+    for(int i = 0; i < FS_FAT_DENTRY_CACHE_SIZE; i++) {
+        fs_fat_dentry* dentry = &self->dentry_cache[i];
+        if(dentry->valid && dentry->exists && dentry->entry_cluster == entry_cluster && dentry->entry_index == entry_index) {
+            dentry->entry = *entry;
+        }
+    }
+    for(int i = 0; i < FS_FAT_DIRECTORY_INDEXES; i++) {
+        fs_fat_directory_index* index = &self->directory_indexes[i];
+        if(index->directory_cluster != directory_cluster) continue;
+        for(uint32_t j = 0; j < index->item_count; j++) {
+            if(index->items[j].entry_cluster == entry_cluster && index->items[j].entry_index == entry_index) {
+                index->items[j].entry = *entry;
+            }
+        }
+    }
+}
+
+/** Finds an item on the filesystem by its path, one directory at a time.
+ * @param path              the path of the item, relative to the root of the filesystem
+ * @param found             set to a copy of the item's directory entry
+ * @param parent_cluster    set to the first cluster of the directory containing the item
+ * @param entry_cluster     set to the cluster the item's directory entry is in
+ * @param entry_index       set to the index of the item's directory entry within that cluster
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int find_path(fs_fat* self, const char* path, directory_entry* found, uint32_t* parent_cluster, uint32_t* entry_cluster, uint32_t* entry_index) {
+    char token[FS_FAT_MAX_NAME_LENGTH + 1]; // the current path component
+    uint32_t directory_cluster = self->root_dir_start_C;
+    bool found_any = false;
+
+    while(true) {
+        // skip path seperators (including repeated ones)
+        while(*path == '/') path++;
+        if(*path == '\0') break;
+
+        // copy the next path component into the token, converting it to uppercase (FAT32 names are case-insensitive)
+        int length = 0;
+        for(; *path != '/' && *path != '\0'; path++) {
+            if(length == sizeof(token) - 1) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            char c = *path;
+            if(c >= 'a' && c <= 'z') {
+                c -= 0x20;
+            }
+            token[length++] = c;
+        }
+        token[length] = '\0';
+
+        // the previous item must be a directory to look inside of it
+        if(found_any) {
+            if(!(found->attr & FS_FAT_FILEATTR_DIRECTORY)) {
+                log_notice("found file when needed directory");
+                errno = ENOTDIR;
+                return -1;
+            }
+            directory_cluster = ((uint32_t)found->cluster_hi << 16) + found->cluster_lo;
+            if(directory_cluster == 0) {
+                directory_cluster = self->root_dir_start_C; // ".." entries pointing at the root directory use cluster 0
+            }
+        }
+
+        log_notice("token: %s, directory: %u", token, directory_cluster);
+        if(lookup_in_directory(self, directory_cluster, token, found, entry_cluster, entry_index) != 0) {
+            return -1;  // lookup_in_directory sets errno
+        }
+        found_any = true;
+    }
+
+    if(!found_any) {
+        // the path refers to the root directory itself, which doesn't have a directory entry
+        memset(found, 0, sizeof *found);
+        found->attr = FS_FAT_FILEATTR_DIRECTORY;
+        found->cluster_hi = self->root_dir_start_C >> 16;
+        found->cluster_lo = self->root_dir_start_C & 0xFFFF;
+        *entry_cluster = 0;
+        *entry_index = 0;
+        directory_cluster = 0;
+    }
+    *parent_cluster = directory_cluster;
+    return 0;
+}
+
+/** Converts a FAT date & time to milliseconds since the unix epoch.
+ * FAT timestamps are in local time, but there's no timezone to convert from, so they're treated as UTC.
+ * @param date          bits 15-9 are the year since 1980, 8-5 the month, 4-0 the day
+ * @param time          bits 15-11 are the hour, 10-5 the minute, 4-0 the second / 2
+ * @param centiseconds  hundredths of a second to add (0-199), only stored for the creation time
+ * @returns the timestamp, or `0` if the date isn't set.
+ */
+static int64_t convert_timestamp(uint16_t date, uint16_t time, uint8_t centiseconds) {
+    if(date == 0) {
+        return 0;
+    }
+    int32_t year = 1980 + (date >> 9);
+    int32_t month = (date >> 5) & 0x0F;
+    int32_t day = date & 0x1F;
+    // days since the epoch of a date in the proleptic gregorian calendar, counting years from march so leap days are at the end
+    year -= month <= 2;
+    int32_t era = year / 400;
+    int32_t year_of_era = year - era * 400;
+    int32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = (int64_t)era * 146097 + day_of_era - 719468;
+
+    int64_t seconds = days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+    return seconds * 1000 + centiseconds * 10;
+}
+
+// fills in the attributes of an item from its directory entry
+static void entry_attributes(const directory_entry* entry, fs_attributes* attributes) {
+    bool is_directory = entry->attr & FS_FAT_FILEATTR_DIRECTORY;
+    *attributes = (fs_attributes){
+        .size = is_directory ? 0 : entry->size,
+        .is_directory = is_directory,
+        .is_read_only = entry->attr & FS_FAT_FILEATTR_READONLY,
+        .created = convert_timestamp(entry->created_date, entry->created_time, entry->created_ms),
+        .modified = convert_timestamp(entry->modified_date, entry->modified_time, 0),
+    };
+}
+
+/** Gets the size, type, and timestamps of an item from its directory entry (which is usually in the dentry cache).
+ * The size of a file that is open and being written to is updated when the file is closed or fsync'd.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_stat(void* filesystem, const char* name, fs_attributes* attributes) {
+    fs_fat* self = filesystem;
+    directory_entry entry;
+    uint32_t parent_cluster, entry_cluster, entry_index;
+    if(find_path(self, name, &entry, &parent_cluster, &entry_cluster, &entry_index) != 0) {
+        return -1;  // find_path sets errno
+    }
+    entry_attributes(&entry, attributes);
+    return 0;
+}
+
+/** Gets the attributes of an open file from its directory entry, so they're the same as `fs_fat_stat()` reports.
+ * The size is the open file's, which is newer than the directory entry's while the file is being written to.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_fstat(fs_file* file, fs_attributes* attributes) {
+    uint32_t entry_LS;
+    directory_entry* entry = get_directory_slot(file->filesystem, file->data.fat.cluster_of_directory_entry, file->data.fat.index_of_directory_entry, &entry_LS);
+    if(entry == NULL) {
+        return -1;  // get_directory_slot sets errno
+    }
+    entry_attributes(entry, attributes);
+    attributes->size = file->size;
+    return 0;
+}
+
+typedef struct {
+    fs_list_callback callback;
+    void* context;
+} list_context;
+
+// directory_item_callback that passes each item except "." and ".." on to a fs_list_callback
+static int list_item(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    list_context* list = context;
+    (void)entry_cluster; (void)entry_index;
+    if(strcmp(short_name, ".") == 0 || strcmp(short_name, "..") == 0) {
+        return 0;
+    }
+    fs_attributes attributes;
+    entry_attributes(entry, &attributes);
+    return list->callback(list->context, long_name != NULL ? long_name : short_name, &attributes) != 0;
+}
+
+/** Calls `callback` for every item in a directory, with the attributes from its directory entry.
+ * The directory table is read through once, so nothing has to be looked up for each item.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_list(void* filesystem, const char* name, fs_list_callback callback, void* context) {
+    fs_fat* self = filesystem;
+    directory_entry entry;
+    uint32_t parent_cluster, entry_cluster, entry_index;
+    if(find_path(self, name, &entry, &parent_cluster, &entry_cluster, &entry_index) != 0) {
+        return -1;  // find_path sets errno
+    }
+    if(!(entry.attr & FS_FAT_FILEATTR_DIRECTORY)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    uint32_t directory_cluster = ((uint32_t)entry.cluster_hi << 16) + entry.cluster_lo;
+    if(directory_cluster == 0) {
+        directory_cluster = self->root_dir_start_C; // ".." entries pointing at the root directory use cluster 0
+    }
+
+    list_context list = { callback, context };
+    int result = iterate_directory(self, directory_cluster, list_item, &list);
+    return result == 0 ? 0 : -1;    // the callback or iterate_directory sets errno
+}
+
+/** Converts a name from UTF-8 to the UTF-16 of a long file name, checking that it's a valid name.
+ * @param characters    set to the name, must have space for 255 characters
+ * @returns the number of UTF-16 characters, or `-1` if the name isn't valid and sets `errno`.
+ */
+static int parse_long_name(const char* name, uint16_t* characters) {
+    const uint8_t* c = (const uint8_t*)name;
+    int count = 0;
+    while(*c != '\0') {
+        uint32_t codepoint;
+        int continuation_bytes;
+        if(*c < 0x80) {
+            codepoint = *c;
+            continuation_bytes = 0;
+        } else if((*c & 0xE0) == 0xC0) {
+            codepoint = *c & 0x1F;
+            continuation_bytes = 1;
+        } else if((*c & 0xF0) == 0xE0) {
+            codepoint = *c & 0x0F;
+            continuation_bytes = 2;
+        } else if((*c & 0xF8) == 0xF0) {
+            codepoint = *c & 0x07;
+            continuation_bytes = 3;
+        } else {
+            errno = EINVAL;
+            return -1;
+        }
+        c++;
+        for(int i = 0; i < continuation_bytes; i++, c++) {
+            if((*c & 0xC0) != 0x80) {
+                errno = EINVAL;
+                return -1;
+            }
+            codepoint = (codepoint << 6) | (*c & 0x3F);
+        }
+        if(codepoint < 0x20 || (codepoint < 0x80 && strchr(FS_FAT_LFN_INVALID_CHARACTERS, codepoint) != NULL)
+          || (codepoint >= 0xD800 && codepoint < 0xE000) || codepoint > 0x10FFFF) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if(count + (codepoint >= 0x10000 ? 2 : 1) > 255) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if(codepoint >= 0x10000) {
+            codepoint -= 0x10000;   // surrogate pair
+            characters[count++] = 0xD800 + (codepoint >> 10);
+            characters[count++] = 0xDC00 + (codepoint & 0x3FF);
+        } else {
+            characters[count++] = codepoint;
+        }
+    }
+    // other systems ignore trailing dots & spaces, and "." and ".." are the directory's own entries
+    if(count == 0 || characters[count - 1] == '.' || characters[count - 1] == ' ') {
+        errno = EINVAL;
+        return -1;
+    }
+    return count;
+}
+
+/** Tries to store a name as only an 8.3 name, which works if it's short enough, only has characters 8.3 names can,
+ * and the name & extension are each all one case (which is stored in the case flags).
+ * @returns `true` if the name fits, with the name, extension & case flags of `entry` set.
+ */
+static bool fit_short_name(const char* name, directory_entry* entry) {
+    const char* dot = strrchr(name, '.');
+    int name_length = dot != NULL ? dot - name : (int)strlen(name);
+    int extension_length = dot != NULL ? (int)strlen(dot + 1) : 0;
+    if(name_length < 1 || name_length > 8 || extension_length > 3 || (dot != NULL && extension_length == 0)) {
+        return false;
+    }
+
+    memset(entry->name, ' ', 8);
+    memset(entry->ext, ' ', 3);
+    entry->lowercase = 0;
+    for(int part = 0; part < 2; part++) {
+        const char* source = part == 0 ? name : dot + 1;
+        int length = part == 0 ? name_length : extension_length;
+        char* destination = part == 0 ? entry->name : entry->ext;
+        bool has_upper = false, has_lower = false;
+        for(int i = 0; i < length; i++) {
+            uint8_t c = source[i];
+            if(c >= 'a' && c <= 'z') {
+                has_lower = true;
+                c -= 0x20;
+            } else if(c >= 'A' && c <= 'Z') {
+                has_upper = true;
+            } else if(!(c >= '0' && c <= '9') && (c >= 0x80 || strchr(FS_FAT_SHORT_NAME_SYMBOLS, c) == NULL)) {
+                return false;
+            }
+            destination[i] = c;
+        }
+        if(has_upper && has_lower) {
+            return false;
+        } else if(has_lower) {
+            entry->lowercase |= part == 0 ? FS_FAT_LFN_LOWERNAME : FS_FAT_LFN_LOWEREXTENSION;
+        }
+    }
+    return true;
+}
+
+// converts a character of a long file name into a character for an 8.3 name, or returns 0 if it should be left out
+static char short_name_character(uint8_t c) {
+    if(c == ' ' || c == '.' || (c >= 0x80 && c < 0xC0)) {
+        return 0;   // spaces, dots, and the continuation bytes of UTF-8 characters are left out
+    } else if(c >= 'a' && c <= 'z') {
+        return c - 0x20;
+    } else if((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c < 0x80 && strchr(FS_FAT_SHORT_NAME_SYMBOLS, c) != NULL)) {
+        return c;
+    }
+    return '_';     // anything else (including each non-ASCII character) is replaced
+}
+
+/** Makes a unique 8.3 name for an item with a long file name, the way Windows does: the name's first characters
+ * (the ones 8.3 names can have) in uppercase, followed by "~1" or the first number not already used in the directory.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int generate_short_name(fs_fat* self, uint32_t directory_cluster, const char* name, directory_entry* entry) {
+    char basis[8];
+    char extension[3];
+    int basis_length = 0, extension_length = 0;
+    const char* dot = strrchr(name, '.');
+    if(dot == name) {
+        dot = NULL; // the name of a hidden file like ".settings" isn't an extension
+    }
+    for(const char* c = name; *c != '\0' && c != dot && basis_length < 8; c++) {
+        char converted = short_name_character(*c);
+        if(converted != 0) basis[basis_length++] = converted;
+    }
+    for(const char* c = dot != NULL ? dot + 1 : ""; *c != '\0' && extension_length < 3; c++) {
+        char converted = short_name_character(*c);
+        if(converted != 0) extension[extension_length++] = converted;
+    }
+    if(basis_length == 0) {
+        basis[basis_length++] = '_';
+    }
+
+    char token[13];
+    for(uint32_t number = 1; number < 1000000; number++) {
+        char tail[9];
+        int tail_length = snprintf(tail, sizeof tail, "~%u", number);
+        int kept = min(basis_length, 8 - tail_length);
+        memset(entry->name, ' ', 8);
+        memcpy(entry->name, basis, kept);
+        memcpy(entry->name + kept, tail, tail_length);
+        memset(entry->ext, ' ', 3);
+        memcpy(entry->ext, extension, extension_length);
+        entry->lowercase = 0;
+
+        // the directory's name index makes checking each number fast
+        directory_entry existing;
+        uint32_t existing_cluster, existing_index;
+        format_short_name(entry, token);
+        if(lookup_in_directory(self, directory_cluster, token, &existing, &existing_cluster, &existing_index) != 0) {
+            return errno == ENOENT ? 0 : -1;
+        }
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+// moves on to the next entry of a directory table, following its cluster chain. returns `false` at the end of the chain
+static bool next_directory_slot(fs_fat* self, uint32_t* cluster, uint32_t* index) {
+    if(++*index < (uint32_t)self->bytes_per_cluster / 32) {
+        return true;
+    }
+    *index = 0;
+    *cluster = find_next_cluster(self, *cluster);
+    return *cluster != 0;
+}
+
+// copies 32 bytes into an entry of a directory table, the change is only made in the block cache
+static int write_directory_slot(fs_fat* self, uint32_t cluster, uint32_t index, const void* raw) {
+    uint32_t block;
+    directory_entry* slot = get_directory_slot(self, cluster, index, &block);
+    if(slot == NULL) {
+        return -1;  // get_directory_slot sets errno
+    }
+    memcpy(slot, raw, 32);
+    fs_cache_mark_dirty_stage(self->device, block, FS_CACHE_STAGE_DIRECTORY);
+    return 0;
+}
+
+/** Finds `count` consecutive unused entries in a directory table, adding clusters to the directory if it's full.
+ * @param slot_cluster  set to the cluster of the first entry
+ * @param slot_index    set to the index of the first entry within that cluster
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int find_free_slots(fs_fat* self, uint32_t directory_cluster, uint32_t count, uint32_t* slot_cluster, uint32_t* slot_index) {
+    uint32_t entries_per_cluster = self->bytes_per_cluster / 32;
+    uint32_t run = 0;
+    uint32_t cluster = directory_cluster;
+    uint32_t last_cluster = directory_cluster;
+    uint32_t clusters_read = 0;
+    for(; cluster != 0 && clusters_read < self->cluster_count; clusters_read++) {
+        for(uint32_t index = 0; index < entries_per_cluster; index++) {
+            uint32_t block;
+            uint8_t* slot = (uint8_t*)get_directory_slot(self, cluster, index, &block);
+            if(slot == NULL) {
+                return -1;  // get_directory_slot sets errno
+            }
+            if(slot[0] == 0x00 || slot[0] == 0xE5) {
+                if(run == 0) {
+                    *slot_cluster = cluster;
+                    *slot_index = index;
+                }
+                if(++run == count) {
+                    return 0;
+                }
+            } else {
+                run = 0;
+            }
+        }
+        last_cluster = cluster;
+        cluster = find_next_cluster(self, cluster);
+    }
+    if(cluster != 0) {
+        log_warn("directory @%u has a looped cluster chain", directory_cluster);
+        errno = EIO;
+        return -1;
+    }
+
+    // the directory is full, add enough clusters for the rest of the entries (a directory can have at most 65536 entries)
+    uint32_t clusters_needed = (count - run + entries_per_cluster - 1) / entries_per_cluster;
+    if((clusters_read + clusters_needed) * entries_per_cluster > 65536) {
+        errno = ENOSPC;
+        return -1;
+    }
+    while(clusters_needed > 0) {
+        uint32_t allocated;
+        uint32_t first_cluster = allocate_cluster_run(self, last_cluster, clusters_needed, &allocated);
+        if(first_cluster == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        // the new clusters are zeroed, so the directory table still ends after the new entries
+        for(uint32_t block = cluster_to_LS(self, first_cluster); block < cluster_to_LS(self, first_cluster + allocated); block++) {
+            uint8_t* data = fs_cache_get(self->device, block, FS_CACHE_ZERO);
+            if(data == NULL) {
+                return -1;  // fs_cache_get sets errno
+            }
+            memset(data, 0, BYTES_PER_SECTOR);
+            fs_cache_mark_dirty_stage(self->device, block, FS_CACHE_STAGE_DIRECTORY);
+        }
+        if(run == 0) {
+            *slot_cluster = first_cluster;
+            *slot_index = 0;
+            run = 1;
+        }
+        clusters_needed -= allocated;
+        last_cluster = first_cluster + allocated - 1;
+    }
+    return 0;
+}
+
+/** Adds an item to a directory table: long file name entries (unless the name is a valid 8.3 name) and an 8.3 entry.
+ * The name must not already be in the directory.
+ * @param name          the item's name (UTF-8)
+ * @param template      the rest of the item's directory entry (attributes, first cluster, size, timestamps)
+ * @param created       set to the item's directory entry
+ * @param entry_cluster set to the cluster the item's directory entry is in
+ * @param entry_index   set to the index of the item's directory entry within that cluster
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int create_directory_entry(fs_fat* self, uint32_t directory_cluster, const char* name, const directory_entry* template, directory_entry* created, uint32_t* entry_cluster, uint32_t* entry_index) {
+    uint16_t characters[255];
+    int length = parse_long_name(name, characters);
+    if(length < 0) {
+        return -1;  // parse_long_name sets errno
+    }
+
+    directory_entry entry = *template;
+    int lfn_count = 0;
+    if(!fit_short_name(name, &entry)) {
+        if(generate_short_name(self, directory_cluster, name, &entry) != 0) {
+            return -1;  // generate_short_name sets errno
+        }
+        lfn_count = (length + FS_FAT_LFN_CHARACTERS - 1) / FS_FAT_LFN_CHARACTERS;
+    }
+
+    uint32_t cluster = 0, index = 0;
+    if(find_free_slots(self, directory_cluster, lfn_count + 1, &cluster, &index) != 0) {
+        return -1;  // find_free_slots sets errno
+    }
+
+    // the long file name entries are listed in reverse order, the first one holds the end of the name
+    uint8_t checksum = short_name_checksum(&entry);
+    for(int sequence = lfn_count; sequence >= 1; sequence--) {
+        uint16_t part[FS_FAT_LFN_CHARACTERS];
+        for(int i = 0; i < FS_FAT_LFN_CHARACTERS; i++) {
+            // the name is null terminated if there's space, and the rest is padded with 0xFFFF
+            int position = (sequence - 1) * FS_FAT_LFN_CHARACTERS + i;
+            part[i] = position < length ? characters[position] : position == length ? 0x0000 : 0xFFFF;
+        }
+        uint8_t raw[32] = { 0 };
+        raw[0] = sequence | (sequence == lfn_count ? FS_FAT_LFN_FIRSTENTRY : 0);
+        memcpy(&raw[0x01], part, 10);
+        raw[0x0B] = FS_FAT_LFN_ATTRIBUTES;
+        raw[0x0D] = checksum;
+        memcpy(&raw[0x0E], (uint8_t*)part + 10, 12);
+        memcpy(&raw[0x1C], (uint8_t*)part + 22, 4);
+        if(write_directory_slot(self, cluster, index, raw) != 0) {
+            return -1;  // write_directory_slot sets errno
+        }
+        next_directory_slot(self, &cluster, &index);    // find_free_slots made sure there's a next entry
+    }
+    if(write_directory_slot(self, cluster, index, &entry) != 0) {
+        return -1;  // write_directory_slot sets errno
+    }
+
+    forget_directory(self, directory_cluster);
+    *created = entry;
+    *entry_cluster = cluster;
+    *entry_index = index;
+    return 0;
+}
+
+/** Removes an item from a directory table, marking its long file name entries and 8.3 entry as deleted.
+ * The item's clusters aren't freed.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int delete_directory_entry(fs_fat* self, uint32_t directory_cluster, uint32_t entry_cluster, uint32_t entry_index) {
+    // the item's long file name entries are right before its 8.3 entry, find where they start
+    uint32_t cluster = directory_cluster, index = 0;
+    uint32_t first_cluster = entry_cluster, first_index = entry_index;
+    bool in_long_name = false;
+    for(uint32_t walked = 0; cluster != entry_cluster || index != entry_index; walked++) {
+        uint32_t block;
+        directory_entry* slot = get_directory_slot(self, cluster, index, &block);
+        if(slot == NULL) {
+            return -1;  // get_directory_slot sets errno
+        }
+        uint8_t first_byte = ((uint8_t*)slot)[0];
+        if(first_byte == 0x00 || walked == 65536) {
+            log_error("didn't find directory entry %u, %u in directory @%u", entry_cluster, entry_index, directory_cluster);
+            errno = EIO;
+            return -1;
+        }
+        if(first_byte != 0xE5 && slot->attr == FS_FAT_LFN_ATTRIBUTES) {
+            if(first_byte & FS_FAT_LFN_FIRSTENTRY) {
+                first_cluster = cluster;
+                first_index = index;
+                in_long_name = true;
+            }
+        } else {
+            in_long_name = false;
+        }
+        if(!next_directory_slot(self, &cluster, &index)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    if(!in_long_name) {
+        first_cluster = entry_cluster;
+        first_index = entry_index;
+    }
+
+    cluster = first_cluster;
+    index = first_index;
+    while(true) {
+        uint32_t block;
+        uint8_t* slot = (uint8_t*)get_directory_slot(self, cluster, index, &block);
+        if(slot == NULL) {
+            return -1;  // get_directory_slot sets errno
+        }
+        slot[0] = 0xE5;
+        fs_cache_mark_dirty_stage(self->device, block, FS_CACHE_STAGE_DIRECTORY);
+        if(cluster == entry_cluster && index == entry_index) {
+            break;
+        }
+        next_directory_slot(self, &cluster, &index);
+    }
+    forget_directory(self, directory_cluster);
+    return 0;
+}
+
+/** Finds the directory that the last part of a path is in, for creating an item at the path.
+ * @param directory_cluster set to the first cluster of the directory
+ * @param name              set to the last part of the path, must have space for `FS_FAT_MAX_NAME_LENGTH + 1` bytes
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int find_parent(fs_fat* self, const char* path, uint32_t* directory_cluster, char* name) {
+    size_t end = strlen(path);
+    while(end > 0 && path[end - 1] == '/') end--;
+    size_t start = end;
+    while(start > 0 && path[start - 1] != '/') start--;
+    if(start == end) {
+        errno = EEXIST; // the path is the root directory
+        return -1;
+    } else if(end - start > FS_FAT_MAX_NAME_LENGTH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+
+    char* parent_path = malloc(start + 1);
+    if(parent_path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(parent_path, path, start);
+    parent_path[start] = '\0';
+    directory_entry parent;
+    uint32_t parent_cluster, entry_cluster, entry_index;
+    int result = find_path(self, parent_path, &parent, &parent_cluster, &entry_cluster, &entry_index);
+    free(parent_path);
+    if(result != 0) {
+        return -1;  // find_path sets errno
+    } else if(!(parent.attr & FS_FAT_FILEATTR_DIRECTORY)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    *directory_cluster = ((uint32_t)parent.cluster_hi << 16) + parent.cluster_lo;
+    if(*directory_cluster == 0) {
+        *directory_cluster = self->root_dir_start_C;    // ".." entries pointing at the root directory use cluster 0
+    }
+    return 0;
+}
+
+/** Creates an empty file, which gets its first cluster when it's written to.
+ * @see find_path() for the parameters
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int create_file(fs_fat* self, const char* path, directory_entry* created, uint32_t* parent_cluster, uint32_t* entry_cluster, uint32_t* entry_index) {
+    char name[FS_FAT_MAX_NAME_LENGTH + 1];
+    if(find_parent(self, path, parent_cluster, name) != 0) {
+        return -1;  // find_parent sets errno
+    }
+    // there's no real time clock yet, so the timestamps are left unset
+    directory_entry template = { 0 };
+    template.attr = FS_FAT_FILEATTR_ARCHIVE;
+    return create_directory_entry(self, *parent_cluster, name, &template, created, entry_cluster, entry_index);
+}
+
+/** Renames or moves an item within the filesystem by moving its directory entry, the item's data isn't touched.
+ * Directories can be moved too (but not into themselves). The destination must not already exist.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_rename(void* filesystem, const char* from, const char* to) {
+    fs_fat* self = filesystem;
+    directory_entry entry;
+    uint32_t from_directory, entry_cluster, entry_index;
+    if(find_path(self, from, &entry, &from_directory, &entry_cluster, &entry_index) != 0) {
+        return -1;  // find_path sets errno
+    } else if(from_directory == 0) {
+        errno = EBUSY;  // the root directory can't be moved
+        return -1;
+    }
+
+    char name[FS_FAT_MAX_NAME_LENGTH + 1];
+    uint32_t to_directory;
+    if(find_parent(self, to, &to_directory, name) != 0) {
+        return -1;  // find_parent sets errno
+    }
+    directory_entry existing;
+    uint32_t existing_directory, existing_cluster, existing_index;
+    if(find_path(self, to, &existing, &existing_directory, &existing_cluster, &existing_index) == 0) {
+        // renaming an item to its own name in a different case is fine, anything else is in the way
+        if(existing_cluster != entry_cluster || existing_index != entry_index) {
+            errno = EEXIST;
+            return -1;
+        }
+    } else if(errno != ENOENT) {
+        return -1;  // find_path sets errno
+    }
+
+    uint32_t item_cluster = ((uint32_t)entry.cluster_hi << 16) + entry.cluster_lo;
+    bool moves_directory = (entry.attr & FS_FAT_FILEATTR_DIRECTORY) && to_directory != from_directory;
+    if(moves_directory) {
+        // a directory can't be moved into itself, so it must not be any of the destination's parents
+        uint32_t directory = to_directory;
+        for(uint32_t depth = 0; directory != self->root_dir_start_C; depth++) {
+            if(directory == item_cluster) {
+                errno = EINVAL;
+                return -1;
+            } else if(depth == self->cluster_count) {
+                errno = EIO;    // the ".." entries loop
+                return -1;
+            }
+            directory_entry parent;
+            uint32_t parent_cluster, parent_index;
+            if(lookup_in_directory(self, directory, "..", &parent, &parent_cluster, &parent_index) != 0) {
+                return -1;  // lookup_in_directory sets errno
+            }
+            directory = ((uint32_t)parent.cluster_hi << 16) + parent.cluster_lo;
+            if(directory == 0) {
+                directory = self->root_dir_start_C;
+            }
+        }
+    }
+
+    // add the new entry before removing the old one, so the item is never missing
+    directory_entry created;
+    uint32_t new_cluster, new_index;
+    if(create_directory_entry(self, to_directory, name, &entry, &created, &new_cluster, &new_index) != 0) {
+        return -1;  // create_directory_entry sets errno
+    }
+    if(delete_directory_entry(self, from_directory, entry_cluster, entry_index) != 0) {
+        return -1;  // delete_directory_entry sets errno
+    }
+
+    if(moves_directory) {
+        // point the directory's ".." entry at its new parent
+        uint32_t block;
+        directory_entry* parent_entry = get_directory_slot(self, item_cluster, 1, &block);
+        if(parent_entry == NULL) {
+            return -1;  // get_directory_slot sets errno
+        }
+        if(memcmp(parent_entry->name, "..      ", 8) == 0) {
+            uint32_t parent = to_directory == self->root_dir_start_C ? 0 : to_directory;
+            parent_entry->cluster_hi = parent >> 16;
+            parent_entry->cluster_lo = parent & 0xFFFF;
+            fs_cache_mark_dirty_stage(self->device, block, FS_CACHE_STAGE_DIRECTORY);
+            forget_directory(self, item_cluster);
+        }
+    }
+
+    // open files update their directory entry when they're closed, so it has to be the new one
+    for(fs_file* file = self->open_files; file != NULL; file = file->data.fat.next_open) {
+        if(file->data.fat.cluster_of_directory_entry == entry_cluster && file->data.fat.index_of_directory_entry == entry_index) {
+            file->data.fat.parent_directory_cluster = to_directory;
+            file->data.fat.cluster_of_directory_entry = new_cluster;
+            file->data.fat.index_of_directory_entry = new_index;
+        }
+    }
+    return 0;
+}
+
+
+// --- Fragmentation --- //
+
+// makes space for another item at the end of an array, doubling its capacity when it's full
+static int grow_array(void** items, uint32_t count, uint32_t* capacity, size_t item_size) {
+    if(count < *capacity) {
+        return 0;
+    }
+    uint32_t new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+    void* new_items = realloc(*items, new_capacity * item_size);
+    if(new_items == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *items = new_items;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// the number of clusters a file of `size` bytes needs
+static uint32_t clusters_for_size(fs_fat* self, uint32_t size) {
+    return size / self->bytes_per_cluster + (size % self->bytes_per_cluster != 0);
+}
+
+/** Counts how many runs of consecutive clusters a cluster chain is in, following at most `cluster_count` clusters of it.
+ * @returns the number of runs (stopping early if the chain ends or can't be read).
+ */
+static uint32_t count_extents(fs_fat* self, uint32_t first_cluster, uint32_t cluster_count) {
+    uint32_t extents = 1;
+    uint32_t cluster = first_cluster;
+    for(uint32_t i = 1; i < cluster_count; i++) {
+        uint32_t next_cluster = find_next_cluster(self, cluster);
+        if(next_cluster == 0) {
+            break;
+        } else if(next_cluster != cluster + 1) {
+            extents++;
+        }
+        cluster = next_cluster;
+    }
+    return extents;
+}
+
+// joins a directory's path & an item's name, returns the path (which must be freed) or `NULL` and sets `errno`
+static char* join_path(const char* directory, const char* name) {
+    char* path = malloc(strlen(directory) + strlen(name) + 2);
+    if(path == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sprintf(path, directory[0] == '\0' ? "%s%s" : "%s/%s", directory, name);
+    return path;
+}
+
+// a directory that fs_fat_get_fragmentation() hasn't searched yet
+typedef struct {
+    uint32_t cluster;
+    char* path;
+} pending_directory;
+
+typedef struct {
+    fs_fat* self;
+    fs_fragmentation* report;
+    fs_fragmentation_callback callback;
+    void* context;
+    const char* path;       // the path of the directory being searched
+    pending_directory* directories;
+    uint32_t directory_count;
+    uint32_t directory_capacity;
+} fragmentation_context;
+
+// directory_item_callback that adds each file to the report, and each directory to the directories to search
+static int fragmentation_item(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    fragmentation_context* walk = context;
+    fs_fat* self = walk->self;
+    (void)entry_cluster; (void)entry_index;
+    if(strcmp(short_name, ".") == 0 || strcmp(short_name, "..") == 0) {
+        return 0;
+    }
+    const char* name = long_name != NULL ? long_name : short_name;
+    uint32_t first_cluster = ((uint32_t)entry->cluster_hi << 16) + entry->cluster_lo;
+
+    if(entry->attr & FS_FAT_FILEATTR_DIRECTORY) {
+        if(first_cluster < 2) {
+            return 0;   // doesn't point to a directory table
+        }
+        if(grow_array((void**)&walk->directories, walk->directory_count, &walk->directory_capacity, sizeof *walk->directories) != 0) {
+            return -1;
+        }
+        char* path = join_path(walk->path, name);
+        if(path == NULL) {
+            return -1;
+        }
+        walk->directories[walk->directory_count++] = (pending_directory){ first_cluster, path };
+        return 0;
+    }
+
+    uint32_t extents = first_cluster >= 2 && entry->size > 0 ? count_extents(self, first_cluster, clusters_for_size(self, entry->size)) : 0;
+    walk->report->file_count++;
+    walk->report->extent_count += extents;
+    walk->report->fragmented_files += extents > 1;
+    walk->report->most_extents = max(walk->report->most_extents, extents);
+    if(walk->callback != NULL) {
+        char* path = join_path(walk->path, name);
+        if(path == NULL) {
+            return -1;
+        }
+        walk->callback(walk->context, path, entry->size, extents);
+        free(path);
+    }
+    return 0;
+}
+
+// adds up the runs of free clusters in the free cluster bitmap
+static void count_free_runs(fs_fat* self, fs_fragmentation* report) {
+    uint32_t last_cluster = self->cluster_count + 1;
+    uint32_t run = 0;
+    for(uint32_t cluster = 2; cluster <= last_cluster + 1; cluster++) {
+        if(cluster <= last_cluster && run == 0 && cluster % 32 == 0 && self->free_bitmap[cluster / 32] == 0xFFFFFFFF) {
+            cluster += 31;  // skip 32 clusters that are all in use
+            continue;
+        }
+        if(cluster <= last_cluster && cluster_is_free(self, cluster)) {
+            run++;
+        } else if(run > 0) {
+            report->free_runs++;
+            report->largest_free_run = max(report->largest_free_run, (uint64_t)run * self->bytes_per_cluster);
+            run = 0;
+        }
+    }
+    report->free_space = (uint64_t)(self->free_clusters - self->reserved_clusters) * self->bytes_per_cluster;
+}
+
+/** Reports how many runs of consecutive clusters each file is in, and how the free space is split up.
+ * Every directory is searched, one at a time (directory tables are read into the cluster buffer, so searches can't be nested).
+ * @param callback  called for each file with its path from the root directory, or `NULL`
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_get_fragmentation(void* filesystem, fs_fragmentation* report, fs_fragmentation_callback callback, void* context) {
+    fs_fat* self = filesystem;
+    memset(report, 0, sizeof *report);
+    if(self->free_bitmap == NULL && build_free_bitmap(self) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    count_free_runs(self, report);
+
+    fragmentation_context walk = { self, report, callback, context, "", NULL, 0, 0 };
+    int status = iterate_directory(self, self->root_dir_start_C, fragmentation_item, &walk) == 0 ? 0 : -1;
+    while(walk.directory_count > 0) {
+        pending_directory directory = walk.directories[--walk.directory_count];
+        if(status == 0) {
+            walk.path = directory.path;
+            status = iterate_directory(self, directory.cluster, fragmentation_item, &walk) == 0 ? 0 : -1;
+        }
+        free(directory.path);
+    }
+    free(walk.directories);
+    return status;  // the callback or iterate_directory sets errno
+}
+
+
+// --- Defragmentation --- //
+
+/* Files are moved one at a time into a run of free clusters big enough to hold all of them.
+ * While a file's data is copied (a step at a time), the new run is only reserved in the free cluster bitmap, so
+ * nothing on the disk refers to it until the copy is complete. Then the run is linked together in the FAT, the
+ * file's directory entry is pointed at it, and all of that is saved before the old clusters are freed.
+ * If this is interrupted at any point, the file keeps either its old or its new clusters, and at worst the other
+ * ones are left allocated with nothing using them (which `chkdsk`/`fsck` clean up).
+ */
+
+// finishes with the file being moved, releasing the new run if it wasn't used
+static void end_move(fs_fat* self, bool release_new_run) {
+    fs_fat_defrag* defrag = &self->defrag;
+    if(release_new_run) {
+        for(uint32_t i = 0; i < defrag->file.cluster_count; i++) {
+            uint32_t cluster = defrag->new_cluster + i;
+            self->free_bitmap[cluster / 32] &= ~(1u << (cluster % 32));
+        }
+    }
+    self->reserved_clusters = 0;
+    free(defrag->old_chain.extents);
+    defrag->old_chain.extents = NULL;
+    defrag->moving = false;
+}
+
+// stops moving a file, because it was opened or changed
+static void cancel_move(fs_fat* self) {
+    log_notice("stopped moving file @%u", self->defrag.file.first_cluster);
+    end_move(self, true);
+}
+
+// stops the defragmentation pass and frees everything it used
+static void stop_defragmenting(fs_fat* self) {
+    fs_fat_defrag* defrag = &self->defrag;
+    if(defrag->moving) {
+        end_move(self, true);
+    }
+    free(defrag->directories);
+    free(defrag->files);
+    free(defrag->buffer);
+    memset(defrag, 0, sizeof *defrag);
+}
+
+// checks that a file's directory entry still points to the same clusters & needs the same number of them
+static int entry_is_unchanged(fs_fat* self, const fs_fat_defrag_file* file, bool* unchanged) {
+    uint32_t block;
+    directory_entry* entry = get_directory_slot(self, file->entry_cluster, file->entry_index, &block);
+    if(entry == NULL) {
+        return -1;  // get_directory_slot sets errno
+    }
+    uint8_t first_byte = entry->name[0];
+    *unchanged = first_byte != 0x00 && first_byte != 0xE5 && !(entry->attr & FS_FAT_FILEATTR_DIRECTORY)
+        && ((uint32_t)entry->cluster_hi << 16) + entry->cluster_lo == file->first_cluster
+        && clusters_for_size(self, entry->size) == file->cluster_count;
+    return 0;
+}
+
+typedef struct {
+    fs_fat* self;
+    uint32_t directory_cluster;
+} defrag_search_context;
+
+// directory_item_callback that adds each fragmented file to the files to move, and each directory to the directories to search
+static int defrag_search_item(void* context, const char* long_name, const char* short_name, const directory_entry* entry, uint32_t entry_cluster, uint32_t entry_index) {
+    defrag_search_context* search = context;
+    fs_fat* self = search->self;
+    fs_fat_defrag* defrag = &self->defrag;
+    (void)long_name;
+    if(strcmp(short_name, ".") == 0 || strcmp(short_name, "..") == 0) {
+        return 0;
+    }
+    uint32_t first_cluster = ((uint32_t)entry->cluster_hi << 16) + entry->cluster_lo;
+    if(first_cluster < 2) {
+        return 0;
+    }
+
+    if(entry->attr & FS_FAT_FILEATTR_DIRECTORY) {
+        if(grow_array((void**)&defrag->directories, defrag->directory_count, &defrag->directory_capacity, sizeof *defrag->directories) != 0) {
+            return -1;
+        }
+        defrag->directories[defrag->directory_count++] = first_cluster;
+        return 0;
+    }
+
+    uint32_t cluster_count = clusters_for_size(self, entry->size);
+    if(cluster_count > 1 && count_extents(self, first_cluster, cluster_count) > 1) {
+        if(grow_array((void**)&defrag->files, defrag->file_count, &defrag->file_capacity, sizeof *defrag->files) != 0) {
+            return -1;
+        }
+        defrag->files[defrag->file_count++] = (fs_fat_defrag_file){
+            .parent_directory_cluster = search->directory_cluster,
+            .entry_cluster = entry_cluster,
+            .entry_index = entry_index,
+            .first_cluster = first_cluster,
+            .cluster_count = cluster_count,
+        };
+    }
+    return 0;
+}
+
+/** Starts moving a fragmented file: maps its clusters and reserves a free run to copy them to.
+ * Files that are open, changed since they were found, or don't fit in any free run are skipped.
+ * @returns `0` on success (or if the file was skipped), or `-1` on error and sets `errno`.
+ */
+static int start_move(fs_fat* self, const fs_fat_defrag_file* file) {
+    fs_fat_defrag* defrag = &self->defrag;
+    for(fs_file* open_file = self->open_files; open_file != NULL; open_file = open_file->data.fat.next_open) {
+        if(open_file->data.fat.first_cluster_id == file->first_cluster) {
+            return 0;
+        }
+    }
+    bool unchanged;
+    if(entry_is_unchanged(self, file, &unchanged) != 0) {
+        return -1;  // entry_is_unchanged sets errno
+    } else if(!unchanged) {
+        return 0;
+    }
+
+    fs_fat_file* chain = &defrag->old_chain;
+    *chain = (fs_fat_file){ .first_cluster_id = file->first_cluster };
+    uint32_t cluster = file->first_cluster;
+    for(uint32_t nth = 0; nth < file->cluster_count; nth++) {
+        if(cluster == 0) {
+            log_warn("cluster chain @%u is shorter than its file", file->first_cluster);
+            end_move(self, false);
+            return 0;
+        } else if(append_extent(chain, cluster, 1) != 0) {
+            end_move(self, false);
+            return -1;  // append_extent sets errno
+        }
+        cluster = nth + 1 < file->cluster_count ? find_next_cluster(self, cluster) : 0;
+    }
+    if(chain->extent_count <= 1) {
+        end_move(self, false);
+        return 0;
+    }
+
+    uint32_t new_cluster = find_free_run(self, 2, file->cluster_count);
+    if(new_cluster == 0) {
+        log_notice("no free run of %u clusters to move file @%u to", file->cluster_count, file->first_cluster);
+        end_move(self, false);
+        return 0;
+    }
+    // reserve the run so nothing else allocates it, without touching the FAT yet
+    for(uint32_t i = 0; i < file->cluster_count; i++) {
+        uint32_t reserved = new_cluster + i;
+        self->free_bitmap[reserved / 32] |= 1u << (reserved % 32);
+    }
+    self->reserved_clusters = file->cluster_count;
+    log_notice("moving file @%u (%u clusters in %u runs) to @%u", file->first_cluster, file->cluster_count, chain->extent_count, new_cluster);
+    defrag->file = *file;
+    defrag->new_cluster = new_cluster;
+    defrag->copied_clusters = 0;
+    defrag->moving = true;
+    return 0;
+}
+
+/** Finishes moving a file: links its new run together, points its directory entry at it, and saves all of that
+ * (after the copied data) before freeing the old clusters.
+ * @returns `0` on success (or if the file changed and the move was cancelled), or `-1` on error and sets `errno`.
+ */
+static int switch_chain(fs_fat* self) {
+    fs_fat_defrag* defrag = &self->defrag;
+    fs_fat_defrag_file* file = &defrag->file;
+    bool unchanged;
+    if(entry_is_unchanged(self, file, &unchanged) != 0) {
+        int error = errno;
+        cancel_move(self);
+        errno = error;
+        return -1;
+    } else if(!unchanged) {
+        cancel_move(self);
+        return 0;
+    }
+
+    // from here on the new run is (or may be) in the FAT, so it's never released back to the bitmap,
+    // and it's counted by `free_clusters` as it's linked instead of being reserved
+    self->reserved_clusters = 0;
+    for(uint32_t i = 0; i < file->cluster_count; i++) {
+        uint32_t value = (i == file->cluster_count - 1) ? FAT32_END_OF_CHAIN : defrag->new_cluster + i + 1;
+        if(write_fat_entry(self, defrag->new_cluster + i, value) != SD_OK) {
+            log_error("failed to link new cluster run @%u", defrag->new_cluster);
+            end_move(self, false);
+            errno = EIO;
+            return -1;
+        }
+    }
+    uint32_t block;
+    directory_entry* entry = get_directory_slot(self, file->entry_cluster, file->entry_index, &block);
+    if(entry == NULL) {
+        int error = errno;
+        end_move(self, false);
+        errno = error;
+        return -1;
+    }
+    entry->cluster_hi = defrag->new_cluster >> 16;
+    entry->cluster_lo = defrag->new_cluster & 0xFFFF;
+    fs_cache_mark_dirty_stage(self->device, block, FS_CACHE_STAGE_DIRECTORY);
+    directory_entry updated = *entry;
+    update_cached_entry(self, file->parent_directory_cluster, file->entry_cluster, file->entry_index, &updated);
+
+    // the old clusters can only be reused once nothing on the disk refers to them
+    if(fs_fat_sync(self) != 0) {
+        int error = errno;
+        log_error("failed to save moved file @%u, not freeing its old clusters", file->first_cluster);
+        end_move(self, false);
+        errno = error;
+        return -1;
+    }
+    truncate_cluster_chain(self, file->first_cluster, true);
+    defrag->moved_files++;
+    end_move(self, false);
+    return 0;
+}
+
+/** Copies the next clusters of the file being moved, up to `FS_FAT_DEFRAG_STEP_BYTES`, and switches the file over
+ * to its new run once they're all copied.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int copy_clusters(fs_fat* self) {
+    fs_fat_defrag* defrag = &self->defrag;
+    uint32_t step_clusters = max(FS_FAT_DEFRAG_STEP_BYTES / self->bytes_per_cluster, 1);
+    fs_fat_extent* extent = find_extent(&defrag->old_chain, defrag->copied_clusters);
+    uint32_t offset = defrag->copied_clusters - extent->first_nth;
+    uint32_t count = min(min(extent->length - offset, step_clusters), defrag->file.cluster_count - defrag->copied_clusters);
+    uint32_t sector_count = count * self->logical_sectors_per_cluster;
+
+    // read without filling up the block cache, but using any cached (possibly modified) blocks
+    if(fs_cache_scan(self->device, cluster_to_LS(self, extent->cluster + offset), sector_count, defrag->buffer) != 0
+        || fs_cache_write(self->device, cluster_to_LS(self, defrag->new_cluster + defrag->copied_clusters), sector_count, defrag->buffer) != 0) {
+        int error = errno;
+        cancel_move(self);
+        errno = error;
+        return -1;
+    }
+    defrag->copied_clusters += count;
+    if(defrag->copied_clusters == defrag->file.cluster_count) {
+        return switch_chain(self);
+    }
+    return 0;
+}
+
+/** Starts a defragmentation pass, which moves every file whose clusters aren't consecutive into a free run that fits it.
+ * The work is done by `fs_fat_defragment_step()`, a little at a time. Does nothing if a pass is already running.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_fat_defragment(void* filesystem) {
+    fs_fat* self = filesystem;
+    fs_fat_defrag* defrag = &self->defrag;
+    if(defrag->running) {
+        return 0;
+    }
+    if(self->free_bitmap == NULL && build_free_bitmap(self) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    defrag->buffer = malloc(max(FS_FAT_DEFRAG_STEP_BYTES, self->bytes_per_cluster));
+    if(defrag->buffer == NULL || grow_array((void**)&defrag->directories, 0, &defrag->directory_capacity, sizeof *defrag->directories) != 0) {
+        stop_defragmenting(self);
+        errno = ENOMEM;
+        return -1;
+    }
+    defrag->directories[defrag->directory_count++] = self->root_dir_start_C;
+    defrag->running = true;
+    log_notice("defragmenting %s", self->device->name);
+    return 0;
+}
+
+/** Does one step of the defragmentation pass: searches one directory for fragmented files, starts moving a file,
+ * or copies the next part of the file being moved. Called regularly by `fs_defragment_step()`.
+ * @returns `1` if there's more to do, `0` if the pass is done (or isn't running), or `-1` if it stopped on an error and sets `errno`.
+ */
+int fs_fat_defragment_step(void* filesystem) {
+    fs_fat* self = filesystem;
+    fs_fat_defrag* defrag = &self->defrag;
+    if(!defrag->running) {
+        return 0;
+    }
+
+    int result;
+    if(defrag->moving) {
+        result = copy_clusters(self);
+    } else if(defrag->file_count > 0) {
+        fs_fat_defrag_file file = defrag->files[--defrag->file_count];
+        result = start_move(self, &file);
+    } else if(defrag->directory_count > 0) {
+        defrag_search_context search = { self, defrag->directories[--defrag->directory_count] };
+        result = iterate_directory(self, search.directory_cluster, defrag_search_item, &search) == 0 ? 0 : -1;
+    } else {
+        log_notice("finished defragmenting %s, moved %u files", self->device->name, defrag->moved_files);
+        stop_defragmenting(self);
+        return 0;
+    }
+
+    if(result != 0) {
+        int error = errno;
+        log_error("stopped defragmenting %s: %i", self->device->name, error);
+        stop_defragmenting(self);
+        errno = error;
+        return -1;
+    }
+    return 1;
+}
@@ -13,30 +13,38 @@
 #define FS_FAT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "fs.h"
+#include "fs_cache.h"
 
-// a suffix of LS means logical sector (hardcoded as 512-bytes)
-// a suffix of C means a FAT cluster (size determined by VBR)
-typedef struct {
-    uint32_t partition_start_LS;    // first sector of the FAT32 partition, as an absolute offset in 512-byte sectors from the beginning of the storage device
-    uint32_t partition_size_LS;
-    uint32_t fat_start_LS;          // first sector of the first File Allocation Table, absolute offset
-    uint32_t data_start_LS;         // first sector of the data region, absolute offset
-    uint32_t root_dir_start_C;      // first cluster of the root directory table (clusters begin in the first sector of the data region)
-    uint8_t logical_sectors_per_cluster;
-    uint32_t sectors_per_fat;
-    uint8_t* cluster_buffer;        // a buffer for this filesystem instance
-    int bytes_per_cluster;          // the size of the cluster buffer
-} fs_fat;
+// 512 byte sector / 4 bytes per integer (aka 4 bytes per fat entry)
+#define FS_FAT_ENTRIES_PER_SECTOR (512 / 4)
+// the FSInfo sector uses this when the free cluster count isn't known
+#define FS_FAT_FREE_COUNT_UNKNOWN 0xFFFFFFFF
+// number of path lookups each filesystem instance remembers
+#define FS_FAT_DENTRY_CACHE_SIZE 512
+// how many slots of the dentry cache a name can be stored in
+#define FS_FAT_DENTRY_CACHE_WAYS 4
+// names this long or longer aren't cached
+#define FS_FAT_DENTRY_NAME_LENGTH 64
+// number of directories each filesystem instance keeps a name index of
+#define FS_FAT_DIRECTORY_INDEXES 8
+// the longest a name can be in bytes (255 UTF-16 characters, each up to 3 bytes of UTF-8)
+#define FS_FAT_MAX_NAME_LENGTH (255 * 3)
+// the most bytes read ahead of a file being read sequentially (the read-ahead window starts small and doubles up to this)
+#define FS_FAT_READAHEAD_MAX_BYTES (FS_CACHE_STAGING_BLOCKS * FS_CACHE_BLOCK_SIZE)
+#define FS_FAT_READAHEAD_MIN_CLUSTERS 2
+// the most bytes the defragmenter copies each step
+#define FS_FAT_DEFRAG_STEP_BYTES (64 * 1024)
 
 typedef struct {
-    uint32_t first_cluster_id;
-    uint32_t current_loaded_cluster_id;     // which cluster id is currently loaded (used to get the next one from the FAT)
-    uint32_t nth_cluster_of_file;           // which cluster of the file we currently have in the buffer (1st cluster, 23rd cluster, etc.)
-    uint32_t cluster_of_directory_entry;    // which cluster this file's directory entry is in (not necessarily the first cluster of the directory table)
-    uint32_t index_of_directory_entry;      // the index (of directory entries) into the directory entry cluster
-} fs_fat_file;
+    uint32_t dentry_cache_hits;     // directory lookups served from memory
+    uint32_t dentry_cache_misses;   // directory lookups that had to search the directory table
+    uint32_t directory_index_builds;    // directory tables read to build a name index
+    uint32_t readahead_bytes;       // bytes of files read ahead of sequential reads
+    uint32_t readahead_hit_bytes;   // bytes of files that were read after being read ahead
+} fs_fat_stats;
 
 typedef struct {
     char name[8];               // 0x00-07
@@ -54,10 +62,143 @@ typedef struct {
     uint32_t size;              // 0x1C-1F  in bytes
 } directory_entry;
 
-fs_fat* fs_fat_init(uint32_t partition_start_LS, uint32_t partition_size_LS);
-fs_file* fs_fat_open(fs_fat* self, const char* name, int mode);
+// a remembered result of looking up a name in a directory
+typedef struct {
+    bool valid;                 // true if this slot holds a lookup result
+    bool exists;                // false if the name wasn't found in the directory (a negative entry)
+    uint32_t last_used;         // value of the cache clock when this slot was last accessed (for LRU eviction)
+    uint32_t hash;
+    uint32_t directory_cluster; // the first cluster of the directory that was searched
+    char name[FS_FAT_DENTRY_NAME_LENGTH];   // the name that was looked up, in uppercase
+    directory_entry entry;      // a copy of the item's directory entry
+    uint32_t entry_cluster;     // which cluster the item's directory entry is in
+    uint32_t entry_index;       // the index of the directory entry within that cluster
+} fs_fat_dentry;
+
+// a name in a directory index
+typedef struct {
+    uint32_t hash;
+    uint32_t name;              // offset of the name (in uppercase) in the index's name pool
+    directory_entry entry;      // a copy of the item's directory entry
+    uint32_t entry_cluster;     // which cluster the item's directory entry is in
+    uint32_t entry_index;       // the index of the directory entry within that cluster
+} fs_fat_index_item;
+
+// a hash table of every name (long and 8.3) in a directory table
+typedef struct {
+    uint32_t directory_cluster; // the first cluster of the indexed directory, or 0 if this slot is unused
+    uint32_t last_used;         // value of the index clock when this index was last used (for LRU eviction)
+    fs_fat_index_item* items;
+    uint32_t item_count;
+    uint32_t item_capacity;
+    char* names;                // all of the names, null terminated
+    uint32_t names_size;
+    uint32_t names_capacity;
+    uint32_t* buckets;          // open addressed hash table of item indexes + 1 (0 is an empty bucket)
+    uint32_t bucket_count;      // always a power of 2
+} fs_fat_directory_index;
+
+// a run of consecutive clusters in a file's cluster chain
+typedef struct {
+    uint32_t first_nth;     // which cluster of the file the run starts at
+    uint32_t cluster;       // the cluster id of the first cluster in the run
+    uint32_t length;        // number of clusters in the run
+} fs_fat_extent;
+
+typedef struct {
+    uint32_t first_cluster_id;
+    fs_fat_extent* extents;                 // the part of the cluster chain that has been walked so far, sorted by first_nth
+    uint32_t extent_count;
+    uint32_t extent_capacity;               // number of extents the array has space for
+    uint32_t mapped_clusters;               // how many clusters of the file (from the start) are covered by the extents
+    uint32_t reserved_clusters;             // how many clusters the file is expected to need, allocated together when the file grows
+    uint32_t readahead_next;                // the offset a read continuing sequentially from the last one would start at
+    uint32_t readahead_end;                 // the file has been read ahead up to (not including) this offset
+    uint32_t readahead_clusters;            // the size of the read-ahead window, 0 if the file isn't being read sequentially
+    uint32_t parent_directory_cluster;      // the first cluster of the directory table this file is in
+    uint32_t cluster_of_directory_entry;    // which cluster this file's directory entry is in (not necessarily the first cluster of the directory table)
+    uint32_t index_of_directory_entry;      // the index (of directory entries) into the directory entry cluster
+    fs_file* next_open;                     // the next open file on the same filesystem
+} fs_fat_file;
+
+// a file the defragmenter found split into more than one run of clusters
+typedef struct {
+    uint32_t parent_directory_cluster;  // the first cluster of the directory table the file is in
+    uint32_t entry_cluster;         // which cluster the file's directory entry is in
+    uint32_t entry_index;           // the index of the directory entry within that cluster
+    uint32_t first_cluster;
+    uint32_t cluster_count;         // how many clusters the file's size needs
+} fs_fat_defrag_file;
+
+// the state of an incremental defragmentation pass, see `fs_fat_defragment_step()`
+typedef struct {
+    bool running;
+    uint32_t* directories;          // first clusters of directories that haven't been searched for fragmented files yet
+    uint32_t directory_count;
+    uint32_t directory_capacity;
+    fs_fat_defrag_file* files;      // fragmented files found in the last searched directory, waiting to be moved
+    uint32_t file_count;
+    uint32_t file_capacity;
+    bool moving;                    // true while a file's data is being copied to its new run
+    fs_fat_defrag_file file;        // the file being moved
+    fs_fat_file old_chain;          // the extent map of the file's clusters
+    uint32_t new_cluster;           // the first cluster of the run the file is moved to, only reserved in the free cluster bitmap until the move finishes
+    uint32_t copied_clusters;       // how many clusters have been copied to the new run
+    uint8_t* buffer;                // the clusters being copied, FS_FAT_DEFRAG_STEP_BYTES (or one cluster if that's bigger)
+    uint32_t moved_files;
+} fs_fat_defrag;
+
+// a suffix of LS means logical sector (hardcoded as 512-bytes)
+// a suffix of C means a FAT cluster (size determined by VBR)
+typedef struct {
+    storage_device* device;         // the device the filesystem is on
+    uint32_t partition_start_LS;    // first sector of the FAT32 partition, as an absolute offset in 512-byte sectors from the beginning of the storage device
+    uint32_t partition_size_LS;
+    uint32_t fat_start_LS;          // first sector of the first File Allocation Table, absolute offset
+    uint32_t data_start_LS;         // first sector of the data region, absolute offset
+    uint32_t root_dir_start_C;      // first cluster of the root directory table (clusters begin in the first sector of the data region)
+    uint8_t logical_sectors_per_cluster;
+    uint32_t sectors_per_fat;
+    uint8_t fat_count;              // number of copies of the FAT, the first one is used and the rest are kept the same
+    uint32_t* dirty_fat_sectors;    // one bit per sector of the FAT, set if it was modified since the last commit (NULL if there's only 1 FAT)
+    bool fat_is_modified;           // true if any bit of dirty_fat_sectors is set
+    uint32_t cluster_count;         // number of clusters in the data region (valid cluster ids are 2 to cluster_count + 1)
+    uint8_t* cluster_buffer;        // a buffer for this filesystem instance
+    int bytes_per_cluster;          // the size of the cluster buffer
+    uint16_t fsinfo_LS;             // sector of the FSInfo structure, relative to the start of the partition (0 if there isn't one)
+    uint32_t free_clusters;         // number of free clusters, or FS_FAT_FREE_COUNT_UNKNOWN
+    uint32_t reserved_clusters;     // free clusters that are set in the free cluster bitmap (the defragmenter's new run), so they aren't free space
+    uint32_t next_free_hint;        // where to start looking for a free cluster for a new cluster chain
+    bool fsinfo_is_modified;        // true if the FSInfo sector must be updated
+    uint32_t* free_bitmap;          // one bit per cluster id, set if the cluster is in use (NULL until built)
+    fs_fat_dentry dentry_cache[FS_FAT_DENTRY_CACHE_SIZE];   // set-associative hash table of directory lookups
+    uint32_t dentry_cache_clock;    // incremented on every dentry cache access
+    fs_fat_directory_index directory_indexes[FS_FAT_DIRECTORY_INDEXES];
+    uint32_t directory_index_clock; // incremented on every directory index access
+    fs_file* open_files;            // every open file on this filesystem, linked through `data.fat.next_open`
+    fs_fat_defrag defrag;
+    fs_fat_stats stats;
+} fs_fat;
+
+extern const fs_ops fs_fat_ops;
+
+fs_fat* fs_fat_init(storage_device* device, uint32_t partition_start_LS, uint32_t partition_size_LS);
+fs_file* fs_fat_open(void* filesystem, const char* name, int mode);
 void fs_fat_close(fs_file* file);
+int fs_fat_fsync(fs_file* file);
+int fs_fat_commit(void* filesystem);
+int fs_fat_sync(void* filesystem);
+int64_t fs_fat_get_free_space(void* filesystem);
+const fs_fat_stats* fs_fat_get_stats(void* filesystem);
 int fs_fat_read(fs_file* file, uint8_t* buffer, int length);
 int fs_fat_write(fs_file* file, uint8_t* write_buffer, int length);
+void fs_fat_reserve(fs_file* file, int size);
+int fs_fat_stat(void* filesystem, const char* name, fs_attributes* attributes);
+int fs_fat_fstat(fs_file* file, fs_attributes* attributes);
+int fs_fat_list(void* filesystem, const char* name, fs_list_callback callback, void* context);
+int fs_fat_rename(void* filesystem, const char* from, const char* to);
+int fs_fat_get_fragmentation(void* filesystem, fs_fragmentation* report, fs_fragmentation_callback callback, void* context);
+int fs_fat_defragment(void* filesystem);
+int fs_fat_defragment_step(void* filesystem);
 
 #endif
@@ -0,0 +1,378 @@
+/* fs_rom.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  A read-only filesystem for the archive of the CraftOS rom that is linked
+  into the kernel image (packed by tools/pack_rom.py at build time), so
+  the hundreds of small files CraftOS reads while booting don't have to be
+  read from the SD card.
+
+  The archive's entries are sorted by path, so opening a file is a binary
+  search, and reading an uncompressed file copies straight out of the
+  archive. Compressed files are decompressed when they're opened.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+// for file open mode flags
+#include <fcntl.h>
+
+#include "log.h"
+
+#include "fs.h"
+#include "fs_rom.h"
+
+static const char log_from[] = "fs_rom";
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/** Checks an archive's header and index, and creates a filesystem for it.
+ * Everything the index points to is checked here, so opening & reading files can trust it.
+ * @returns the filesystem, or `NULL` if the archive is empty or invalid.
+ */
+fs_rom* fs_rom_init(const uint8_t* archive, uint32_t archive_size) {
+    const fs_rom_header* header = (const fs_rom_header*)archive;
+    if(archive_size < sizeof *header || header->magic != FS_ROM_MAGIC || header->version != FS_ROM_VERSION) {
+        log_error("rom archive has an invalid header");
+        return NULL;
+    }
+    if(header->entry_count == 0) {
+        log_notice("rom archive is empty");
+        return NULL;
+    }
+    uint64_t index_end = sizeof *header + (uint64_t)header->entry_count * sizeof(fs_rom_entry) + header->names_size;
+    if(index_end > archive_size) {
+        log_error("rom archive index is larger than the archive");
+        return NULL;
+    }
+    const fs_rom_entry* entries = (const fs_rom_entry*)(archive + sizeof *header);
+    const char* names = (const char*)&entries[header->entry_count];
+    if(header->names_size == 0 || names[header->names_size - 1] != '\0') {
+        log_error("rom archive name table isn't terminated");
+        return NULL;
+    }
+    for(uint32_t i = 0; i < header->entry_count; i++) {
+        const fs_rom_entry* entry = &entries[i];
+        if(entry->name_offset >= header->names_size || (uint64_t)entry->data_offset + entry->stored_size > archive_size
+          || (!(entry->flags & FS_ROM_FLAG_COMPRESSED) && entry->stored_size != entry->size)) {
+            log_error("rom archive entry %u is invalid", i);
+            return NULL;
+        }
+    }
+
+    fs_rom* self = malloc(sizeof *self);
+    if(self == NULL) {
+        log_error("failed to allocate romfs struct: %i", errno);
+        return NULL;
+    }
+    self->archive = archive;
+    self->archive_size = archive_size;
+    self->entries = entries;
+    self->entry_count = header->entry_count;
+    self->names = names;
+    log_notice("mounted rom archive with %u entries, %u bytes", self->entry_count, archive_size);
+    return self;
+}
+
+// binary searches the index for a path, returns its entry or `NULL` if it isn't in the archive
+static const fs_rom_entry* find_entry(fs_rom* self, const char* path, uint32_t path_length) {
+    uint32_t low = 0;
+    uint32_t high = self->entry_count;
+    while(low < high) {
+        uint32_t middle = (low + high) / 2;
+        const char* name = self->names + self->entries[middle].name_offset;
+        int compare = strncmp(name, path, path_length);
+        if(compare == 0 && name[path_length] != '\0') {
+            compare = 1;    // the name is longer than the path
+        }
+        if(compare == 0) {
+            return &self->entries[middle];
+        } else if(compare < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+// compares an archive path to the first `length` bytes of `path` followed by a '/', for finding the items in a directory
+static int compare_to_directory(const char* name, const char* path, uint32_t length) {
+    int compare = strncmp(name, path, length);
+    if(compare == 0) {
+        compare = (uint8_t)name[length] - '/';
+    }
+    return compare;
+}
+
+/** Binary searches the index for the first item in a directory (the entries of a directory's items are all together).
+ * @returns the index of the first entry whose path starts with the directory's path followed by a '/'.
+ */
+static uint32_t find_directory_start(fs_rom* self, const char* path, uint32_t path_length) {
+    uint32_t low = 0;
+    uint32_t high = self->entry_count;
+    while(low < high) {
+        uint32_t middle = (low + high) / 2;
+        if(compare_to_directory(self->names + self->entries[middle].name_offset, path, path_length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/** Decompresses an LZ4 block.
+ * @returns `0` on success, or `-1` if the data doesn't decompress to exactly `size` bytes.
+ */
+static int decompress(const uint8_t* source, uint32_t source_size, uint8_t* destination, uint32_t size) {
+    const uint8_t* source_end = source + source_size;
+    uint32_t out = 0;
+    while(source < source_end) {
+        uint8_t token = *source++;
+
+        uint32_t literals = token >> 4;
+        if(literals == 15) {
+            uint8_t byte;
+            do {
+                if(source == source_end) return -1;
+                byte = *source++;
+                literals += byte;
+            } while(byte == 255);
+        }
+        if(literals > (uint32_t)(source_end - source) || literals > size - out) {
+            return -1;
+        }
+        memcpy(destination + out, source, literals);
+        source += literals;
+        out += literals;
+        if(source == source_end) {
+            break;  // the last sequence only has literals
+        }
+
+        if(source_end - source < 2) {
+            return -1;
+        }
+        uint32_t offset = source[0] | (source[1] << 8);
+        source += 2;
+        uint32_t match_length = (token & 0x0F) + 4;
+        if((token & 0x0F) == 15) {
+            uint8_t byte;
+            do {
+                if(source == source_end) return -1;
+                byte = *source++;
+                match_length += byte;
+            } while(byte == 255);
+        }
+        if(offset == 0 || offset > out || match_length > size - out) {
+            return -1;
+        }
+        // the match can overlap the bytes it's producing, so copy one at a time
+        for(uint32_t i = 0; i < match_length; i++) {
+            destination[out + i] = destination[out - offset + i];
+        }
+        out += match_length;
+    }
+    return out == size ? 0 : -1;
+}
+
+/** Opens a file in the rom archive. The archive is read-only, so `mode` must be `O_RDONLY`.
+ * @param filesystem the struct returned by `fs_rom_init()`
+ * @param name the name of the file to open
+ * @param mode file opening mode, O_* defines from fcntl.h
+ * @returns a `fs_file` struct on success, or `NULL` on error and sets `errno`.
+ */
+fs_file* fs_rom_open(void* filesystem, const char* name, int mode) {
+    fs_rom* self = filesystem;
+    if(mode & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_APPEND)) {
+        errno = EROFS;
+        return NULL;
+    }
+    // ignore extra slashes, the archive's paths have none at the start or end
+    while(*name == '/') name++;
+    uint32_t length = strlen(name);
+    while(length > 0 && name[length - 1] == '/') length--;
+    if(length == 0) {
+        errno = EISDIR; // the root of the archive
+        return NULL;
+    }
+
+    const fs_rom_entry* entry = find_entry(self, name, length);
+    if(entry == NULL) {
+        errno = ENOENT;
+        return NULL;
+    } else if(entry->flags & FS_ROM_FLAG_DIRECTORY) {
+        errno = EISDIR;
+        return NULL;
+    }
+
+    fs_file* file = malloc(sizeof *file);
+    if(file == NULL) {
+        log_error("failed to allocate file struct: %i", errno);
+        return NULL;
+    }
+    file->data.rom.entry = entry;
+    file->data.rom.data = self->archive + entry->data_offset;
+    file->data.rom.decompressed = NULL;
+    if(entry->flags & FS_ROM_FLAG_COMPRESSED) {
+        uint8_t* decompressed = malloc(entry->size > 0 ? entry->size : 1);
+        if(decompressed == NULL || decompress(file->data.rom.data, entry->stored_size, decompressed, entry->size) != 0) {
+            log_error("failed to decompress %.*s", (int)length, name);
+            free(decompressed);
+            free(file);
+            errno = EIO;
+            return NULL;
+        }
+        file->data.rom.data = decompressed;
+        file->data.rom.decompressed = decompressed;
+    }
+
+    file->ops = &fs_rom_ops;
+    file->filesystem = self;
+    file->size = entry->size;
+    file->offset = 0;
+    file->mode = mode;
+    file->file_is_modified = false;
+    return file;
+}
+
+/** Closes an open file. */
+void fs_rom_close(fs_file* file) {
+    free(file->data.rom.decompressed);
+}
+
+// the archive can't be modified, there's nothing to save
+int fs_rom_sync(void* filesystem) {
+    (void)filesystem;
+    return 0;
+}
+
+// the archive is read-only, so it has no free space
+int64_t fs_rom_get_free_space(void* filesystem) {
+    (void)filesystem;
+    return 0;
+}
+
+/** Reads up to `length` bytes from the file into `buffer`, straight out of the archive.
+ * @returns the number of bytes read, or `0` for end of file.
+ */
+int fs_rom_read(fs_file* file, uint8_t* read_buffer, int length) {
+    if(file->offset >= file->size || length < 1) {
+        return 0;   // end of file
+    }
+    int count = min(length, file->size - file->offset);
+    memcpy(read_buffer, file->data.rom.data + file->offset, count);
+    file->offset += count;
+    return count;
+}
+
+// the archive is read-only, always fails and sets `errno` to `EROFS`
+int fs_rom_write(fs_file* file, uint8_t* write_buffer, int length) {
+    (void)file; (void)write_buffer; (void)length;
+    errno = EROFS;
+    return -1;
+}
+
+void fs_rom_reserve(fs_file* file, int size) {
+    (void)file; (void)size;
+}
+
+// files are already in memory (in the archive, or decompressed when opened), so they can be mapped without copying
+const uint8_t* fs_rom_map(fs_file* file) {
+    return file->data.rom.data;
+}
+
+// fills in the attributes of an item in the archive
+static void entry_attributes(const fs_rom_entry* entry, fs_attributes* attributes) {
+    *attributes = (fs_attributes){
+        .size = entry->flags & FS_ROM_FLAG_DIRECTORY ? 0 : entry->size,
+        .is_directory = entry->flags & FS_ROM_FLAG_DIRECTORY,
+        .is_read_only = true,
+        .created = 0,   // the archive doesn't store timestamps
+        .modified = 0,
+    };
+}
+
+/** Gets the size and type of an item in the archive.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_rom_stat(void* filesystem, const char* name, fs_attributes* attributes) {
+    fs_rom* self = filesystem;
+    while(*name == '/') name++;
+    uint32_t length = strlen(name);
+    while(length > 0 && name[length - 1] == '/') length--;
+    if(length == 0) {
+        *attributes = (fs_attributes){ .is_directory = true, .is_read_only = true };
+        return 0;
+    }
+    const fs_rom_entry* entry = find_entry(self, name, length);
+    if(entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    entry_attributes(entry, attributes);
+    return 0;
+}
+
+/** Calls `callback` for every item in a directory of the archive.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_rom_list(void* filesystem, const char* name, fs_list_callback callback, void* context) {
+    fs_rom* self = filesystem;
+    while(*name == '/') name++;
+    uint32_t length = strlen(name);
+    while(length > 0 && name[length - 1] == '/') length--;
+
+    uint32_t first = 0;
+    uint32_t prefix_length = 0;   // the length of the directory's path with the '/' after it
+    if(length > 0) {
+        const fs_rom_entry* entry = find_entry(self, name, length);
+        if(entry == NULL) {
+            errno = ENOENT;
+            return -1;
+        } else if(!(entry->flags & FS_ROM_FLAG_DIRECTORY)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        first = find_directory_start(self, name, length);
+        prefix_length = length + 1;
+    }
+
+    for(uint32_t i = first; i < self->entry_count; i++) {
+        const char* path = self->names + self->entries[i].name_offset;
+        if(length > 0 && compare_to_directory(path, name, length) != 0) {
+            break;  // past the end of the directory
+        }
+        const char* item_name = path + prefix_length;
+        if(strchr(item_name, '/') != NULL) {
+            continue;   // in a subdirectory
+        }
+        fs_attributes attributes;
+        entry_attributes(&self->entries[i], &attributes);
+        if(callback(context, item_name, &attributes) != 0) {
+            return -1;  // the callback sets errno
+        }
+    }
+    return 0;
+}
+
+const fs_ops fs_rom_ops = {
+    .open = fs_rom_open,
+    .close = fs_rom_close,
+    .read = fs_rom_read,
+    .write = fs_rom_write,
+    .reserve = fs_rom_reserve,
+    .get_free_space = fs_rom_get_free_space,
+    .sync = fs_rom_sync,
+    .stat = fs_rom_stat,
+    .list = fs_rom_list,
+    .map = fs_rom_map,
+};
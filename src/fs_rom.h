@@ -0,0 +1,72 @@
+/* fs_rom.h © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+ */
+#ifndef FS_ROM_H
+#define FS_ROM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fs.h"
+
+#define FS_ROM_MAGIC 0x4D4F524B     // "KROM"
+#define FS_ROM_VERSION 1
+#define FS_ROM_FLAG_DIRECTORY   1 << 0
+#define FS_ROM_FLAG_COMPRESSED  1 << 1  // the data is LZ4 block compressed
+
+// the archive created by tools/pack_rom.py, linked into the kernel by rom-archive.S
+extern const uint8_t fs_rom_archive[];
+extern const uint8_t fs_rom_archive_end[];
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t names_size;    // the size of the name table, which follows the entries
+} fs_rom_header;
+
+typedef struct {
+    uint32_t name_offset;   // offset of the path in the name table
+    uint32_t data_offset;   // offset of the file's data from the start of the archive
+    uint32_t size;          // the size of the file
+    uint32_t stored_size;   // the size of the data in the archive (smaller than `size` if it's compressed)
+    uint32_t flags;         // FS_ROM_FLAG_*
+} fs_rom_entry;
+
+typedef struct {
+    const uint8_t* archive;
+    uint32_t archive_size;
+    const fs_rom_entry* entries;    // sorted by path
+    uint32_t entry_count;
+    const char* names;
+} fs_rom;
+
+typedef struct {
+    const fs_rom_entry* entry;
+    const uint8_t* data;    // points into the archive, or to `decompressed`
+    uint8_t* decompressed;  // the file's data if it's stored compressed, freed when the file is closed
+} fs_rom_file;
+
+extern const fs_ops fs_rom_ops;
+
+fs_rom* fs_rom_init(const uint8_t* archive, uint32_t archive_size);
+fs_file* fs_rom_open(void* filesystem, const char* name, int mode);
+void fs_rom_close(fs_file* file);
+int fs_rom_sync(void* filesystem);
+int64_t fs_rom_get_free_space(void* filesystem);
+int fs_rom_read(fs_file* file, uint8_t* buffer, int length);
+int fs_rom_write(fs_file* file, uint8_t* buffer, int length);
+void fs_rom_reserve(fs_file* file, int size);
+int fs_rom_stat(void* filesystem, const char* name, fs_attributes* attributes);
+int fs_rom_list(void* filesystem, const char* name, fs_list_callback callback, void* context);
+const uint8_t* fs_rom_map(fs_file* file);
+
+#endif
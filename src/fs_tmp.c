@@ -0,0 +1,373 @@
+/* fs_tmp.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  A filesystem that keeps its files in RAM, for scratch files that don't
+  need to survive a reboot and shouldn't wear out the SD card.
+
+  Each file's data is a list of chunks (extents) that are allocated as the
+  file grows, each twice as large as the last (up to FS_TMP_MAX_CHUNK), so
+  a file of any size takes few allocations and reads & writes are just
+  memcpy's between the caller's buffer and the chunks.
+  There are no directories, a path is just the name of a file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+// for file open mode flags
+#include <fcntl.h>
+
+#include "log.h"
+
+#include "fs.h"
+#include "fs_tmp.h"
+
+static const char log_from[] = "fs_tmp";
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/** Creates an empty RAM filesystem.
+ * @param max_bytes how much file data the filesystem may hold
+ * @returns the filesystem, or `NULL` on error.
+ */
+fs_tmp* fs_tmp_init(uint32_t max_bytes) {
+    fs_tmp* self = malloc(sizeof *self);
+    if(self == NULL) {
+        log_error("failed to allocate tmpfs struct: %i", errno);
+        return NULL;
+    }
+    self->nodes = NULL;
+    self->used_bytes = 0;
+    self->max_bytes = max_bytes;
+    log_notice("created tmpfs with space for %u bytes", max_bytes);
+    return self;
+}
+
+static fs_tmp_node* find_node(fs_tmp* self, const char* name) {
+    for(fs_tmp_node* node = self->nodes; node != NULL; node = node->next) {
+        if(strcmp(node->name, name) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// frees all of a file's data
+static void truncate_node(fs_tmp* self, fs_tmp_node* node) {
+    for(uint32_t i = 0; i < node->chunk_count; i++) {
+        free(node->chunks[i].data);
+    }
+    free(node->chunks);
+    self->used_bytes -= node->allocated;
+    node->chunks = NULL;
+    node->chunk_count = 0;
+    node->chunk_capacity = 0;
+    node->allocated = 0;
+    node->size = 0;
+}
+
+/** Allocates chunks until the file has space for `end` bytes.
+ * @returns `0` on success, or `-1` if there isn't enough memory and sets `errno` (some chunks may still have been added).
+ */
+static int grow_node(fs_tmp* self, fs_tmp_node* node, uint32_t end) {
+    while(node->allocated < end) {
+        // each chunk doubles the size of the file
+        uint32_t size = node->allocated < FS_TMP_MIN_CHUNK ? FS_TMP_MIN_CHUNK : min(node->allocated, FS_TMP_MAX_CHUNK);
+        uint32_t free_bytes = self->max_bytes - self->used_bytes;
+        if(size > free_bytes) {
+            // not enough space left for a whole chunk, only take what the file needs (or whatever is left)
+            size = min(end - node->allocated, free_bytes);
+            if(size == 0) {
+                errno = ENOSPC;
+                return -1;
+            }
+        }
+
+        if(node->chunk_count == node->chunk_capacity) {
+            uint32_t capacity = node->chunk_capacity == 0 ? 8 : node->chunk_capacity * 2;
+            fs_tmp_chunk* chunks = realloc(node->chunks, capacity * sizeof *chunks);
+            if(chunks == NULL) {
+                errno = ENOSPC;
+                return -1;
+            }
+            node->chunks = chunks;
+            node->chunk_capacity = capacity;
+        }
+        uint8_t* data = malloc(size);
+        if(data == NULL) {
+            log_warn("failed to allocate %u byte chunk for %s", size, node->name);
+            errno = ENOSPC;
+            return -1;
+        }
+        node->chunks[node->chunk_count++] = (fs_tmp_chunk){ .start = node->allocated, .capacity = size, .data = data };
+        node->allocated += size;
+        self->used_bytes += size;
+    }
+    return 0;
+}
+
+// finds which chunk holds the byte at `offset`, which must be less than `node->allocated`
+static uint32_t find_chunk(fs_tmp_node* node, uint32_t offset) {
+    uint32_t low = 0;
+    uint32_t high = node->chunk_count - 1;
+    while(low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if(node->chunks[middle].start <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// copies between a buffer and the file's chunks, the range must already be allocated
+// (writing with a `NULL` buffer fills the range with zeros)
+static void copy_data(fs_tmp_node* node, uint32_t offset, uint8_t* buffer, uint32_t length, bool write) {
+    uint32_t i = find_chunk(node, offset);
+    while(length > 0) {
+        fs_tmp_chunk* chunk = &node->chunks[i++];
+        uint32_t chunk_offset = offset - chunk->start;
+        uint32_t run = min(length, chunk->capacity - chunk_offset);
+        if(write && buffer == NULL) {
+            memset(chunk->data + chunk_offset, 0, run);
+        } else if(write) {
+            memcpy(chunk->data + chunk_offset, buffer, run);
+        } else {
+            memcpy(buffer, chunk->data + chunk_offset, run);
+        }
+        offset += run;
+        if(buffer != NULL) buffer += run;
+        length -= run;
+    }
+}
+
+/** Opens a file on the RAM filesystem, creating it if `mode` has `O_CREAT`.
+ * @param filesystem the struct returned by `fs_tmp_init()`
+ * @param name the name of the file to open
+ * @param mode file opening mode, O_* defines from fcntl.h
+ * @returns a `fs_file` struct on success, or `NULL` on error and sets `errno`.
+ */
+fs_file* fs_tmp_open(void* filesystem, const char* name, int mode) {
+    fs_tmp* self = filesystem;
+    if(name[0] == '\0') {
+        errno = EISDIR; // the root of the filesystem
+        return NULL;
+    }
+    if(strlen(name) > FS_TMP_MAX_NAME_LENGTH) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    fs_tmp_node* node = find_node(self, name);
+    if(node == NULL) {
+        if(!(mode & O_CREAT)) {
+            errno = ENOENT;
+            return NULL;
+        }
+        node = calloc(1, sizeof *node);
+        if(node == NULL || (node->name = strdup(name)) == NULL) {
+            free(node);
+            errno = ENOSPC;
+            return NULL;
+        }
+        node->next = self->nodes;
+        self->nodes = node;
+    } else if((mode & O_CREAT) && (mode & O_EXCL)) {
+        errno = EEXIST;
+        return NULL;
+    }
+
+    fs_file* file = malloc(sizeof *file);
+    if(file == NULL) {
+        log_error("failed to allocate file struct: %i", errno);
+        return NULL;
+    }
+    if(mode & O_TRUNC) {
+        truncate_node(self, node);
+    }
+
+    file->data.tmp.node = node;
+    file->ops = &fs_tmp_ops;
+    file->filesystem = self;
+    file->size = node->size;
+    file->offset = 0;
+    file->mode = mode;
+    file->file_is_modified = false;
+    return file;
+}
+
+/** Closes an open file. Its data stays in memory until the file is truncated. */
+void fs_tmp_close(fs_file* file) {
+    (void)file;
+}
+
+// the data is only ever in memory, there's nothing to save
+int fs_tmp_sync(void* filesystem) {
+    (void)filesystem;
+    return 0;
+}
+
+/** Gets how much more file data the filesystem can hold.
+ * @returns the number of free bytes.
+ */
+int64_t fs_tmp_get_free_space(void* filesystem) {
+    fs_tmp* self = filesystem;
+    return self->max_bytes - self->used_bytes;
+}
+
+/** Reads up to `length` bytes from the file into `buffer`.
+ * @returns the number of bytes read, or `0` for end of file.
+ */
+int fs_tmp_read(fs_file* file, uint8_t* read_buffer, int length) {
+    fs_tmp_node* node = file->data.tmp.node;
+    file->size = node->size;    // another handle to the file may have changed it
+    if(file->offset >= file->size || length < 1) {
+        return 0;   // end of file
+    }
+    uint32_t count = min((uint32_t)length, (uint32_t)(file->size - file->offset));
+    copy_data(node, file->offset, read_buffer, count, false);
+    file->offset += count;
+    return count;
+}
+
+/** Writes `length` bytes from `buffer` into the file, allocating more memory for it if necessary.
+ * @returns the number of bytes written, or `-1` on error and sets `errno`.
+ */
+int fs_tmp_write(fs_file* file, uint8_t* write_buffer, int length) {
+    fs_tmp* self = file->filesystem;
+    fs_tmp_node* node = file->data.tmp.node;
+    if(length < 1) {
+        return 0;
+    }
+    uint32_t end = (uint32_t)file->offset + length;
+    if(grow_node(self, node, end) != 0) {
+        // write as much as there's space for
+        if(node->allocated <= (uint32_t)file->offset) {
+            return -1;  // grow_node sets errno
+        }
+        end = node->allocated;
+    }
+    // another handle may have truncated the file below this one's offset, what was there before now reads as zeros
+    if((uint32_t)file->offset > node->size) {
+        copy_data(node, node->size, NULL, file->offset - node->size, true);
+    }
+    uint32_t count = end - file->offset;
+    copy_data(node, file->offset, write_buffer, count, true);
+    file->offset += count;
+    if((uint32_t)file->offset > node->size) {
+        node->size = file->offset;
+    }
+    file->size = node->size;
+    file->file_is_modified = true;
+    return count;
+}
+
+/** Sets how large the file is expected to become, so memory for it can be allocated up front.
+ * This doesn't change the size of the file, and does nothing if there isn't enough memory.
+ */
+void fs_tmp_reserve(fs_file* file, int size) {
+    fs_tmp* self = file->filesystem;
+    fs_tmp_node* node = file->data.tmp.node;
+    if(size > 0 && (uint32_t)size > node->allocated && (uint32_t)size - node->allocated <= self->max_bytes - self->used_bytes) {
+        grow_node(self, node, size);
+    }
+}
+
+// small files are in one chunk, which can be mapped without copying
+const uint8_t* fs_tmp_map(fs_file* file) {
+    fs_tmp_node* node = file->data.tmp.node;
+    if(node->chunk_count == 0 || node->chunks[0].capacity < node->size) {
+        return NULL;
+    }
+    return node->chunks[0].data;
+}
+
+/** Gets the size of a file, or the attributes of the root directory if `name` is empty.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_tmp_stat(void* filesystem, const char* name, fs_attributes* attributes) {
+    fs_tmp* self = filesystem;
+    *attributes = (fs_attributes){ 0 };
+    if(name[0] == '\0') {
+        attributes->is_directory = true;
+        return 0;
+    }
+    fs_tmp_node* node = find_node(self, name);
+    if(node == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    attributes->size = node->size;
+    return 0;
+}
+
+/** Calls `callback` for every file. There are no directories, so `name` must be empty (the root).
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_tmp_list(void* filesystem, const char* name, fs_list_callback callback, void* context) {
+    fs_tmp* self = filesystem;
+    if(name[0] != '\0') {
+        errno = find_node(self, name) != NULL ? ENOTDIR : ENOENT;
+        return -1;
+    }
+    for(fs_tmp_node* node = self->nodes; node != NULL; node = node->next) {
+        fs_attributes attributes = { .size = node->size };
+        if(callback(context, node->name, &attributes) != 0) {
+            return -1;  // the callback sets errno
+        }
+    }
+    return 0;
+}
+
+/** Renames a file. The destination must not already exist.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int fs_tmp_rename(void* filesystem, const char* from, const char* to) {
+    fs_tmp* self = filesystem;
+    fs_tmp_node* node = find_node(self, from);
+    if(node == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if(to[0] == '\0') {
+        errno = EEXIST; // the root of the filesystem
+        return -1;
+    } else if(strlen(to) > FS_TMP_MAX_NAME_LENGTH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    } else if(find_node(self, to) != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+    char* name = strdup(to);
+    if(name == NULL) {
+        errno = ENOSPC;
+        return -1;
+    }
+    free(node->name);
+    node->name = name;
+    return 0;
+}
+
+const fs_ops fs_tmp_ops = {
+    .open = fs_tmp_open,
+    .close = fs_tmp_close,
+    .read = fs_tmp_read,
+    .write = fs_tmp_write,
+    .reserve = fs_tmp_reserve,
+    .get_free_space = fs_tmp_get_free_space,
+    .sync = fs_tmp_sync,
+    .stat = fs_tmp_stat,
+    .list = fs_tmp_list,
+    .rename = fs_tmp_rename,
+    .map = fs_tmp_map,
+};
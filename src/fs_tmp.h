@@ -0,0 +1,71 @@
+/* fs_tmp.h © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+ */
+#ifndef FS_TMP_H
+#define FS_TMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fs.h"
+
+// how much file data the RAM filesystem may hold, can be overridden when compiling
+#ifndef FS_TMP_MAX_BYTES
+#define FS_TMP_MAX_BYTES (16 * 1024 * 1024)
+#endif
+// file data is allocated in chunks that double in size as the file grows, from the min up to the max
+#define FS_TMP_MIN_CHUNK (4 * 1024)
+#define FS_TMP_MAX_CHUNK (1024 * 1024)
+#define FS_TMP_MAX_NAME_LENGTH 255
+
+// an extent of file data, one allocation of memory
+typedef struct {
+    uint32_t start;         // the offset in the file this chunk holds data from
+    uint32_t capacity;      // the size of the chunk in bytes
+    uint8_t* data;
+} fs_tmp_chunk;
+
+typedef struct fs_tmp_node {
+    char* name;                 // the path of the file within the filesystem
+    uint32_t size;              // the size of the file in bytes
+    fs_tmp_chunk* chunks;       // sorted by start, each starts where the previous one ends
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;    // number of chunks the array has space for
+    uint32_t allocated;         // the total capacity of the chunks
+    struct fs_tmp_node* next;
+} fs_tmp_node;
+
+typedef struct {
+    fs_tmp_node* nodes;         // every file in the filesystem
+    uint32_t used_bytes;        // the total capacity of every file's chunks
+    uint32_t max_bytes;
+} fs_tmp;
+
+typedef struct {
+    fs_tmp_node* node;
+} fs_tmp_file;
+
+extern const fs_ops fs_tmp_ops;
+
+fs_tmp* fs_tmp_init(uint32_t max_bytes);
+fs_file* fs_tmp_open(void* filesystem, const char* name, int mode);
+void fs_tmp_close(fs_file* file);
+int fs_tmp_sync(void* filesystem);
+int64_t fs_tmp_get_free_space(void* filesystem);
+int fs_tmp_read(fs_file* file, uint8_t* buffer, int length);
+int fs_tmp_write(fs_file* file, uint8_t* buffer, int length);
+void fs_tmp_reserve(fs_file* file, int size);
+int fs_tmp_stat(void* filesystem, const char* name, fs_attributes* attributes);
+int fs_tmp_list(void* filesystem, const char* name, fs_list_callback callback, void* context);
+int fs_tmp_rename(void* filesystem, const char* from, const char* to);
+const uint8_t* fs_tmp_map(fs_file* file);
+
+#endif
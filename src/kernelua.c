@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "gic-400.h"
 
@@ -30,6 +31,7 @@
 #define SCREEN_DEPTH 32 /* Stick to 32-bit depth for ease-of tutorial code */
 
 #define TIMER_HERTZ 100 /* Default hertz for libuspi (can be changed, but best to leave at default for now) */
+#define WRITEBACK_TIMER_DELAY (TIMER_HERTZ / 2) /* how often the filesystem is told to write back modified blocks & defragment */
 
 const char* rotor = "\xC4\\\xB3/";
 
@@ -58,6 +60,58 @@ void shutdown() {
     RPI_PowerReset();
 }
 
+/** Loads a Lua script straight from a memory-mapped view of the file, instead of through stdio.
+ * @returns the status from `luaL_loadbuffer()` (leaving the chunk or an error message on the stack), or `LUA_ERRFILE` if the file couldn't be read.
+ */
+static int loadScript(lua_State* L, const char* name) {
+    int file = fs_open(name, O_RDONLY, 1);
+    int size;
+    const uint8_t* view = file == -1 ? NULL : fs_mmap(file, &size);
+    if(view == NULL) {
+        lua_pushfstring(L, "cannot open %s: %s", name, strerror(errno));
+        if(file != -1) fs_close(file);
+        return LUA_ERRFILE;
+    }
+    // skip a first line starting with '#' like luaL_loadfile does, but keep the newline so line numbers stay the same
+    const char* script = (const char*)view;
+    if(size > 0 && script[0] == '#') {
+        const char* newline = memchr(script, '\n', size);
+        int skip = newline != NULL ? newline - script : size;
+        script += skip;
+        size -= skip;
+    }
+    lua_pushfstring(L, "@%s", name);
+    int result = luaL_loadbuffer(L, script, size, lua_tostring(L, -1));
+    lua_remove(L, -2);  // the chunk name
+    fs_munmap(file);
+    fs_close(file);
+    return result;
+}
+
+/** Tells the filesystem a write-back (and defragmentation step) may be due, so it's done while Lua is running.
+ * Timer handlers only fire once, so this connects itself again each time. */
+static void writebackTimer(TKernelTimerHandle timer, void* param, void* context) {
+    fs_writeback_due(RPI_GetTimerTicks() / 1000);  // the system timer counts microseconds
+    ConnectTimerHandler(WRITEBACK_TIMER_DELAY, writebackTimer, NULL, NULL);
+}
+
+/** Starts defragmenting the boot device if any of its files are split up, which makes reading them take more commands.
+ * The files are moved a little at a time by `fs_writeback_if_due()`, while Lua runs. */
+static void defragmentIfFragmented() {
+    fs_fragmentation report;
+    if(fs_get_fragmentation("/", &report, NULL, NULL) != 0) {
+        printf("checking fragmentation failed: %i\n", errno);
+        return;
+    }
+    if(report.fragmented_files == 0) {
+        return;
+    }
+    printf("%u of %u files are fragmented (%u runs), defragmenting\n", report.fragmented_files, report.file_count, report.extent_count);
+    if(fs_defragment("/") != 0) {
+        printf("starting defragmentation failed: %i\n", errno);
+    }
+}
+
 static void keyPressedRaw(unsigned char ucModifiers, const unsigned char RawKeys[6]) {
     printf("%X, %X, %X, %X, %X, %X\n", RawKeys[0], RawKeys[1], RawKeys[2], RawKeys[3], RawKeys[4], RawKeys[5]);
 }
@@ -302,6 +356,8 @@ void kernel_main(unsigned int r0, unsigned int r1, unsigned int atags) {
 
     if(result == 0) {
         printf("fs init success!       \n");
+        defragmentIfFragmented();
+        ConnectTimerHandler(WRITEBACK_TIMER_DELAY, writebackTimer, NULL, NULL);
     } else {
         RPI_TermSetTextColor(COLORS_ORANGE);
         printf("error init: %i         \n", result);
@@ -331,7 +387,7 @@ void kernel_main(unsigned int r0, unsigned int r1, unsigned int atags) {
         lua_pop(L, 1);  // remove lib
     }
 
-    result = luaL_loadfile(L, "bios.lua");
+    result = loadScript(L, "bios.lua");
     if(result != LUA_OK) {
         printf("loading bios.lua failed: %i\n", result);
         printf("\terror: %s\n", lua_tostring(L, -1));
@@ -352,6 +408,8 @@ void kernel_main(unsigned int r0, unsigned int r1, unsigned int atags) {
             USPiKeyboardUpdateLEDs();
 
             spinRotor(i);
+            // and write back file changes & move defragmentation along, when the timer says it's due
+            fs_writeback_if_due();
             RPI_WaitMiliseconds(250);
         }
     }
@@ -13,6 +13,7 @@
 #define LOG_H
 
 #include <stdarg.h>
+#include <stdint.h>
 
 // from uspi
 #define LOG_ERROR	1
@@ -0,0 +1,106 @@
+/* rpi-dma.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  The DMA controller, which copies between memory & peripherals without the
+  CPU. Each transfer is described by a control block in memory; peripherals
+  like the EMMC pace it with their data request (DREQ) signal.
+
+  The ARM's data cache isn't coherent with the DMA controller, so buffers must
+  be cleaned before a transfer reads them and invalidated around a transfer that
+  writes them (see rpi-memory.h).
+*/
+
+#include <stddef.h>
+
+#include "rpi-dma.h"
+#include "rpi-memory.h"
+#include "rpi-mailbox-interface.h"
+#include "rpi-systimer.h"
+#include "log.h"
+
+static const char log_from[] = "dma";
+
+static uint32_t allocated_channels = 0;
+
+static inline rpi_dma_channel_t* get_channel(int channel) {
+    return (rpi_dma_channel_t*)(RPI_DMA_BASE + channel * RPI_DMA_CHANNEL_SIZE);
+}
+
+/** Picks a full DMA channel that the firmware says isn't in use (and hasn't been picked already), enables & resets it.
+ * @returns the channel number, or `-1` if there aren't any free.
+ */
+int RPI_DmaAllocateChannel() {
+    RPI_PropertyInit();
+    RPI_PropertyAddTag(TAG_GET_DMA_CHANNELS);
+    RPI_PropertyProcess();
+    rpi_mailbox_property_t* mp = RPI_PropertyGet(TAG_GET_DMA_CHANNELS);
+    uint32_t usable = mp != NULL ? mp->data.buffer_32[0] : 0;
+
+    for(int channel = 0; channel < RPI_DMA_FULL_CHANNELS; channel++) {
+        uint32_t bit = 1u << channel;
+        if((usable & bit) && !(allocated_channels & bit)) {
+            allocated_channels |= bit;
+            *(rpi_reg_rw_t*)RPI_DMA_ENABLE |= bit;
+            get_channel(channel)->CS = RPI_DMA_CS_RESET;
+            log_notice("using channel %i (usable: %04X)", channel, usable);
+            return channel;
+        }
+    }
+    log_warn("no free channels (usable: %04X)", usable);
+    return -1;
+}
+
+/** Starts a transfer. The control block is written back from the data cache first, the buffers it points to must
+ * already be cleaned or invalidated as needed.
+ */
+void RPI_DmaStart(int channel, rpi_dma_control_block_t* block) {
+    rpi_dma_channel_t* dma = get_channel(channel);
+    RPI_MemoryCleanDataCache(block, sizeof *block);
+
+    dma->CS = RPI_DMA_CS_END | RPI_DMA_CS_INT;  // clear the previous transfer's flags
+    dma->DEBUG = RPI_DMA_DEBUG_ERRORS;
+    dma->CONBLK_AD = RPI_DMA_BUS_MEMORY(block);
+    dma->CS = RPI_DMA_CS_ACTIVE | RPI_DMA_CS_PRIORITY(8) | RPI_DMA_CS_PANIC_PRIORITY(8) | RPI_DMA_CS_WAIT_FOR_OUTSTANDING_WRITES;
+}
+
+/** Waits for a transfer to finish.
+ * @returns `0` once it has, or `-1` if it failed or took longer than `timeout_us` microseconds (the transfer is aborted).
+ */
+int RPI_DmaWait(int channel, uint32_t timeout_us) {
+    rpi_dma_channel_t* dma = get_channel(channel);
+    uint64_t start = RPI_GetTimerTicks();
+    while(dma->CS & RPI_DMA_CS_ACTIVE) {
+        if(dma->CS & RPI_DMA_CS_ERROR) {
+            log_error("channel %i failed: CS %08X DEBUG %08X", channel, dma->CS, dma->DEBUG);
+            RPI_DmaAbort(channel);
+            return -1;
+        } else if(RPI_TimerTickDifference(start, RPI_GetTimerTicks()) > timeout_us) {
+            log_error("channel %i timed out: CS %08X, %u bytes left", channel, dma->CS, dma->TXFR_LEN);
+            RPI_DmaAbort(channel);
+            return -1;
+        }
+    }
+    if(dma->DEBUG & RPI_DMA_DEBUG_ERRORS) {
+        log_error("channel %i failed: DEBUG %08X", channel, dma->DEBUG);
+        return -1;
+    }
+    return 0;
+}
+
+// stops a transfer and resets the channel
+void RPI_DmaAbort(int channel) {
+    rpi_dma_channel_t* dma = get_channel(channel);
+    dma->CS = 0;    // pause
+    dma->CONBLK_AD = 0;
+    dma->CS = RPI_DMA_CS_ABORT;
+    RPI_WaitMicroseconds(10);
+    dma->CS = RPI_DMA_CS_RESET;
+}
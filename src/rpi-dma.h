@@ -0,0 +1,88 @@
+/* rpi-dma.h © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+ */
+#ifndef RPI_DMA_H
+#define RPI_DMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rpi-base.h"
+
+// DMA controller, from the BCM2835 ARM Peripherals manual (chapter 4)
+#define RPI_DMA_BASE            (PERIPHERAL_BASE + 0x7000)
+#define RPI_DMA_ENABLE          (RPI_DMA_BASE + 0xFF0)
+#define RPI_DMA_CHANNEL_SIZE    0x100
+// channels 0-6 can transfer up to 1 GiB at once, 7-14 are "lite" channels that can only transfer 64 KiB
+#define RPI_DMA_FULL_CHANNELS   7
+
+// CS (control and status) register
+#define RPI_DMA_CS_ACTIVE       (1 << 0)
+#define RPI_DMA_CS_END          (1 << 1)    // write 1 to clear
+#define RPI_DMA_CS_INT          (1 << 2)    // write 1 to clear
+#define RPI_DMA_CS_ERROR        (1 << 8)
+#define RPI_DMA_CS_PRIORITY(x)          ((x) << 16)
+#define RPI_DMA_CS_PANIC_PRIORITY(x)    ((x) << 20)
+#define RPI_DMA_CS_WAIT_FOR_OUTSTANDING_WRITES (1 << 28)
+#define RPI_DMA_CS_ABORT        (1 << 30)
+#define RPI_DMA_CS_RESET        (1u << 31)
+
+// TI (transfer information) field of a control block
+#define RPI_DMA_TI_INTEN        (1 << 0)
+#define RPI_DMA_TI_WAIT_RESP    (1 << 3)    // wait for each write to be acknowledged
+#define RPI_DMA_TI_DEST_INC     (1 << 4)
+#define RPI_DMA_TI_DEST_DREQ    (1 << 6)    // pace writes with the peripheral's data request signal
+#define RPI_DMA_TI_SRC_INC      (1 << 8)
+#define RPI_DMA_TI_SRC_DREQ     (1 << 10)   // pace reads with the peripheral's data request signal
+#define RPI_DMA_TI_PERMAP(x)    ((x) << 16)
+// the peripheral numbers for RPI_DMA_TI_PERMAP
+#define RPI_DMA_PERMAP_EMMC     11
+
+// DEBUG register error flags (write 1 to clear)
+#define RPI_DMA_DEBUG_ERRORS    0x7
+
+// the DMA controller uses VideoCore bus addresses, not ARM physical addresses
+#define RPI_DMA_BUS_PERIPHERAL(address) ((uint32_t)(address) - PERIPHERAL_BASE + 0x7E000000)
+#if defined( RPI0 ) || defined( RPI1 )
+    #define RPI_DMA_BUS_MEMORY(address) ((uint32_t)(address) | 0x40000000)  // the alias that is coherent with the ARM
+#else
+    #define RPI_DMA_BUS_MEMORY(address) ((uint32_t)(address) | 0xC0000000)  // the alias that bypasses the VideoCore's L2 cache
+#endif
+
+typedef struct {
+    rpi_reg_rw_t CS;
+    rpi_reg_rw_t CONBLK_AD;
+    rpi_reg_ro_t TI;
+    rpi_reg_ro_t SOURCE_AD;
+    rpi_reg_ro_t DEST_AD;
+    rpi_reg_ro_t TXFR_LEN;
+    rpi_reg_ro_t STRIDE;
+    rpi_reg_ro_t NEXTCONBK;
+    rpi_reg_rw_t DEBUG;
+} rpi_dma_channel_t;
+
+// describes one transfer, the DMA controller reads it from memory
+typedef struct __attribute__((aligned(32))) {
+    uint32_t transfer_information;  // RPI_DMA_TI_* flags
+    uint32_t source;                // bus address
+    uint32_t destination;           // bus address
+    uint32_t length;                // in bytes
+    uint32_t stride;
+    uint32_t next;                  // bus address of the next control block, or 0 to stop
+    uint32_t reserved[2];
+} rpi_dma_control_block_t;
+
+int RPI_DmaAllocateChannel();
+void RPI_DmaStart(int channel, rpi_dma_control_block_t* block);
+int RPI_DmaWait(int channel, uint32_t timeout_us);
+void RPI_DmaAbort(int channel);
+
+#endif
@@ -173,3 +173,27 @@ int RPI_MemoryEnableMMU() {
   log(LOG_MMU, "MMU configured!");
   return 0;
 }
+
+/* The data cache isn't coherent with DMA transfers, so these are used around them.
+ * They work on whole cache lines, so a buffer that a transfer writes to should start & end on a cache line
+ * boundary, or the other data in its first & last lines could be overwritten. */
+
+// writes back any modified cache lines covering a buffer, so a DMA transfer reading it sees what the CPU wrote
+void RPI_MemoryCleanDataCache(const void* start, uint32_t length) {
+  uintptr_t line = (uintptr_t)start & ~(MEMORY_CACHE_LINE_SIZE - 1);
+  uintptr_t end = (uintptr_t)start + length;
+  for(; line < end; line += MEMORY_CACHE_LINE_SIZE) {
+    asm volatile ("mcr p15, 0, %0, c7, c10, 1" : : "r" (line) : "memory");  // DCCMVAC: clean by address to the point of coherency
+  }
+  asm volatile ("dsb" : : : "memory");
+}
+
+// writes back & then discards the cache lines covering a buffer, so the CPU reads what a DMA transfer wrote to it
+void RPI_MemoryCleanInvalidateDataCache(void* start, uint32_t length) {
+  uintptr_t line = (uintptr_t)start & ~(MEMORY_CACHE_LINE_SIZE - 1);
+  uintptr_t end = (uintptr_t)start + length;
+  for(; line < end; line += MEMORY_CACHE_LINE_SIZE) {
+    asm volatile ("mcr p15, 0, %0, c7, c14, 1" : : "r" (line) : "memory");  // DCCIMVAC: clean & invalidate by address to the point of coherency
+  }
+  asm volatile ("dsb" : : : "memory");
+}
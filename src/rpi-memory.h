@@ -19,6 +19,11 @@
 #define MEMORY_SECTION_DEVICE    0x10416   // shared device
 #define MEMORY_SECTION_COHERENT  0x10412   // strongly ordered
 
+// the size of a line of the Cortex-A53's data cache, buffers that DMA transfers write to should be aligned to this
+#define MEMORY_CACHE_LINE_SIZE   64
+
 int RPI_MemoryEnableMMU();
+void RPI_MemoryCleanDataCache(const void* start, uint32_t length);
+void RPI_MemoryCleanInvalidateDataCache(void* start, uint32_t length);
 
 #endif
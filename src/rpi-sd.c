@@ -3,9 +3,16 @@
 #include <ctype.h>								// Needed for toupper for wildcard string match
 #include <wchar.h>								// Needed for UTF for long file name support
 #include <string.h>								// Needed for string copy
+#ifdef __ARM_NEON
+#include <arm_neon.h>							// Needed for NEON copies to/from the bounce buffer
+#endif
 
 #include "rpi-sd.h"								// This units header
 #include "rpi-systimer.h"
+#include "rpi-dma.h"
+#include "rpi-memory.h"
+#include "rpi-interrupts.h"
+#include "rpi-mailbox-interface.h"
 
 #include "rpi-base.h"
 #define RPi_IO_Base_Addr PERIPHERAL_BASE
@@ -533,6 +540,8 @@ static_assert(sizeof(struct regCID) == 0x10, "EMMC register CID should be 0x10 b
 {--------------------------------------------------------------------------*/
 #define FREQ_SETUP				400000  // 400 Khz
 #define FREQ_NORMAL			  25000000  // 25 Mhz
+#define FREQ_HIGH			  50000000  // 50 Mhz, needs high speed mode (CMD6)
+#define FREQ_BASE_DEFAULT	  41666667  // Used if the firmware doesn't report the EMMC clock
 
 /*--------------------------------------------------------------------------}
 {						  CMD 41 BIT SELECTIONS							    }
@@ -613,7 +622,8 @@ static EMMCCommand sdCommandTable[IX_SEND_SCR + 1] =  {
 	[IX_ALL_SEND_CID] =		{ "ALL_SEND_CID" , .code.CMD_INDEX = 0x02, .code.CMD_RSPNS_TYPE = CMD_136BIT_RESP    , .use_rca = 0 , .delay = 0},
 	[IX_SEND_REL_ADDR] =	{ "SEND_REL_ADDR", .code.CMD_INDEX = 0x03, .code.CMD_RSPNS_TYPE = CMD_48BIT_RESP     , .use_rca = 0 , .delay = 0},
 	[IX_SET_DSR] =			{ "SET_DSR"      , .code.CMD_INDEX = 0x04, .code.CMD_RSPNS_TYPE = CMD_NO_RESP        , .use_rca = 0 , .delay = 0},
-	[IX_SWITCH_FUNC] =		{ "SWITCH_FUNC"  , .code.CMD_INDEX = 0x06, .code.CMD_RSPNS_TYPE = CMD_48BIT_RESP     , .use_rca = 0 , .delay = 0},
+	[IX_SWITCH_FUNC] =		{ "SWITCH_FUNC"  , .code.CMD_INDEX = 0x06, .code.CMD_RSPNS_TYPE = CMD_48BIT_RESP     ,
+											   .code.CMD_ISDATA = 1  , .code.TM_DAT_DIR = 1,					   .use_rca = 0 , .delay = 0},
 	[IX_CARD_SELECT] =		{ "CARD_SELECT"  , .code.CMD_INDEX = 0x07, .code.CMD_RSPNS_TYPE = CMD_BUSY48BIT_RESP , .use_rca = 1 , .delay = 0},
 	[IX_SEND_IF_COND] = 	{ "SEND_IF_COND" , .code.CMD_INDEX = 0x08, .code.CMD_RSPNS_TYPE = CMD_48BIT_RESP     , .use_rca = 0 , .delay = 100},
 	[IX_SEND_CSD] =			{ "SEND_CSD"     , .code.CMD_INDEX = 0x09, .code.CMD_RSPNS_TYPE = CMD_136BIT_RESP    , .use_rca = 1 , .delay = 0},
@@ -681,6 +691,108 @@ typedef struct SDDescriptor {
 {					    CURRENT SD CARD DATA STORAGE					    }
 {--------------------------------------------------------------------------*/
 static SDDescriptor sdCard = { 0 };
+static uint32_t sdBaseClock = 0;									// EMMC base clock in Hz, 0 until asked for
+static uint32_t sdClockFreq = 0;									// SD clock in Hz the divider last set gives
+
+/*--------------------------------------------------------------------------}
+{						  EMMC INTERRUPT DATA STORAGE						}
+{--------------------------------------------------------------------------*/
+#define EMMC_IRQ			62										// IRQ 30 of the second GPU bank, the Arasan controller
+#define CPSR_IRQ_DISABLE	0x80									// The I bit of the CPSR
+#define INT_DATA_ERROR_MASK (INT_DATA_TIMEOUT|INT_DATA_CRC_ERR|INT_DATA_END_ERR)
+#define INT_IRQ_MASK		(INT_CMD_DONE|INT_DATA_DONE|INT_ERROR_MASK)	// Interrupts that are always sent to the ARM
+
+static bool sdIrqConnected = false;									// Set once sdInterruptHandler is connected
+static volatile uint32_t sdInterrupts = 0;							// Flags the handler took out of EMMC_INTERRUPT
+
+/*-[INTERNAL: sdDisableIrq]-------------------------------------------------}
+. Masks IRQs so the interrupt handler can't run, for the short sections that
+. read and change sdInterrupts or the request state.
+. RETURN: the CPSR from before, to give to sdRestoreIrq
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static inline uint32_t sdDisableIrq (void)
+{
+	uint32_t cpsr;
+	__asm__ volatile ("mrs %0, cpsr\n\tcpsid i" : "=r" (cpsr) : : "memory");
+	return cpsr;
+}
+
+static inline void sdRestoreIrq (uint32_t cpsr)
+{
+	__asm__ volatile ("msr cpsr_c, %0" : : "r" (cpsr) : "memory");
+}
+
+/*-[INTERNAL: sdReadInterrupts]---------------------------------------------}
+. Returns the interrupt flags that are set, whether they're still in the
+. EMMC_INTERRUPT register or were already collected by the handler.
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static uint32_t sdReadInterrupts (void)
+{
+	return sdInterrupts | EMMC_INTERRUPT->Raw32;
+}
+
+/*-[INTERNAL: sdClearInterrupts]--------------------------------------------}
+. Clears the interrupt flags in the mask, both in the register and the ones
+. collected by the handler.
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static void sdClearInterrupts (uint32_t mask)
+{
+	uint32_t cpsr = sdDisableIrq();
+	EMMC_INTERRUPT->Raw32 = mask;									// Clear them in the register
+	sdInterrupts &= ~mask;											// and the ones the handler collected
+	sdRestoreIrq(cpsr);
+}
+
+/*-[INTERNAL: sdWaitUntil]--------------------------------------------------}
+. Waits for up to timeout microseconds for the condition to be true. Each
+. condition waited for here is signalled by an EMMC interrupt, so once the
+. handler is connected the core sleeps with WFI between checks instead of
+. spinning. The check and the WFI are done with IRQs masked so an interrupt
+. arriving between them still wakes the core. It spins if the caller has
+. IRQs masked.
+. RETURN: true if the condition became true, false if it timed out
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+typedef bool (*sdCondition) (uint32_t arg);
+
+static bool sdWaitUntil (sdCondition condition, uint32_t arg, uint32_t timeout)
+{
+	uint64_t start_time = TICKCOUNT();								// Get start time
+	while (true) {
+		uint32_t cpsr = sdDisableIrq();
+		bool done = condition(arg);
+		if (!done && sdIrqConnected && !(cpsr & CPSR_IRQ_DISABLE))
+			__asm__ volatile ("wfi");								// A pending IRQ wakes the core even while masked
+		sdRestoreIrq(cpsr);											// and is handled here
+		if (done) return true;
+		if (TIMEDIFF(start_time, TICKCOUNT()) >= timeout) {			// Timeout reached, check one last time
+			cpsr = sdDisableIrq();
+			done = condition(arg);
+			sdRestoreIrq(cpsr);
+			return done;
+		}
+	}
+}
+
+static bool sdInterruptRaised (uint32_t mask)
+{
+	return (sdReadInterrupts() & mask) != 0;
+}
+
+static bool sdCommandIdle (uint32_t unused)
+{
+	(void)unused;
+	return !EMMC_STATUS->CMD_INHIBIT || (sdReadInterrupts() & INT_ERROR_MASK);
+}
+
+static bool sdDataIdle (uint32_t unused)
+{
+	(void)unused;
+	return !EMMC_STATUS->DAT_INHIBIT || (sdReadInterrupts() & INT_ERROR_MASK);
+}
 
 
 //**************************************************************************
@@ -691,7 +803,7 @@ static int sdDebugResponse( int resp )
 {
 	log_debug("Status: %08x, control1: %08x, interrupt: %08x",
 		(unsigned int)EMMC_STATUS->Raw32, (unsigned int)EMMC_CONTROL1->Raw32,
-		(unsigned int)EMMC_INTERRUPT->Raw32);
+		(unsigned int)sdReadInterrupts());
 	log_debug("Command %s resp %08x: %08x %08x %08x %08x",
 		sdCard.lastCmd->cmd_name, (unsigned int)resp,(unsigned int)*EMMC_RESP3,
 		(unsigned int)*EMMC_RESP2, (unsigned int)*EMMC_RESP1,
@@ -700,8 +812,8 @@ static int sdDebugResponse( int resp )
 }
 
 /*-[INTERNAL: sdWaitForInterrupt]-------------------------------------------}
-. Given an interrupt mask the routine loops polling for the condition for up
-. to 1 second.
+. Given an interrupt mask the routine waits for the condition for up to 1
+. second, sleeping until the EMMC interrupt fires if it's connected.
 . RETURN: SD_TIMEOUT - the condition mask flags where not met in 1 second
 .		  SD_ERROR - an identifiable error occurred
 .		  SD_OK - the wait completed with a mask state as requested
@@ -709,15 +821,13 @@ static int sdDebugResponse( int resp )
 .--------------------------------------------------------------------------*/
 static SDRESULT sdWaitForInterrupt (uint32_t mask )
 {
-	uint64_t td = 0;												// Zero time difference
-	uint64_t start_time = 0;										// Zero start time
 	uint32_t tMask = mask | INT_ERROR_MASK;							// Add fatal error masks to mask provided
-	while (!(EMMC_INTERRUPT->Raw32 & tMask) && (td < 1000000)) {
-		if (!start_time) start_time = TICKCOUNT();					// If start time not set the set start time
-			else td = TIMEDIFF(start_time, TICKCOUNT());			// Time difference between start time and now
-	}
-	uint32_t ival = EMMC_INTERRUPT->Raw32;							// Fetch all the interrupt flags
-	if( td >= 1000000 ||											// No reponse timeout occurred
+	uint32_t enabled = EMMC_IRPT_EN->Raw32;
+	EMMC_IRPT_EN->Raw32 = enabled | tMask;							// Whatever is waited for must wake the core
+	bool raised = sdWaitUntil(sdInterruptRaised, tMask, 1000000);
+	EMMC_IRPT_EN->Raw32 = enabled;
+	uint32_t ival = sdReadInterrupts();								// Fetch all the interrupt flags
+	if( !raised ||													// No reponse timeout occurred
 		(ival & INT_CMD_TIMEOUT) ||									// Command timeout occurred
 		(ival & INT_DATA_TIMEOUT) )									// Data timeout occurred
 	{
@@ -726,7 +836,7 @@ static SDRESULT sdWaitForInterrupt (uint32_t mask )
 			(unsigned int)ival, (unsigned int)*EMMC_RESP0);			// Log any error if requested
 
 		// Clear the interrupt register completely.
-		EMMC_INTERRUPT->Raw32 = ival;								// Clear any interrupt that occured
+		sdClearInterrupts(ival);									// Clear any interrupt that occured
 
 		return SD_TIMEOUT;											// Return SD_TIMEOUT
 	} else if ( ival & INT_ERROR_MASK ) {
@@ -735,13 +845,13 @@ static SDRESULT sdWaitForInterrupt (uint32_t mask )
 			(unsigned int)*EMMC_RESP0);								// Log any error if requested
 
 		// Clear the interrupt register completely.
-		EMMC_INTERRUPT->Raw32 = ival;								// Clear any interrupt that occured
+		sdClearInterrupts(ival);									// Clear any interrupt that occured
 
 		return SD_ERROR;											// Return SD_ERROR
     }
 
 	// Clear the interrupt we were waiting for, leaving any other (non-error) interrupts.
-	EMMC_INTERRUPT->Raw32 = mask;									// Clear any interrupt we are waiting on
+	sdClearInterrupts(mask);										// Clear any interrupt we are waiting on
 
 	return SD_OK;													// Return SD_OK
 }
@@ -755,19 +865,11 @@ static SDRESULT sdWaitForInterrupt (uint32_t mask )
 .--------------------------------------------------------------------------*/
 static SDRESULT sdWaitForCommand (void)
 {
-	uint64_t td = 0;												// Zero time difference
-	uint64_t start_time = 0;										// Zero start time
-	while ((EMMC_STATUS->CMD_INHIBIT) &&							// Command inhibit signal
-		  !(EMMC_INTERRUPT->Raw32 & INT_ERROR_MASK) &&				// No error occurred
-		   (td < 1000000))											// Timeout not reached
-	{
-		if (!start_time) start_time = TICKCOUNT();					// Get start time
-			else td = TIMEDIFF(start_time, TICKCOUNT());			// Time difference between start and now
-	}
-	if( (td >= 1000000) || (EMMC_INTERRUPT->Raw32 & INT_ERROR_MASK) )// Error occurred or it timed out
+	if( !sdWaitUntil(sdCommandIdle, 0, 1000000) ||					// Timeout reached
+		(sdReadInterrupts() & INT_ERROR_MASK) )						// Error occurred
     {
 		log_error("Wait for command aborted: %08x %08x %08x",
-			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)EMMC_INTERRUPT->Raw32,
+			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)sdReadInterrupts(),
 			(unsigned int)*EMMC_RESP0);								// Log any error if requested
 		return SD_BUSY;												// return SD_BUSY
     }
@@ -784,19 +886,11 @@ static SDRESULT sdWaitForCommand (void)
 .--------------------------------------------------------------------------*/
 static SDRESULT sdWaitForData (void)
 {
-	uint64_t td = 0;												// Zero time difference
-	uint64_t start_time = 0;										// Zero start time
-	while ((EMMC_STATUS->DAT_INHIBIT) &&							// Data inhibit signal
-		  !(EMMC_INTERRUPT->Raw32 & INT_ERROR_MASK) &&				// Some error occurred
-		   (td < 500000))											// Timeout not reached
-	{
-		if (!start_time) start_time = TICKCOUNT();					// If start time not set the set start time
-			else td = TIMEDIFF(start_time, TICKCOUNT());			// Time difference between start time and now
-	}
-	if ( (td >= 500000) || (EMMC_INTERRUPT->Raw32 & INT_ERROR_MASK) )
+	if ( !sdWaitUntil(sdDataIdle, 0, 500000) ||						// Timeout reached
+		(sdReadInterrupts() & INT_ERROR_MASK) )						// Some error occurred
     {
 		log_error("Wait for data aborted: %08x %08x %08x",
-			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)EMMC_INTERRUPT->Raw32,
+			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)sdReadInterrupts(),
 			(unsigned int)*EMMC_RESP0);								// Log any error if requested
 		return SD_BUSY;												// return SD_BUSY
     }
@@ -923,7 +1017,7 @@ static int sdSendCommandP( EMMCCommand* cmd, uint32_t arg )
 	sdCard.lastCmd = cmd;
 
 	/* Clear interrupt flags.  This is done by setting the ones that are currently set */
-	EMMC_INTERRUPT->Raw32 = EMMC_INTERRUPT->Raw32;					// Clear interrupts
+	sdClearInterrupts(sdReadInterrupts());							// Clear interrupts
 
 	/* Set the argument and the command code, Some commands require a delay before reading the response */
 	*EMMC_ARG1 = arg;												// Set argument to SD card
@@ -1115,7 +1209,7 @@ static SDRESULT sdReadSCR (void)
 	{
 		log_error("SEND_SCR ERR: %08x %08x %08x",
 			(unsigned int)EMMC_STATUS->Raw32,
-			(unsigned int)EMMC_INTERRUPT->Raw32,
+			(unsigned int)sdReadInterrupts(),
 			(unsigned int)*EMMC_RESP0);
 		log_error("Reading SCR, only read %d words", numRead);
 		return SD_TIMEOUT;
@@ -1158,28 +1252,50 @@ static uint_fast8_t fls_uint32_t (uint32_t x)
 	return r;														// Return the number of the uppermost set bit
 }
 
+/*-[INTERNAL: sdGetBaseClock]---------------------------------------------}
+. Get the EMMC base clock from the firmware. The firmware can run it at any
+. rate (config.txt), so it is asked once rather than assumed.
+. RETURN: The base clock in Hz, FREQ_BASE_DEFAULT if the firmware didn't say
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static uint32_t sdGetBaseClock (void)
+{
+	if (sdBaseClock) return sdBaseClock;							// Already asked
+	RPI_PropertyInit();
+	RPI_PropertyAddTag(TAG_GET_CLOCK_RATE, TAG_CLOCK_EMMC);
+	RPI_PropertyProcess();
+	rpi_mailbox_property_t* mp = RPI_PropertyGet(TAG_GET_CLOCK_RATE);
+	sdBaseClock = (mp != NULL && mp->data.buffer_32[1] > 0) ? (uint32_t)mp->data.buffer_32[1] : FREQ_BASE_DEFAULT;
+	log_debug("Base clock = %i", (int)sdBaseClock);
+	return sdBaseClock;
+}
+
 /*-[INTERNAL: sdGetClockDivider]--------------------------------------------}
-. Get clock divider for the given requested frequency. This is calculated
-. relative to the SD base clock of 41.66667Mhz
-. RETURN: 3 - 0x3FF are only possible answers for the divisor
+. Get clock divider for the given requested frequency. The SD clock is the
+. base clock / (2 * divisor), or the base clock itself for a divisor of 0.
+. The divisor is rounded up so the card is never clocked faster than asked.
+. RETURN: 0 - 0x3FF are only possible answers for the divisor
 . 10Aug17 LdB
 .--------------------------------------------------------------------------*/
 static uint32_t sdGetClockDivider (uint32_t freq)
 {
-	uint32_t divisor = (41666667 + freq - 1) / freq;				// Pi SD frequency is always 41.66667Mhz on baremetal
-	if (divisor > 0x3FF) divisor = 0x3FF;							// Constrain divisor to max 0x3FF
-	if (EMMC_SLOTISR_VER->SDVERSION < 2) {							// Any version less than HOST SPECIFICATION 3 (Aka numeric 2)
-		uint_fast8_t shiftcount = fls_uint32_t(divisor);			// Only 8 bits and set pwr2 div on Hosts specs 1 & 2
-		if (shiftcount > 0) shiftcount--;							// Note the offset of shift by 1 (look at the spec)
-		if (shiftcount > 7) shiftcount = 7;							// It's only 8 bits maximum on HOST_SPEC_V2
-		divisor = ((uint32_t)1 << shiftcount);						// Version 1,2 take power 2
-	} else if (divisor < 3) divisor = 4;							// Set minimum divisor limit
-	log_debug("Divisor = %i, Freq Set = %i", (int)divisor, (int)(41666667/divisor));
+	uint32_t base = sdGetBaseClock();
+	uint32_t divisor = 0;											// Run at the base clock if it's slow enough
+	if (freq < base) {
+		divisor = (base + 2 * freq - 1) / (2 * freq);				// Smallest divisor that doesn't go over freq
+		if (EMMC_SLOTISR_VER->SDVERSION < 2) {						// Any version less than HOST SPECIFICATION 3 (Aka numeric 2)
+			uint_fast8_t shiftcount = fls_uint32_t(divisor - 1);	// Only 8 bits and set pwr2 div on Hosts specs 1 & 2
+			if (shiftcount > 7) shiftcount = 7;						// It's only 8 bits maximum on HOST_SPEC_V2
+			divisor = ((uint32_t)1 << shiftcount);					// Version 1,2 take power 2
+		} else if (divisor > 0x3FF) divisor = 0x3FF;				// Constrain divisor to max 0x3FF
+	}
+	sdClockFreq = divisor ? base / (2 * divisor) : base;			// What the card will actually be clocked at
+	log_debug("Divisor = %i, Freq Set = %i", (int)divisor, (int)sdClockFreq);
 	return divisor;													// Return divisor that would be required
 }
 
 /*-[INTERNAL: sdGetClockDivider]--------------------------------------------}
-. Set the SD clock to the given frequency from the 41.66667Mhz base clock
+. Set the SD clock to the given frequency from the EMMC base clock
 . RETURN: SD_ERROR_CLOCK - A fatal error occurred setting the clock
 .		  SD_OK - the clock change to given frequency
 . 10Aug17 LdB
@@ -1233,6 +1349,96 @@ static SDRESULT sdSetClock (uint32_t freq)
 	return SD_OK;													// Clock frequency set worked
 }
 
+/*-[INTERNAL: sdSwitchFunction]---------------------------------------------}
+. Sends SWITCH_FUNC (CMD6) with the given argument and reads the 512 bit
+. switch status the card replies with. The status is big endian, so bit 511
+. is the top bit of status[0].
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static SDRESULT sdSwitchFunction (uint32_t arg, uint8_t status[64])
+{
+	// SWITCH_FUNC is like a READ_SINGLE but for a block of 64 bytes.
+	if( sdWaitForData() ) return SD_TIMEOUT;
+
+	EMMC_BLKSIZECNT->BLKCNT = 1;
+	EMMC_BLKSIZECNT->BLKSIZE = 64;
+	int resp;
+	if( (resp = sdSendCommandA(IX_SWITCH_FUNC, arg)) ) return sdDebugResponse(resp);
+
+	// Wait for READ_RDY interrupt.
+	if( (resp = sdWaitForInterrupt(INT_READ_RDY)) )
+	{
+		log_error("Timeout waiting for switch status");
+		return sdDebugResponse(resp);
+	}
+
+	// Allow maximum of 100ms for the read operation.
+	int numRead = 0, count = 100000;
+	while( numRead < 16 )  {
+		if (EMMC_STATUS->READ_TRANSFER) {
+			uint32_t data = *EMMC_DATA;								// Bytes arrive in order, lowest byte first
+			memcpy(&status[numRead * 4], &data, 4);
+			numRead++;
+		} else {
+			waitMicro(1);
+			if( --count == 0 ) break;
+		}
+	}
+	if( numRead != 16 )
+	{
+		log_error("Reading switch status, only read %d words", numRead);
+		return SD_TIMEOUT;
+	}
+	return SD_OK;
+}
+
+/*-[INTERNAL: sdEnableHighSpeed]--------------------------------------------}
+. Switches the card to high speed timing (function 1 of function group 1)
+. if it supports it, then the host, and raises the clock to 50Mhz. Cards
+. older than spec 1.10 don't have CMD6 and stay at the default speed.
+. RETURN: SD_OK - the card and host are in high speed mode
+.		  !SD_OK - high speed isn't used, the caller sets the normal clock
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+#define SWITCH_CHECK		0x00FFFFF0								// Mode 0 check, all other groups unchanged (0xF)
+#define SWITCH_SET			0x80FFFFF0								// Mode 1 switch, all other groups unchanged (0xF)
+#define SWITCH_HIGH_SPEED	1										// Function 1 of group 1 (access mode)
+
+static SDRESULT sdEnableHighSpeed (void)
+{
+	if (sdCard.scr.SD_SPEC == SD_SPEC_1_101) return SD_ERROR;		// CMD6 was added in spec 1.10
+
+	// The check returns the max current [511:496] (0 is an error), the functions of
+	// group 1 supported [415:400], and the function group 1 would switch to [379:376].
+	uint8_t status[64];
+	SDRESULT resp;
+	if( (resp = sdSwitchFunction(SWITCH_CHECK | SWITCH_HIGH_SPEED, status)) ) return resp;
+	if( (status[0] == 0 && status[1] == 0) ||
+		!(status[13] & (1 << SWITCH_HIGH_SPEED)) ||
+		(status[16] & 0xF) != SWITCH_HIGH_SPEED )
+	{
+		log_notice("Card doesn't support high speed");
+		return SD_ERROR;
+	}
+
+	if( (resp = sdSwitchFunction(SWITCH_SET | SWITCH_HIGH_SPEED, status)) ) return resp;
+	if( (status[16] & 0xF) != SWITCH_HIGH_SPEED )
+	{
+		log_warn("Card didn't switch to high speed: %02x", status[16]);
+		return SD_ERROR;
+	}
+
+	// The card switches within 8 clocks of sending the status, then the host follows.
+	waitMicro(10);
+	EMMC_CONTROL0->HCTL_HS_EN = 1;
+	if( (resp = sdSetClock(FREQ_HIGH)) )
+	{
+		EMMC_CONTROL0->HCTL_HS_EN = 0;
+		return resp;
+	}
+	return SD_OK;
+}
+
 /*-[INTERNAL: sdResetCard]--------------------------------------------------}
 . Reset the SD Card
 . RETURN: SD_ERROR_RESET - A fatal error occurred resetting the SD Card
@@ -1327,18 +1533,162 @@ static SDRESULT sdAppSendOpCond (uint32_t arg )
 	return SD_OK;
 }
 
-/*-[sdTransferBlocks]-------------------------------------------------------}
-. Transfer the count blocks starting at given block to/from SD Card.
-. 21Aug17 LdB
+/*-[INTERNAL: sdStartDma]--------------------------------------------------}
+. Sets up the DMA controller to move a transfer's blocks between the buffer
+. and the EMMC data register, paced by the EMMC's data requests. The buffer
+. must be cache line aligned, so its cache lines hold nothing else.
+. Penguin_Spy 2024
 .--------------------------------------------------------------------------*/
-SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buffer, bool write )
+static int sdDmaChannel = -1;										// -1 until a channel is allocated, or if there isn't one
+static rpi_dma_control_block_t sdDmaBlock;
+#define SD_BOUNCE_BLOCKS 64											// 32KB, transfers to/from unaligned buffers are split into chunks this big
+static uint8_t sdBounceBuffer[SD_BOUNCE_BLOCKS * 512] __attribute__((aligned(MEMORY_CACHE_LINE_SIZE)));
+
+static void sdStartDma (uint32_t numBlocks, uint8_t* buffer, bool write)
+{
+	uint32_t length = numBlocks * 512;
+	if (write) {
+		RPI_MemoryCleanDataCache(buffer, length);					// The DMA controller reads memory, not the cache
+		sdDmaBlock.transfer_information = RPI_DMA_TI_SRC_INC | RPI_DMA_TI_DEST_DREQ | RPI_DMA_TI_WAIT_RESP | RPI_DMA_TI_PERMAP(RPI_DMA_PERMAP_EMMC);
+		sdDmaBlock.source = RPI_DMA_BUS_MEMORY(buffer);
+		sdDmaBlock.destination = RPI_DMA_BUS_PERIPHERAL(EMMC_DATA);
+	} else {
+		RPI_MemoryCleanInvalidateDataCache(buffer, length);		// Nothing modified may be written back over the data
+		sdDmaBlock.transfer_information = RPI_DMA_TI_DEST_INC | RPI_DMA_TI_SRC_DREQ | RPI_DMA_TI_WAIT_RESP | RPI_DMA_TI_PERMAP(RPI_DMA_PERMAP_EMMC);
+		sdDmaBlock.source = RPI_DMA_BUS_PERIPHERAL(EMMC_DATA);
+		sdDmaBlock.destination = RPI_DMA_BUS_MEMORY(buffer);
+	}
+	sdDmaBlock.length = length;
+	sdDmaBlock.stride = 0;
+	sdDmaBlock.next = 0;
+	RPI_DmaStart(sdDmaChannel, &sdDmaBlock);
+}
+
+/*--------------------------------------------------------------------------}
+{						  SD REQUEST STATE DATA STORAGE						}
+{--------------------------------------------------------------------------*/
+typedef enum {
+	SD_REQUEST_IDLE = 0,											// No DMA transfer is in progress
+	SD_REQUEST_DATA = 1,											// The command was accepted, blocks are moving
+	SD_REQUEST_ENDED = 2,											// The card signalled the end of the data, sdWaitForRequest finishes it
+} SDREQUESTSTATE;
+
+static struct {
+	volatile SDREQUESTSTATE state;									// Changed by the interrupt handler
+	uint32_t numBlocks;
+	uint8_t* buffer;
+	bool write;
+	bool stopNeeded;												// A failed multi block transfer must be stopped before the next command
+	volatile uint32_t endFlags;										// The interrupt flags that ended the data
+	SDRESULT result;												// Result of the last request once it is idle
+} sdRequest = { 0 };
+
+/*-[INTERNAL: sdPollRequest]------------------------------------------------}
+. Marks the request in progress as ended if the card has signalled the end of
+. its data (or a data error), keeping the flags for sdWaitForRequest. Nothing
+. slow is done here as it runs from the interrupt handler. Must be called with
+. IRQs masked (the interrupt handler is).
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static void sdPollRequest (void)
+{
+	if (sdRequest.state != SD_REQUEST_DATA) return;					// Nothing in progress
+	uint32_t ival = sdReadInterrupts();
+	if (!(ival & (INT_DATA_DONE | INT_DATA_ERROR_MASK))) return;	// Still moving
+
+	sdClearInterrupts(INT_DATA_DONE | INT_READ_RDY | INT_WRITE_RDY | (ival & INT_DATA_ERROR_MASK));
+	sdRequest.endFlags = ival;
+	sdRequest.state = SD_REQUEST_ENDED;
+}
+
+/*-[INTERNAL: sdInterruptHandler]-------------------------------------------}
+. Handles the EMMC interrupt: the flags are moved out of the register (which
+. clears the interrupt) into sdInterrupts for the wait routines, and the
+. request in progress is marked ended if its data is done.
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static void sdInterruptHandler (void* param)
+{
+	(void)param;
+	uint32_t ival = EMMC_INTERRUPT->Raw32;
+	EMMC_INTERRUPT->Raw32 = ival;									// Acknowledge the flags that are set
+	sdInterrupts |= ival;
+	sdPollRequest();
+}
+
+static bool sdRequestEnded (uint32_t unused)
+{
+	(void)unused;
+	sdPollRequest();												// The handler may not be connected, or IRQs may be masked
+	return sdRequest.state != SD_REQUEST_DATA;
+}
+
+/*-[INTERNAL: sdWaitForRequest]---------------------------------------------}
+. Waits for the request in progress (if there is one) to end, sleeping until
+. the EMMC interrupt marks it ended, then finishes it: reads wait a moment for
+. the DMA controller to empty the FIFO, then drop the cache lines loaded
+. during the transfer. A request that takes longer than 1 second plus 100us
+. per block (a slow card at 5MB/s) is aborted. A failed multi block transfer
+. is stopped here, so no command is sent from the IRQ.
+. RETURN: the result of the request (SD_OK, SD_TIMEOUT or SD_ERROR), or of
+.		  the last one if none is in progress
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static SDRESULT sdWaitForRequest (void)
+{
+	if (sdRequest.state == SD_REQUEST_IDLE) return sdRequest.result;
+
+	bool timedOut = false;
+	if (!sdWaitUntil(sdRequestEnded, 0, 1000000 + sdRequest.numBlocks * 100)) {
+		uint32_t cpsr = sdDisableIrq();
+		timedOut = sdRequest.state == SD_REQUEST_DATA;				// Still not done after re-checking
+		if (timedOut) sdRequest.state = SD_REQUEST_IDLE;
+		sdRestoreIrq(cpsr);
+	}
+
+	uint32_t ival = sdRequest.endFlags;
+	if (timedOut) {
+		log_error("Transfer of %d blocks timed out: %08x %08x",
+			(int)sdRequest.numBlocks, (unsigned int)EMMC_STATUS->Raw32, (unsigned int)sdReadInterrupts());
+		RPI_DmaAbort(sdDmaChannel);
+		sdRequest.stopNeeded = sdRequest.numBlocks > 1;
+		sdRequest.result = SD_TIMEOUT;
+	} else if (ival & INT_DATA_ERROR_MASK) {
+		log_error("Data error in transfer of %d blocks: %08x",
+			(int)sdRequest.numBlocks, (unsigned int)ival);
+		RPI_DmaAbort(sdDmaChannel);
+		sdRequest.stopNeeded = sdRequest.numBlocks > 1;				// The card may still be sending or receiving
+		sdRequest.result = (ival & INT_DATA_TIMEOUT) ? SD_TIMEOUT : SD_ERROR;
+	} else if (RPI_DmaWait(sdDmaChannel, 1000) != 0) {				// The last words may still be in the FIFO
+		sdRequest.result = SD_TIMEOUT;
+	} else {
+		sdRequest.result = SD_OK;
+	}
+	if (!sdRequest.write)
+		RPI_MemoryCleanInvalidateDataCache(sdRequest.buffer, sdRequest.numBlocks * 512);	// Drop lines speculatively loaded during the transfer
+	sdRequest.state = SD_REQUEST_IDLE;
+
+	if (sdRequest.stopNeeded) {
+		sdRequest.stopNeeded = false;
+		SDRESULT resp = sdSendCommand(IX_STOP_TRANS);
+		if (resp) log_debug("Error response from stop transmission: %d", resp);
+	}
+	return sdRequest.result;
+}
+
+/*-[INTERNAL: sdStartTransfer]----------------------------------------------}
+. Sends the commands for a transfer of blocks to/from the SD Card. With DMA
+. the blocks then move on their own, the EMMC interrupt marks the request
+. ended, and sdWaitForRequest finishes it. Without DMA the caller moves the
+. blocks.
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static SDRESULT sdStartTransfer (uint32_t startBlock, uint32_t numBlocks, uint8_t* buffer, bool write,
+	bool useDma)
 {
 	if ( sdCard.type == SD_TYPE_UNKNOWN ) return SD_NO_RESP;		// If card not known return error
 	if ( sdWaitForData() ) return SD_TIMEOUT;						// Ensure any data operation has completed before doing the transfer.
 
-	// Work out the status, interrupt and command values for the transfer.
-	int readyInt = write ? INT_WRITE_RDY : INT_READ_RDY;
-
 	int transferCmd = write ? ( numBlocks == 1 ? IX_WRITE_SINGLE : IX_WRITE_MULTI) :
 							( numBlocks == 1 ? IX_READ_SINGLE : IX_READ_MULTI);
 
@@ -1361,13 +1711,51 @@ SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buf
 	// TODO: TM_AUTO_CMD12 - is this needed?  What effect does it have?
 	EMMC_BLKSIZECNT->BLKCNT = numBlocks;
 	EMMC_BLKSIZECNT->BLKSIZE = 512;
+
+	// The DMA controller waits for the EMMC's data requests, so it's started before the command.
+	if (useDma) sdStartDma(numBlocks, buffer, write);
+
 	if ((resp = sdSendCommandA(transferCmd, blockAddress))) {
+		if (useDma) RPI_DmaAbort(sdDmaChannel);
 		return sdDebugResponse(resp);
 	}
 
+	if (useDma) {
+		uint32_t cpsr = sdDisableIrq();
+		sdRequest.numBlocks = numBlocks;
+		sdRequest.buffer = buffer;
+		sdRequest.write = write;
+		sdRequest.result = SD_OK;
+		sdRequest.endFlags = 0;
+		sdRequest.state = SD_REQUEST_DATA;
+		sdPollRequest();											// A short transfer may already be done
+		sdRestoreIrq(cpsr);
+	}
+	return SD_OK;
+}
+
+/*-[INTERNAL: sdTransferDirect]---------------------------------------------}
+. Transfer the count blocks starting at given block to/from SD Card, straight
+. to/from the buffer, which must be at least word aligned. Cache line aligned
+. buffers are moved by DMA while the core sleeps until the EMMC interrupt
+. completes the transfer.
+. 21Aug17 LdB
+.--------------------------------------------------------------------------*/
+static SDRESULT sdTransferDirect (uint32_t startBlock, uint32_t numBlocks, uint8_t* buffer, bool write )
+{
+	// Cache line aligned buffers are moved by the DMA controller. Others are moved a word at a time below.
+	bool useDma = sdDmaChannel >= 0 && ((uintptr_t)buffer & (MEMORY_CACHE_LINE_SIZE - 1)) == 0;
+
+	SDRESULT resp;
+	if ( (resp = sdStartTransfer(startBlock, numBlocks, buffer, write, useDma)) ) return resp;
+
+	// Work out the ready interrupt for the transfer.
+	int readyInt = write ? INT_WRITE_RDY : INT_READ_RDY;
+
 	// Transfer all blocks.
 	uint_fast32_t blocksDone = 0;
-	while ( blocksDone < numBlocks )
+	if ( useDma && sdWaitForRequest() == SD_OK ) blocksDone = numBlocks;
+	while ( !useDma && blocksDone < numBlocks )
     {
 		// Wait for ready interrupt for the next block.
 		if( (resp = sdWaitForInterrupt(readyInt)) )
@@ -1376,33 +1764,12 @@ SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buf
 			return sdDebugResponse(resp);
 		}
 
-		// Handle non-word-aligned buffers byte-by-byte.
+		// Move the block a word at a time (unaligned buffers were staged through sdBounceBuffer).
 		// Note: the entire block is sent without looking at status registers.
-		if ((uintptr_t)buffer & 0x03) {
-			for (uint_fast16_t i = 0; i < 512; i++ ) {
-				if ( write ) {
-					uint32_t data = (buffer[i]      );
-					data |=    (buffer[i+1] << 8 );
-					data |=    (buffer[i+2] << 16);
-					data |=    (buffer[i+3] << 24);
-					*EMMC_DATA = data;
-				} else {
-					uint32_t data = *EMMC_DATA;
-					buffer[i] =   (data      ) & 0xff;
-					buffer[i+1] = (data >> 8 ) & 0xff;
-					buffer[i+2] = (data >> 16) & 0xff;
-					buffer[i+3] = (data >> 24) & 0xff;
-				}
-			}
-		}
-	    // Handle word-aligned buffers more efficiently.
-		// Hopefully people smart enough to privide aligned data buffer
-		else {
-			uint32_t* intbuff = (uint32_t*)buffer;
-			for (uint_fast16_t i = 0; i < 128; i++ ) {
-				if ( write ) *EMMC_DATA = intbuff[i];
-					else intbuff[i] = *EMMC_DATA;
-			}
+		uint32_t* intbuff = (uint32_t*)buffer;
+		for (uint_fast16_t i = 0; i < 128; i++ ) {
+			if ( write ) *EMMC_DATA = intbuff[i];
+				else intbuff[i] = *EMMC_DATA;
 		}
 
 		blocksDone++;
@@ -1413,16 +1780,17 @@ SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buf
 	if( blocksDone != numBlocks ) {
 		log_error("Transfer error only done %d/%d blocks",blocksDone,numBlocks);
 		log_debug("Transfer: %08x %08x %08x %08x", (unsigned int)EMMC_STATUS->Raw32,
-			(unsigned int)EMMC_INTERRUPT->Raw32, (unsigned int)*EMMC_RESP0,
+			(unsigned int)sdReadInterrupts(), (unsigned int)*EMMC_RESP0,
 			(unsigned int)EMMC_BLKSIZECNT->Raw32);
-		if( !write && numBlocks > 1 && (resp = sdSendCommand(IX_STOP_TRANS)) )
+		if( !useDma && !write && numBlocks > 1 && (resp = sdSendCommand(IX_STOP_TRANS)) )
 			log_debug("Error response from stop transmission: %d",resp);
 
 		return SD_TIMEOUT;
     }
 
 	// For a write operation, ensure DATA_DONE interrupt before we stop transmission.
-	if( write && (resp = sdWaitForInterrupt(INT_DATA_DONE)) )
+	// (A DMA request only completes once DATA_DONE is raised.)
+	if( !useDma && write && (resp = sdWaitForInterrupt(INT_DATA_DONE)) )
 	{
 		log_error("Timeout waiting for data done");
 		return sdDebugResponse(resp);
@@ -1436,6 +1804,54 @@ SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buf
 	return SD_OK;
 }
 
+/*-[INTERNAL: sdCopyBlocks]-------------------------------------------------}
+. Copies whole blocks between a caller's buffer and the bounce buffer, 64
+. bytes per loop with NEON. NEON loads & stores don't need to be aligned.
+. Penguin_Spy 2024
+.--------------------------------------------------------------------------*/
+static void sdCopyBlocks (uint8_t* dest, const uint8_t* src, uint32_t numBlocks)
+{
+#ifdef __ARM_NEON
+	for (uint32_t i = 0; i < numBlocks * 512; i += 64) {
+		uint8x16_t a = vld1q_u8(src + i);
+		uint8x16_t b = vld1q_u8(src + i + 16);
+		uint8x16_t c = vld1q_u8(src + i + 32);
+		uint8x16_t d = vld1q_u8(src + i + 48);
+		vst1q_u8(dest + i, a);
+		vst1q_u8(dest + i + 16, b);
+		vst1q_u8(dest + i + 32, c);
+		vst1q_u8(dest + i + 48, d);
+	}
+#else
+	memcpy(dest, src, numBlocks * 512);
+#endif
+}
+
+/*-[sdTransferBlocks]-------------------------------------------------------}
+. Transfer the count blocks starting at given block to/from SD Card. Buffers
+. that can't be moved directly (not cache line aligned when DMA is in use, or
+. not word aligned) are staged through the bounce buffer, a chunk at a time.
+. 21Aug17 LdB
+.--------------------------------------------------------------------------*/
+SDRESULT sdTransferBlocks (uint32_t startBlock, uint32_t numBlocks, uint8_t* buffer, bool write )
+{
+	uintptr_t alignMask = sdDmaChannel >= 0 ? MEMORY_CACHE_LINE_SIZE - 1 : 3;
+	if (((uintptr_t)buffer & alignMask) == 0)
+		return sdTransferDirect(startBlock, numBlocks, buffer, write);
+
+	while (numBlocks > 0) {
+		uint32_t chunk = numBlocks < SD_BOUNCE_BLOCKS ? numBlocks : SD_BOUNCE_BLOCKS;
+		if (write) sdCopyBlocks(sdBounceBuffer, buffer, chunk);
+		SDRESULT resp = sdTransferDirect(startBlock, chunk, sdBounceBuffer, write);
+		if (resp) return resp;
+		if (!write) sdCopyBlocks(buffer, sdBounceBuffer, chunk);
+		startBlock += chunk;
+		numBlocks -= chunk;
+		buffer += chunk * 512;
+	}
+	return SD_OK;
+}
+
 /*-[sdClearBlocks]----------------------------------------------------------}
 . Clears the count blocks starting at given block from SD Card.
 . 21Aug17 LdB
@@ -1465,7 +1881,7 @@ SDRESULT sdClearBlocks(uint32_t startBlock , uint32_t numBlocks)
 	if ( --count == 0 )
 		{
 		log_error("Timeout waiting for erase: %08x %08x",
-			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)EMMC_INTERRUPT->Raw32);
+			(unsigned int)EMMC_STATUS->Raw32, (unsigned int)sdReadInterrupts());
 		return SD_TIMEOUT;
 		}
 
@@ -1561,9 +1977,25 @@ SDRESULT sdInitCard ()
 		log_debug("Bus width set to 4");
 	}
 
+	// Send SWITCH_FUNC (CMD6) to use high speed timing at 50Mhz if the card supports it.
+	// If anything goes wrong, go back to the normal clock.
+	if( sdEnableHighSpeed() && (resp = sdSetClock(FREQ_NORMAL)) ) return sdDebugResponse(resp);
+	log_notice("Clock %d kHz%s, bus width %d", (int)(sdClockFreq / 1000),
+		EMMC_CONTROL0->HCTL_HS_EN ? " (high speed)" : "", EMMC_CONTROL0->HCTL_DWIDTH ? 4 : 1);
+
 	// Send SET_BLOCKLEN (CMD16)
 	if( (resp = sdSendCommandA(IX_SET_BLOCKLEN,512)) ) return sdDebugResponse(resp);
 
+	// Data transfers are done by DMA if there's a free channel.
+	if (sdDmaChannel < 0) sdDmaChannel = RPI_DmaAllocateChannel();
+
+	// Waits sleep until the EMMC interrupt instead of polling, and DMA transfers complete from it.
+	if (!sdIrqConnected) {
+		ConnectIRQHandler(EMMC_IRQ, sdInterruptHandler, 0);
+		sdIrqConnected = true;
+	}
+	EMMC_IRPT_EN->Raw32 = INT_IRQ_MASK;								// Ready flags only wake the core while waited for
+
 	// Print out the CID having got this far.
 	unsigned int serial = sdCard.cid.SerialNumHi;
 	serial <<= 16;
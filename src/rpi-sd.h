@@ -2,6 +2,7 @@
 #define SDCARD_H
 #include <time.h>										// C standard for time needed for that and struct tm
 #include <stdbool.h>							// Needed for bool and true/false
+#include <stdint.h>							// Needed for uint8_t, uint32_t etc
 
 /*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++}
 {																			}
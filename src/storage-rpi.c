@@ -0,0 +1,146 @@
+/* storage-rpi.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  The Raspberry Pi's storage devices: the SD card (through the EMMC driver),
+  which is always the boot device, and any USB mass storage devices USPi
+  has found (USPiInitialize() must be called before `storage_init()`).
+*/
+
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "log.h"
+#include "rpi-sd.h"
+#include "rpi-systimer.h"
+#include "uspi.h"
+
+#include "storage.h"
+
+static const char log_from[] = "storage-rpi";
+
+// the EMMC block count register is 16 bits
+#define SD_MAX_TRANSFER_BLOCKS 0xFFFF
+// the sd driver DMAs buffers that are cache line aligned and stages any others through its own aligned buffer,
+// and the USB host controller DMAs words
+#define SD_ALIGNMENT 1
+#define USB_ALIGNMENT 4
+// a single bulk-only transport command; larger transfers are slower than splitting them up on most sticks
+#define USB_MAX_TRANSFER_BLOCKS 128
+
+static int sd_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return sdTransferBlocks(lba, count, buffer, false) == SD_OK ? 0 : -1;
+}
+
+static int sd_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    return sdTransferBlocks(lba, count, (uint8_t*)buffer, true) == SD_OK ? 0 : -1;
+}
+
+static const storage_device_ops sd_ops = {
+    .read = sd_read,
+    .write = sd_write,
+};
+
+static int usb_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    unsigned bytes = count * USPI_BLOCK_SIZE;
+    int result = USPiMassStorageDeviceRead((unsigned long long)lba * USPI_BLOCK_SIZE, buffer, bytes, device->driver_index);
+    return result == (int)bytes ? 0 : -1;
+}
+
+static int usb_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    unsigned bytes = count * USPI_BLOCK_SIZE;
+    int result = USPiMassStorageDeviceWrite((unsigned long long)lba * USPI_BLOCK_SIZE, buffer, bytes, device->driver_index);
+    return result == (int)bytes ? 0 : -1;
+}
+
+static const storage_device_ops usb_ops = {
+    .read = usb_read,
+    .write = usb_write,
+};
+
+// set to 1 to time reads from the sd card into aligned & unaligned buffers at boot (the card isn't written to)
+#define SD_BENCHMARK 0
+#define SD_BENCHMARK_BLOCKS 2048    // 1 MiB read by each pass
+
+#if SD_BENCHMARK == 1
+// reads the start of the sd card with different buffer alignments & transfer sizes, and logs how long each took
+static void sd_benchmark() {
+    static const struct {
+        const char* name;
+        uint32_t offset;            // bytes past a cache line boundary the buffer starts at
+        uint32_t blocks;            // blocks per transfer
+    } passes[] = {
+        { "aligned", 0, 128 },
+        { "word aligned", 4, 128 },
+        { "unaligned", 1, 128 },
+        { "aligned, 1 block", 0, 1 },
+        { "unaligned, 1 block", 1, 1 },
+    };
+    uint8_t* buffer = memalign(STORAGE_BUFFER_ALIGNMENT, SD_BENCHMARK_BLOCKS * STORAGE_BLOCK_SIZE + STORAGE_BUFFER_ALIGNMENT);
+    if(buffer == NULL) {
+        return;
+    }
+    for(unsigned i = 0; i < sizeof passes / sizeof passes[0]; i++) {
+        uint8_t* destination = buffer + passes[i].offset;
+        uint64_t start = RPI_GetTimerTicks();
+        for(uint32_t lba = 0; lba < SD_BENCHMARK_BLOCKS; lba += passes[i].blocks) {
+            if(sdTransferBlocks(lba, passes[i].blocks, destination + lba * STORAGE_BLOCK_SIZE, false) != SD_OK) {
+                log_error("benchmark %s failed at block %u", passes[i].name, lba);
+                break;
+            }
+        }
+        uint32_t elapsed = RPI_GetTimerTicks() - start;
+        log_notice("benchmark %s: %u KiB in %u us (%u KiB/s)", passes[i].name, SD_BENCHMARK_BLOCKS / 2, elapsed,
+            elapsed > 0 ? (uint32_t)((uint64_t)SD_BENCHMARK_BLOCKS / 2 * 1000000 / elapsed) : 0);
+    }
+    free(buffer);
+}
+#endif
+
+// calculates the number of 512 byte blocks on the sd card from its CSD
+static uint32_t sd_block_count() {
+    struct CSD* csd = sdCardCSD();
+    if(csd == NULL) {
+        return 0;
+    }
+    if(csd->csd_structure == CSD_VERSION_2) {
+        return (csd->ver2_c_size + 1) * 1024;   // C_SIZE is in units of 512 KiB
+    }
+    uint64_t bytes = (uint64_t)(csd->c_size + 1) * (1 << (csd->c_size_mult + 2)) * (1 << csd->read_bl_len);
+    return bytes / STORAGE_BLOCK_SIZE;
+}
+
+/** Adds the SD card, then any USB mass storage devices.
+ * @returns `0` on success, or `-1` if the SD card couldn't be initialized.
+ */
+int storage_platform_init() {
+    int result = sdInitCard();
+    if(result != SD_OK) {
+        log_error("error during sd init: %i", result);
+        return -1;
+    }
+    storage_add_device("sd", &sd_ops, sd_block_count(), SD_MAX_TRANSFER_BLOCKS, SD_ALIGNMENT, 0);
+#if SD_BENCHMARK == 1
+    sd_benchmark();
+#endif
+
+    int usb_count = USPiMassStorageDeviceAvailable();
+    for(int i = 0; i < usb_count; i++) {
+        char name[8] = "usb0";
+        name[3] = '0' + i;
+        unsigned block_count = USPiMassStorageDeviceGetCapacity(i);
+        if(block_count == 0) {
+            log_warn("couldn't get capacity of usb mass storage device %i", i);
+            continue;
+        }
+        storage_add_device(name, &usb_ops, block_count, USB_MAX_TRANSFER_BLOCKS, USB_ALIGNMENT, i);
+    }
+    return 0;
+}
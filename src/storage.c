@@ -0,0 +1,321 @@
+/* storage.c © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+
+  Keeps the list of attached block devices, and transfers blocks to & from
+  them through their driver's functions.
+
+  Which devices exist is platform-specific (see `storage_platform_init()`),
+  this module only splits transfers to fit what each device can do in one
+  command, and counts the commands & blocks transferred for each device.
+
+  Transfers can also be queued and then dispatched together: queued transfers
+  that touch adjacent or overlapping blocks are combined into one command, and
+  the commands are issued in order of block address, continuing upward from
+  where the last dispatch ended before wrapping around (an elevator).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+
+#include "storage.h"
+
+static const char log_from[] = "storage";
+
+static storage_device devices[STORAGE_MAX_DEVICES];
+static int device_count = 0;
+
+/** Finds the attached storage devices.
+ * @returns the number of devices found, or `-1` on error (if there is no boot device).
+ */
+int storage_init() {
+    device_count = 0;
+    storage_platform_init();
+    if(device_count == 0) {
+        log_error("no boot storage device!");
+        return -1;
+    }
+    for(int i = 0; i < device_count; i++) {
+        storage_device* device = &devices[i];
+        log_notice("device %i: %s, %u blocks, %u blocks per transfer, %u byte alignment", i, device->name, device->block_count, device->max_transfer_blocks, device->alignment);
+    }
+    return device_count;
+}
+
+/** Adds a device to the device list, called by the platform's storage drivers.
+ * The first device added is the boot device.
+ * @param max_transfer_blocks   the most blocks one command can transfer, 1 if the device doesn't support multi-block transfers
+ * @param alignment             what buffers must be aligned to (in bytes, a power of 2)
+ * @returns the device, or `NULL` if there are already too many.
+ */
+storage_device* storage_add_device(const char* name, const storage_device_ops* ops, uint32_t block_count, uint32_t max_transfer_blocks, uint32_t alignment, int driver_index) {
+    if(device_count == STORAGE_MAX_DEVICES) {
+        log_warn("too many storage devices, ignoring %s", name);
+        return NULL;
+    }
+    storage_device* device = &devices[device_count];
+    memset(device, 0, sizeof *device);
+    snprintf(device->name, sizeof device->name, "%s", name);
+    device->id = device_count;
+    device->ops = ops;
+    device->block_count = block_count;
+    device->max_transfer_blocks = max_transfer_blocks > 0 ? max_transfer_blocks : 1;
+    device->multi_block = device->max_transfer_blocks > 1;
+    device->alignment = alignment > 0 ? alignment : 1;
+    device->driver_index = driver_index;
+    device_count++;
+    return device;
+}
+
+int storage_get_device_count() {
+    return device_count;
+}
+
+// gets a device by its id, or `NULL` if there isn't one
+storage_device* storage_get_device(int id) {
+    if(id < 0 || id >= device_count) {
+        return NULL;
+    }
+    return &devices[id];
+}
+
+// gets the largest number of blocks the device transfers efficiently (in one command)
+uint32_t storage_get_transfer_blocks(storage_device* device) {
+    return device->max_transfer_blocks;
+}
+
+// checks if a buffer can be passed straight to the device's driver
+bool storage_is_aligned(storage_device* device, const void* buffer) {
+    return ((uintptr_t)buffer & (device->alignment - 1)) == 0;
+}
+
+/** Transfers blocks, split into as few commands as the device allows.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+static int transfer(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write) {
+    if(device->block_count != 0 && (lba >= device->block_count || count > device->block_count - lba)) {
+        log_error("%s: transfer of blocks %u-%u is past the end of the device", device->name, lba, lba + count - 1);
+        errno = EINVAL;
+        return -1;
+    }
+    if(!storage_is_aligned(device, buffer)) {
+        log_error("%s: unaligned buffer %p", device->name, buffer);
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(count > 0) {
+        uint32_t run = count < device->max_transfer_blocks ? count : device->max_transfer_blocks;
+        int result;
+        if(write) {
+            device->stats.write_commands++;
+            device->stats.blocks_written += run;
+            result = device->ops->write(device, lba, run, buffer);
+        } else {
+            device->stats.read_commands++;
+            device->stats.blocks_read += run;
+            result = device->ops->read(device, lba, run, buffer);
+        }
+        if(result != 0) {
+            device->stats.errors++;
+            log_error("%s: failed to %s blocks %u-%u", device->name, write ? "write" : "read", lba, lba + run - 1);
+            errno = EIO;
+            return -1;
+        }
+        lba += run;
+        count -= run;
+        buffer += run * STORAGE_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+/** Reads blocks from a device. `buffer` must meet the device's alignment.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int storage_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return transfer(device, lba, count, buffer, false);
+}
+
+/** Writes blocks to a device. `buffer` must meet the device's alignment.
+ * @returns `0` on success, or `-1` on error and sets `errno`.
+ */
+int storage_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    return transfer(device, lba, count, (uint8_t*)buffer, true);
+}
+
+/** Queues a transfer to be done by the next `storage_dispatch()` of the device. `buffer` must stay valid until then, and
+ * must meet the device's alignment if the transfer is larger than `STORAGE_QUEUE_STAGING_BLOCKS`.
+ * The queue is dispatched first if it has a transfer that touches the same blocks and either of them is a write (so a
+ * read always sees the writes queued before it, and the last write to a block is the one that sticks, which the
+ * elevator order couldn't promise otherwise), or if it's full and can't grow.
+ * @param result    set to `0` or `-1` once the transfer is done, or `NULL`
+ * @returns `0` on success, or `-1` on error and sets `errno` (only if the transfer couldn't be queued).
+ */
+int storage_queue(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write, int* result) {
+    if(device->block_count != 0 && (lba >= device->block_count || count > device->block_count - lba)) {
+        log_error("%s: transfer of blocks %u-%u is past the end of the device", device->name, lba, lba + count - 1);
+        errno = EINVAL;
+        return -1;
+    }
+    if(count == 0 || (count > STORAGE_QUEUE_STAGING_BLOCKS && !storage_is_aligned(device, buffer))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(device->staging == NULL) {
+        device->staging = memalign(STORAGE_BUFFER_ALIGNMENT, STORAGE_QUEUE_STAGING_BLOCKS * STORAGE_BLOCK_SIZE);
+        if(device->staging == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if(device->queue_count == device->queue_capacity) {
+        uint32_t capacity = device->queue_capacity > 0 ? device->queue_capacity * 2 : STORAGE_QUEUE_SIZE;
+        storage_request* queue = realloc(device->queue, capacity * sizeof *queue);
+        if(queue != NULL) {
+            device->queue = queue;
+            device->queue_capacity = capacity;
+        } else if(device->queue_count > 0) {
+            storage_dispatch(device);   // make space, failures are reported through the queued transfers' results
+        } else {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    bool conflict = false;
+    for(uint32_t i = 0; i < device->queue_count && !conflict; i++) {
+        storage_request* queued = &device->queue[i];
+        conflict = (queued->write || write) && queued->lba < lba + count && lba < queued->lba + queued->count;
+    }
+    if(conflict) {
+        storage_dispatch(device);   // failures are reported through the queued transfers' results
+    }
+
+    device->queue[device->queue_count++] = (storage_request){
+        .lba = lba,
+        .count = count,
+        .buffer = buffer,
+        .write = write,
+        .sequence = device->queue_sequence++,
+        .result = result,
+    };
+    return 0;
+}
+
+// for sorting queued transfers by block address, then by the order they were queued
+static int compare_request_lba(const void* a, const void* b) {
+    const storage_request* request_a = a;
+    const storage_request* request_b = b;
+    if(request_a->lba != request_b->lba) {
+        return (request_a->lba > request_b->lba) - (request_a->lba < request_b->lba);
+    }
+    return (request_a->sequence > request_b->sequence) - (request_a->sequence < request_b->sequence);
+}
+
+/** Finds how many of the (sorted) queued transfers starting at `first` can be combined into one command: the ones in
+ * the same direction that touch adjacent (or, for reads, overlapping) blocks, up to `max_blocks` blocks in all.
+ * @param end_lba   set to the block after the last one the command transfers
+ */
+static uint32_t run_length(storage_request* queue, uint32_t count, uint32_t first, uint32_t max_blocks, uint32_t* end_lba) {
+    uint32_t first_lba = queue[first].lba;
+    uint32_t end = first_lba + queue[first].count;
+    uint32_t run = 1;
+    while(first + run < count) {
+        storage_request* next = &queue[first + run];
+        uint32_t next_end = next->lba + next->count > end ? next->lba + next->count : end;
+        if(next->write != queue[first].write || next->lba > end || next_end - first_lba > max_blocks) {
+            break;
+        }
+        end = next_end;
+        run++;
+    }
+    *end_lba = end;
+    return run;
+}
+
+// sets the results of a run of queued transfers
+static void finish_requests(storage_request* requests, uint32_t count, int result) {
+    for(uint32_t i = 0; i < count; i++) {
+        if(requests[i].result != NULL) {
+            *requests[i].result = result;
+        }
+    }
+}
+
+// does one run of queued transfers as one command (or more, if it's one transfer larger than the device can do at once)
+static int dispatch_run(storage_device* device, storage_request* requests, uint32_t run, uint32_t end_lba) {
+    uint32_t first_lba = requests[0].lba;
+    bool write = requests[0].write;
+    int result;
+    if(run == 1 && storage_is_aligned(device, requests[0].buffer)) {
+        result = transfer(device, first_lba, requests[0].count, requests[0].buffer, write);
+    } else if(write) {
+        for(uint32_t i = 0; i < run; i++) {
+            memcpy(device->staging + (requests[i].lba - first_lba) * STORAGE_BLOCK_SIZE, requests[i].buffer, requests[i].count * STORAGE_BLOCK_SIZE);
+        }
+        result = transfer(device, first_lba, end_lba - first_lba, device->staging, true);
+    } else {
+        result = transfer(device, first_lba, end_lba - first_lba, device->staging, false);
+        for(uint32_t i = 0; i < run && result == 0; i++) {
+            memcpy(requests[i].buffer, device->staging + (requests[i].lba - first_lba) * STORAGE_BLOCK_SIZE, requests[i].count * STORAGE_BLOCK_SIZE);
+        }
+    }
+    device->stats.merged_requests += run - 1;
+    finish_requests(requests, run, result);
+    device->head_lba = end_lba;
+    return result;
+}
+
+/** Does all of a device's queued transfers, combining the ones in the same direction that touch adjacent or
+ * overlapping blocks into one command (queued writes never overlap, see `storage_queue()`). Commands are issued in order of block address, starting from where the last
+ * dispatch ended and wrapping around to the lowest address.
+ * @returns `0` on success, or `-1` if any transfer failed and sets `errno`.
+ */
+int storage_dispatch(storage_device* device) {
+    uint32_t count = device->queue_count;
+    if(count == 0) {
+        return 0;
+    }
+    storage_request* queue = device->queue;
+    qsort(queue, count, sizeof *queue, compare_request_lba);
+    uint32_t max_blocks = device->max_transfer_blocks < STORAGE_QUEUE_STAGING_BLOCKS ? device->max_transfer_blocks : STORAGE_QUEUE_STAGING_BLOCKS;
+
+    // find the first command at or above the elevator's position
+    uint32_t start = 0;
+    uint32_t end_lba;
+    while(start < count && queue[start].lba < device->head_lba) {
+        start += run_length(queue, count, start, max_blocks, &end_lba);
+    }
+
+    int status = 0;
+    int error = 0;
+    for(uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t i = pass == 0 ? start : 0;
+        uint32_t stop = pass == 0 ? count : start;
+        while(i < stop) {
+            uint32_t run = run_length(queue, stop, i, max_blocks, &end_lba);
+            if(dispatch_run(device, &queue[i], run, end_lba) != 0) {
+                status = -1;    // keep going, the other transfers may still work
+                error = errno;
+            }
+            i += run;
+        }
+    }
+    device->queue_count = 0;
+    if(status != 0) {
+        errno = error;
+    }
+    return status;
+}
@@ -0,0 +1,88 @@
+/* storage.h © Penguin_Spy 2024
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+ *
+ * The Covered Software may not be used as training or other input data
+ * for LLMs, generative AI, or other forms of machine learning or neural
+ * networks.
+ */
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STORAGE_BLOCK_SIZE 512      // the only block size any of the drivers support
+#define STORAGE_MAX_DEVICES 8       // the boot device + up to 7 usb drives
+// buffers allocated for transfers are aligned to this (a data cache line), so drivers can DMA straight into them
+#define STORAGE_BUFFER_ALIGNMENT 64
+// how many transfers each device's queue has space for at first (it grows as needed)
+#define STORAGE_QUEUE_SIZE 128
+// the most blocks queued transfers are combined into for one command
+#define STORAGE_QUEUE_STAGING_BLOCKS 128
+
+typedef struct storage_device storage_device;
+
+// the functions a storage driver provides, called with buffers that meet the device's alignment
+// and block counts the device can transfer in one command
+typedef struct {
+    // both return `0` on success or `-1` on error
+    int (*read)(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+    int (*write)(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer);
+} storage_device_ops;
+
+typedef struct {
+    uint32_t read_commands;     // transfers issued to the device (each one is a round trip to the device)
+    uint32_t write_commands;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint32_t errors;            // transfers that failed
+    uint32_t merged_requests;   // queued transfers that were combined into another one's command
+} storage_stats;
+
+// a transfer waiting in a device's queue
+typedef struct {
+    uint32_t lba;
+    uint32_t count;
+    uint8_t* buffer;
+    bool write;
+    uint32_t sequence;      // the order transfers were queued in (transfers of the same blocks are done in this order)
+    int* result;            // set to `0` or `-1` when the transfer is done, or NULL
+} storage_request;
+
+struct storage_device {
+    char name[8];                   // for logging, like "sd" or "usb0"
+    int id;                         // the device's index in the device list (0 is always the boot device)
+    const storage_device_ops* ops;
+    uint32_t block_count;           // the size of the device in blocks, or 0 if it isn't known
+    uint32_t max_transfer_blocks;   // the most blocks one command can transfer
+    uint32_t alignment;             // buffers passed to the driver must be aligned to this many bytes
+    bool multi_block;               // false if the device can only transfer one block per command
+    int driver_index;               // which device of its driver this is (like the USPi device index)
+    storage_request* queue;         // transfers waiting for storage_dispatch() (NULL until something is queued)
+    uint32_t queue_count;
+    uint32_t queue_capacity;
+    uint32_t queue_sequence;
+    uint32_t head_lba;              // where the last dispatched command ended, the next dispatch continues upward from here
+    uint8_t* staging;               // STORAGE_QUEUE_STAGING_BLOCKS blocks, for combining queued transfers into one command
+    storage_stats stats;
+};
+
+int storage_init();
+storage_device* storage_add_device(const char* name, const storage_device_ops* ops, uint32_t block_count, uint32_t max_transfer_blocks, uint32_t alignment, int driver_index);
+int storage_get_device_count();
+storage_device* storage_get_device(int id);
+uint32_t storage_get_transfer_blocks(storage_device* device);
+bool storage_is_aligned(storage_device* device, const void* buffer);
+int storage_read(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer);
+int storage_write(storage_device* device, uint32_t lba, uint32_t count, const uint8_t* buffer);
+int storage_queue(storage_device* device, uint32_t lba, uint32_t count, uint8_t* buffer, bool write, int* result);
+int storage_dispatch(storage_device* device);
+
+// implemented by the platform (storage-rpi.c, or host-storage.c for the host build), adds the attached devices
+int storage_platform_init();
+
+#endif
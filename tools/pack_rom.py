@@ -0,0 +1,140 @@
+# pack_rom.py © Penguin_Spy 2024
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+#
+# Packs a directory (the CraftOS rom) into the archive that is linked into the kernel and served at /rom by fs_rom.
+#   usage: pack_rom.py [--compress] <directory> <output file>
+# If the directory doesn't exist, an empty archive is written (and files under /rom are read from the boot drive instead).
+#
+# The format (all integers are little-endian uint32, see fs_rom.h):
+#   header: "KROM", version, entry count, size of the name table
+#   entries, sorted by path: name offset, data offset, size, stored size, flags
+#   name table: NUL-terminated paths relative to the directory, with '/' separators
+#   file data, each file aligned to 4 bytes
+# With --compress, files that get at least 1/8 smaller are stored LZ4 block compressed (flag 2).
+import os
+import struct
+import sys
+
+MAGIC = b"KROM"
+VERSION = 1
+FLAG_DIRECTORY = 1
+FLAG_COMPRESSED = 2
+
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+LAST_LITERALS = 5   # the LZ4 block format requires the last 5 bytes to be literals,
+MATCH_LIMIT = 12    # and the last match to start at least 12 bytes before the end
+
+def write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+# greedy LZ4 block compression, with a hash table of the last position each 4 byte sequence was seen at
+def lz4_compress(data):
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    end = len(data) - LAST_LITERALS
+    while i < len(data) - MATCH_LIMIT:
+        key = data[i:i + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+        match_length = MIN_MATCH
+        while i + match_length < end and data[candidate + match_length] == data[i + match_length]:
+            match_length += 1
+
+        literals = i - anchor
+        token_literals = min(literals, 15)
+        token_match = min(match_length - MIN_MATCH, 15)
+        out.append(token_literals << 4 | token_match)
+        if literals >= 15:
+            write_length(out, literals - 15)
+        out += data[anchor:i]
+        out += struct.pack("<H", i - candidate)
+        if match_length - MIN_MATCH >= 15:
+            write_length(out, match_length - MIN_MATCH - 15)
+        i += match_length
+        anchor = i
+
+    literals = len(data) - anchor
+    out.append(min(literals, 15) << 4)
+    if literals >= 15:
+        write_length(out, literals - 15)
+    out += data[anchor:]
+    return bytes(out)
+
+def collect(directory):
+    entries = []    # (path, data or None for directories)
+    for root, dirs, files in os.walk(directory):
+        dirs.sort()
+        relative = os.path.relpath(root, directory).replace(os.sep, "/")
+        prefix = "" if relative == "." else relative + "/"
+        for name in dirs:
+            entries.append((prefix + name, None))
+        for name in sorted(files):
+            with open(os.path.join(root, name), "rb") as f:
+                entries.append((prefix + name, f.read()))
+    # fs_rom binary searches with strcmp, so sort by the UTF-8 bytes
+    entries.sort(key=lambda entry: entry[0].encode("utf-8"))
+    return entries
+
+def pack(entries, compress):
+    names = bytearray()
+    name_offsets = []
+    for path, _ in entries:
+        name_offsets.append(len(names))
+        names += path.encode("utf-8") + b"\0"
+    while len(names) % 4 != 0:
+        names.append(0)
+
+    header_size = 16
+    entry_size = 20
+    data_start = header_size + entry_size * len(entries) + len(names)
+    index = bytearray()
+    data = bytearray()
+    original_total = stored_total = 0
+    for (path, content), name_offset in zip(entries, name_offsets):
+        if content is None:
+            index += struct.pack("<5I", name_offset, 0, 0, 0, FLAG_DIRECTORY)
+            continue
+        stored = content
+        flags = 0
+        if compress and len(content) > 64:
+            compressed = lz4_compress(content)
+            if len(compressed) <= len(content) - len(content) // 8:
+                stored = compressed
+                flags = FLAG_COMPRESSED
+        index += struct.pack("<5I", name_offset, data_start + len(data), len(content), len(stored), flags)
+        data += stored
+        while len(data) % 4 != 0:
+            data.append(0)
+        original_total += len(content)
+        stored_total += len(stored)
+
+    header = MAGIC + struct.pack("<3I", VERSION, len(entries), len(names))
+    return header + index + names + data, original_total, stored_total
+
+def main():
+    args = sys.argv[1:]
+    compress = "--compress" in args
+    args = [arg for arg in args if arg != "--compress"]
+    if len(args) != 2:
+        print("usage: pack_rom.py [--compress] <directory> <output file>")
+        sys.exit(2)
+    directory, output = args
+
+    entries = collect(directory) if os.path.isdir(directory) else []
+    archive, original_total, stored_total = pack(entries, compress)
+    with open(output, "wb") as f:
+        f.write(archive)
+    print(f"packed {len(entries)} entries from {directory}: {original_total} bytes of files stored in {stored_total}, archive is {len(archive)} bytes")
+
+main()